@@ -0,0 +1,49 @@
+﻿
+# generates DISPID tables, typed sinks and typed client stubs from an ODL file
+# and adds them to the target:
+#
+#	cmw_generate_interfaces(<target> <file.odl> [NAMESPACE <namespace>])
+#
+# <file>_ids.h depends on the standard library only,
+# <file>.h requires com_wrapper.h (link the target with cmwComWrapper)
+
+function(cmw_generate_interfaces target odl)
+	cmake_parse_arguments(ARG "" "NAMESPACE" "" ${ARGN})
+
+	if(NOT ARG_NAMESPACE)
+		set(ARG_NAMESPACE cmw_generated)
+	endif()
+
+	get_filename_component(odl_path ${odl} ABSOLUTE)
+	get_filename_component(odl_name ${odl} NAME_WE)
+
+	set(output_dir ${CMAKE_CURRENT_BINARY_DIR}/cmw_generated)
+	set(outputs
+		${output_dir}/${odl_name}_ids.h
+		${output_dir}/${odl_name}.h
+		)
+
+	add_custom_command(
+		OUTPUT
+			${outputs}
+		COMMAND
+			${CMAKE_COMMAND} -E make_directory ${output_dir}
+		COMMAND
+			cmwidlgen ${odl_path} ${output_dir} ${ARG_NAMESPACE}
+		DEPENDS
+			cmwidlgen
+			${odl_path}
+		COMMENT
+			"Generating COM interfaces from ${odl_name}.odl"
+		)
+
+	target_sources(${target}
+		PRIVATE
+			${outputs}
+		)
+
+	target_include_directories(${target}
+		PRIVATE
+			${output_dir}
+		)
+endfunction()
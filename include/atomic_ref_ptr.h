@@ -0,0 +1,190 @@
+﻿#pragma once
+
+// atomically replaceable pointer to an object counting its references
+// through AddRef and Release, e.g. a COM interface
+
+#include "thread_slots.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+namespace cmw
+{
+    // pointers being read by the threads. A thread protects at most one pointer
+    // at a time, only for the duration of AddRef.
+    // Threads without a thread_slots index are counted by a shared counter instead
+    class hazard_pointers
+    {
+    public:
+
+        constexpr static size_t max_threads = thread_slots::max_threads;
+
+        using slot = std::atomic<const void*>;
+
+        // slot of the calling thread, nullptr if every index is taken
+        static slot* Slot() noexcept
+        {
+            size_t index = thread_slots::Index();
+            return index != thread_slots::no_slot ? &slots_[index].value : nullptr;
+        }
+
+        // protects the pointer of threads without a slot until the returned guard is destroyed
+        class overflow_guard
+        {
+        public:
+
+            overflow_guard() noexcept
+            {
+                overflowReaders_.fetch_add(1, std::memory_order_seq_cst);
+            }
+
+            ~overflow_guard()
+            {
+                overflowReaders_.fetch_sub(1, std::memory_order_release);
+            }
+
+            overflow_guard(const overflow_guard&) = delete;
+            overflow_guard& operator=(const overflow_guard&) = delete;
+        };
+
+        // waits till no reader protects the pointer. The pointer must have been
+        // unpublished before, so that new readers can not protect it
+        static void WaitUnprotected(const void *ptr) noexcept
+        {
+            size_t inUse = thread_slots::InUse();
+            for (size_t i = 0; i < inUse; ++i)
+                while (slots_[i].value.load(std::memory_order_seq_cst) == ptr)
+                    std::this_thread::yield();
+
+            while (overflowReaders_.load(std::memory_order_seq_cst))
+                std::this_thread::yield();
+        }
+
+    private:
+
+        static inline std::array<cache_padded<slot>, max_threads> slots_{};
+        static inline std::atomic<size_t> overflowReaders_ = 0;
+    };
+
+    // owns one reference of the stored object. Readers never lock nor wait:
+    // a read protects the pointer with a hazard slot, validates it and adds a reference.
+    // Writers wait for the readers protecting the replaced pointer before releasing it,
+    // which takes no longer than their AddRef
+    template <class T>
+    class atomic_ref_ptr
+    {
+        std::atomic<T*> ptr_ = nullptr;
+
+    public:
+
+        atomic_ref_ptr() = default;
+
+        // takes ownership of the reference
+        explicit atomic_ref_ptr(T *owned) noexcept
+            : ptr_(owned)
+        {
+        }
+
+        atomic_ref_ptr(const atomic_ref_ptr&) = delete;
+        atomic_ref_ptr& operator=(const atomic_ref_ptr&) = delete;
+
+        // no reader may be running
+        ~atomic_ref_ptr()
+        {
+            if (T *p = ptr_.load(std::memory_order_acquire))
+                p->Release();
+        }
+
+        // the returned reference belongs to the caller
+        T* Load() const noexcept
+        {
+            hazard_pointers::slot *hazard = hazard_pointers::Slot();
+            if (!hazard)
+            {
+                hazard_pointers::overflow_guard guard;
+                return add_ref(ptr_.load(std::memory_order_seq_cst));
+            }
+
+            T *p = ptr_.load(std::memory_order_relaxed);
+            while (true)
+            {
+                hazard->store(p, std::memory_order_seq_cst);
+                T *current = ptr_.load(std::memory_order_seq_cst);
+                if (current == p)
+                    break;
+                p = current;
+            }
+
+            add_ref(p);
+            hazard->store(nullptr, std::memory_order_release);
+
+            return p;
+        }
+
+        // takes ownership of the reference
+        void Store(T *owned) noexcept
+        {
+            retire(ptr_.exchange(owned, std::memory_order_seq_cst));
+        }
+
+        // takes ownership of the reference, returns the owned previous one
+        T* Exchange(T *owned) noexcept
+        {
+            T *prev = ptr_.exchange(owned, std::memory_order_seq_cst);
+
+            // the caller may release it right away, while readers still add their references
+            if (prev)
+                hazard_pointers::WaitUnprotected(prev);
+
+            return prev;
+        }
+
+        // stores desired if the current pointer equals expected. Both are borrowed,
+        // a reference of desired is added on success. On failure expected receives
+        // an owned reference of the current pointer, to be released by the caller
+        bool CompareExchange(T *&expected, T *desired) noexcept
+        {
+            // added in advance: once stored, desired may be replaced and released at once
+            add_ref(desired);
+
+            T *prev = expected;
+            if (ptr_.compare_exchange_strong(prev, desired, std::memory_order_seq_cst))
+            {
+                retire(prev);
+                return true;
+            }
+
+            if (desired)
+                desired->Release();
+
+            expected = Load();
+            return false;
+        }
+
+        // unprotected peek, e.g. for comparisons. The object may be released at any time
+        T* Peek() const noexcept
+        {
+            return ptr_.load(std::memory_order_acquire);
+        }
+
+    private:
+
+        static T* add_ref(T *p) noexcept
+        {
+            if (p)
+                p->AddRef();
+            return p;
+        }
+
+        static void retire(T *p) noexcept
+        {
+            if (!p)
+                return;
+
+            hazard_pointers::WaitUnprotected(p);
+            p->Release();
+        }
+    };
+}
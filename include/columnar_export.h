@@ -0,0 +1,621 @@
+﻿#pragma once
+
+// columnar export of sink events for offline analysis. Events are collected into
+// batches, one per DISPID, and written by a background thread.
+// The events are encoded with flat_event_builder
+//
+// File layout, little endian. Offsets and sizes are multiples of 8, so a mapped file
+// can be read in place:
+//   "CMWCOL1\0", then the batches one after another.
+//   batch: column_batch_header, numColumns column_header, then the buffers.
+//   Offsets of the buffers are counted from the batch header.
+// Column 0 holds the timestamps as i8, nanoseconds since the Unix epoch.
+// Column i + 1 holds argument i in declaration order. Its type is the one of the first
+// value in the batch; empty arguments, values of another type and missing arguments are null.
+// A batch has a column for every argument of its widest event.
+// The buffers follow Arrow's layouts, e.g. pyarrow.Array.from_buffers wraps them without copying:
+//   validity: bitmap, least significant bit first, 1 for a value
+//   fixed width: values of the column's width, boolean as VARIANT_BOOL
+//   bstr: numRows + 1 int32 offsets into UTF-8 data
+
+#include "shm_event_bus.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace cmw
+{
+    constexpr inline char columnar_file_magic[8] = "CMWCOL1";
+    // "BTCH"
+    constexpr inline uint32_t column_batch_magic = 0x48435442;
+
+    struct column_batch_header
+    {
+        uint32_t magic;
+        int32_t dispId;
+        uint32_t numRows;
+        uint16_t numColumns;
+        uint16_t reserved;
+        // of the whole batch, buffers included
+        uint64_t size;
+    };
+
+    struct column_header
+    {
+        flat_vt vt;
+        // bytes per value, 0 for strings
+        uint16_t width;
+        uint32_t reserved;
+        uint64_t validity;
+        // fixed width values or string offsets
+        uint64_t values;
+        // characters of strings, 0 otherwise
+        uint64_t data;
+        uint64_t dataSize;
+    };
+
+    static_assert(sizeof(column_batch_header) == 24 && sizeof(column_header) == 40,
+        "Columnar layout must not depend on the compiler!");
+
+    // bytes per value of the fixed width types, 0 for strings and empty
+    constexpr size_t flat_vt_width(flat_vt vt)
+    {
+        switch (vt)
+        {
+        case flat_vt::i1:
+        case flat_vt::ui1:
+            return 1;
+        case flat_vt::i2:
+        case flat_vt::ui2:
+        case flat_vt::boolean:
+            return 2;
+        case flat_vt::i4:
+        case flat_vt::ui4:
+        case flat_vt::integer:
+        case flat_vt::uinteger:
+        case flat_vt::error:
+        case flat_vt::r4:
+            return 4;
+        case flat_vt::i8:
+        case flat_vt::ui8:
+        case flat_vt::r8:
+        case flat_vt::date:
+            return 8;
+        default:
+            return 0;
+        }
+    }
+
+    // events of one DISPID, appended row by row. Reset keeps the buffers,
+    // so a recycled batch does not allocate unless its strings grow
+    class column_batch
+    {
+        struct column
+        {
+            flat_vt vt = flat_vt::empty;
+            std::vector<uint8_t> validity;
+            std::vector<uint8_t> values;
+            std::vector<int32_t> offsets;
+            std::string data;
+        };
+
+        int32_t dispId_ = 0;
+        size_t numRows_ = 0;
+        size_t capacity_;
+        std::vector<column> columns_;
+
+    public:
+
+        explicit column_batch(size_t capacity)
+            : capacity_(capacity)
+        {
+        }
+
+        void Reset(int32_t dispId)
+        {
+            dispId_ = dispId;
+            numRows_ = 0;
+
+            for (column& c : columns_)
+            {
+                c.vt = flat_vt::empty;
+                c.validity.clear();
+                c.values.clear();
+                c.offsets.clear();
+                c.data.clear();
+            }
+        }
+
+        int32_t DispID() const
+        {
+            return dispId_;
+        }
+
+        size_t NumRows() const
+        {
+            return numRows_;
+        }
+
+        bool IsFull() const
+        {
+            return numRows_ >= capacity_;
+        }
+
+        void Append(const flat_event& event, int64_t timestamp)
+        {
+            if (!numRows_)
+                begin(event);
+            else if (event.NumArgs() + 1 > columns_.size())
+                widen(event.NumArgs() + 1);
+
+            column& time = columns_[0];
+            set_valid(time, true);
+            append_value(time, &timestamp);
+
+            for (size_t i = 1; i < columns_.size(); ++i)
+            {
+                column& c = columns_[i];
+                size_t arg = i - 1;
+
+                if (c.vt == flat_vt::empty && arg < event.NumArgs())
+                    adopt_type(c, event.Arg(arg).vt);
+
+                bool valid = arg < event.NumArgs() && event.Arg(arg).vt == c.vt &&
+                    c.vt != flat_vt::empty;
+                set_valid(c, valid);
+
+                if (c.vt == flat_vt::bstr)
+                {
+                    if (valid)
+                        append_utf8(c.data, event.String(arg));
+                    c.offsets.push_back((int32_t)c.data.size());
+                    continue;
+                }
+
+                if (!valid)
+                {
+                    c.values.resize(c.values.size() + flat_vt_width(c.vt));
+                    continue;
+                }
+
+                const flat_arg& a = event.Arg(arg);
+                if (c.vt == flat_vt::r4)
+                {
+                    float value = (float)a.r;
+                    append_value(c, &value);
+                }
+                else if (c.vt == flat_vt::r8 || c.vt == flat_vt::date)
+                    append_value(c, &a.r);
+                else
+                    // little endian: the low bytes of the integer
+                    append_value(c, &a.i);
+            }
+
+            ++numRows_;
+        }
+
+        size_t SerializedSize() const
+        {
+            size_t size = sizeof(column_batch_header) + columns_.size() * sizeof(column_header);
+            for (const column& c : columns_)
+                size += padded(c.validity.size()) + padded(values_size(c)) + padded(c.data.size());
+            return size;
+        }
+
+        void WriteTo(std::ostream& out) const
+        {
+            column_batch_header header{ column_batch_magic, dispId_, (uint32_t)numRows_,
+                (uint16_t)columns_.size(), 0, SerializedSize() };
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+            uint64_t offset = sizeof(column_batch_header) + columns_.size() * sizeof(column_header);
+            for (const column& c : columns_)
+            {
+                column_header ch{ c.vt, (uint16_t)flat_vt_width(c.vt), 0, 0, 0, 0, c.data.size() };
+                ch.validity = offset;
+                offset += padded(c.validity.size());
+                ch.values = offset;
+                offset += padded(values_size(c));
+                ch.data = c.vt == flat_vt::bstr ? offset : 0;
+                offset += padded(c.data.size());
+
+                out.write(reinterpret_cast<const char*>(&ch), sizeof(ch));
+            }
+
+            for (const column& c : columns_)
+            {
+                write_padded(out, c.validity.data(), c.validity.size());
+                if (c.vt == flat_vt::bstr)
+                    write_padded(out, c.offsets.data(), values_size(c));
+                else
+                    write_padded(out, c.values.data(), c.values.size());
+                write_padded(out, c.data.data(), c.data.size());
+            }
+        }
+
+    private:
+
+        // the first value decides the type of a column
+        void begin(const flat_event& event)
+        {
+            columns_.resize(event.NumArgs() + 1);
+            for (column& c : columns_)
+                c.validity.reserve((capacity_ + 7) / 8);
+
+            adopt_type(columns_[0], flat_vt::i8);
+        }
+
+        // columns of arguments missing from the previous rows, which are null
+        void widen(size_t numColumns)
+        {
+            size_t numColumnsBefore = columns_.size();
+            columns_.resize(numColumns);
+
+            for (size_t i = numColumnsBefore; i < numColumns; ++i)
+            {
+                column& c = columns_[i];
+                c.validity.reserve((capacity_ + 7) / 8);
+                c.validity.assign((numRows_ + 7) / 8, 0);
+            }
+        }
+
+        // the previous rows of the column become nulls of the type
+        void adopt_type(column& c, flat_vt vt)
+        {
+            if (vt == flat_vt::empty)
+                return;
+
+            c.vt = vt;
+            if (vt == flat_vt::bstr)
+            {
+                c.offsets.reserve(capacity_ + 1);
+                c.offsets.assign(numRows_ + 1, 0);
+            }
+            else
+            {
+                c.values.reserve(capacity_ * flat_vt_width(vt));
+                c.values.assign(numRows_ * flat_vt_width(vt), 0);
+            }
+        }
+
+        void set_valid(column& c, bool valid)
+        {
+            if (numRows_ % 8 == 0)
+                c.validity.push_back(0);
+            if (valid)
+                c.validity.back() |= uint8_t(1u << (numRows_ % 8));
+        }
+
+        static void append_value(column& c, const void *value)
+        {
+            const uint8_t *bytes = static_cast<const uint8_t*>(value);
+            c.values.insert(c.values.end(), bytes, bytes + flat_vt_width(c.vt));
+        }
+
+        static void append_utf8(std::string& out, std::u16string_view chars)
+        {
+            for (size_t i = 0; i < chars.size(); ++i)
+            {
+                uint32_t cp = chars[i];
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 1 < chars.size() &&
+                    chars[i + 1] >= 0xDC00 && chars[i + 1] < 0xE000)
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (chars[++i] - 0xDC00);
+                else if (cp >= 0xD800 && cp < 0xE000)
+                    // unpaired surrogate
+                    cp = 0xFFFD;
+
+                if (cp < 0x80)
+                    out += char(cp);
+                else if (cp < 0x800)
+                {
+                    out += char(0xC0 | (cp >> 6));
+                    out += char(0x80 | (cp & 0x3F));
+                }
+                else if (cp < 0x10000)
+                {
+                    out += char(0xE0 | (cp >> 12));
+                    out += char(0x80 | ((cp >> 6) & 0x3F));
+                    out += char(0x80 | (cp & 0x3F));
+                }
+                else
+                {
+                    out += char(0xF0 | (cp >> 18));
+                    out += char(0x80 | ((cp >> 12) & 0x3F));
+                    out += char(0x80 | ((cp >> 6) & 0x3F));
+                    out += char(0x80 | (cp & 0x3F));
+                }
+            }
+        }
+
+        static size_t values_size(const column& c)
+        {
+            return c.vt == flat_vt::bstr ? c.offsets.size() * sizeof(int32_t) : c.values.size();
+        }
+
+        static size_t padded(size_t size)
+        {
+            return (size + 7) & ~size_t(7);
+        }
+
+        static void write_padded(std::ostream& out, const void *data, size_t size)
+        {
+            constexpr char zeros[8] = {};
+
+            if (size)
+                out.write(static_cast<const char*>(data), size);
+            out.write(zeros, padded(size) - size);
+        }
+    };
+
+    // read-only view of a written batch, e.g. in a mapped file
+    class column_batch_view
+    {
+        const uint8_t *data_;
+
+    public:
+
+        explicit column_batch_view(const uint8_t *data)
+            : data_(data)
+        {}
+
+        const column_batch_header& Header() const
+        {
+            return *reinterpret_cast<const column_batch_header*>(data_);
+        }
+
+        bool IsValid() const
+        {
+            return Header().magic == column_batch_magic;
+        }
+
+        int32_t DispID() const
+        {
+            return Header().dispId;
+        }
+
+        size_t NumRows() const
+        {
+            return Header().numRows;
+        }
+
+        size_t NumColumns() const
+        {
+            return Header().numColumns;
+        }
+
+        const column_header& Column(size_t i) const
+        {
+            return reinterpret_cast<const column_header*>(data_ + sizeof(column_batch_header))[i];
+        }
+
+        bool IsNull(size_t column, size_t row) const
+        {
+            return !(data_[Column(column).validity + row / 8] & (1u << (row % 8)));
+        }
+
+        // T must match the column's width
+        template <class T>
+        T Value(size_t column, size_t row) const
+        {
+            T value{};
+            std::memcpy(&value, data_ + Column(column).values + row * sizeof(T), sizeof(T));
+            return value;
+        }
+
+        int64_t Timestamp(size_t row) const
+        {
+            return Value<int64_t>(0, row);
+        }
+
+        std::string_view String(size_t column, size_t row) const
+        {
+            const column_header& c = Column(column);
+            const int32_t *offsets = reinterpret_cast<const int32_t*>(data_ + c.values);
+            return std::string_view(reinterpret_cast<const char*>(data_ + c.data) + offsets[row],
+                offsets[row + 1] - offsets[row]);
+        }
+
+        // the batch following this one
+        const uint8_t* Next() const
+        {
+            return data_ + Header().size;
+        }
+    };
+
+    // collects events into batches per DISPID. A batch is written once full, or by Flush.
+    // Append only copies the event into its batch, writing is done by a background thread.
+    // Events of DISPIDs in different shards are appended concurrently.
+    // Written batches are recycled: in steady state Append does not allocate
+    class columnar_exporter
+    {
+        constexpr static size_t num_shards = 16;
+
+        // batches being filled. Locked before mutex_
+        struct shard
+        {
+            std::mutex mutex;
+            std::unordered_map<int32_t, std::unique_ptr<column_batch>> filling;
+        };
+
+        std::ostream& out_;
+        size_t batchRows_;
+
+        std::array<shard, num_shards> shards_;
+
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<column_batch>> free_;
+        std::deque<std::unique_ptr<column_batch>> sealed_;
+        // sealed batches and the one being written
+        size_t unwritten_ = 0;
+
+        std::condition_variable hasSealed_;
+        std::condition_variable written_;
+        bool stop_ = false;
+
+        std::atomic<uint64_t> rowsWritten_ = 0;
+        std::atomic<uint64_t> batchesWritten_ = 0;
+
+        std::thread writer_;
+
+    public:
+
+        constexpr static size_t default_batch_rows = 4096;
+
+        // writes the file header. The stream must outlive the exporter
+        explicit columnar_exporter(std::ostream& out, size_t batchRows = default_batch_rows,
+            size_t preallocatedBatches = 4)
+            : out_(out),
+            batchRows_(batchRows ? batchRows : 1)
+        {
+            out_.write(columnar_file_magic, sizeof(columnar_file_magic));
+
+            free_.reserve(preallocatedBatches);
+            for (size_t i = 0; i < preallocatedBatches; ++i)
+                free_.push_back(std::make_unique<column_batch>(batchRows_));
+
+            writer_ = std::thread(&columnar_exporter::run, this);
+        }
+
+        columnar_exporter(const columnar_exporter&) = delete;
+        columnar_exporter& operator=(const columnar_exporter&) = delete;
+
+        // writes everything appended
+        ~columnar_exporter()
+        {
+            Flush();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            hasSealed_.notify_one();
+
+            writer_.join();
+        }
+
+        // nanoseconds since the Unix epoch
+        static int64_t Now()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        void Append(const flat_event& event, int64_t timestamp = Now())
+        {
+            shard& s = shards_[(uint32_t)event.DispID() % num_shards];
+            std::lock_guard<std::mutex> lock(s.mutex);
+
+            std::unique_ptr<column_batch>& batch = s.filling[event.DispID()];
+            if (!batch)
+                batch = take_free(event.DispID());
+
+            batch->Append(event, timestamp);
+            if (!batch->IsFull())
+                return;
+
+            // sealed under the shard's lock: the batches of a DISPID are written in order
+            seal(batch);
+            hasSealed_.notify_one();
+        }
+
+        // writes the partial batches and waits till everything appended is written
+        void Flush()
+        {
+            for (shard& s : shards_)
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                for (auto& filling : s.filling)
+                    if (filling.second && filling.second->NumRows())
+                        seal(filling.second);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            hasSealed_.notify_one();
+            written_.wait(lock, [this]() { return !unwritten_; });
+        }
+
+        uint64_t RowsWritten() const
+        {
+            return rowsWritten_;
+        }
+
+        uint64_t BatchesWritten() const
+        {
+            return batchesWritten_;
+        }
+
+    private:
+
+        std::unique_ptr<column_batch> take_free(int32_t dispId)
+        {
+            std::unique_ptr<column_batch> batch;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!free_.empty())
+                {
+                    batch = std::move(free_.back());
+                    free_.pop_back();
+                }
+            }
+
+            if (!batch)
+                batch = std::make_unique<column_batch>(batchRows_);
+
+            batch->Reset(dispId);
+            return batch;
+        }
+
+        // the DISPID takes a new batch on its next event
+        void seal(std::unique_ptr<column_batch>& batch)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sealed_.push_back(std::move(batch));
+            ++unwritten_;
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true)
+            {
+                hasSealed_.wait(lock, [this]() { return stop_ || !sealed_.empty(); });
+
+                if (sealed_.empty())
+                    return;
+
+                std::unique_ptr<column_batch> batch = std::move(sealed_.front());
+                sealed_.pop_front();
+                bool last = sealed_.empty();
+
+                lock.unlock();
+
+                batch->WriteTo(out_);
+                if (last)
+                    out_.flush();
+
+                rowsWritten_ += batch->NumRows();
+                ++batchesWritten_;
+
+                lock.lock();
+
+                free_.push_back(std::move(batch));
+                --unwritten_;
+                if (!unwritten_)
+                    written_.notify_all();
+            }
+        }
+    };
+}
@@ -0,0 +1,109 @@
+﻿#pragma once
+
+#include "com_events.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace cmw
+{
+    // outcome of one call executed by DispatchBatch::Flush
+    struct batch_result
+    {
+        DISPID dispId;
+        WORD flags;
+        HRESULT hr;
+    };
+
+    // records property puts and method calls on an IDispatch and runs them on Flush.
+    // A put replaces an earlier put of the same DISPID unless a method call was
+    // recorded in between, so properties are expected not to depend on each other
+    class DispatchBatch
+    {
+        ComPtr<IDispatch> pDispatch_;
+        std::shared_ptr<thread_pool> worker_;
+
+        std::vector<disp_event> calls_;
+        // puts which may still be overwritten: DISPID -> index in calls_
+        std::unordered_map<DISPID, size_t> openPuts_;
+        size_t coalesced_ = 0;
+
+    public:
+
+        // without a worker the calls are made on the thread calling Flush
+        explicit DispatchBatch(const ComPtr<IDispatch>& pDispatch,
+            std::shared_ptr<thread_pool> worker = nullptr);
+
+        DispatchBatch(const DispatchBatch&) = delete;
+        DispatchBatch& operator=(const DispatchBatch&) = delete;
+
+        template <class T>
+        void Put(DISPID dispId, const T& value)
+        {
+            put(record(dispId, DISPATCH_PROPERTYPUT, value));
+        }
+
+        template <typename ... A>
+        void Call(DISPID dispId, const A& ... args)
+        {
+            openPuts_.clear();
+            calls_.push_back(record(dispId, DISPATCH_METHOD, args...));
+        }
+
+        // calls waiting for Flush
+        size_t Size() const
+        {
+            return calls_.size();
+        }
+
+        // puts dropped because a later put replaced them, since construction
+        size_t Coalesced() const
+        {
+            return coalesced_;
+        }
+
+        // runs the recorded calls in order and clears the batch. The worker gets the
+        // object marshaled from the calling thread: if it lives in the calling STA,
+        // Flush must not use a worker, or it blocks.
+        // An exception thrown by a call stops the batch and is rethrown here
+        std::vector<batch_result> Flush();
+
+    private:
+
+        template <typename ... A>
+        static disp_event record(DISPID dispId, WORD wFlags, const A& ... args)
+        {
+            std::array<VARIANTARG, sizeof...(A) + 1> rgvarg{};
+            if constexpr (sizeof...(A) > 0)
+            {
+                // reverse order
+                size_t i = sizeof...(A);
+                (variant_traits<A>::Set(rgvarg[--i], args), ...);
+            }
+
+            DISPID propPut = DISPID_PROPERTYPUT;
+            bool isPut = wFlags == DISPATCH_PROPERTYPUT;
+
+            DISPPARAMS params{};
+            params.rgvarg = sizeof...(A) ? rgvarg.data() : nullptr;
+            params.cArgs = (UINT)sizeof...(A);
+            params.rgdispidNamedArgs = isPut ? &propPut : nullptr;
+            params.cNamedArgs = isPut ? 1 : 0;
+
+            disp_event call(dispId, LOCALE_USER_DEFAULT, wFlags, &params);
+
+            if constexpr (sizeof...(A) > 0)
+            {
+                size_t i = sizeof...(A);
+                ((variant_traits<A>::owning ? (void)VariantClear(&rgvarg[--i]) : (void)--i), ...);
+            }
+
+            return call;
+        }
+
+        void put(disp_event&& call);
+
+        static std::vector<batch_result> run(IDispatch& target, std::vector<disp_event>& calls);
+    };
+}
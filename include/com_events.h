@@ -1,6 +1,721 @@
 ﻿#pragma once
 
+#include "com_wrapper.h"
+#include "columnar_export.h"
+#include "cpu_affinity.h"
+#include "property_batcher.h"
+#include "shm_event_bus.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
 namespace cmw
 {
+    // owning copy of a single Invoke call, which may outlive the DISPPARAMS
+    // of the firing thread and be delivered by another thread.
+    // Arguments are copied with VariantCopyInd: references are replaced by their values,
+    // writes to them are not seen by the caller. Interface arguments are marshaled
+    // and restored by Unmarshal on the delivering thread. Arrays of interfaces
+    // can not be marshaled and are delivered as VT_EMPTY, as are the interfaces
+    // failing to marshal. The arrays of arguments are allocated from the event's resource
+    class disp_event
+    {
+        // interface argument waiting for Unmarshal
+        struct marshaled_arg
+        {
+            UINT index;
+            VARTYPE vt;
+            IStream *stream;
+        };
+
+        DISPID dispIdMember_ = DISPID_UNKNOWN;
+        LCID lcid_ = 0;
+        WORD wFlags_ = 0;
+
+        std::pmr::vector<VARIANTARG> args_;
+        std::pmr::vector<DISPID> namedArgs_;
+        std::pmr::vector<marshaled_arg> marshaled_;
+        DISPPARAMS params_{};
+
+        std::chrono::steady_clock::time_point received_;
+
+    public:
+
+        using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+        disp_event() = default;
+
+        explicit disp_event(const allocator_type& alloc);
+
+        disp_event(DISPID dispIdMember, LCID lcid, WORD wFlags,
+            const DISPPARAMS *pDispParams, const allocator_type& alloc = {});
+
+        disp_event(const disp_event&) = delete;
+        disp_event& operator=(const disp_event&) = delete;
+
+        disp_event(disp_event&& other) noexcept;
+        // arguments are moved to the resource of alloc
+        disp_event(disp_event&& other, const allocator_type& alloc);
+        disp_event& operator=(disp_event&& other) noexcept;
+
+        allocator_type get_allocator() const
+        {
+            return args_.get_allocator();
+        }
+
+        DISPID DispID() const
+        {
+            return dispIdMember_;
+        }
+
+        LCID Locale() const
+        {
+            return lcid_;
+        }
+
+        WORD Flags() const
+        {
+            return wFlags_;
+        }
+
+        // rgvarg keeps the Invoke order: the last argument comes first.
+        // Interface arguments are VT_EMPTY until Unmarshal
+        DISPPARAMS* Params()
+        {
+            return &params_;
+        }
+
+        // restores the interface arguments in the apartment of the calling thread,
+        // which delivers the event. Returns the first failure, the arguments
+        // failing to unmarshal are left VT_EMPTY
+        HRESULT Unmarshal() noexcept;
+
+        std::chrono::steady_clock::time_point Received() const
+        {
+            return received_;
+        }
+
+        ~disp_event();
+
+    private:
+
+        void clear();
+        // replaces the copied interface with a stream marshaling it
+        void marshal(UINT index);
+        // points params_ to the arrays, which may have been reallocated by a move
+        void bind();
+        // leaves the moved-from event empty without clearing the arguments
+        void release();
+    };
+
+    enum class event_priority : size_t
+    {
+        critical = 0,
+        high,
+        normal,
+        low
+    };
+
+    constexpr inline size_t num_event_priorities = 4;
+
+    enum class lane_scheduler
+    {
+        // a lower lane is served only when all the higher ones are empty
+        strict_priority,
+        // lanes are served round-robin, up to the lane's weight events per turn
+        weighted_fair
+    };
+
+    // delivery statistics of a single lane. Latency is measured from Invoke
+    // to the callback's return. Buckets are powers of two in microseconds
+    class lane_stats
+    {
+        constexpr static size_t num_buckets = 32;
+
+        std::array<std::atomic<uint64_t>, num_buckets> buckets_{};
+        std::atomic<uint64_t> delivered_ = 0;
+        std::atomic<uint64_t> dropped_ = 0;
+        std::atomic<uint64_t> maxLatencyUs_ = 0;
+
+    public:
+
+        void Record(std::chrono::nanoseconds latency);
+        void RecordDrop();
+
+        uint64_t Delivered() const
+        {
+            return delivered_;
+        }
+
+        uint64_t Dropped() const
+        {
+            return dropped_;
+        }
+
+        std::chrono::microseconds MaxLatency() const
+        {
+            return std::chrono::microseconds(maxLatencyUs_);
+        }
+
+        // upper bound of the bucket holding the requested percentile, e.g. 0.99
+        std::chrono::microseconds Percentile(double p) const;
+
+        void Reset();
+    };
+
+    // Listener delivering events through separate lanes, one per priority class.
+    // Invoke copies the call and returns immediately, a single worker thread
+    // picks events from the lanes according to the scheduler and runs the callbacks.
+    // The worker is in the multithreaded apartment, events it can not initialize COM
+    // for are dropped.
+    // pVarResult is never filled: results of asynchronous callbacks are discarded
+    class PriorityListener : public Listener
+    {
+        struct lane
+        {
+            std::pmr::deque<disp_event> events;
+            // 0 means unbounded
+            size_t capacity = 0;
+            size_t weight = 1;
+            lane_stats stats;
+
+            explicit lane(std::pmr::memory_resource *resource)
+                : events(resource)
+            {
+            }
+        };
+
+        lane_scheduler scheduler_;
+        std::array<lane, num_event_priorities> lanes_;
+
+        std::unordered_map<DISPID, event_priority> priorities_;
+        mutable std::shared_mutex mutexPriorities_;
+
+        mutable std::mutex mutexLanes_;
+        std::condition_variable hasEvents_;
+        bool stop_ = false;
+
+        // weighted fair scheduler state
+        size_t currentLane_ = 0;
+        size_t servedInTurn_ = 0;
+
+        std::thread worker_;
+
+    public:
+
+        // the queued events are allocated from the resource. It is used by the firing
+        // threads and the worker: a non-default resource must be synchronized,
+        // e.g. std::pmr::synchronized_pool_resource
+        static std::unique_ptr<PriorityListener> Create(REFIID connectionIID,
+            lane_scheduler scheduler = lane_scheduler::strict_priority,
+            std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+        using Listener::SetCallback;
+
+        // registers the callback and assigns the DISPID's priority class
+        subscription SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback,
+            event_priority priority);
+
+        // DISPIDs without an assigned class are delivered as event_priority::normal
+        void SetPriority(DISPID dispiid, event_priority priority);
+        event_priority Priority(DISPID dispiid) const;
+
+        // events arriving at a full lane are dropped and counted in the lane's stats.
+        // The critical lane should be left unbounded
+        void SetLaneCapacity(event_priority priority, size_t capacity);
+
+        // number of events served per turn by the weighted_fair scheduler
+        void SetLaneWeight(event_priority priority, size_t weight);
+
+        size_t Pending(event_priority priority) const;
+        const lane_stats& LaneStats(event_priority priority) const;
+
+        // IDispatch
+
+        virtual HRESULT __stdcall Invoke(DISPID dispIdMember,
+            REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr) override;
+
+        // delivers the events already queued, then stops the worker
+        virtual ~PriorityListener();
+
+    protected:
+
+        PriorityListener(REFIID connectionIID, lane_scheduler scheduler,
+            std::pmr::memory_resource *resource);
+
+    private:
+
+        // must be called with mutexLanes_ locked
+        bool has_events() const;
+        size_t next_lane();
+
+        void run();
+    };
+
+    // Listener delivering events on worker threads pinned to CPUs. Every DISPID is
+    // routed to a single worker, so its callbacks always run on the same core, in order.
+    // The events of a worker are allocated from memory first touched by the worker,
+    // which places it on the worker's NUMA node. Workers are in the multithreaded apartment.
+    // pVarResult is never filled: results of asynchronous callbacks are discarded
+    class AffinityListener : public Listener
+    {
+        // created by the pinned worker thread
+        struct worker_memory
+        {
+            first_touch_arena arena;
+            std::pmr::synchronized_pool_resource pool;
+            std::pmr::deque<disp_event> events;
+
+            explicit worker_memory(size_t arenaSize)
+                : arena(arenaSize),
+                pool(&arena),
+                events(&pool)
+            {
+            }
+        };
+
+        struct worker_thread
+        {
+            int cpu = -1;
+            bool pinned = false;
+            std::unique_ptr<worker_memory> memory;
+
+            std::mutex mutexEvents;
+            std::condition_variable hasEvents;
+            bool stop = false;
+
+            // not queued or not delivered
+            std::atomic<uint64_t> dropped = 0;
+
+            std::thread thread;
+        };
+
+        size_t arenaSize_;
+        std::vector<std::unique_ptr<worker_thread>> workers_;
+
+        std::unordered_map<DISPID, size_t> routes_;
+        mutable std::shared_mutex mutexRoutes_;
+
+    public:
+
+        constexpr static size_t default_arena_size = 1 << 20;
+
+        // starts a worker per CPU and returns once all of them are running.
+        // A worker whose CPU can not be used runs unpinned, see IsPinned
+        static std::unique_ptr<AffinityListener> Create(REFIID connectionIID,
+            const std::vector<int>& cpus, size_t arenaSize = default_arena_size);
+
+        using Listener::SetCallback;
+
+        // registers the callback and routes the DISPID to the worker
+        subscription SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback,
+            size_t worker);
+
+        // DISPIDs without a route are spread over the workers by their value
+        void Route(DISPID dispiid, size_t worker);
+        size_t Worker(DISPID dispiid) const;
+
+        size_t NumWorkers() const;
+        int WorkerCpu(size_t worker) const;
+        bool IsPinned(size_t worker) const;
+        size_t Pending(size_t worker) const;
+
+        // events lost: queuing them failed, or the worker could not initialize COM
+        uint64_t Dropped(size_t worker) const;
+
+        // memory on the worker's NUMA node, e.g. for the state of its callbacks.
+        // Synchronized, valid for the lifetime of the listener
+        std::pmr::memory_resource* WorkerResource(size_t worker) const;
+        const first_touch_arena& WorkerArena(size_t worker) const;
+
+        // IDispatch
+
+        virtual HRESULT __stdcall Invoke(DISPID dispIdMember,
+            REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr) override;
+
+        // delivers the events already queued, then stops the workers
+        virtual ~AffinityListener();
+
+    protected:
+
+        AffinityListener(REFIID connectionIID, const std::vector<int>& cpus, size_t arenaSize);
+
+    private:
+
+        void run(worker_thread& w, std::promise<void>& ready);
+    };
+
+    // call of a subscriber which has exceeded the latency budget of its DISPID
+    struct slow_callback
+    {
+        // identity only, the listener may have been destroyed since
+        const Listener *listener;
+        // see Listener::Id
+        uint64_t listenerId;
+        DISPID dispId;
+        // id of the subscriber's subscription
+        size_t subscriber;
+        // type of the registered callable, e.g. the lambda's. Typed callbacks report
+        // the function they were registered with, not their adapter
+        const std::type_info *handler;
+        // since the call began, the call is still running
+        std::chrono::nanoseconds elapsed;
+        // over-budget calls of the subscriber so far, this one included
+        size_t offenses;
+        // the following calls of the subscriber are delivered by the watchdog's worker
+        bool offloaded;
+    };
+
+    // invoke_monitor sampling the calls in flight. A call running longer than the budget
+    // of its DISPID is reported once, by the monitor thread, while it still runs.
+    // Stamping a call costs a clock read and a few relaxed stores on the firing thread.
+    // Optionally, subscribers exceeding the budget repeatedly are moved to the watchdog's
+    // worker: the listeners only queue their events from then on. Results of the moved
+    // calls are discarded. The moved calls of a listener are cancelled when it is
+    // destroyed or detached, which waits for the one in progress.
+    // Attach with Listener::SetMonitor
+    class callback_watchdog : public invoke_monitor
+    {
+    public:
+
+        constexpr static size_t max_threads = thread_slots::max_threads;
+
+        using clock = std::chrono::steady_clock;
+
+    private:
+
+        // written by the thread owning the slot, read by the monitor thread
+        struct alignas(cache_line_size) call_slot
+        {
+            // clock ticks, 0 when no call is running
+            std::atomic<clock::rep> began = 0;
+            std::atomic<uint64_t> call = 0;
+            std::atomic<const Listener*> listener = nullptr;
+            std::atomic<uint64_t> listenerId = 0;
+            std::atomic<DISPID> dispId = 0;
+            std::atomic<size_t> subscriber = 0;
+            std::atomic<const std::type_info*> handler = nullptr;
+
+            // nested calls are not stamped. Owning thread only
+            size_t depth = 0;
+            // last call reported. Monitor thread only
+            uint64_t reported = 0;
+        };
+
+        struct offloaded_call
+        {
+            uint64_t listenerId;
+            callback_table::subscriber subscriber;
+            void *context;
+            disp_event event;
+        };
+
+        // listener's id and subscription id
+        using subscriber_key = std::pair<uint64_t, size_t>;
+
+        std::array<call_slot, max_threads> slots_;
+        std::function<void(const slow_callback&)> onSlow_;
+        clock::duration period_;
+
+        std::unordered_map<DISPID, clock::duration> budgets_;
+        clock::duration defaultBudget_;
+        mutable std::shared_mutex mutexBudgets_;
+
+        std::map<subscriber_key, size_t> offenses_;
+        std::set<subscriber_key> offloaded_;
+        std::atomic<size_t> offloadAfter_ = 0;
+        std::atomic<size_t> numOffloaded_ = 0;
+        mutable std::shared_mutex mutexOffenders_;
+
+        std::atomic<uint64_t> numReported_ = 0;
+        std::atomic<uint64_t> numOffloadedCalls_ = 0;
+
+        // a list: Detach moves the cancelled calls out without allocating
+        std::list<offloaded_call> lane_;
+        // id of the listener whose call the worker runs, 0 if none
+        uint64_t running_ = 0;
+        std::mutex mutexLane_;
+        std::condition_variable hasCalls_;
+        std::condition_variable callDone_;
+        std::condition_variable stopping_;
+        bool stop_ = false;
+
+        std::thread worker_;
+        std::thread monitor_;
+
+    public:
+
+        // onSlow is called by the monitor thread, which samples the calls once per period
+        explicit callback_watchdog(std::function<void(const slow_callback&)> onSlow,
+            std::chrono::nanoseconds defaultBudget = std::chrono::milliseconds(100),
+            std::chrono::nanoseconds period = std::chrono::milliseconds(10));
+
+        callback_watchdog(const callback_watchdog&) = delete;
+        callback_watchdog& operator=(const callback_watchdog&) = delete;
+
+        void SetBudget(DISPID dispId, std::chrono::nanoseconds budget);
+        std::chrono::nanoseconds Budget(DISPID dispId) const;
+
+        // subscribers are moved to the worker at their offenses-th over-budget call,
+        // 0 never moves them
+        void SetOffloadAfter(size_t offenses);
+
+        size_t Offenses(const Listener& listener, size_t subscriber) const;
+        bool IsOffloaded(const Listener& listener, size_t subscriber) const;
+
+        // forgets the offenses, the moved subscribers are called in place again
+        void Reset();
+
+        uint64_t NumReported() const
+        {
+            return numReported_;
+        }
+
+        uint64_t NumOffloadedCalls() const
+        {
+            return numOffloadedCalls_;
+        }
+
+        // invoke_monitor
+
+        bool Begin(const Listener& listener, const callback_table::subscriber& subscriber,
+            void *context, DISPID dispIdMember, LCID lcid, WORD wFlags,
+            DISPPARAMS *pDispParams) noexcept override;
+
+        void End(const Listener& listener, const callback_table::subscriber& subscriber) noexcept override;
+
+        // cancels the listener's moved calls, waits for the one in progress unless
+        // called by it, and forgets the listener's offenses
+        void Detach(const Listener& listener) noexcept override;
+
+        // delivers the calls already moved to the worker
+        virtual ~callback_watchdog();
+
+    private:
+
+        void offload(const Listener& listener, const callback_table::subscriber& subscriber,
+            void *context, DISPID dispIdMember, LCID lcid, WORD wFlags, DISPPARAMS *pDispParams);
+
+        void report(const Listener *listener, uint64_t listenerId, DISPID dispId, size_t subscriber,
+            const std::type_info *handler, clock::duration elapsed);
+
+        void sample();
+
+        void run_monitor();
+        void run_worker();
+    };
+
+    // Listener connected to the provider only while it has callbacks.
+    // Advise is done when the first callback is registered, Unadvise when the last
+    // one is removed. Connection points are looked up through the cache, which may
+    // be shared by several listeners.
+    // Changes made by the handlers take effect when Invoke returns, still inside the
+    // provider's call: the provider must accept Advise and Unadvise while firing.
+    // Handlers called during Advise, by providers firing on connection, are deferred alike
+    class AutoConnectListener : public Listener
+    {
+        ComPtr<IConnectionPointContainer> provider_;
+        std::shared_ptr<connection_point_cache> cache_;
+
+        mutable std::mutex mutexConnection_;
+        DWORD cookie_ = 0;
+        bool connected_ = false;
+        HRESULT hr_ = S_OK;
+
+        // callbacks changed since the connection was last updated
+        std::atomic<bool> changed_ = false;
+
+    public:
+
+        static std::unique_ptr<AutoConnectListener> Create(REFIID connectionIID,
+            const ComPtr<IConnectionPointContainer>& provider,
+            std::shared_ptr<connection_point_cache> cache = nullptr);
+
+        bool IsConnected() const;
+
+        // result of the last Advise or Unadvise
+        HRESULT LastResult() const;
+
+        virtual HRESULT __stdcall Invoke(DISPID dispIdMember, REFIID riid, LCID lcid,
+            WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult,
+            EXCEPINFO * pExcepInfo, UINT * puArgErr) override;
+
+    protected:
+
+        AutoConnectListener(REFIID connectionIID,
+            const ComPtr<IConnectionPointContainer>& provider,
+            std::shared_ptr<connection_point_cache> cache);
+
+        void OnCallbacksChanged() override;
+
+    private:
+
+        // Advise or Unadvise until the connection matches the callbacks
+        void reconnect();
+        // mutexConnection_ must be held
+        void update_connection();
+    };
+
+    // IPropertyNotifySink implementation forwarding OnChanged to a callback.
+    // OnRequestEdit always allows the edit
+    class PropertyNotifySink : public IPropertyNotifySink
+    {
+        // destroy last to keep track of references till the end
+        reference_counter refCounter_;
+        std::function<void(DISPID)> onChanged_;
+        com_connections connections_;
+
+    public:
+
+        PropertyNotifySink(const PropertyNotifySink&) = delete;
+        PropertyNotifySink(PropertyNotifySink&&) = delete;
+
+        // RAII. Terminate connections on destruction
+        static std::unique_ptr<PropertyNotifySink> Create(std::function<void(DISPID)>&& onChanged);
+
+        // invalidates the cached values of the changed properties.
+        // The cache is kept alive by the sink
+        static std::unique_ptr<PropertyNotifySink> Create(std::shared_ptr<property_cache> cache);
+
+        // advises on the IPropertyNotifySink connection point of the container
+        Result<DWORD> TryConnect(IConnectionPointContainer& container) noexcept;
+
+        size_t NumConnections() const;
+        void RegConnection(DWORD cookie, ComPtr<IConnectionPoint>& cpoint);
+        std::variant<HRESULT, bool> Disconnect(DWORD cookie);
+        Result<void> TryDisconnect(DWORD cookie) noexcept;
+        HRESULT DisconnectAll();
+
+        // IUnknown
+
+        ULONG __stdcall AddRef(void) override;
+        ULONG __stdcall Release(void) override;
+        HRESULT __stdcall QueryInterface(REFIID riid, void ** ppvObject) override;
+
+        // IPropertyNotifySink
+
+        HRESULT __stdcall OnChanged(DISPID dispID) override;
+        HRESULT __stdcall OnRequestEdit(DISPID dispID) override;
+
+        virtual ~PropertyNotifySink() = default;
+
+    protected:
+
+        explicit PropertyNotifySink(std::function<void(DISPID)>&& onChanged);
+    };
+
+    // IPropertyNotifySink of one object, recording the changed DISPIDs
+    // for the batcher instead of calling back on each OnChanged.
+    // Connect it to a single container: the context identifies the object
+    class BatchedPropertySink : public PropertyNotifySink
+    {
+        std::shared_ptr<property_batcher> batcher_;
+        std::shared_ptr<property_batcher::watched_object> object_;
+
+    public:
+
+        // RAII. Terminate connections on destruction
+        static std::unique_ptr<BatchedPropertySink> Create(std::shared_ptr<property_batcher> batcher,
+            void *context = nullptr);
+
+        void* Context() const;
+
+        // IPropertyNotifySink
+
+        HRESULT __stdcall OnChanged(DISPID dispID) override;
+
+        ~BatchedPropertySink();
+
+    protected:
+
+        BatchedPropertySink(std::shared_ptr<property_batcher> batcher, void *context);
+    };
+
+    // appends the arguments in declaration order. Arguments which can not leave
+    // the process, e.g. interfaces, are encoded as empty
+    void flatten_disp_params(flat_event_builder& builder, DISPID dispIdMember, WORD wFlags,
+        const DISPPARAMS *pDispParams);
+
+    // Listener republishing every event to the local processes subscribed to the bus,
+    // so a single connection to the server serves all of them. Local callbacks are
+    // called as well
+    class PublishingListener : public Listener
+    {
+        std::shared_ptr<shm_event_bus> bus_;
+
+        // the bus has a single publisher
+        std::mutex mutexBus_;
+        flat_event_builder builder_;
+
+        std::atomic<uint64_t> numFailed_ = 0;
+
+    public:
+
+        static std::unique_ptr<PublishingListener> Create(REFIID connectionIID,
+            std::shared_ptr<shm_event_bus> bus);
+
+        // events not published because encoding or publishing threw
+        uint64_t NumFailed() const
+        {
+            return numFailed_.load(std::memory_order_relaxed);
+        }
+
+        virtual HRESULT __stdcall Invoke(DISPID dispIdMember,
+            REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr) override;
+
+    protected:
+
+        PublishingListener(REFIID connectionIID, std::shared_ptr<shm_event_bus> bus);
+    };
+
+    // Listener exporting every event in columnar batches for offline analysis,
+    // see columnar_exporter. Local callbacks are called as well.
+    // Events are encoded in a buffer of the firing thread
+    class ExportingListener : public Listener
+    {
+        std::shared_ptr<columnar_exporter> exporter_;
+
+        std::atomic<uint64_t> numFailed_ = 0;
+
+    public:
+
+        static std::unique_ptr<ExportingListener> Create(REFIID connectionIID,
+            std::shared_ptr<columnar_exporter> exporter);
+
+        // events not exported because encoding or appending threw
+        uint64_t NumFailed() const
+        {
+            return numFailed_.load(std::memory_order_relaxed);
+        }
+
+        virtual HRESULT __stdcall Invoke(DISPID dispIdMember,
+            REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr) override;
+
+    protected:
+
+        ExportingListener(REFIID connectionIID, std::shared_ptr<columnar_exporter> exporter);
+    };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,56 @@
+﻿#pragma once
+
+#include <array>
+#include <vector>
+#include <atomic>
+#include <ostream>
+#include <cstdint>
+
+namespace cmw
+{
+    enum class flight_event : uint8_t
+    {
+        invoke,
+        connect,
+        disconnect
+    };
+
+    // compact binary record. Timestamps are raw ticks of the recorder's clock,
+    // comparable between threads
+    struct flight_record
+    {
+        int64_t ticks;
+        int32_t dispId;
+        int32_t result;
+        uint32_t cookie;
+        uint32_t threadId;
+        uint16_t numArgs;
+        flight_event event;
+        uint8_t reserved;
+    };
+
+    static_assert(sizeof(flight_record) == 32, "Flight record must stay compact!");
+
+    // always-on history of sink events and connection changes.
+    // Every thread writes to its own ring, overwriting the oldest records
+    class flight_recorder
+    {
+    public:
+
+        static constexpr size_t ring_capacity = 1024;
+        static constexpr size_t max_threads = 128;
+
+        static void Record(flight_event event, int32_t dispId, int32_t result,
+            uint32_t numArgs = 0, uint32_t cookie = 0) noexcept;
+
+        // merged in time order. Records overwritten while copying are skipped
+        static std::vector<flight_record> Snapshot();
+
+        // text, one record per line
+        static void Dump(std::ostream& out);
+
+        // for crash handlers: no locks, no allocations. Writes the binary header
+        // "CMWFLT1" followed by the merged records to the file descriptor
+        static void DumpSignalSafe(int fd) noexcept;
+    };
+}
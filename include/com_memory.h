@@ -0,0 +1,210 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+
+namespace cmw
+{
+    enum class allocation_check
+    {
+        off,
+        // violations are only counted
+        count,
+        // violations are counted and reported to the violation handler,
+        // the program is aborted without one. Also in release builds
+        assert_none
+    };
+
+    // detects global heap allocations made while Listener::Invoke runs on the thread.
+    // Works in programs replacing operator new with CMW_DEFINE_GUARDED_OPERATOR_NEW
+    class allocation_guard
+    {
+    public:
+
+        // called inside operator new: must not allocate
+        using violation_handler = void (*)(size_t size) noexcept;
+
+    private:
+
+        static std::atomic<allocation_check> mode_;
+        static std::atomic<violation_handler> handler_;
+
+    public:
+
+        static void SetMode(allocation_check mode) noexcept
+        {
+            mode_.store(mode, std::memory_order_relaxed);
+        }
+
+        static allocation_check Mode() noexcept
+        {
+            return mode_.load(std::memory_order_relaxed);
+        }
+
+        // replaces std::abort in assert_none mode. nullptr restores it
+        static void SetViolationHandler(violation_handler handler) noexcept
+        {
+            handler_.store(handler, std::memory_order_release);
+        }
+
+        // called by the replaced operator new
+        static void OnGlobalAllocation(size_t size) noexcept;
+
+        // allocations made inside guarded scopes, on every thread
+        static uint64_t Violations() noexcept;
+
+        // bytes requested by these allocations
+        static uint64_t ViolationBytes() noexcept;
+
+        // guarded region. Nested scopes are allowed
+        class scope
+        {
+            bool active_;
+
+        public:
+
+            scope() noexcept;
+            ~scope();
+
+            scope(const scope&) = delete;
+            scope& operator=(const scope&) = delete;
+        };
+
+        // one-time allocations of the library inside a guarded region,
+        // e.g. per-thread buffers created on the first event
+        class exempt
+        {
+            bool active_;
+
+        public:
+
+            exempt() noexcept;
+            ~exempt();
+
+            exempt(const exempt&) = delete;
+            exempt& operator=(const exempt&) = delete;
+        };
+    };
+
+    // scratch memory of the callback running on the thread, e.g. for converted strings
+    // or temporary vectors built from the arguments. Listener rewinds the arena when the
+    // callback returns: nothing allocated from it may be kept. Deallocation does nothing.
+    // The thread keeps its chunks, so in steady state the scratch allocations
+    // do not reach the heap
+    class scratch_arena : public std::pmr::memory_resource
+    {
+        struct chunk
+        {
+            chunk *next;
+            size_t size;
+        };
+
+        chunk *first_ = nullptr;
+        // nullptr until the first allocation after a full rewind
+        chunk *current_ = nullptr;
+        size_t used_ = 0;
+
+        size_t numChunks_ = 0;
+        size_t capacity_ = 0;
+
+    public:
+
+        constexpr static size_t chunk_size = 16 * 1024;
+
+        // arena of the calling thread
+        static scratch_arena& Current() noexcept;
+
+        scratch_arena() = default;
+
+        scratch_arena(const scratch_arena&) = delete;
+        scratch_arena& operator=(const scratch_arena&) = delete;
+
+        // releases what is allocated during its lifetime. Nested scopes are allowed
+        class scope
+        {
+            scratch_arena& arena_;
+            chunk *current_;
+            size_t used_;
+
+        public:
+
+            scope() noexcept
+                : scope(Current())
+            {
+            }
+
+            explicit scope(scratch_arena& arena) noexcept
+                : arena_(arena),
+                current_(arena.current_),
+                used_(arena.used_)
+            {
+            }
+
+            ~scope()
+            {
+                arena_.current_ = current_;
+                arena_.used_ = used_;
+            }
+
+            scope(const scope&) = delete;
+            scope& operator=(const scope&) = delete;
+        };
+
+        size_t NumChunks() const
+        {
+            return numChunks_;
+        }
+
+        // bytes of all the chunks
+        size_t Capacity() const
+        {
+            return capacity_;
+        }
+
+        ~scratch_arena();
+
+    protected:
+
+        void* do_allocate(size_t bytes, size_t alignment) override;
+
+        void do_deallocate(void*, size_t, size_t) override
+        {
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+
+    private:
+
+        static std::byte* data(chunk *c)
+        {
+            return reinterpret_cast<std::byte*>(c + 1);
+        }
+
+        // inserted after the current chunk
+        chunk* add_chunk(size_t minSize);
+    };
+}
+
+// put in one translation unit of the program to enable allocation_guard
+#define CMW_DEFINE_GUARDED_OPERATOR_NEW \
+    void* operator new(std::size_t size) \
+    { \
+        cmw::allocation_guard::OnGlobalAllocation(size); \
+        if (void *p = std::malloc(size ? size : 1)) \
+            return p; \
+        throw std::bad_alloc(); \
+    } \
+    void operator delete(void *p) noexcept \
+    { \
+        std::free(p); \
+    } \
+    void operator delete(void *p, std::size_t) noexcept \
+    { \
+        std::free(p); \
+    }
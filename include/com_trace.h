@@ -0,0 +1,147 @@
+﻿#pragma once
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace cmw
+{
+    enum class trace_category : uint8_t
+    {
+        create_instance,
+        query_interface,
+        find_connection_point,
+        connect,
+        disconnect,
+        invoke
+    };
+
+    const char* trace_category_name(trace_category category) noexcept;
+
+    // completed span
+    struct trace_record
+    {
+        // static string
+        const char *name;
+        trace_category category;
+        int32_t result;
+        int64_t arg;
+        int64_t beginNs;
+        int64_t endNs;
+    };
+
+    // written by the owning thread only, drained by the flusher.
+    // Spans are dropped when the ring is full
+    class trace_ring
+    {
+        static constexpr size_t capacity = 4096;
+
+        std::array<trace_record, capacity> records_;
+
+        alignas(64) std::atomic<size_t> head_ = 0;
+        alignas(64) std::atomic<size_t> tail_ = 0;
+        std::atomic<uint64_t> dropped_ = 0;
+
+        const uint32_t threadId_;
+
+    public:
+
+        explicit trace_ring(uint32_t threadId)
+            : threadId_(threadId)
+        {}
+
+        uint32_t ThreadId() const
+        {
+            return threadId_;
+        }
+
+        uint64_t Dropped() const
+        {
+            return dropped_.load(std::memory_order_relaxed);
+        }
+
+        uint64_t TakeDropped()
+        {
+            return dropped_.exchange(0, std::memory_order_relaxed);
+        }
+
+        void Push(const trace_record& record) noexcept;
+
+        // appends the pending records to out
+        size_t Drain(std::vector<trace_record>& out);
+    };
+
+    // records spans of COM calls into per-thread rings. A background thread
+    // flushes them to a Chrome trace JSON file, viewable in chrome://tracing or Perfetto
+    class tracer
+    {
+        static std::atomic<bool> enabled_;
+
+    public:
+
+        static bool Enabled() noexcept
+        {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+
+        // false if a session is already running or the file can not be created
+        static bool Start(const std::string& path,
+            std::chrono::milliseconds flushInterval = std::chrono::milliseconds(100));
+
+        // stops recording, flushes the pending spans and closes the file
+        static void Stop();
+
+        // spans lost to full rings during the current or last session
+        static uint64_t Dropped();
+
+        static void Record(const trace_record& record) noexcept;
+
+        static int64_t Now() noexcept
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+    };
+
+    // RAII span. While tracing is disabled it costs one branch on a global flag
+    class trace_span
+    {
+        const char *name_ = nullptr;
+        trace_category category_;
+        int32_t result_ = 0;
+        int64_t arg_;
+        int64_t begin_ = 0;
+
+    public:
+
+        trace_span(const char *name, trace_category category, int64_t arg = 0) noexcept
+            : category_(category),
+            arg_(arg)
+        {
+            if (tracer::Enabled())
+            {
+                name_ = name;
+                begin_ = tracer::Now();
+            }
+        }
+
+        trace_span(const trace_span&) = delete;
+        trace_span& operator=(const trace_span&) = delete;
+
+        // HRESULT of the traced call
+        void SetResult(int32_t result) noexcept
+        {
+            result_ = result;
+        }
+
+        ~trace_span()
+        {
+            if (name_)
+                tracer::Record({ name_, category_, result_, arg_, begin_, tracer::Now() });
+        }
+    };
+}
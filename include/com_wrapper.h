@@ -2,31 +2,169 @@
 
 #include <map>
 #include <set>
+#include <array>
 #include <unordered_map>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 
 #include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include <type_traits>
+#include <typeinfo>
 #include <variant>
 #include <cassert>
+#include <cstring>
+#include <limits>
 
 #include <atomic>
+#include <chrono>
 #include <functional>
 
 #include <combaseapi.h>
 #include <comdef.h>
 
+#include "com_trace.h"
+#include "com_flight.h"
+#include "com_memory.h"
+#include "atomic_ref_ptr.h"
+#include "epoch_reclamation.h"
+#include "release_queue.h"
+
 #undef interface
 #undef max
 
 namespace cmw
 {
+    // RPC_E_CHANGED_MODE is not an error: COM is already initialized on the thread
+    // in the other apartment and is left as it is
     struct COMContext
     {
         COMContext(bool multithreaded = true);
         ~COMContext();
+
+    private:
+
+        bool initialized_ = false;
+    };
+
+    enum class com_apartment
+    {
+        multithreaded,
+        single_threaded
+    };
+
+    // lazy COM initialization of the calling thread. CreateInstance, FindConnectionPoint
+    // and ConnectListener initialize the thread on first use, COM is uninitialized
+    // when the thread exits. Threads never touching COM pay nothing
+    class com_thread
+    {
+        static thread_local bool initialized_;
+
+    public:
+
+        // apartment of the threads which have not chosen their own.
+        // Multithreaded by default
+        static void SetDefaultApartment(com_apartment apartment) noexcept;
+
+        // apartment of the calling thread. Has no effect once the thread is initialized
+        static void SetApartment(com_apartment apartment) noexcept;
+
+        // S_OK if COM may be used on the thread, including the case when it has been
+        // initialized in the other apartment by someone else. Failures are retried
+        // on the next call
+        static HRESULT Ensure() noexcept
+        {
+            return initialized_ ? S_OK : initialize();
+        }
+
+        static bool IsInitialized() noexcept
+        {
+            return initialized_;
+        }
+
+    private:
+
+        static HRESULT initialize() noexcept;
+    };
+
+    // fixed set of worker threads running posted tasks in FIFO order.
+    // Workers do not initialize COM until a task uses it, see com_thread.
+    // They join the multithreaded apartment whatever the default is
+    class thread_pool
+    {
+        std::vector<std::thread> workers_;
+        std::deque<std::function<void()>> tasks_;
+
+        std::mutex mutexTasks_;
+        std::condition_variable hasTasks_;
+        bool stop_ = false;
+
+    public:
+
+        explicit thread_pool(size_t numThreads = std::thread::hardware_concurrency());
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        void Post(std::function<void()>&& task);
+
+        size_t NumThreads() const
+        {
+            return workers_.size();
+        }
+
+        // runs the tasks already posted, then joins the workers
+        ~thread_pool();
+
+    private:
+
+        void run();
+    };
+
+    // queue of the deferred ComPtr releases. Its thread initializes COM
+    release_queue& com_release_queue();
+
+    // opt-in per thread: while a scope exists, the releases of ComPtr made by the thread
+    // are pushed to com_release_queue() instead of being done in place.
+    // Any release may be the final one, so all of them are deferred. The queue's thread
+    // is in the multithreaded apartment: pointers bound to a single-threaded one must not
+    // be released in a scope. Flush the queue before uninitializing COM or unloading the servers
+    class deferred_release
+    {
+        static thread_local size_t depth_;
+
+    public:
+
+        deferred_release() noexcept
+        {
+            ++depth_;
+        }
+
+        ~deferred_release()
+        {
+            --depth_;
+        }
+
+        deferred_release(const deferred_release&) = delete;
+        deferred_release& operator=(const deferred_release&) = delete;
+
+        static bool IsActive() noexcept
+        {
+            return depth_ > 0;
+        }
     };
 
+    // either a value or a failed HRESULT. Defined below ComPtr
+    template <class T>
+    class Result;
+
     template <typename T, 
         class = std::enable_if_t<std::is_base_of_v<IUnknown, T>>>
     class ComPtr
@@ -72,17 +210,23 @@ namespace cmw
             other.rawPtr_ = nullptr;
         }
 
+        // the new pointer is referenced before the old one is released:
+        // self-assignment must not destroy the object
         ComPtr& operator=(const ComPtr& other)
         {
-            release_if_valid(rawPtr_);
+            ptr_type *prev = rawPtr_;
             rawPtr_ = other.rawPtr_;
             if (IsValid())
                 rawPtr_->AddRef();
+            release_if_valid(prev);
             return *this;
         }
 
         ComPtr& operator=(ComPtr&& other)
         {
+            if (this == &other)
+                return *this;
+
             release_if_valid(rawPtr_);
             rawPtr_ = other.rawPtr_;
             other.rawPtr_ = nullptr;
@@ -118,19 +262,40 @@ namespace cmw
         ComPtr(Q *raw_parent)
             : rawPtr_(nullptr)
         {
+            trace_span span("ComPtr::ComPtr", trace_category::query_interface);
             HRESULT hr = raw_parent->QueryInterface((T**)&rawPtr_);
+            span.SetResult(hr);
             assert(SUCCEEDED(hr) && "Failed to query interface!");
 
             if (!SUCCEEDED(hr))
                 throw _com_error(hr);
         }
 
+        // non-throwing counterpart of the constructor above
+        template <typename Q, class = std::enable_if_t<std::is_base_of_v<IUnknown, Q>>>
+        static Result<ComPtr> TryQuery(Q *raw_parent) noexcept
+        {
+            if (!raw_parent)
+                return Result<ComPtr>::Fail(E_POINTER);
+
+            trace_span span("ComPtr::TryQuery", trace_category::query_interface);
+            T *rawOut = nullptr;
+            HRESULT hr = raw_parent->QueryInterface(__uuidof(T), (void**)&rawOut);
+            span.SetResult(hr);
+            if (!SUCCEEDED(hr))
+                return Result<ComPtr>::Fail(hr);
+
+            return ComPtr(rawOut);
+        }
+
         // TODO: return hresut code, do not throw
         template <typename Q, class = std::enable_if_t<std::is_base_of_v<IUnknown, Q>>>
         std::variant<ComPtr<Q>, HRESULT> QueryInterface()
         {
+            trace_span span("ComPtr::QueryInterface", trace_category::query_interface);
             Q *rawOut = nullptr;
             HRESULT hr = rawPtr_->QueryInterface(__uuidof(Q), (void**)&rawOut);
+            span.SetResult(hr);
 
             if (!SUCCEEDED(hr))
                 return hr;
@@ -139,6 +304,23 @@ namespace cmw
             return ComPtr<Q>(rawOut);
         }
 
+        // non-throwing counterpart of the conversion operator below
+        template <typename Q, class = std::enable_if_t<std::is_base_of_v<IUnknown, Q>>>
+        Result<ComPtr<Q>> TryQueryInterface() const noexcept
+        {
+            if (!IsValid())
+                return Result<ComPtr<Q>>::Fail(E_POINTER);
+
+            trace_span span("ComPtr::TryQueryInterface", trace_category::query_interface);
+            Q *rawOut = nullptr;
+            HRESULT hr = rawPtr_->QueryInterface(__uuidof(Q), (void**)&rawOut);
+            span.SetResult(hr);
+            if (!SUCCEEDED(hr))
+                return Result<ComPtr<Q>>::Fail(hr);
+
+            return ComPtr<Q>(rawOut);
+        }
+
         template <typename Q, class = std::enable_if_t<std::is_base_of_v<IUnknown, Q>>>
         operator ComPtr<Q>()
         {
@@ -184,6 +366,14 @@ namespace cmw
             return rawPtr_;
         }
 
+        // gives up ownership without releasing the pointer
+        T* Detach()
+        {
+            T *raw = rawPtr_;
+            rawPtr_ = nullptr;
+            return raw;
+        }
+
         size_t RefsCount() const
         {
             if (!IsValid())
@@ -197,8 +387,7 @@ namespace cmw
 
         ~ComPtr()
         {
-            if (rawPtr_)
-                rawPtr_->Release();
+            release_if_valid(rawPtr_);
         }
 
     private:
@@ -212,463 +401,1851 @@ namespace cmw
 
         static void release_if_valid(T *ptr)
         {
-            if (ptr)
+            if (!ptr)
+                return;
+
+            if (deferred_release::IsActive())
+                com_release_queue().Push(ptr);
+            else
                 ptr->Release();
         }
     };
 
-    template <class Interface>
-    struct transfer_com_ptr
+    // ComPtr shared by threads without a lock. Load returns an owning copy,
+    // Store, Exchange and CompareExchange replace the pointer. See atomic_ref_ptr
+    template <class T>
+    class AtomicComPtr
     {
+        atomic_ref_ptr<T> ptr_;
 
-        using v_interface = std::variant<ComPtr<Interface>, HRESULT>;
-        using ptr_com = ComPtr<Interface>;
-
-        v_interface temp_;
+    public:
 
-        constexpr transfer_com_ptr(v_interface&& temp)
-            : temp_(std::move(temp))
-        {}
+        AtomicComPtr() = default;
 
-        operator v_interface()
+        AtomicComPtr(ComPtr<T> ptr) noexcept
+            : ptr_(ptr.Detach())
         {
-            return std::move(temp_);
         }
 
-        operator ptr_com()
+        AtomicComPtr(const AtomicComPtr&) = delete;
+        AtomicComPtr& operator=(const AtomicComPtr&) = delete;
+
+        ComPtr<T> Load() const noexcept
         {
-            assert(!std::holds_alternative<HRESULT>(temp_) &&
-                "Invalid Connection point received!");
-            if (std::holds_alternative<HRESULT>(temp_))
-                throw _com_error(std::get<HRESULT>(temp_));
+            return wrap(ptr_.Load());
+        }
 
-            return std::move(std::get<ptr_com>(temp_));
+        void Store(ComPtr<T> ptr) noexcept
+        {
+            ptr_.Store(ptr.Detach());
         }
-    };
 
-    template <class Interface, class CoClass>
-    class CreateInstance : protected transfer_com_ptr<Interface>
-    {
-        using transfer = transfer_com_ptr<Interface>;
+        ComPtr<T> Exchange(ComPtr<T> ptr) noexcept
+        {
+            return wrap(ptr_.Exchange(ptr.Detach()));
+        }
 
-    public:
-        static std::variant<ComPtr<Interface>, HRESULT> Create(tagCLSCTX clsContext,
-            IUnknown * pAggregate = nullptr)
+        // on failure expected receives the current pointer
+        bool CompareExchange(ComPtr<T>& expected, const ComPtr<T>& desired) noexcept
         {
-            Interface *pRes = nullptr;
-            HRESULT hr = CoCreateInstance(__uuidof(CoClass), pAggregate, clsContext,
-                __uuidof(Interface), (void**)&pRes);
-            if (!SUCCEEDED(hr))
-                return hr;
+            T *rawExpected = const_cast<T*>(expected.GetRaw());
+            if (ptr_.CompareExchange(rawExpected, const_cast<T*>(desired.GetRaw())))
+                return true;
 
-            assert(pRes && "Interface is nullptr!");
-            return ComPtr<Interface>(pRes);
+            expected = wrap(rawExpected);
+            return false;
         }
 
-        CreateInstance(tagCLSCTX clsContext,
-            IUnknown * pAggregate = nullptr) noexcept
-            : transfer(Create(clsContext, pAggregate))
-        {}
+        // true if the pointer is set at the moment of the call
+        bool IsValid() const noexcept
+        {
+            return ptr_.Peek() != nullptr;
+        }
 
-        using transfer::operator transfer::v_interface;
-        using transfer::operator transfer::ptr_com;
+    private:
 
+        // ComPtr does not accept owned nullptr
+        static ComPtr<T> wrap(T *owned) noexcept
+        {
+            return owned ? ComPtr<T>(owned) : ComPtr<T>();
+        }
     };
 
-    template <class Interface, class CoClass, class Dispatch>
-    class ComObj
+    // helper type of Result's failed state
+    struct result_failure
     {
-    protected:
+        HRESULT hr;
 
-        ComPtr<Interface> pInterface_;
-        ComPtr<Dispatch> pDispInterface_;
+        // a success code is a bug of the caller, release builds fail with E_UNEXPECTED
+        HRESULT Code() const noexcept
+        {
+            assert(!SUCCEEDED(hr) && "Result must hold a failure code!");
+            return SUCCEEDED(hr) ? E_UNEXPECTED : hr;
+        }
+    };
+
+    // value of type T or a failed HRESULT. Never throws: failures are propagated
+    // with and_then/or_else or inspected with HResult(). The continuations throw
+    // only what the callable throws
+    template <class T>
+    class [[nodiscard]] Result
+    {
+        union
+        {
+            T value_;
+        };
+        HRESULT hr_;
 
     public:
 
-        using coclass = CoClass;
-        using interface = Interface;
-        using dispinterface = Dispatch;
+        using value_type = T;
 
-        ComObj() = default;
+        Result(const T& value) noexcept(std::is_nothrow_copy_constructible_v<T>)
+            : value_(value),
+            hr_(S_OK)
+        {}
 
-        ComObj(const ComPtr<Interface>& pInterface)
-            : pInterface_(pInerface),
-            pDispInterface_(pInterface_)
+        Result(T&& value) noexcept(std::is_nothrow_move_constructible_v<T>)
+            : value_(std::move(value)),
+            hr_(S_OK)
         {}
 
-        operator const ComPtr<Interface>&()
+        Result(result_failure failure) noexcept
+            : hr_(failure.Code())
+        {}
+
+        static Result Fail(HRESULT hr) noexcept
         {
-            return pInterface_;
+            return result_failure{ hr };
         }
-        operator const ComPtr<Dispatch>&()
+
+        Result(const Result& other) noexcept(std::is_nothrow_copy_constructible_v<T>)
+            : hr_(other.hr_)
         {
-            return pDispInterface_;
+            if (other.Succeeded())
+                new (&value_) T(other.value_);
         }
 
-        HRESULT CreateInstance(tagCLSCTX clsContext, IUnknown *pAggregate = nullptr)
+        Result(Result&& other) noexcept(std::is_nothrow_move_constructible_v<T>)
+            : hr_(other.hr_)
         {
-            std::variant<ComPtr<Interface>, HRESULT> vInterface =
-                cmw::CreateInstance<Interface, CoClass>(clsContext, pAggregate);
-
-            if (std::holds_alternative<HRESULT>(vInterface))
-                return std::get<HRESULT>(vInterface);
-
-            pInterface_ = std::move(std::get<0>(vInterface));
-            return S_OK;
+            if (other.Succeeded())
+                new (&value_) T(std::move(other.value_));
         }
 
-        ComObj(tagCLSCTX clsContext,
-            IUnknown * pAggregate = nullptr)
+        Result& operator=(const Result& other)
         {
-            try
+            if (this != &other)
             {
-                pInterface_ = CreateInstance<Interface, CoClass>(clsContext, pAggregate);
-                pDispInterface_ = pInterface_;
+                destroy();
+                // failed until the value is constructed: a throwing copy leaves no value behind
+                hr_ = E_UNEXPECTED;
+                if (other.Succeeded())
+                    new (&value_) T(other.value_);
+                hr_ = other.hr_;
             }
-            catch (const _com_error& error)
-                throw error;
+            return *this;
         }
 
-    private:
+        Result& operator=(Result&& other)
+        {
+            if (this != &other)
+            {
+                destroy();
+                // see the copy assignment
+                hr_ = E_UNEXPECTED;
+                if (other.Succeeded())
+                    new (&value_) T(std::move(other.value_));
+                hr_ = other.hr_;
+            }
+            return *this;
+        }
 
-        static void check_dispatch()
+        bool Succeeded() const noexcept
         {
-            if constexpr (std::is_same_v<void, Dispatch>)
-                return;
-            else
-                static_assert(std::is_base_of_v<IDispatch, Dispatch>,
-                    "Dispinterface must inherit from IDispatch!");
+            return SUCCEEDED(hr_);
         }
-    };
 
+        explicit operator bool() const noexcept
+        {
+            return Succeeded();
+        }
 
-    template <class Interface = void, bool = std::is_void_v<Interface>>
-    class FindConnectionPoint : protected transfer_com_ptr<IConnectionPoint>
-    {
-        using transfer = transfer_com_ptr<IConnectionPoint>;
+        // S_OK if the result holds a value
+        HRESULT HResult() const noexcept
+        {
+            return hr_;
+        }
 
-    public:
+        T& Value() & noexcept
+        {
+            assert(Succeeded() && "Accessing value of a failed result!");
+            return value_;
+        }
 
-        static std::variant<ComPtr<IConnectionPoint>, HRESULT>
-            Find(IConnectionPointContainer& cpContainer, REFIID riid);
+        const T& Value() const & noexcept
+        {
+            assert(Succeeded() && "Accessing value of a failed result!");
+            return value_;
+        }
 
-        FindConnectionPoint(IConnectionPointContainer& cpContainer, REFIID riid) noexcept
-            : transfer(Find(cpContainer, riid))
-        {}
+        T&& Value() && noexcept
+        {
+            assert(Succeeded() && "Accessing value of a failed result!");
+            return std::move(value_);
+        }
 
-        using transfer::operator transfer::v_interface;
-        using transfer::operator transfer::ptr_com;
+        // f: T -> Result<U>. Not called on failure, the HRESULT is forwarded
+        template <class F>
+        auto and_then(F&& f) && noexcept(std::is_nothrow_invocable_v<F, T&&>)
+        {
+            using result_t = std::invoke_result_t<F, T&&>;
+            if (!Succeeded())
+                return result_t(result_failure{ hr_ });
 
-    };
+            return std::invoke(std::forward<F>(f), std::move(value_));
+        }
 
-    template <class Interface>
-    class FindConnectionPoint<Interface, false> : public FindConnectionPoint<void>
-    {
-        static_assert(std::is_base_of_v<IUnknown, Interface>,
-            "Invalid interface! Must inherit from IUnknown!");
+        // f: HRESULT -> Result<T>. Called on failure only
+        template <class F>
+        Result or_else(F&& f) && noexcept(std::is_nothrow_invocable_v<F, HRESULT> &&
+            std::is_nothrow_move_constructible_v<T>)
+        {
+            if (Succeeded())
+                return std::move(*this);
 
-        static_assert(!(std::is_same_v<IUnknown, Interface> ||
-            std::is_same_v<IDispatch, Interface> ||
-            std::is_same_v<IConnectionPoint, Interface>), "Class must have a valid unique REFIID");
-   
-        using base = FindConnectionPoint<void>;
-    public:
+            return std::invoke(std::forward<F>(f), hr_);
+        }
 
-        static std::variant<ComPtr<IConnectionPoint>, HRESULT>
-            Find(IConnectionPointContainer& cpContainer)
+        ~Result()
         {
-            // TODO: assert __uuidof is not null
-            return FindConnectionPoint(cpContainer, __uuidof(Interface));
+            destroy();
         }
 
-        FindConnectionPoint(IConnectionPointContainer& cpContainer) noexcept
-            : base(cpContainer, __uuidof(Interface))
-        {}
+    private:
 
+        void destroy() noexcept
+        {
+            if (Succeeded())
+                value_.~T();
+        }
     };
-    
-    // helper class. Implements thread safe reference counting
-    class reference_counter
+
+    // success or a failed HRESULT
+    template <>
+    class [[nodiscard]] Result<void>
     {
-        std::atomic<ULONG> refs_ = 1;
+        HRESULT hr_;
 
     public:
-        ULONG AddRef()
+
+        using value_type = void;
+
+        Result(HRESULT hr = S_OK) noexcept
+            : hr_(hr)
+        {}
+
+        Result(result_failure failure) noexcept
+            : hr_(failure.hr)
+        {}
+
+        static Result Fail(HRESULT hr) noexcept
         {
-            ++refs_;
-            return refs_;
+            return Result(hr);
         }
 
-        ULONG Release()
+        bool Succeeded() const noexcept
         {
-            --refs_;
-            assert((refs_ != std::numeric_limits<ULONG>::max()) && "Invalid value!");
-            return refs_;
+            return SUCCEEDED(hr_);
         }
 
-        ULONG RefsCount() const
+        explicit operator bool() const noexcept
         {
-            return refs_;
+            return Succeeded();
         }
 
-        constexpr reference_counter() = default;
-        ~reference_counter() = default;
-
+        HRESULT HResult() const noexcept
+        {
+            return hr_;
+        }
+
+        // f: () -> Result<U>
+        template <class F>
+        auto and_then(F&& f) && noexcept(std::is_nothrow_invocable_v<F>)
+        {
+            using result_t = std::invoke_result_t<F>;
+            if (!Succeeded())
+                return result_t(result_failure{ hr_ });
+
+            return std::invoke(std::forward<F>(f));
+        }
+
+        // f: HRESULT -> Result<void>
+        template <class F>
+        Result or_else(F&& f) && noexcept(std::is_nothrow_invocable_v<F, HRESULT>)
+        {
+            if (Succeeded())
+                return *this;
+
+            return std::invoke(std::forward<F>(f), hr_);
+        }
+    };
+
+    // pointer-sized: holds either the interface pointer or the failure code
+    // shifted left with the lowest bit set. Failure codes always have the highest bit set,
+    // so it can be dropped on 32-bit platforms
+    template <class Q>
+    class [[nodiscard]] Result<ComPtr<Q>>
+    {
+        uintptr_t bits_;
+
+        constexpr static uintptr_t failure_bit = 1;
+
+        static uintptr_t encode(HRESULT hr) noexcept
+        {
+            return ((uintptr_t)(uint32_t)hr << 1) | failure_bit;
+        }
+
+    public:
+
+        using value_type = ComPtr<Q>;
+
+        Result(ComPtr<Q>&& value) noexcept
+            : bits_((uintptr_t)value.Detach())
+        {}
+
+        Result(const ComPtr<Q>& value) noexcept
+            : Result(ComPtr<Q>(value))
+        {}
+
+        Result(result_failure failure) noexcept
+            : bits_(encode(failure.Code()))
+        {}
+
+        static Result Fail(HRESULT hr) noexcept
+        {
+            return result_failure{ hr };
+        }
+
+        Result(const Result& other) noexcept
+            : bits_(other.bits_)
+        {
+            if (Succeeded() && bits_)
+                Raw()->AddRef();
+        }
+
+        Result(Result&& other) noexcept
+            : bits_(other.bits_)
+        {
+            other.bits_ = encode(E_POINTER);
+        }
+
+        Result& operator=(Result other) noexcept
+        {
+            std::swap(bits_, other.bits_);
+            return *this;
+        }
+
+        bool Succeeded() const noexcept
+        {
+            return !(bits_ & failure_bit);
+        }
+
+        explicit operator bool() const noexcept
+        {
+            return Succeeded();
+        }
+
+        HRESULT HResult() const noexcept
+        {
+            if (Succeeded())
+                return S_OK;
+
+            return (HRESULT)(uint32_t)(((bits_ >> 1) & 0x7FFFFFFF) | 0x80000000);
+        }
+
+        // non-owning
+        Q* Raw() const noexcept
+        {
+            assert(Succeeded() && "Accessing value of a failed result!");
+            return reinterpret_cast<Q*>(bits_);
+        }
+
+        ComPtr<Q> Value() const & noexcept
+        {
+            Result copy(*this);
+            return std::move(copy).Value();
+        }
+
+        ComPtr<Q> Value() && noexcept
+        {
+            assert(Succeeded() && "Accessing value of a failed result!");
+
+            ComPtr<Q> value;
+            if (bits_)
+                value.Init(Raw());
+            bits_ = encode(E_POINTER);
+            return value;
+        }
+
+        // f: ComPtr<Q> -> Result<U>
+        template <class F>
+        auto and_then(F&& f) && noexcept(std::is_nothrow_invocable_v<F, ComPtr<Q>&&>)
+        {
+            using result_t = std::invoke_result_t<F, ComPtr<Q>&&>;
+            if (!Succeeded())
+                return result_t(result_failure{ HResult() });
+
+            return std::invoke(std::forward<F>(f), std::move(*this).Value());
+        }
+
+        // f: HRESULT -> Result<ComPtr<Q>>
+        template <class F>
+        Result or_else(F&& f) && noexcept(std::is_nothrow_invocable_v<F, HRESULT>)
+        {
+            if (Succeeded())
+                return std::move(*this);
+
+            return std::invoke(std::forward<F>(f), HResult());
+        }
+
+        ~Result()
+        {
+            if (Succeeded() && bits_)
+                Raw()->Release();
+        }
+    };
+
+    static_assert(sizeof(Result<ComPtr<IUnknown>>) == sizeof(void*),
+        "Result of an interface pointer must be pointer-sized!");
+
+    template <class Interface>
+    struct transfer_com_ptr
+    {
+
+        using v_interface = std::variant<ComPtr<Interface>, HRESULT>;
+        using ptr_com = ComPtr<Interface>;
+
+        v_interface temp_;
+
+        constexpr transfer_com_ptr(v_interface&& temp)
+            : temp_(std::move(temp))
+        {}
+
+        operator v_interface()
+        {
+            return std::move(temp_);
+        }
+
+        operator ptr_com()
+        {
+            assert(!std::holds_alternative<HRESULT>(temp_) &&
+                "Invalid Connection point received!");
+            if (std::holds_alternative<HRESULT>(temp_))
+                throw _com_error(std::get<HRESULT>(temp_));
+
+            return std::move(std::get<ptr_com>(temp_));
+        }
+    };
+
+    template <class Interface, class CoClass>
+    class CreateInstance : protected transfer_com_ptr<Interface>
+    {
+        using transfer = transfer_com_ptr<Interface>;
+
+    public:
+        static std::variant<ComPtr<Interface>, HRESULT> Create(tagCLSCTX clsContext,
+            IUnknown * pAggregate = nullptr)
+        {
+            HRESULT init = com_thread::Ensure();
+            if (!SUCCEEDED(init))
+                return init;
+
+            trace_span span("CreateInstance", trace_category::create_instance);
+            Interface *pRes = nullptr;
+            HRESULT hr = CoCreateInstance(__uuidof(CoClass), pAggregate, clsContext,
+                __uuidof(Interface), (void**)&pRes);
+            span.SetResult(hr);
+            if (!SUCCEEDED(hr))
+                return hr;
+
+            assert(pRes && "Interface is nullptr!");
+            return ComPtr<Interface>(pRes);
+        }
+
+        static Result<ComPtr<Interface>> TryCreate(tagCLSCTX clsContext,
+            IUnknown * pAggregate = nullptr) noexcept
+        {
+            HRESULT init = com_thread::Ensure();
+            if (!SUCCEEDED(init))
+                return Result<ComPtr<Interface>>::Fail(init);
+
+            trace_span span("CreateInstance", trace_category::create_instance);
+            Interface *pRes = nullptr;
+            HRESULT hr = CoCreateInstance(__uuidof(CoClass), pAggregate, clsContext,
+                __uuidof(Interface), (void**)&pRes);
+            span.SetResult(hr);
+            if (!SUCCEEDED(hr))
+                return Result<ComPtr<Interface>>::Fail(hr);
+
+            assert(pRes && "Interface is nullptr!");
+            return ComPtr<Interface>(pRes);
+        }
+
+        CreateInstance(tagCLSCTX clsContext,
+            IUnknown * pAggregate = nullptr) noexcept
+            : transfer(Create(clsContext, pAggregate))
+        {}
+
+        using typename transfer::v_interface;
+        using typename transfer::ptr_com;
+        using transfer::operator v_interface;
+        using transfer::operator ptr_com;
+
+    };
+
+    // memoizes QueryInterface results of a single object, so repeated conversions,
+    // each a round trip on proxies, are made once. E_NOINTERFACE is cached as well,
+    // other failures are not. The cache is bound to the pointer it is queried with
+    // and keeps it and the returned interfaces alive. Querying another pointer
+    // clears it. Not thread safe, like ComPtr
+    class interface_cache
+    {
+    public:
+
+        constexpr static size_t capacity = 8;
+
+    private:
+
+        struct entry
+        {
+            IID iid{};
+            // interface of the IID, nullptr if the query failed
+            void *ptr = nullptr;
+            HRESULT hr = S_OK;
+        };
+
+        ComPtr<IUnknown> source_;
+        std::array<entry, capacity> entries_{};
+        size_t size_ = 0;
+        // replaced when the cache is full
+        size_t next_ = 0;
+
+        size_t hits_ = 0;
+        size_t misses_ = 0;
+
+    public:
+
+        interface_cache() = default;
+
+        interface_cache(const interface_cache& other);
+        interface_cache(interface_cache&& other) noexcept;
+        interface_cache& operator=(const interface_cache& other);
+        interface_cache& operator=(interface_cache&& other) noexcept;
+
+        template <typename Q, class = std::enable_if_t<std::is_base_of_v<IUnknown, Q>>>
+        Result<ComPtr<Q>> Query(IUnknown *object) noexcept
+        {
+            void *raw = nullptr;
+            HRESULT hr = query(object, __uuidof(Q), &raw);
+            if (!SUCCEEDED(hr))
+                return Result<ComPtr<Q>>::Fail(hr);
+
+            return ComPtr<Q>(static_cast<Q*>(raw));
+        }
+
+        template <typename Q, typename T>
+        Result<ComPtr<Q>> Query(const ComPtr<T>& object) noexcept
+        {
+            return Query<Q>(const_cast<T*>(object.GetRaw()));
+        }
+
+        // releases the interfaces and the bound pointer
+        void Clear() noexcept;
+
+        size_t Size() const
+        {
+            return size_;
+        }
+
+        size_t Hits() const
+        {
+            return hits_;
+        }
+
+        size_t Misses() const
+        {
+            return misses_;
+        }
+
+        ~interface_cache();
+
+    private:
+
+        // *ppv receives an owned reference on success
+        HRESULT query(IUnknown *object, REFIID riid, void **ppv) noexcept;
+    };
+
+    // memoized property values, defined below Listener
+    class property_cache;
+
+    template <class Interface, class CoClass, class Dispatch>
+    class ComObj
+    {
+    protected:
+
+        ComPtr<Interface> pInterface_;
+        ComPtr<Dispatch> pDispInterface_;
+
+        // opt-in, nullptr if the properties are not cached
+        std::shared_ptr<property_cache> cache_;
+
+        // interfaces queried from pInterface_
+        interface_cache queries_;
+
+    public:
+
+        using coclass = CoClass;
+        using interface = Interface;
+        using dispinterface = Dispatch;
+
+        ComObj() = default;
+
+        static Result<ComObj> TryCreate(tagCLSCTX clsContext,
+            IUnknown *pAggregate = nullptr) noexcept
+        {
+            return cmw::CreateInstance<Interface, CoClass>::TryCreate(clsContext, pAggregate)
+                .and_then([](ComPtr<Interface>&& pInterface)
+            {
+                return TryFrom(pInterface);
+            });
+        }
+
+        static Result<ComObj> TryFrom(const ComPtr<Interface>& pInterface) noexcept
+        {
+            ComObj obj;
+            obj.pInterface_ = pInterface;
+
+            return obj.template TryQuery<Dispatch>()
+                .and_then([&obj](ComPtr<Dispatch>&& pDispInterface) -> Result<ComObj>
+            {
+                obj.pDispInterface_ = std::move(pDispInterface);
+                return std::move(obj);
+            });
+        }
+
+        ComObj(const ComPtr<Interface>& pInterface)
+            : pInterface_(pInterface)
+        {
+            pDispInterface_ = query_dispatch();
+        }
+
+        operator const ComPtr<Interface>&()
+        {
+            return pInterface_;
+        }
+        operator const ComPtr<Dispatch>&()
+        {
+            return pDispInterface_;
+        }
+
+        HRESULT CreateInstance(tagCLSCTX clsContext, IUnknown *pAggregate = nullptr)
+        {
+            std::variant<ComPtr<Interface>, HRESULT> vInterface =
+                cmw::CreateInstance<Interface, CoClass>(clsContext, pAggregate);
+
+            if (std::holds_alternative<HRESULT>(vInterface))
+                return std::get<HRESULT>(vInterface);
+
+            pInterface_ = std::move(std::get<0>(vInterface));
+            queries_.Clear();
+            return S_OK;
+        }
+
+        // QueryInterface of the object, memoized. Failed queries are repeated
+        // unless they returned E_NOINTERFACE
+        template <class Q>
+        Result<ComPtr<Q>> TryQuery() noexcept
+        {
+            return queries_.template Query<Q>(pInterface_);
+        }
+
+        const interface_cache& QueryCache() const
+        {
+            return queries_;
+        }
+
+        // property gets made with Get go through the cache.
+        // The cache must belong to this object only
+        void SetPropertyCache(std::shared_ptr<property_cache> cache)
+        {
+            cache_ = std::move(cache);
+        }
+
+        const std::shared_ptr<property_cache>& PropertyCache() const
+        {
+            return cache_;
+        }
+
+        template <class R>
+        Result<R> Get(DISPID dispId);
+
+        // invalidates the cached value
+        template <class T>
+        Result<void> Put(DISPID dispId, const T& value);
+
+        ComObj(tagCLSCTX clsContext,
+            IUnknown * pAggregate = nullptr)
+        {
+            pInterface_ = cmw::CreateInstance<Interface, CoClass>(clsContext, pAggregate);
+            pDispInterface_ = query_dispatch();
+        }
+
+    private:
+
+        ComPtr<Dispatch> query_dispatch()
+        {
+            Result<ComPtr<Dispatch>> vDispatch = TryQuery<Dispatch>();
+            assert(vDispatch && "Failed to query interface!");
+            if (!vDispatch)
+                throw _com_error(vDispatch.HResult());
+
+            return std::move(vDispatch).Value();
+        }
+
+        static void check_dispatch()
+        {
+            if constexpr (std::is_same_v<void, Dispatch>)
+                return;
+            else
+                static_assert(std::is_base_of_v<IDispatch, Dispatch>,
+                    "Dispinterface must inherit from IDispatch!");
+        }
+    };
+
+
+    template <class Interface = void, bool = std::is_void_v<Interface>>
+    class FindConnectionPoint : protected transfer_com_ptr<IConnectionPoint>
+    {
+        using transfer = transfer_com_ptr<IConnectionPoint>;
+
+    public:
+
+        static std::variant<ComPtr<IConnectionPoint>, HRESULT>
+            Find(IConnectionPointContainer& cpContainer, REFIID riid);
+
+        static Result<ComPtr<IConnectionPoint>>
+            TryFind(IConnectionPointContainer& cpContainer, REFIID riid) noexcept
+        {
+            HRESULT init = com_thread::Ensure();
+            if (!SUCCEEDED(init))
+                return Result<ComPtr<IConnectionPoint>>::Fail(init);
+
+            trace_span span("FindConnectionPoint::TryFind", trace_category::find_connection_point);
+            IConnectionPoint *pCp = nullptr;
+            HRESULT hr = cpContainer.FindConnectionPoint(riid, &pCp);
+            span.SetResult(hr);
+            if (!SUCCEEDED(hr))
+                return Result<ComPtr<IConnectionPoint>>::Fail(hr);
+
+            return ComPtr<IConnectionPoint>(pCp);
+        }
+
+        FindConnectionPoint(IConnectionPointContainer& cpContainer, REFIID riid) noexcept
+            : transfer(Find(cpContainer, riid))
+        {}
+
+        using typename transfer::v_interface;
+        using typename transfer::ptr_com;
+        using transfer::operator v_interface;
+        using transfer::operator ptr_com;
+
+    };
+
+    template <class Interface>
+    class FindConnectionPoint<Interface, false> : public FindConnectionPoint<void>
+    {
+        static_assert(std::is_base_of_v<IUnknown, Interface>,
+            "Invalid interface! Must inherit from IUnknown!");
+
+        static_assert(!(std::is_same_v<IUnknown, Interface> ||
+            std::is_same_v<IDispatch, Interface> ||
+            std::is_same_v<IConnectionPoint, Interface>), "Class must have a valid unique REFIID");
+   
+        using base = FindConnectionPoint<void>;
+    public:
+
+        static std::variant<ComPtr<IConnectionPoint>, HRESULT>
+            Find(IConnectionPointContainer& cpContainer)
+        {
+            // TODO: assert __uuidof is not null
+            return FindConnectionPoint(cpContainer, __uuidof(Interface));
+        }
+
+        static Result<ComPtr<IConnectionPoint>>
+            TryFind(IConnectionPointContainer& cpContainer) noexcept
+        {
+            return base::TryFind(cpContainer, __uuidof(Interface));
+        }
+
+        FindConnectionPoint(IConnectionPointContainer& cpContainer) noexcept
+            : base(cpContainer, __uuidof(Interface))
+        {}
+
+    };
+
+    // memoizes FindConnectionPoint results per (container, IID), so reconnecting
+    // does not repeat the lookup. Containers are identified by their IUnknown
+    // and are kept alive until evicted
+    class connection_point_cache
+    {
+        struct key
+        {
+            IUnknown *identity;
+            IID iid;
+
+            bool operator<(const key& other) const
+            {
+                if (identity != other.identity)
+                    return identity < other.identity;
+                return std::memcmp(&iid, &other.iid, sizeof(IID)) < 0;
+            }
+        };
+
+        struct entry
+        {
+            ComPtr<IUnknown> identity;
+            ComPtr<IConnectionPoint> cpoint;
+        };
+
+        std::map<key, entry> entries_;
+        mutable std::mutex mutexEntries_;
+
+        std::atomic<size_t> hits_ = 0;
+        std::atomic<size_t> misses_ = 0;
+
+    public:
+
+        // failed lookups are not cached
+        Result<ComPtr<IConnectionPoint>> Find(IConnectionPointContainer& cpContainer,
+            REFIID riid) noexcept;
+
+        void Evict(IUnknown& container);
+        void Clear();
+
+        size_t Size() const;
+
+        size_t Hits() const
+        {
+            return hits_;
+        }
+
+        size_t Misses() const
+        {
+            return misses_;
+        }
+    };
+    
+    // helper class. Implements thread safe reference counting
+    class reference_counter
+    {
+        std::atomic<ULONG> refs_ = 1;
+
+    public:
+        ULONG AddRef()
+        {
+            ++refs_;
+            return refs_;
+        }
+
+        ULONG Release()
+        {
+            --refs_;
+            assert((refs_ != std::numeric_limits<ULONG>::max()) && "Invalid value!");
+            return refs_;
+        }
+
+        ULONG RefsCount() const
+        {
+            return refs_;
+        }
+
+        constexpr reference_counter() = default;
+        ~reference_counter() = default;
+
+    };
+
+    // this class implements multiple connections for a com object. 
+    // Connectible object may inherit from it to provide RegConnection 
+    class com_connections
+    {
+        // pointers to IConnectionPoints must be 'Alive' by the moment Unadvise is called 
+        std::pmr::map<DWORD, ComPtr<IConnectionPoint>> connections_;
+
+    public:
+
+        size_t NumConnections() const
+        {
+            return connections_.size();
+        }
+
+        void RegConnection(DWORD cookie, ComPtr<IConnectionPoint>& cpoint)
+        {
+            connections_.emplace(cookie, cpoint);
+            flight_recorder::Record(flight_event::connect, 0, S_OK, 0, cookie);
+        }
+
+        std::variant<HRESULT, bool> Disconnect(DWORD cookie)
+        {
+            auto found = connections_.find(cookie);
+            if (found == connections_.end())
+                return false;
+
+            trace_span span("com_connections::Disconnect", trace_category::disconnect, cookie);
+            ComPtr<IConnectionPoint>& cp = found->second;
+            HRESULT hr = cp->Unadvise(found->first);
+            span.SetResult(hr);
+            flight_recorder::Record(flight_event::disconnect, 0, hr, 0, cookie);
+
+            connections_.erase(found);
+
+            return hr;
+        }
+
+        // CONNECT_E_NOCONNECTION if the cookie is not registered
+        Result<void> TryDisconnect(DWORD cookie) noexcept
+        {
+            auto found = connections_.find(cookie);
+            if (found == connections_.end())
+                return CONNECT_E_NOCONNECTION;
+
+            trace_span span("com_connections::TryDisconnect", trace_category::disconnect, cookie);
+            HRESULT hr = found->second->Unadvise(found->first);
+            span.SetResult(hr);
+            flight_recorder::Record(flight_event::disconnect, 0, hr, 0, cookie);
+            connections_.erase(found);
+
+            return hr;
+        }
+
+        // 
+        HRESULT DisconnectAll()
+        {
+            if (connections_.empty())
+                return S_OK;
+
+            trace_span span("com_connections::DisconnectAll", trace_category::disconnect,
+                (int64_t)connections_.size());
+            HRESULT res = S_OK;
+
+            using iter = decltype(connections_)::iterator;
+
+            iter it = connections_.begin();
+            while (it != connections_.end())
+            {
+                ComPtr<IConnectionPoint>& cp = it->second;
+                HRESULT hr = cp->Unadvise(it->first);
+                flight_recorder::Record(flight_event::disconnect, 0, hr, 0, it->first);
+                if (!SUCCEEDED(hr))
+                    res = hr;
+                ++it;
+            }
+
+            connections_.clear();
+            span.SetResult(res);
+            return res;
+        }
+
+        explicit com_connections(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+            : connections_(resource)
+        {
+        }
+
+        ~com_connections()
+        {
+            HRESULT hr = DisconnectAll();
+            assert(SUCCEEDED(hr));
+        }
+
+    };
+
+
+
+    template <class Dispatch>
+    class listener_traits
+    {
+        using t_reg_cpoint = void(Dispatch::*)(DWORD, IConnectionPoint&);
+        using t_disconnect = std::variant<HRESULT, bool>(Dispatch::*)(DWORD);
+
+        template <class T, class = std::void_t<>>
+        struct has_reg_cpoint : std::false_type {};
+
+        template<class T>
+        struct has_reg_cpoint<T,
+            std::void_t<decltype(t_reg_cpoint(&T::RegConnection))>> :
+            std::true_type {};
+
+        template <class T, class = std::void_t<>>
+        struct has_disconnect : std::false_type {};
+
+        template<class T>
+        struct has_disconnect<T,
+            std::void_t<decltype(t_reg_cpoint(&T::Disconnect))>> :
+            std::true_type {};
+
+    public:
+
+        using type = Dispatch;
+        constexpr static bool inherit_idispatch = std::is_base_of_v<IDispatch, Dispatch>;
+        constexpr static bool has_reg_cpoint_v = has_reg_cpoint<Dispatch>();
+        constexpr static bool has_disconnect_v = has_disconnect<Dispatch>();
+
+        constexpr static bool is_connectible = //inherit_idispatch &&
+            has_reg_cpoint_v &&
+            has_disconnect_v;
+
+    };
+
+    template <class T>
+    struct tag_iid {};
+
+    template <class Connectible,
+        class = std::enable_if_t<listener_traits<Connectible>::is_connectible>>
+        class ConnectListener
+    {
+        HRESULT hr_ = S_OK;
+
+    public:
+
+        // does not register dword cookie in Connectible's connections map
+        static std::variant<DWORD, HRESULT> Connect(ComPtr<IUnknown>& pSink,
+            IConnectionPoint& cpoint)
+        {
+            HRESULT init = com_thread::Ensure();
+            if (!SUCCEEDED(init))
+                return init;
+
+            trace_span span("ConnectListener::Connect", trace_category::connect);
+            DWORD cookie = 0;
+            HRESULT hr = cpoint.Advise(pSink.GetRaw(), &cookie);
+            span.SetResult(hr);
+            if (!SUCCEEDED(hr))
+                return hr;
+            return cookie;
+        }
+
+        static Result<DWORD> TryConnect(ComPtr<IUnknown>& pSink,
+            IConnectionPoint& cpoint) noexcept
+        {
+            HRESULT init = com_thread::Ensure();
+            if (!SUCCEEDED(init))
+                return Result<DWORD>::Fail(init);
+
+            trace_span span("ConnectListener::TryConnect", trace_category::connect);
+            DWORD cookie = 0;
+            HRESULT hr = cpoint.Advise(pSink.GetRaw(), &cookie);
+            span.SetResult(hr);
+            if (!SUCCEEDED(hr))
+                return Result<DWORD>::Fail(hr);
+            return cookie;
+        }
+
+        // registers the cookie in Connectible's connections map
+        static Result<DWORD> TryConnect(ComPtr<Connectible>& connectible,
+            ComPtr<IConnectionPoint>& cpoint) noexcept
+        {
+            return connectible.template TryQueryInterface<IUnknown>()
+                .and_then([&](ComPtr<IUnknown>&& pSink)
+            {
+                return TryConnect(pSink, *cpoint);
+            })
+                .and_then([&](DWORD cookie) -> Result<DWORD>
+            {
+                try
+                {
+                    connectible->RegConnection(cookie, cpoint);
+                }
+                catch (const std::bad_alloc&)
+                {
+                    cpoint->Unadvise(cookie);
+                    return Result<DWORD>::Fail(E_OUTOFMEMORY);
+                }
+                return cookie;
+            });
+        }
+
+        template <class Interface, class Provider>
+        static Result<DWORD> TryConnect(ComPtr<Connectible>& connectible,
+            ComPtr<Provider>& cpProvider, tag_iid<Interface>) noexcept
+        {
+            return cpProvider.template TryQueryInterface<IConnectionPointContainer>()
+                .and_then([](ComPtr<IConnectionPointContainer>&& cpContainer)
+            {
+                return FindConnectionPoint<Interface>::TryFind(*cpContainer);
+            })
+                .and_then([&connectible](ComPtr<IConnectionPoint>&& cPoint)
+            {
+                return TryConnect(connectible, cPoint);
+            });
+        }
+
+        static HRESULT Connect(ComPtr<Connectible>& connectible,
+            ComPtr<IConnectionPoint>& cpoint)
+        {
+            ComPtr<IUnknown> pSink = connectible;
+            std::variant<DWORD, HRESULT> vCookie = Connect(pSink, *cpoint);
+            if (std::holds_alternative<HRESULT>(vCookie))
+                return std::get<HRESULT>(vCookie);
+
+            connectible->RegConnection(std::get<DWORD>(vCookie), cpoint);
+
+            return S_OK;
+        }
+
+        static std::variant<HRESULT, bool> Disconnect(ComPtr<Connectible>& connectible, 
+            DWORD cookie)
+        {
+            return connectible->Disconnect(cookie);
+        }
+
+        ConnectListener(ComPtr<Connectible>& connectible,
+            ComPtr<IConnectionPoint>& cpoint)
+            : hr_(Connect(connectible, cpoint))
+        {}
+
+        // something is wrong. If this method is used, UnAdvise returns "Object is not connected to server"
+        template <class Interface, class Provider>
+        ConnectListener(ComPtr<Connectible>& connectible, ComPtr<Provider>& cpProvider, 
+            tag_iid<Interface> tag)
+            : hr_(TryConnect(connectible, cpProvider, tag).HResult())
+        {
+        }
+
+        operator HRESULT() const
+        {
+            return hr_;
+        }
+
+    };
+
+
+    enum class disp_inv_args : size_t
+    {
+        dispIDMember = 0,
+        riid,
+        locale,
+        wFlags,
+        pDispParams,
+        pVarResult,
+        pExcepInfo,
+        puArgErr,
+        // injected: scratch memory of the call, see scratch_arena
+        scratch
+    };
+
+    using disp_inv_t = HRESULT(DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*);
+
+    template <typename T>
+    struct disp_arg_indx : std::integral_constant<size_t, std::numeric_limits<size_t>::max()> {};
+
+    template <> 
+    struct disp_arg_indx<DISPID> : std::integral_constant<size_t, (size_t)disp_inv_args::dispIDMember> {};
+    template <>
+    struct disp_arg_indx<REFIID> : std::integral_constant<size_t, (size_t)disp_inv_args::riid> {};
+    template <>
+    struct disp_arg_indx<LCID> : std::integral_constant<size_t, (size_t)disp_inv_args::locale> {};
+    template <>
+    struct disp_arg_indx<WORD> : std::integral_constant<size_t, (size_t)disp_inv_args::wFlags> {};
+    template <>
+    struct disp_arg_indx<DISPPARAMS*> : std::integral_constant<size_t, (size_t)disp_inv_args::pDispParams> {};
+    template <>
+    struct disp_arg_indx<VARIANT*> : std::integral_constant<size_t, (size_t)disp_inv_args::pVarResult> {};
+    template <>
+    struct disp_arg_indx<EXCEPINFO*> : std::integral_constant<size_t, (size_t)disp_inv_args::pExcepInfo> {};
+    template <>
+    struct disp_arg_indx<UINT*> : std::integral_constant<size_t, (size_t)disp_inv_args::puArgErr> {};
+    template <>
+    struct disp_arg_indx<scratch_arena&> : std::integral_constant<size_t, (size_t)disp_inv_args::scratch> {};
+
+    template <typename T>
+    constexpr inline size_t disp_arg_indx_v = disp_arg_indx<T>();
+
+    // adapter of a typed callback, remembers the type of the handler it calls.
+    // Listener unwraps it on registration and keeps the handler's type for diagnostics
+    struct typed_callback
+    {
+        std::function<disp_inv_t> adapter;
+        const std::type_info *handler;
+
+        HRESULT operator()(DISPID dispIDMember, REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS *pDispParams, VARIANT *pVarResult,
+            EXCEPINFO *pExcepInfo, UINT *puArgErr) const
+        {
+            return adapter(dispIDMember, riid, lcid, wFlags,
+                pDispParams, pVarResult, pExcepInfo, puArgErr);
+        }
+    };
+
+    // writes the result of a typed callback to pVarResult, defined below variant_traits
+    template <class R>
+    HRESULT set_disp_result(VARIANT *pVarResult, R&& result);
+
+    // callbacks returning anything but HRESULT have their result written to pVarResult
+    template <typename R, typename ... A>
+    class reduce_disp_inv_args
+    {
+        std::function<disp_inv_t> reduced_;
+
+        template <size_t ... arg_i>
+        constexpr static std::function<disp_inv_t> reduce_args(std::function<R(A...)>&& f,
+            std::index_sequence<arg_i...>)
+        {
+            static_assert(std::is_same_v<R, HRESULT> ||
+                ((arg_i != (size_t)disp_inv_args::pVarResult) && ...),
+                "Callback returning a value can not take pVarResult!");
+            static_assert(((arg_i != disp_arg_indx<void>()) && ...),
+                "Callback function contains invalid arguement types!");
+
+            const std::type_info& handler = f.target_type();
+            return typed_callback{
+                [f = std::move(f)](DISPID dispIDMember,
+                    REFIID riid, LCID lcid, WORD wFlags,
+                    DISPPARAMS *pDispParams, VARIANT *pVarResult,
+                    EXCEPINFO *pExcepInfo, UINT *puArgErr)
+            {
+                scratch_arena& scratch = scratch_arena::Current();
+
+                // tuple of default args collection
+                auto fwd = std::tie(dispIDMember, riid, lcid,
+                    wFlags, pDispParams,
+                    pVarResult, pExcepInfo, puArgErr, scratch);
+
+                if constexpr (std::is_same_v<R, HRESULT>)
+                    return f(std::get<arg_i>(fwd)...);
+                else if constexpr (std::is_void_v<R>)
+                {
+                    f(std::get<arg_i>(fwd)...);
+                    return S_OK;
+                }
+                else
+                    return set_disp_result(pVarResult, f(std::get<arg_i>(fwd)...));
+            }, &handler };
+        }
+
+        reduce_disp_inv_args() = delete;
+        reduce_disp_inv_args(const reduce_disp_inv_args&) = delete;
+        reduce_disp_inv_args(reduce_disp_inv_args&&) = delete;
+
+    public:
+        constexpr reduce_disp_inv_args(std::function<R(A...)>&& callback)
+            : reduced_(reduce_args(std::move(callback),
+                std::index_sequence<disp_arg_indx_v<A>...>()))
+        {}
+
+        constexpr operator std::function<disp_inv_t>()
+        {
+            return std::move(reduced_);
+        }
+    };
+
+    // compile-time mapping between C++ types and VARIANT contents.
+    // Accepts checks the VARTYPE only, no coercion is done.
+    // owning: Set allocates, the VARIANT must be cleared after use
+    template <class T>
+    struct variant_traits
+    {
+        static_assert(!std::is_same_v<T, T>, "Type can not be stored in a VARIANT!");
+    };
+
+    template <VARTYPE type>
+    struct variant_traits_base
+    {
+        constexpr static VARTYPE vt = type;
+        constexpr static bool owning = false;
+
+        static bool Accepts(const VARIANT& v)
+        {
+            return v.vt == type;
+        }
+    };
+
+    template <>
+    struct variant_traits<bool> : variant_traits_base<VT_BOOL>
+    {
+        static bool Get(const VARIANT& v) { return v.boolVal != VARIANT_FALSE; }
+        static void Set(VARIANT& v, bool value) { v.vt = vt; v.boolVal = value ? VARIANT_TRUE : VARIANT_FALSE; }
+    };
+
+    template <>
+    struct variant_traits<BYTE> : variant_traits_base<VT_UI1>
+    {
+        static BYTE Get(const VARIANT& v) { return v.bVal; }
+        static void Set(VARIANT& v, BYTE value) { v.vt = vt; v.bVal = value; }
+    };
+
+    template <>
+    struct variant_traits<short> : variant_traits_base<VT_I2>
+    {
+        static short Get(const VARIANT& v) { return v.iVal; }
+        static void Set(VARIANT& v, short value) { v.vt = vt; v.iVal = value; }
+    };
+
+    template <>
+    struct variant_traits<int> : variant_traits_base<VT_INT>
+    {
+        // type libraries declare int as VT_INT, but servers often send VT_I4
+        static bool Accepts(const VARIANT& v) { return v.vt == VT_INT || v.vt == VT_I4; }
+        static int Get(const VARIANT& v) { return v.vt == VT_INT ? v.intVal : (int)v.lVal; }
+        static void Set(VARIANT& v, int value) { v.vt = vt; v.intVal = value; }
+    };
+
+    template <>
+    struct variant_traits<LONG> : variant_traits_base<VT_I4>
+    {
+        static LONG Get(const VARIANT& v) { return v.lVal; }
+        static void Set(VARIANT& v, LONG value) { v.vt = vt; v.lVal = value; }
+    };
+
+    template <>
+    struct variant_traits<ULONG> : variant_traits_base<VT_UI4>
+    {
+        static ULONG Get(const VARIANT& v) { return v.ulVal; }
+        static void Set(VARIANT& v, ULONG value) { v.vt = vt; v.ulVal = value; }
+    };
+
+    template <>
+    struct variant_traits<LONGLONG> : variant_traits_base<VT_I8>
+    {
+        static LONGLONG Get(const VARIANT& v) { return v.llVal; }
+        static void Set(VARIANT& v, LONGLONG value) { v.vt = vt; v.llVal = value; }
+    };
+
+    template <>
+    struct variant_traits<float> : variant_traits_base<VT_R4>
+    {
+        static float Get(const VARIANT& v) { return v.fltVal; }
+        static void Set(VARIANT& v, float value) { v.vt = vt; v.fltVal = value; }
+    };
+
+    // DATE is a double as well: both are accepted
+    template <>
+    struct variant_traits<double> : variant_traits_base<VT_R8>
+    {
+        static bool Accepts(const VARIANT& v) { return v.vt == VT_R8 || v.vt == VT_DATE; }
+        static double Get(const VARIANT& v) { return v.vt == VT_R8 ? v.dblVal : v.date; }
+        static void Set(VARIANT& v, double value) { v.vt = vt; v.dblVal = value; }
+    };
+
+    // not owning: the string belongs to the caller
+    template <>
+    struct variant_traits<BSTR> : variant_traits_base<VT_BSTR>
+    {
+        static BSTR Get(const VARIANT& v) { return v.bstrVal; }
+        static void Set(VARIANT& v, BSTR value) { v.vt = vt; v.bstrVal = value; }
+    };
+
+    template <>
+    struct variant_traits<std::wstring_view> : variant_traits_base<VT_BSTR>
+    {
+        static std::wstring_view Get(const VARIANT& v)
+        {
+            if (!v.bstrVal)
+                return std::wstring_view();
+            return std::wstring_view(v.bstrVal, SysStringLen(v.bstrVal));
+        }
+    };
+
+    template <>
+    struct variant_traits<std::wstring> : variant_traits_base<VT_BSTR>
+    {
+        constexpr static bool owning = true;
+
+        static std::wstring Get(const VARIANT& v)
+        {
+            return std::wstring(variant_traits<std::wstring_view>::Get(v));
+        }
+
+        static void Set(VARIANT& v, const std::wstring& value)
+        {
+            v.vt = vt;
+            v.bstrVal = SysAllocStringLen(value.data(), (UINT)value.size());
+        }
+    };
+
+    // Get copies the string. Results and byref<_bstr_t>::Set hand it over
+    // without a copy, see disp_result
+    template <>
+    struct variant_traits<_bstr_t> : variant_traits_base<VT_BSTR>
+    {
+        constexpr static bool owning = true;
+
+        static _bstr_t Get(const VARIANT& v)
+        {
+            return _bstr_t(v.bstrVal, true);
+        }
+
+        static void Set(VARIANT& v, const _bstr_t& value)
+        {
+            v.vt = vt;
+            v.bstrVal = value.copy();
+        }
+    };
+
+    // not owning: no reference is added
+    template <>
+    struct variant_traits<IDispatch*> : variant_traits_base<VT_DISPATCH>
+    {
+        static IDispatch* Get(const VARIANT& v) { return v.pdispVal; }
+        static void Set(VARIANT& v, IDispatch *value) { v.vt = vt; v.pdispVal = value; }
+    };
+
+    template <>
+    struct variant_traits<IUnknown*> : variant_traits_base<VT_UNKNOWN>
+    {
+        static IUnknown* Get(const VARIANT& v) { return v.punkVal; }
+        static void Set(VARIANT& v, IUnknown *value) { v.vt = vt; v.punkVal = value; }
+    };
+
+    // any VARIANT, passed as is. Set makes a shallow copy
+    template <>
+    struct variant_traits<const VARIANT*> : variant_traits_base<VT_VARIANT>
+    {
+        static bool Accepts(const VARIANT&) { return true; }
+        static const VARIANT* Get(const VARIANT& v) { return &v; }
+        static void Set(VARIANT& v, const VARIANT *value) { v = *value; }
     };
 
-    // this class implements multiple connections for a com object. 
-    // Connectible object may inherit from it to provide RegConnection 
-    class com_connections
+    // argument at its declaration position: rgvarg is stored in reverse order.
+    // A VARIANT passed by reference is dereferenced
+    inline const VARIANT& disp_param(const DISPPARAMS& params, UINT arg)
     {
-        // pointers to IConnectionPoints must be 'Alive' by the moment Unadvise is called 
-        std::map<DWORD, ComPtr<IConnectionPoint>> connections_;
-
-    public:
+        const VARIANT& v = params.rgvarg[params.cArgs - 1 - arg];
+        if (v.vt == (VT_BYREF | VT_VARIANT) && v.pvarVal)
+            return *v.pvarVal;
+        return v;
+    }
+
+    // return value of a typed callback moved into a VARIANT. Strings and interfaces
+    // returned as _bstr_t or ComPtr are handed over without a copy, std::wstring
+    // is allocated once directly in the VARIANT
+    template <class R>
+    struct disp_result
+    {
+        static_assert(!std::is_pointer_v<R>,
+            "Interface and string pointers can not be returned, use ComPtr, _bstr_t or std::wstring!");
 
-        size_t NumConnections() const
+        static void Set(VARIANT& v, R&& value)
         {
-            return connections_.size();
+            variant_traits<R>::Set(v, value);
         }
+    };
 
-        void RegConnection(DWORD cookie, ComPtr<IConnectionPoint>& cpoint)
+    template <>
+    struct disp_result<_bstr_t>
+    {
+        static void Set(VARIANT& v, _bstr_t&& value)
         {
-            connections_.emplace(cookie, cpoint);
+            v.vt = VT_BSTR;
+            v.bstrVal = value.Detach();
         }
+    };
 
-        std::variant<HRESULT, bool> Disconnect(DWORD cookie)
+    template <class I>
+    struct disp_result<ComPtr<I>>
+    {
+        static void Set(VARIANT& v, ComPtr<I>&& value)
         {
-            auto found = connections_.find(cookie);
-            if (found == connections_.end())
-                return false;
+            if constexpr (std::is_base_of_v<IDispatch, I>)
+            {
+                v.vt = VT_DISPATCH;
+                v.pdispVal = static_cast<IDispatch*>(value.Detach());
+            }
+            else
+            {
+                v.vt = VT_UNKNOWN;
+                v.punkVal = static_cast<IUnknown*>(value.Detach());
+            }
+        }
+    };
 
-            ComPtr<IConnectionPoint>& cp = found->second;
-            HRESULT hr = cp->Unadvise(found->first);
+    template <class T>
+    struct is_hresult_pair : std::false_type {};
 
-            connections_.erase(found);
+    template <class T>
+    struct is_hresult_pair<std::pair<HRESULT, T>> : std::true_type {};
 
-            return hr;
-        }
+    // R is either the value or std::pair<HRESULT, value>. The value is written only
+    // on success. A callback returning HRESULT alone is never treated as a value,
+    // LONG results have to be returned in a pair
+    template <class R>
+    HRESULT set_disp_result(VARIANT *pVarResult, R&& result)
+    {
+        using result_type = std::decay_t<R>;
 
-        // 
-        HRESULT DisconnectAll()
+        if constexpr (is_hresult_pair<result_type>::value)
         {
-            HRESULT res = S_OK;
-
-            using iter = decltype(connections_)::iterator;
+            using value_type = typename result_type::second_type;
 
-            iter it = connections_.begin();
-            while (it != connections_.end())
+            if (SUCCEEDED(result.first) && pVarResult)
             {
-                ComPtr<IConnectionPoint>& cp = it->second;
-                HRESULT hr = cp->Unadvise(it->first);
-                if (!SUCCEEDED(hr))
-                    res = hr;
-                ++it;
+                VariantClear(pVarResult);
+                disp_result<value_type>::Set(*pVarResult, std::move(result.second));
             }
-
-            connections_.clear();
-            return res;
+            return result.first;
+        }
+        else
+        {
+            if (pVarResult)
+            {
+                VariantClear(pVarResult);
+                disp_result<result_type>::Set(*pVarResult, std::move(result));
+            }
+            return S_OK;
         }
+    }
 
-        com_connections() = default;
-        ~com_connections()
+    // VARIANT passed by reference, as [out] and [in, out] arguments are.
+    // Accepts VT_BYREF of the type's VARTYPE and VT_BYREF | VT_VARIANT.
+    // Set writes through the reference, releasing the previous string or interface
+    template <class T>
+    class byref
+    {
+        VARIANT *target_;
+
+    public:
+
+        explicit byref(VARIANT& target)
+            : target_(&target)
         {
-            HRESULT hr = DisconnectAll();
-            assert(SUCCEEDED(hr));
         }
 
-    };
+        static bool Accepts(const VARIANT& v)
+        {
+            if (v.vt == (VT_BYREF | VT_VARIANT))
+                return v.pvarVal != nullptr;
 
+            if (!(v.vt & VT_BYREF) || !v.byref)
+                return false;
 
+            VARIANT value = byref_value(v);
+            return variant_traits<T>::Accepts(value);
+        }
 
-    template <class Dispatch>
-    class listener_traits
-    {
-        using t_reg_cpoint = void(Dispatch::*)(DWORD, IConnectionPoint&);
-        using t_disconnect = std::variant<HRESULT, bool>(Dispatch::*)(DWORD);
+        // default value if the referenced VARIANT is empty
+        T Get() const
+        {
+            VARIANT value = target_->vt == (VT_BYREF | VT_VARIANT) ?
+                *target_->pvarVal :
+                byref_value(*target_);
+            if (!variant_traits<T>::Accepts(value))
+                return T();
+            return variant_traits<T>::Get(value);
+        }
 
-        template <class T, class = std::void_t<>>
-        struct has_reg_cpoint : std::false_type {};
+        void Set(T value)
+        {
+            if (target_->vt == (VT_BYREF | VT_VARIANT))
+            {
+                VariantClear(target_->pvarVal);
+                disp_result<T>::Set(*target_->pvarVal, std::move(value));
+                return;
+            }
 
-        template<class T>
-        struct has_reg_cpoint<T,
-            std::void_t<decltype(t_reg_cpoint(&T::RegConnection))>> :
-            std::true_type {};
+            VARIANT converted;
+            VariantInit(&converted);
+            disp_result<T>::Set(converted, std::move(value));
+            set_byref_value(*target_, converted);
+        }
 
-        template <class T, class = std::void_t<>>
-        struct has_disconnect : std::false_type {};
+        byref& operator=(T value)
+        {
+            Set(std::move(value));
+            return *this;
+        }
 
-        template<class T>
-        struct has_disconnect<T,
-            std::void_t<decltype(t_reg_cpoint(&T::Disconnect))>> :
-            std::true_type {};
+    private:
 
-    public:
+        // shallow copy of the referenced value
+        static VARIANT byref_value(const VARIANT& ref)
+        {
+            VARIANT v;
+            VariantInit(&v);
+            v.vt = ref.vt & ~VT_BYREF;
+            switch (v.vt)
+            {
+            case VT_BOOL: v.boolVal = *ref.pboolVal; break;
+            case VT_UI1: v.bVal = *ref.pbVal; break;
+            case VT_I2: v.iVal = *ref.piVal; break;
+            case VT_INT: v.intVal = *ref.pintVal; break;
+            case VT_I4: v.lVal = *ref.plVal; break;
+            case VT_UI4: v.ulVal = *ref.pulVal; break;
+            case VT_I8: v.llVal = *ref.pllVal; break;
+            case VT_R4: v.fltVal = *ref.pfltVal; break;
+            case VT_R8: v.dblVal = *ref.pdblVal; break;
+            case VT_DATE: v.date = *ref.pdate; break;
+            case VT_BSTR: v.bstrVal = *ref.pbstrVal; break;
+            case VT_DISPATCH: v.pdispVal = *ref.ppdispVal; break;
+            case VT_UNKNOWN: v.punkVal = *ref.ppunkVal; break;
+            default: v.vt = VT_EMPTY; break;
+            }
+            return v;
+        }
 
-        using type = Dispatch;
-        constexpr static bool inherit_idispatch = std::is_base_of_v<IDispatch, Dispatch>;
-        constexpr static bool has_reg_cpoint_v = has_reg_cpoint<Dispatch>();
-        constexpr static bool has_disconnect_v = has_disconnect<Dispatch>();
+        // moves the value, converted to the referenced VARTYPE by Accepts
+        static void set_byref_value(VARIANT& ref, VARIANT& value)
+        {
+            switch (ref.vt & ~VT_BYREF)
+            {
+            case VT_BOOL: *ref.pboolVal = value.boolVal; break;
+            case VT_UI1: *ref.pbVal = value.bVal; break;
+            case VT_I2: *ref.piVal = value.iVal; break;
+            case VT_INT: *ref.pintVal = value.intVal; break;
+            case VT_I4: *ref.plVal = value.vt == VT_INT ? (LONG)value.intVal : value.lVal; break;
+            case VT_UI4: *ref.pulVal = value.ulVal; break;
+            case VT_I8: *ref.pllVal = value.llVal; break;
+            case VT_R4: *ref.pfltVal = value.fltVal; break;
+            case VT_R8: *ref.pdblVal = value.dblVal; break;
+            case VT_DATE: *ref.pdate = value.dblVal; break;
+            case VT_BSTR:
+                SysFreeString(*ref.pbstrVal);
+                *ref.pbstrVal = value.bstrVal;
+                return;
+            case VT_DISPATCH:
+            case VT_UNKNOWN:
+                if (*ref.ppunkVal)
+                    (*ref.ppunkVal)->Release();
+                *ref.ppunkVal = value.punkVal;
+                return;
+            default:
+                assert(false && "Unsupported reference type!");
+                break;
+            }
+            VariantClear(&value);
+        }
+    };
 
-        constexpr static bool is_connectible = //inherit_idispatch &&
-            has_reg_cpoint_v &&
-            has_disconnect_v;
+    // reads a typed argument at its declaration position
+    template <class A>
+    struct disp_arg_decoder
+    {
+        static bool Accepts(DISPPARAMS& params, UINT arg)
+        {
+            return variant_traits<A>::Accepts(disp_param(params, arg));
+        }
 
+        static A Get(DISPPARAMS& params, UINT arg)
+        {
+            return variant_traits<A>::Get(disp_param(params, arg));
+        }
     };
 
     template <class T>
-    struct tag_iid {};
-
-    template <class Connectible,
-        class = std::enable_if_t<listener_traits<Connectible>::is_connectible>>
-        class ConnectListener
+    struct disp_arg_decoder<byref<T>>
     {
-        HRESULT hr_ = S_OK;
+        static bool Accepts(DISPPARAMS& params, UINT arg)
+        {
+            return byref<T>::Accepts(params.rgvarg[params.cArgs - 1 - arg]);
+        }
 
-    public:
+        static byref<T> Get(DISPPARAMS& params, UINT arg)
+        {
+            return byref<T>(params.rgvarg[params.cArgs - 1 - arg]);
+        }
+    };
 
-        // does not register dword cookie in Connectible's connections map
-        static std::variant<DWORD, HRESULT> Connect(ComPtr<IUnknown>& pSink,
-            IConnectionPoint& cpoint)
+    // copied to the scratch memory of the call instead of the heap
+    template <>
+    struct disp_arg_decoder<std::pmr::wstring>
+    {
+        static bool Accepts(DISPPARAMS& params, UINT arg)
         {
-            DWORD cookie = 0;
-            HRESULT hr = cpoint.Advise(pSink.GetRaw(), &cookie);
-            if (!SUCCEEDED(hr))
-                return hr;
-            return cookie;
+            return variant_traits<std::wstring_view>::Accepts(disp_param(params, arg));
         }
 
-        static HRESULT Connect(ComPtr<Connectible>& connectible,
-            ComPtr<IConnectionPoint>& cpoint)
+        static std::pmr::wstring Get(DISPPARAMS& params, UINT arg)
         {
-            ComPtr<IUnknown> pSink = connectible;
-            std::variant<DWORD, HRESULT> vCookie = Connect(pSink, *cpoint);
-            if (std::holds_alternative<HRESULT>(vCookie))
-                return std::get<HRESULT>(vCookie);
+            return std::pmr::wstring(variant_traits<std::wstring_view>::Get(disp_param(params, arg)),
+                &scratch_arena::Current());
+        }
+    };
 
-            connectible->RegConnection(std::get<DWORD>(vCookie), cpoint);
+    // injected, takes no position among the arguments
+    template <>
+    struct disp_arg_decoder<scratch_arena>
+    {
+        constexpr static bool injected = true;
 
-            return S_OK;
+        static bool Accepts(DISPPARAMS&, UINT)
+        {
+            return true;
         }
 
-        static std::variant<HRESULT, bool> Disconnect(ComPtr<Connectible>& connectible, 
-            DWORD cookie)
+        static scratch_arena& Get(DISPPARAMS&, UINT)
         {
-            return connectible->Disconnect(cookie);
+            return scratch_arena::Current();
         }
+    };
 
-        ConnectListener(ComPtr<Connectible>& connectible,
-            ComPtr<IConnectionPoint>& cpoint)
-            : hr_(Connect(connectible, cpoint))
-        {}
+    template <class A, class = void>
+    struct disp_arg_injected : std::false_type {};
 
-        // something is wrong. If this method is used, UnAdvise returns "Object is not connected to server"
-        template <class Interface, class Provider>
-        ConnectListener(ComPtr<Connectible>& connectible, ComPtr<Provider>& cpProvider, 
-            tag_iid<Interface>)
+    template <class A>
+    struct disp_arg_injected<A, std::void_t<decltype(disp_arg_decoder<A>::injected)>>
+        : std::bool_constant<disp_arg_decoder<A>::injected> {};
+
+    // adapts a callback with typed arguments to disp_inv_t.
+    // Argument types are checked against the VARIANTs before the callback is called,
+    // a mismatch returns DISP_E_TYPEMISMATCH and reports the argument in puArgErr.
+    // A scratch_arena& parameter receives the scratch memory of the call
+    // and is not counted as an argument.
+    // The callback may return HRESULT, void, a value or std::pair<HRESULT, value>:
+    // values are written to pVarResult, see set_disp_result
+    template <typename ... A>
+    class decode_disp_args
+    {
+        std::function<disp_inv_t> decoded_;
+
+        constexpr static size_t decoded_count =
+            (size_t(!disp_arg_injected<std::decay_t<A>>::value) + ... + 0);
+
+        // position of the parameter among the decoded arguments
+        template <size_t i>
+        constexpr static UINT position()
         {
-            
-            try
+            constexpr bool injected[] = { disp_arg_injected<std::decay_t<A>>::value..., false };
+            UINT pos = 0;
+            for (size_t j = 0; j < i; ++j)
+                pos += injected[j] ? 0 : 1;
+            return pos;
+        }
+
+        template <class R, size_t ... arg_i>
+        static HRESULT invoke(const std::function<R(A...)>& f,
+            DISPPARAMS& params, VARIANT *pVarResult, UINT *puArgErr,
+            std::index_sequence<arg_i...>)
+        {
+            UINT mismatch = 0;
+            bool accepted = ((disp_arg_decoder<std::decay_t<A>>::Accepts(params, position<arg_i>()) ||
+                (mismatch = position<arg_i>(), false)) && ...);
+
+            if (!accepted)
             {
-                ComPtr<IConnectionPointContainer> cpContainter = cpProvider;
-                ComPtr<IConnectionPoint> cPoint =
-                    FindConnectionPoint<Interface>(*cpContainter);
-                hr_ = Connect(connectible, cPoint);
+                if (puArgErr)
+                    *puArgErr = params.cArgs - 1 - mismatch;
+                return DISP_E_TYPEMISMATCH;
             }
-            catch (const _com_error& error)
+
+            return complete(f, pVarResult,
+                disp_arg_decoder<std::decay_t<A>>::Get(params, position<arg_i>())...);
+        }
+
+        template <class R, class ... D>
+        static HRESULT complete(const std::function<R(A...)>& f, VARIANT *pVarResult, D&& ... args)
+        {
+            if constexpr (std::is_same_v<R, HRESULT>)
+                return f(std::forward<D>(args)...);
+            else if constexpr (std::is_void_v<R>)
             {
-                hr_ = error.Error();
+                f(std::forward<D>(args)...);
+                return S_OK;
             }
-           
+            else
+                return set_disp_result(pVarResult, f(std::forward<D>(args)...));
         }
 
-        operator HRESULT() const
+        template <class R>
+        static std::function<disp_inv_t> decode(std::function<R(A...)>&& f)
         {
-            return hr_;
+            const std::type_info& handler = f.target_type();
+            return typed_callback{
+                [f = std::move(f)](DISPID, REFIID, LCID, WORD,
+                    DISPPARAMS *pDispParams, VARIANT *pVarResult,
+                    EXCEPINFO *, UINT *puArgErr) -> HRESULT
+            {
+                UINT cArgs = pDispParams ? pDispParams->cArgs : 0;
+                if (cArgs != decoded_count)
+                    return DISP_E_BADPARAMCOUNT;
+
+                if constexpr (!sizeof...(A))
+                    return complete(f, pVarResult);
+                else
+                {
+                    // only injected parameters
+                    DISPPARAMS none{};
+                    return invoke(f, pDispParams ? *pDispParams : none, pVarResult, puArgErr,
+                        std::index_sequence_for<A...>());
+                }
+            }, &handler };
         }
 
-    };
+    public:
 
+        template <class R>
+        decode_disp_args(std::function<R(A...)>&& callback)
+            : decoded_(decode(std::move(callback)))
+        {}
 
-    enum class disp_inv_args : size_t
-    {
-        dispIDMember = 0,
-        riid,
-        locale,
-        wFlags,
-        pDispParams,
-        pVarResult,
-        pExcepInfo,
-        puArgErr
+        operator std::function<disp_inv_t>()
+        {
+            return std::move(decoded_);
+        }
     };
 
-    using disp_inv_t = HRESULT(DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*);
+    // calls IDispatch::Invoke with typed arguments and converts the result.
+    // Property puts pass the value as the DISPID_PROPERTYPUT named argument
+    template <class R, typename ... A>
+    Result<R> disp_call(IDispatch& target, DISPID dispIdMember, WORD wFlags, const A& ... args) noexcept
+    {
+        std::array<VARIANTARG, sizeof...(A) + 1> rgvarg{};
+        if constexpr (sizeof...(A) > 0)
+        {
+            // reverse order
+            size_t i = sizeof...(A);
+            (variant_traits<A>::Set(rgvarg[--i], args), ...);
+        }
 
-    template <typename T>
-    struct disp_arg_indx : std::integral_constant<size_t, std::numeric_limits<size_t>::max()> {};
+        DISPID propPut = DISPID_PROPERTYPUT;
+        bool isPut = (wFlags & (DISPATCH_PROPERTYPUT | DISPATCH_PROPERTYPUTREF)) != 0;
 
-    template <> 
-    struct disp_arg_indx<DISPID> : std::integral_constant<size_t, (size_t)disp_inv_args::dispIDMember> {};
-    template <>
-    struct disp_arg_indx<REFIID> : std::integral_constant<size_t, (size_t)disp_inv_args::riid> {};
-    template <>
-    struct disp_arg_indx<LCID> : std::integral_constant<size_t, (size_t)disp_inv_args::locale> {};
-    template <>
-    struct disp_arg_indx<WORD> : std::integral_constant<size_t, (size_t)disp_inv_args::wFlags> {};
-    template <>
-    struct disp_arg_indx<DISPPARAMS*> : std::integral_constant<size_t, (size_t)disp_inv_args::pDispParams> {};
-    template <>
-    struct disp_arg_indx<VARIANT*> : std::integral_constant<size_t, (size_t)disp_inv_args::pVarResult> {};
-    template <>
-    struct disp_arg_indx<EXCEPINFO*> : std::integral_constant<size_t, (size_t)disp_inv_args::pExcepInfo> {};
-    template <>
-    struct disp_arg_indx<UINT*> : std::integral_constant<size_t, (size_t)disp_inv_args::puArgErr> {};
+        DISPPARAMS params{};
+        params.rgvarg = sizeof...(A) ? rgvarg.data() : nullptr;
+        params.cArgs = (UINT)sizeof...(A);
+        params.rgdispidNamedArgs = isPut ? &propPut : nullptr;
+        params.cNamedArgs = isPut ? 1 : 0;
 
-    template <typename T>
-    constexpr inline size_t disp_arg_indx_v = disp_arg_indx<T>();
+        VARIANT result;
+        VariantInit(&result);
 
-    template <typename ... A>
-    class reduce_disp_inv_args
-    {
-        std::function<disp_inv_t> reduced_;
+        HRESULT hr = target.Invoke(dispIdMember, IID_NULL, LOCALE_USER_DEFAULT, wFlags,
+            &params, std::is_void_v<R> ? nullptr : &result, nullptr, nullptr);
 
-        template <size_t ... arg_i>
-        constexpr static std::function<disp_inv_t> reduce_args(std::function<HRESULT(A...)>&& f,
-            std::index_sequence<arg_i...>)
+        if constexpr (sizeof...(A) > 0)
         {
-            static_assert(((arg_i != disp_arg_indx<void>()) && ...),
-                "Callback function contains invalid arguement types!");
-
-            return std::function<disp_inv_t>(
-                [f = std::move(f)](DISPID dispIDMember,
-                    REFIID riid, LCID lcid, WORD wFlags,
-                    DISPPARAMS *pDispParams, VARIANT *pVarResult,
-                    EXCEPINFO *pExcepInfo, UINT *puArgErr)
-            {
-                // tuple of default args collection
-                auto fwd = std::tie(dispIDMember, riid, lcid,
-                    wFlags, pDispParams,
-                    pVarResult, pExcepInfo, puArgErr);
-
-                return f(std::get<arg_i>(fwd)...);
-            });
+            size_t i = sizeof...(A);
+            ((variant_traits<A>::owning ? (void)VariantClear(&rgvarg[--i]) : (void)--i), ...);
         }
 
-        reduce_disp_inv_args() = delete;
-        reduce_disp_inv_args(const reduce_disp_inv_args&) = delete;
-        reduce_disp_inv_args(reduce_disp_inv_args&&) = delete;
+        if constexpr (std::is_void_v<R>)
+            return hr;
+        else
+        {
+            static_assert(!std::is_pointer_v<R>,
+                "Interface and string pointers can not be returned, use ComPtr or std::wstring!");
 
-    public:
-        constexpr reduce_disp_inv_args(std::function<HRESULT(A...)>&& callback)
-            : reduced_(reduce_args(std::move(callback),
-                std::index_sequence<disp_arg_indx_v<A>...>()))
-        {}
+            if (!SUCCEEDED(hr))
+                return Result<R>::Fail(hr);
+
+            if (!variant_traits<R>::Accepts(result))
+            {
+                VariantClear(&result);
+                return Result<R>::Fail(DISP_E_TYPEMISMATCH);
+            }
 
-        constexpr operator std::function<disp_inv_t>()
-        {
-            return std::move(reduced_);
+            R value = variant_traits<R>::Get(result);
+            VariantClear(&result);
+            return value;
         }
-    };
+    }
 
     template <auto ptr, typename = decltype(ptr)>
     struct function_traits;
@@ -732,19 +2309,246 @@ namespace cmw
         }
     };
 
+    // declarative condition checked by Listener::Invoke before the callback is called.
+    // Arguments are addressed by their position in the method declaration: 0 is the first one.
+    // Named arguments are not supported
+    class event_filter
+    {
+    public:
+
+        enum class op
+        {
+            equals_int,
+            in_range,
+            equals_str,
+            starts_with
+        };
+
+        struct predicate
+        {
+            op kind;
+            UINT arg;
+            LONGLONG value = 0;
+            double lo = 0.;
+            double hi = 0.;
+            std::wstring str;
+        };
+
+    private:
+
+        // kept sorted: integer checks first, string checks last
+        std::vector<predicate> predicates_;
+
+        constexpr static size_t no_key = std::numeric_limits<size_t>::max();
+
+        // position of the first equality predicate, Listener indexes subscribers by its value
+        size_t key_ = no_key;
+
+    public:
+
+        event_filter& ArgEquals(UINT arg, LONGLONG value);
+        event_filter& ArgEquals(UINT arg, const std::wstring& value);
+        // inclusive range. Applies to integer, floating point and VARIANT_BOOL arguments
+        event_filter& ArgInRange(UINT arg, double lo, double hi);
+        // BSTR arguments only
+        event_filter& ArgStartsWith(UINT arg, const std::wstring& prefix);
+
+        bool Empty() const
+        {
+            return predicates_.empty();
+        }
+
+        bool HasKey() const
+        {
+            return key_ != no_key;
+        }
+
+        UINT KeyArg() const
+        {
+            assert(HasKey() && "Filter has no equality predicate!");
+            return predicates_[key_].arg;
+        }
+
+        size_t KeyHash() const;
+
+        bool Matches(const DISPPARAMS *pDispParams) const;
+
+        // hash of an argument compatible with KeyHash. False if the argument can not be a key
+        static bool ArgHash(const DISPPARAMS *pDispParams, UINT arg, size_t& hash);
+
+    private:
+
+        event_filter& add(predicate&& p);
+    };
+
+    // handle of a single callback registered in a Listener
+    struct subscription
+    {
+        DISPID dispID = DISPID_UNKNOWN;
+        size_t id = 0;
+
+        bool IsValid() const
+        {
+            return id != 0;
+        }
+
+        explicit operator bool() const
+        {
+            return IsValid();
+        }
+    };
+
+    enum class fanout_policy
+    {
+        // subscribers are called one by one on the firing thread.
+        // The result of the first subscriber setting one is returned
+        sequential,
+        // the first subscriber runs on the firing thread, the others on a thread pool.
+        // Invoke returns when all of them have returned. Only the first subscriber
+        // gets the out-parameters. Events with interface or reference arguments are
+        // delivered sequentially, such arguments can not leave the firing thread
+        parallel
+    };
+
+    // observes the subscribers' calls, defined below callback_table
+    class invoke_monitor;
+
+    // immutable snapshot of Listener's callbacks. Every change creates a new table,
+    // the subscribers' arrays of untouched DISPIDs are shared between snapshots.
+    // Listeners with the same handlers may share one table
+    struct callback_table
+    {
+        struct subscriber
+        {
+            size_t id;
+            std::function<disp_inv_t> callback;
+            // nullptr if the subscriber receives all the events
+            std::shared_ptr<const event_filter> filter;
+            // the registered function, for typed callbacks the one behind the adapter
+            const std::type_info *handler = nullptr;
+
+            bool Accepts(const DISPPARAMS *pDispParams) const
+            {
+                return !filter || filter->Matches(pDispParams);
+            }
+        };
+
+        using allocator_type = std::pmr::polymorphic_allocator<char>;
+        using subscribers = std::pmr::vector<subscriber>;
+
+        struct dispatch_entry
+        {
+            using allocator_type = callback_table::allocator_type;
+
+            // unfiltered subscribers and filters without an equality predicate
+            subscribers plain;
+            // argument position -> hash of the expected value -> subscribers
+            std::pmr::unordered_map<UINT,
+                std::pmr::unordered_map<size_t, std::shared_ptr<const subscribers>>> indexed;
+
+            explicit dispatch_entry(const allocator_type& alloc = {})
+                : plain(alloc),
+                indexed(alloc)
+            {
+            }
+
+            dispatch_entry(const dispatch_entry& other, const allocator_type& alloc)
+                : plain(other.plain, alloc),
+                indexed(other.indexed, alloc)
+            {
+            }
+
+            size_t Size() const;
+            bool Empty() const
+            {
+                return !Size();
+            }
+        };
+
+        struct range_subscriber
+        {
+            DISPID first;
+            DISPID last;
+            subscriber target;
+        };
+
+        using range_subscribers = std::pmr::vector<range_subscriber>;
+
+        std::pmr::unordered_map<DISPID, std::shared_ptr<const dispatch_entry>> callbacks;
+        std::shared_ptr<const range_subscribers> ranges;
+        size_t numSubscribers = 0;
+
+        fanout_policy fanout = fanout_policy::sequential;
+        std::shared_ptr<thread_pool> pool;
+
+        // nullptr if the calls are not monitored
+        std::shared_ptr<invoke_monitor> monitor;
+
+        // the table, its entries and the subscribers' arrays are allocated
+        // from the same resource. The callbacks' captures are not
+        explicit callback_table(const allocator_type& alloc = {})
+            : callbacks(alloc)
+        {
+        }
+
+        callback_table(const callback_table& other, const allocator_type& alloc)
+            : callbacks(other.callbacks, alloc),
+            ranges(other.ranges),
+            numSubscribers(other.numSubscribers),
+            fanout(other.fanout),
+            pool(other.pool),
+            monitor(other.monitor)
+        {
+        }
+
+        allocator_type get_allocator() const
+        {
+            return callbacks.get_allocator();
+        }
+    };
+
+    class Listener;
+
+    // hooks around every call of a subscriber made by Listener::Invoke, on the calling
+    // thread. Must be cheap: they run on the firing thread of the server
+    class invoke_monitor
+    {
+    public:
+
+        // returns false to take the call over: the listener does not call the subscriber
+        // and considers it successful, e.g. when the call is moved to another thread
+        virtual bool Begin(const Listener& listener, const callback_table::subscriber& subscriber,
+            void *context, DISPID dispIdMember, LCID lcid, WORD wFlags,
+            DISPPARAMS *pDispParams) noexcept = 0;
+
+        // after the subscriber has returned. Not called for the calls taken over
+        virtual void End(const Listener& listener, const callback_table::subscriber& subscriber) noexcept = 0;
+
+        // the listener is destroyed or watched by another monitor: the calls taken over
+        // must not run once it returns
+        virtual void Detach(const Listener& listener) noexcept {}
+
+        virtual ~invoke_monitor() = default;
+    };
+
     // default implementation has one-to-one interface connection 
     class Listener : public IDispatch
     {
         // destroy last to keep track of references till the end
         reference_counter refCounter_;
         IID connectionIID_;
-
-        // must be destroyed after connections
-        //std::unordered_map<DISPID, std::unique_ptr<idisp_callback>> callbackMap_;
-        std::unordered_map<DISPID, std::function<disp_inv_t>> callbackMap_;
+        const uint64_t id_ = next_id();
+
+        // must be destroyed after connections.
+        // Invoke reads the snapshot through table_ without locking nor counting
+        // references, replaced snapshots are released by epoch_reclamation.
+        // Writers are serialized by a mutex of a pool shared by all the listeners
+        std::shared_ptr<const callback_table> callbacks_;
+        std::atomic<const callback_table*> table_;
         com_connections connections_;
 
-        std::shared_mutex mutexMap_;
+        // passed to the handlers of a shared table, see InvokeContext
+        std::atomic<void*> context_ = nullptr;
 
     public:
 
@@ -755,17 +2559,81 @@ namespace cmw
         // RAII. Terminate connections on destruction
         static std::unique_ptr<Listener> Create(REFIID connectionIID);
 
+        // shares the table of callbacks with other listeners. The listener gets
+        // its own copy only when it registers or removes a callback
+        static std::unique_ptr<Listener> Create(REFIID connectionIID,
+            std::shared_ptr<const callback_table> callbacks, void *context = nullptr);
+
+        // tables of callbacks and connections are allocated from the resource,
+        // which must outlive the listener and be thread-safe if the callbacks
+        // are changed from several threads
+        static std::unique_ptr<Listener> Create(REFIID connectionIID,
+            std::pmr::memory_resource *resource);
+
+        // current snapshot. May be passed to Create to share it.
+        // Loaded by std::atomic_load, which may lock: not used by Invoke
+        std::shared_ptr<const callback_table> Callbacks() const;
+
+        void SetContext(void *context);
+        void* Context() const;
+
+        // context of the listener invoking the handler on this thread.
+        // nullptr outside of the handlers
+        static void* InvokeContext() noexcept;
+
+        // unique for the lifetime of the process, unlike the address
+        uint64_t Id() const
+        {
+            return id_;
+        }
+
         // IConnectible
 
         virtual REFIID Interface(size_t n = 0) const;
         virtual size_t NumInterfaces() const;
 
-        virtual void SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback,
+        // adds a subscriber. Several callbacks may be registered for the same DISPID.
+        // The callbacks without an equality filter are called first in the order of
+        // registration, then the ones looked up by an equality filter, then the ones
+        // registered for a DISPID range
+        virtual subscription SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback,
                 REFIID = IID());
 
+        // the callback is called only for the events accepted by the filter.
+        // Filters with an equality predicate are looked up by hash of the argument,
+        // so thousands of them cost one lookup per event
+        subscription SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback,
+            const event_filter& filter);
+
+        // the callback receives every DISPID of the inclusive range
+        subscription SetCallback(DISPID first, DISPID last, std::function<disp_inv_t>&& callback,
+            const event_filter& filter = event_filter());
+
+        // the subscriber is removed after its first call. Calls racing with the first one
+        // on other threads are skipped. Listeners sharing the table must not outlive this one
+        subscription SetCallbackOnce(DISPID dispiid, std::function<disp_inv_t>&& callback,
+            const event_filter& filter = event_filter());
+
+        // returns false if the subscriber has already been removed.
+        // Callbacks may be added and removed from the handlers, the running Invoke
+        // keeps calling the subscribers of its snapshot
+        virtual bool RemoveCallback(const subscription& handle);
+
+        size_t NumCallbacks(DISPID dispiid) const;
+        // all the registered callbacks, including DISPID ranges
+        size_t NumCallbacks() const;
+
+        // parallel fan-out requires a pool. Ignored for events with a single accepting subscriber
+        void SetFanout(fanout_policy policy, std::shared_ptr<thread_pool> pool = nullptr);
+
+        // every call of a subscriber is reported to the monitor, nullptr to stop.
+        // A monitor may watch several listeners
+        void SetMonitor(std::shared_ptr<invoke_monitor> monitor);
+
         size_t NumConnections() const;
         void RegConnection(DWORD cookie, ComPtr<IConnectionPoint>& cpoint);
         std::variant<HRESULT, bool> Disconnect(DWORD cookie);
+        Result<void> TryDisconnect(DWORD cookie) noexcept;
         HRESULT DisconnectAll();
 
         // IUnknown
@@ -778,19 +2646,38 @@ namespace cmw
 
         // IDispatch
 
+        // subscribers are isolated from each other: a failing or throwing callback
+        // does not prevent the others from being called. Returns the first failure.
+        // Sequential fan-out does not allocate, see allocation_guard
         virtual HRESULT __stdcall Invoke(DISPID dispIdMember, 
             REFIID riid, LCID lcid, WORD wFlags, 
             DISPPARAMS * pDispParams, 
             VARIANT * pVarResult, EXCEPINFO * pExcepInfo, 
             UINT * puArgErr) override;
 
-        virtual ~Listener() = default;
+        // detaches the monitor, see invoke_monitor::Detach, and releases the replaced
+        // tables, see epoch_reclamation::Synchronize
+        virtual ~Listener();
+
+        // calls the subscriber as Invoke does: InvokeContext returns the context,
+        // exceptions are converted to HRESULT. For calls delivered by other threads
+        static HRESULT InvokeSubscriber(const callback_table::subscriber& subscriber,
+            void *context,
+            DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr) noexcept;
 
     protected:
 
-        Listener(REFIID connectionIID)
-            : connectionIID_(connectionIID)
-        {}
+        Listener(REFIID connectionIID);
+        Listener(REFIID connectionIID, std::shared_ptr<const callback_table> callbacks,
+            void *context);
+        Listener(REFIID connectionIID, std::pmr::memory_resource *resource);
+
+        // called after callbacks are added or removed, without any lock held.
+        // Calls from concurrent registrations may arrive in any order
+        virtual void OnCallbacksChanged() {}
 
         // these methods are not implemented
         virtual HRESULT __stdcall GetTypeInfoCount(UINT * pctinfo) override;
@@ -798,64 +2685,381 @@ namespace cmw
             UINT cNames, LCID lcid, DISPID * rgDispId) override;
         virtual HRESULT __stdcall GetTypeInfo(UINT iTInfo, LCID lcid, ITypeInfo ** ppTInfo) override;
 
+    private:
+
+        // where the subscribers of one Invoke are called
+        struct invoke_site
+        {
+            const Listener *listener;
+            void *context;
+            invoke_monitor *monitor;
+        };
+
+        static uint64_t next_id() noexcept;
+
+        // Invoke without tracing
+        HRESULT dispatch(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr);
+
+        static HRESULT invoke_isolated(const callback_table::subscriber& subscriber,
+            const invoke_site& site,
+            DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr) noexcept;
+
+        subscription add_subscriber(DISPID dispiid, callback_table::subscriber&& subscriber);
+
+        // replaces the snapshot, the table mutex must be held. Returns the previous one,
+        // to be retired when the mutex is released
+        std::shared_ptr<const callback_table> publish(std::shared_ptr<const callback_table>&& table);
+
+        // released once no Invoke may read it
+        void retire(std::shared_ptr<const callback_table>&& table);
+
+        static HRESULT invoke_parallel(const std::pmr::vector<const callback_table::subscriber*>& subscribers,
+            thread_pool& pool, const invoke_site& site,
+            DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags,
+            DISPPARAMS * pDispParams,
+            VARIANT * pVarResult, EXCEPINFO * pExcepInfo,
+            UINT * puArgErr);
 
     };
 
 
+    // removes the subscriber on destruction. The listener must outlive it
+    class scoped_subscription
+    {
+        Listener *listener_ = nullptr;
+        subscription handle_;
+
+    public:
+
+        scoped_subscription() = default;
+
+        scoped_subscription(Listener& listener, const subscription& handle) noexcept
+            : listener_(&listener),
+            handle_(handle)
+        {
+        }
+
+        scoped_subscription(scoped_subscription&& other) noexcept
+            : listener_(other.listener_),
+            handle_(other.Release())
+        {
+        }
+
+        scoped_subscription& operator=(scoped_subscription&& other)
+        {
+            if (this != &other)
+            {
+                Reset();
+                listener_ = other.listener_;
+                handle_ = other.Release();
+            }
+            return *this;
+        }
+
+        scoped_subscription(const scoped_subscription&) = delete;
+        scoped_subscription& operator=(const scoped_subscription&) = delete;
+
+        ~scoped_subscription()
+        {
+            try
+            {
+                Reset();
+            }
+            catch (...)
+            {
+                // the subscriber stays registered
+            }
+        }
+
+        // removes the subscriber now
+        void Reset()
+        {
+            if (handle_)
+                listener_->RemoveCallback(handle_);
+            handle_ = subscription();
+        }
+
+        // the subscriber stays registered
+        subscription Release() noexcept
+        {
+            subscription handle = handle_;
+            handle_ = subscription();
+            return handle;
+        }
+
+        const subscription& Get() const
+        {
+            return handle_;
+        }
+
+        explicit operator bool() const
+        {
+            return handle_.IsValid();
+        }
+    };
+
     // TODO: make Listener a template parameter?
     class RegisterCallback
     {
-        static void Register(Listener& listener, DISPID dispIDMember,
+        subscription handle_;
+
+        static subscription Register(Listener& listener, DISPID dispIDMember,
             std::function<disp_inv_t>&& callback)
         {
-            listener.SetCallback(dispIDMember, std::move(callback));
+            return listener.SetCallback(dispIDMember, std::move(callback));
         }
 
     public:
 
         RegisterCallback(Listener& listener, DISPID dispIDMember,
             std::function<disp_inv_t>&& callback)
+            : handle_(Register(listener, dispIDMember, std::move(callback)))
         {
-            Register(listener, dispIDMember, std::move(callback));
         }
 
-        template <typename ... A>
+        // callbacks returning a value have it written to pVarResult, see set_disp_result
+        template <typename R, typename ... A>
         RegisterCallback(Listener& listener, DISPID dispIDMember,
-            std::function<HRESULT(A...)>&& callback)
+            std::function<R(A...)>&& callback)
             : RegisterCallback(listener, dispIDMember,
                 reduce_disp_inv_args(std::move(callback)))
         {
         }
 
-        template <typename ... A>
+        template <typename R, typename ... A>
         RegisterCallback(Listener& listener, DISPID dispIDMember,
-            HRESULT(*pCallback)(A...))
+            R(*pCallback)(A...))
             : RegisterCallback(listener, dispIDMember, 
-            (std::function<HRESULT(A...)>)bind_function(pCallback))
+            (std::function<R(A...)>)bind_function(pCallback))
             // why doesn't this work?
             //: RegisterCallback(listener, dispIDMember, 
             //    reduce_disp_inv_args(bind_function(pCallback)))
         {
         }
 
-        template <class T, typename ... A>
+        template <class T, typename R, typename ... A>
         RegisterCallback(Listener& listener, DISPID dispIDMember, T *pObj,
-            HRESULT(T::*pCallback)(A...))
+            R(T::*pCallback)(A...))
             : RegisterCallback(listener, dispIDMember,
-            (std::function<HRESULT(A...)>)bind_function(pObj, pCallback))
+            (std::function<R(A...)>)bind_function(pObj, pCallback))
            // : RegisterCallback(listener, dispIDMember, 
            //     reduce_disp_inv_args(bind_function(pObj, pCallback)))
         {
         }
 
+        // pass to Listener::RemoveCallback to unsubscribe
+        operator subscription() const
+        {
+            return handle_;
+        }
+
     };
 
 
-    /*
-    // TODO: implement
-    class ListenerMultiple : public Listener
+    // property values of one object, memoized per DISPID. Hits read an immutable
+    // snapshot through a raw pointer, replaced snapshots are released by
+    // epoch_reclamation. Values are dropped when the object reports a change, see
+    // InvalidateOn and PropertyNotifySink, and when their TTL has expired by the
+    // time the snapshot is replaced
+    class property_cache
+    {
+    public:
+
+        using duration = std::chrono::steady_clock::duration;
+
+    private:
+
+        struct entry
+        {
+            VARIANT value;
+            std::chrono::steady_clock::time_point fetched;
+            // readers may still hold the entry after it is invalidated
+            mutable std::atomic<bool> invalidated = false;
+
+            entry()
+            {
+                VariantInit(&value);
+            }
+
+            entry(const entry&) = delete;
+            entry& operator=(const entry&) = delete;
+
+            ~entry()
+            {
+                VariantClear(&value);
+            }
+        };
+
+        struct table
+        {
+            std::unordered_map<DISPID, std::shared_ptr<const entry>> entries;
+            std::unordered_map<DISPID, duration> ttls;
+            duration defaultTtl = duration::zero();
+
+            // counters of Invalidate per DISPID and of InvalidateAll: a refill is
+            // cached only if its property was not invalidated while it was fetched
+            std::unordered_map<DISPID, uint64_t> invalidated;
+            uint64_t invalidatedAll = 0;
+
+            duration Ttl(DISPID dispId) const
+            {
+                auto found = ttls.find(dispId);
+                return found != ttls.cend() ? found->second : defaultTtl;
+            }
+
+            bool Expired(DISPID dispId, const entry& e,
+                std::chrono::steady_clock::time_point now) const
+            {
+                duration ttl = Ttl(dispId);
+                return ttl != duration::zero() && now - e.fetched >= ttl;
+            }
+
+            // both counters only grow: their sum changes with either of them
+            uint64_t Generation(DISPID dispId) const
+            {
+                auto found = invalidated.find(dispId);
+                return invalidatedAll + (found != invalidated.cend() ? found->second : 0);
+            }
+        };
+
+        // Read loads table_ without locking nor counting references.
+        // Writers copy the table under the mutex, owner_ keeps the current one
+        std::shared_ptr<const table> owner_;
+        std::atomic<const table*> table_;
+        std::mutex mutexTable_;
+
+        std::atomic<uint64_t> hits_ = 0;
+        std::atomic<uint64_t> misses_ = 0;
+        std::atomic<uint64_t> expirations_ = 0;
+        std::atomic<uint64_t> invalidations_ = 0;
+        std::atomic<uint64_t> staleReads_ = 0;
+
+    public:
+
+        // zero TTL: values are kept until invalidated
+        explicit property_cache(duration defaultTtl = duration::zero());
+
+        property_cache(const property_cache&) = delete;
+        property_cache& operator=(const property_cache&) = delete;
+
+        // releases the replaced snapshots, see epoch_reclamation::Synchronize
+        ~property_cache();
+
+        void SetTtl(DISPID dispId, duration ttl);
+
+        // owning copy of the property, from the cache or from the target
+        HRESULT Read(IDispatch& target, DISPID dispId, VARIANT& value);
+
+        template <class R>
+        Result<R> Get(IDispatch& target, DISPID dispId)
+        {
+            static_assert(!std::is_pointer_v<R>,
+                "Interface and string pointers can not be returned, use ComPtr or std::wstring!");
+
+            VARIANT value;
+            VariantInit(&value);
+
+            HRESULT hr = Read(target, dispId, value);
+            if (!SUCCEEDED(hr))
+                return Result<R>::Fail(hr);
+
+            if (!variant_traits<R>::Accepts(value))
+            {
+                VariantClear(&value);
+                return Result<R>::Fail(DISP_E_TYPEMISMATCH);
+            }
+
+            R res = variant_traits<R>::Get(value);
+            VariantClear(&value);
+            return res;
+        }
+
+        // DISPID_UNKNOWN invalidates every property, as IPropertyNotifySink::OnChanged
+        void Invalidate(DISPID dispId);
+        void InvalidateAll();
+
+        // invalidates the properties when the listener receives the event.
+        // The cache must outlive the subscription
+        subscription InvalidateOn(Listener& listener, DISPID eventId,
+            std::vector<DISPID> properties);
+
+        size_t Size() const;
+
+        uint64_t Hits() const
+        {
+            return hits_;
+        }
+
+        uint64_t Misses() const
+        {
+            return misses_;
+        }
+
+        // reads which found the value expired
+        uint64_t Expirations() const
+        {
+            return expirations_;
+        }
+
+        uint64_t Invalidations() const
+        {
+            return invalidations_;
+        }
+
+        // hits which returned a value invalidated while it was being read
+        uint64_t StaleReads() const
+        {
+            return staleReads_;
+        }
+
+    private:
+
+        void store(DISPID dispId, const VARIANT& value, uint64_t generation);
+
+        // copy of the current table without the expired values. The mutex must be held
+        std::shared_ptr<table> copy() const;
+        // the mutex must be held. Returns the replaced table, to be retired
+        std::shared_ptr<const table> publish(std::shared_ptr<const table>&& t);
+        void retire(std::shared_ptr<const table>&& t);
+    };
+
+    template <class Interface, class CoClass, class Dispatch>
+    template <class R>
+    Result<R> ComObj<Interface, CoClass, Dispatch>::Get(DISPID dispId)
+    {
+        static_assert(!std::is_void_v<Dispatch>, "Properties require a dispinterface!");
+
+        if (!pDispInterface_.IsValid())
+            return Result<R>::Fail(E_POINTER);
+
+        if (cache_)
+            return cache_->template Get<R>(*pDispInterface_, dispId);
+
+        return disp_call<R>(*pDispInterface_, dispId, DISPATCH_PROPERTYGET);
+    }
+
+    template <class Interface, class CoClass, class Dispatch>
+    template <class T>
+    Result<void> ComObj<Interface, CoClass, Dispatch>::Put(DISPID dispId, const T& value)
     {
-    };*/
+        static_assert(!std::is_void_v<Dispatch>, "Properties require a dispinterface!");
+
+        if (!pDispInterface_.IsValid())
+            return E_POINTER;
+
+        Result<void> res = disp_call<void>(*pDispInterface_, dispId, DISPATCH_PROPERTYPUT, value);
+        if (cache_)
+            cache_->Invalidate(dispId);
+
+        return res;
+    }
+
 
     /*
     template <class COM, class Interface, class Disp>
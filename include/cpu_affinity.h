@@ -0,0 +1,209 @@
+﻿#pragma once
+
+// pinning of threads to CPUs and memory placed on the NUMA node of a thread
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory_resource>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace cmw
+{
+    // false if the CPU does not exist or is not allowed for the process.
+    // On Windows only the CPUs of the thread's processor group, up to 64, can be used
+    inline bool pin_current_thread(int cpu) noexcept
+    {
+        if (cpu < 0)
+            return false;
+
+#ifdef _WIN32
+        if (cpu >= 64)
+            return false;
+        return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+        if (cpu >= CPU_SETSIZE)
+            return false;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+    }
+
+    // CPU the calling thread is running on, -1 if unknown
+    inline int current_cpu() noexcept
+    {
+#ifdef _WIN32
+        return (int)GetCurrentProcessorNumber();
+#else
+        return sched_getcpu();
+#endif
+    }
+
+    // NUMA node of the CPU, -1 if unknown. Machines without NUMA report node 0
+    inline int numa_node_of_cpu(int cpu) noexcept
+    {
+        if (cpu < 0)
+            return -1;
+
+#ifdef _WIN32
+        UCHAR node = 0;
+        if (cpu > 255 || !GetNumaProcessorNode((UCHAR)cpu, &node))
+            return -1;
+        return node;
+#else
+        // the CPU's directory links its node: /sys/devices/system/cpu/cpuN/nodeK
+        char path[96];
+        for (int node = 0; node < 1024; ++node)
+        {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+            if (access(path, F_OK) == 0)
+                return node;
+        }
+        return access("/sys/devices/system/node", F_OK) == 0 ? -1 : 0;
+#endif
+    }
+
+    // NUMA node holding the page of the address, -1 if unknown or not yet touched
+    inline int numa_node_of_address(const void *address) noexcept
+    {
+#if defined(_WIN32)
+        PSAPI_WORKING_SET_EX_INFORMATION info{};
+        info.VirtualAddress = const_cast<void*>(address);
+        if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) ||
+            !info.VirtualAttributes.Valid)
+            return -1;
+        return (int)info.VirtualAttributes.Node;
+#elif defined(SYS_get_mempolicy)
+        // MPOL_F_NODE | MPOL_F_ADDR: node of the page, as libnuma's numa_move_pages query
+        constexpr unsigned long node_of_address = 1 | 2;
+        int node = -1;
+        if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, node_of_address) != 0)
+            return -1;
+        return node;
+#else
+        return -1;
+#endif
+    }
+
+    // bump allocator over a block committed and first touched by the constructing thread,
+    // so the operating system places its pages on that thread's NUMA node.
+    // Construct it on the thread that will use the memory. Memory is returned only
+    // when the arena is destroyed, requests not fitting the block go to the upstream.
+    // Allocation is thread-safe
+    class first_touch_arena : public std::pmr::memory_resource
+    {
+        char *begin_ = nullptr;
+        size_t size_ = 0;
+        std::atomic<size_t> used_ = 0;
+        std::atomic<size_t> overflows_ = 0;
+        std::pmr::memory_resource *upstream_;
+
+    public:
+
+        explicit first_touch_arena(size_t size,
+            std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+            : upstream_(upstream)
+        {
+#ifdef _WIN32
+            void *block = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+            void *block = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block == MAP_FAILED)
+                block = nullptr;
+#endif
+            if (!block)
+                return;
+
+            begin_ = static_cast<char*>(block);
+            size_ = size;
+
+            // the first write places the pages
+            std::memset(begin_, 0, size_);
+        }
+
+        first_touch_arena(const first_touch_arena&) = delete;
+        first_touch_arena& operator=(const first_touch_arena&) = delete;
+
+        ~first_touch_arena()
+        {
+            if (!begin_)
+                return;
+#ifdef _WIN32
+            VirtualFree(begin_, 0, MEM_RELEASE);
+#else
+            munmap(begin_, size_);
+#endif
+        }
+
+        const void* Data() const noexcept
+        {
+            return begin_;
+        }
+
+        size_t Capacity() const noexcept
+        {
+            return size_;
+        }
+
+        size_t Used() const noexcept
+        {
+            return std::min(used_.load(std::memory_order_relaxed), size_);
+        }
+
+        // allocations served by the upstream
+        size_t Overflows() const noexcept
+        {
+            return overflows_.load(std::memory_order_relaxed);
+        }
+
+    protected:
+
+        void* do_allocate(size_t bytes, size_t alignment) override
+        {
+            size_t used = used_.load(std::memory_order_relaxed);
+            while (begin_)
+            {
+                size_t offset = (used + alignment - 1) & ~(alignment - 1);
+                if (offset + bytes > size_)
+                    break;
+
+                if (used_.compare_exchange_weak(used, offset + bytes, std::memory_order_relaxed))
+                    return begin_ + offset;
+            }
+
+            overflows_.fetch_add(1, std::memory_order_relaxed);
+            return upstream_->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override
+        {
+            char *block = static_cast<char*>(p);
+            if (block >= begin_ && block < begin_ + size_)
+                return;
+
+            upstream_->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+}
@@ -0,0 +1,244 @@
+﻿#pragma once
+
+// epoch-based reclamation of objects read without locks: a reader announces
+// the epoch it started in, an object unpublished by a writer is destroyed
+// once every reader which could still see it has left.
+// Readers never wait nor allocate, and lock only to reclaim what they retired.
+// Writers never wait for readers, owners of retired objects do before they are destroyed
+
+#include "thread_slots.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace cmw
+{
+    class epoch_reclamation
+    {
+    public:
+
+        constexpr static size_t max_threads = thread_slots::max_threads;
+
+    private:
+
+        using slot = std::atomic<uint64_t>;
+
+        // readers of the calling thread
+        struct thread_state
+        {
+            // nullptr without a thread_slots index: the readers are counted by a shared counter
+            slot *taken;
+            // nested readers belong to the outermost one
+            size_t depth = 0;
+            // objects retired inside a reader, reclaimed as the outermost one leaves
+            bool retiredInside = false;
+        };
+
+        struct retired
+        {
+            uint64_t epoch;
+            const void *owner;
+            std::function<void()> reclaim;
+        };
+
+        static thread_state& state() noexcept
+        {
+            thread_local thread_state own{ own_slot() };
+            return own;
+        }
+
+        static slot* own_slot() noexcept
+        {
+            size_t index = thread_slots::Index();
+            return index != thread_slots::no_slot ? &slots_[index].value : nullptr;
+        }
+
+    public:
+
+        // objects loaded during its lifetime stay valid until it is destroyed.
+        // Writers may run on the same thread, e.g. from an event handler
+        class reader
+        {
+            thread_state& state_;
+
+        public:
+
+            reader() noexcept
+                : state_(state())
+            {
+                if (state_.depth++)
+                    return;
+
+                // the announcement must be visible before the object is loaded
+                if (state_.taken)
+                    state_.taken->store(epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+                else
+                    overflowReaders_.fetch_add(1, std::memory_order_seq_cst);
+            }
+
+            ~reader()
+            {
+                if (--state_.depth)
+                    return;
+
+                if (state_.taken)
+                    state_.taken->store(0, std::memory_order_release);
+                else
+                    overflowReaders_.fetch_sub(1, std::memory_order_release);
+
+                // the retiring reader was the one keeping them
+                if (state_.retiredInside)
+                {
+                    state_.retiredInside = false;
+                    Reclaim();
+                }
+            }
+
+            reader(const reader&) = delete;
+            reader& operator=(const reader&) = delete;
+        };
+
+        // reclaim is called once no reader may use what the writer has unpublished before.
+        // Runs on the thread of this or a later Retire, Reclaim or Synchronize, or as the
+        // reader it was retired in leaves, none of which may hold locks the reclaimed
+        // objects take. owner identifies the objects for Synchronize
+        static void Retire(std::function<void()>&& reclaim, const void *owner = nullptr)
+        {
+            uint64_t retiredIn = epoch_.fetch_add(1, std::memory_order_seq_cst);
+
+            {
+                std::lock_guard<std::mutex> lock(mutexRetired_);
+                retired_.push_back({ retiredIn, owner, std::move(reclaim) });
+            }
+
+            thread_state& own = state();
+            if (own.depth)
+                own.retiredInside = true;
+
+            Reclaim();
+        }
+
+        // returns the number of objects reclaimed
+        static size_t Reclaim()
+        {
+            // readers without a slot do not tell their epoch
+            if (overflowReaders_.load(std::memory_order_seq_cst))
+                return 0;
+
+            uint64_t oldest = epoch_.load(std::memory_order_seq_cst);
+            size_t inUse = thread_slots::InUse();
+            for (size_t i = 0; i < inUse; ++i)
+            {
+                uint64_t announced = slots_[i].value.load(std::memory_order_seq_cst);
+                if (announced && announced < oldest)
+                    oldest = announced;
+            }
+
+            return reclaim_before(oldest, nullptr, 0);
+        }
+
+        // waits for the readers of the other threads which may use an object retired
+        // before, then reclaims the objects of owner and the ones no reader may use.
+        // Returns at once if owner has nothing retired, nullptr waits for the objects of
+        // every owner. For the destructor of the owner: the readers of the calling thread,
+        // e.g. an event handler destroying it, must not use its objects, and the caller
+        // must not hold locks the readers of the other threads wait for
+        static void Synchronize(const void *owner = nullptr)
+        {
+            if (owner && !has_retired(owner))
+                return;
+
+            uint64_t synchronizedAt = epoch_.fetch_add(1, std::memory_order_seq_cst);
+
+            // readers announcing a later epoch have loaded the objects after they were unpublished
+            const thread_state& own = state();
+            size_t inUse = thread_slots::InUse();
+            for (size_t i = 0; i < inUse; ++i)
+            {
+                const slot& s = slots_[i].value;
+                if (&s == own.taken)
+                    continue;
+
+                uint64_t announced = s.load(std::memory_order_seq_cst);
+                while (announced && announced <= synchronizedAt)
+                {
+                    std::this_thread::yield();
+                    announced = s.load(std::memory_order_seq_cst);
+                }
+            }
+
+            bool ownOverflow = !own.taken && own.depth;
+            while (overflowReaders_.load(std::memory_order_seq_cst) > (ownOverflow ? 1u : 0u))
+                std::this_thread::yield();
+
+            // the readers of the calling thread keep the objects of the other owners
+            uint64_t oldest = synchronizedAt;
+            if (own.depth)
+                oldest = own.taken ? std::min(oldest, own.taken->load(std::memory_order_relaxed)) : 0;
+
+            reclaim_before(oldest, owner, synchronizedAt);
+        }
+
+        // retired objects not reclaimed yet
+        static size_t NumRetired()
+        {
+            std::lock_guard<std::mutex> lock(mutexRetired_);
+            return retired_.size();
+        }
+
+    private:
+
+        static bool has_retired(const void *owner)
+        {
+            std::lock_guard<std::mutex> lock(mutexRetired_);
+            return std::any_of(retired_.cbegin(), retired_.cend(),
+                [owner](const retired& r) { return r.owner == owner; });
+        }
+
+        // reclaims the objects retired before oldest, and the ones of owner retired before ownerOldest
+        static size_t reclaim_before(uint64_t oldest, const void *owner, uint64_t ownerOldest)
+        {
+            std::vector<std::function<void()>> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutexRetired_);
+
+                auto kept = retired_.begin();
+                for (auto& r : retired_)
+                {
+                    if (r.epoch < oldest || (owner && r.owner == owner && r.epoch < ownerOldest))
+                        ready.push_back(std::move(r.reclaim));
+                    else
+                    {
+                        if (&*kept != &r)
+                            *kept = std::move(r);
+                        ++kept;
+                    }
+                }
+                retired_.erase(kept, retired_.end());
+            }
+
+            // reclaimed objects may retire others
+            for (auto& reclaim : ready)
+                reclaim();
+
+            return ready.size();
+        }
+
+        // 0 marks a thread outside readers
+        static inline std::array<cache_padded<slot>, max_threads> slots_{};
+        static inline std::atomic<size_t> overflowReaders_ = 0;
+
+        static inline std::atomic<uint64_t> epoch_ = 1;
+
+        static inline std::mutex mutexRetired_;
+        static inline std::vector<retired> retired_;
+    };
+}
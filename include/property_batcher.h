@@ -0,0 +1,314 @@
+﻿#pragma once
+
+// batching of property change notifications: the DISPIDs an object reports
+// between two flushes are delivered in one callback. BatchedPropertySink in
+// com_events.h feeds it from IPropertyNotifySink::OnChanged
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace cmw
+{
+    // set of changed DISPIDs. The DISPIDs below bitset_size, as assigned by most
+    // type libraries, take a bit each, the others are kept sorted in a vector.
+    // dispid_unknown marks every property as changed
+    class dirty_properties
+    {
+    public:
+
+        constexpr static int32_t bitset_size = 256;
+
+        // DISPID_UNKNOWN
+        constexpr static int32_t dispid_unknown = -1;
+
+    private:
+
+        std::bitset<bitset_size> low_;
+        std::vector<int32_t> other_;
+        size_t size_ = 0;
+        bool all_ = false;
+
+    public:
+
+        void Add(int32_t dispId)
+        {
+            if (dispId == dispid_unknown)
+            {
+                all_ = true;
+                return;
+            }
+
+            if (dispId >= 0 && dispId < bitset_size)
+            {
+                if (low_.test((size_t)dispId))
+                    return;
+                low_.set((size_t)dispId);
+                ++size_;
+                return;
+            }
+
+            auto found = std::lower_bound(other_.begin(), other_.end(), dispId);
+            if (found != other_.end() && *found == dispId)
+                return;
+            other_.insert(found, dispId);
+            ++size_;
+        }
+
+        // true for every DISPID once dispid_unknown is added
+        bool Contains(int32_t dispId) const
+        {
+            if (all_)
+                return true;
+
+            if (dispId >= 0 && dispId < bitset_size)
+                return low_.test((size_t)dispId);
+
+            return std::binary_search(other_.cbegin(), other_.cend(), dispId);
+        }
+
+        // dispid_unknown was added: any property may have changed
+        bool All() const
+        {
+            return all_;
+        }
+
+        bool Empty() const
+        {
+            return !size_ && !all_;
+        }
+
+        // DISPIDs added, dispid_unknown not counted
+        size_t Size() const
+        {
+            return size_;
+        }
+
+        // calls f(DISPID) in ascending order, dispid_unknown not included
+        template <class F>
+        void ForEach(F&& f) const
+        {
+            auto high = std::lower_bound(other_.cbegin(), other_.cend(), bitset_size);
+            for (auto it = other_.cbegin(); it != high; ++it)
+                f(*it);
+
+            for (int32_t dispId = 0; dispId < bitset_size; ++dispId)
+                if (low_.test((size_t)dispId))
+                    f(dispId);
+
+            for (auto it = high; it != other_.cend(); ++it)
+                f(*it);
+        }
+
+        // keeps the capacity
+        void Clear()
+        {
+            low_.reset();
+            other_.clear();
+            size_ = 0;
+            all_ = false;
+        }
+
+        void Swap(dirty_properties& other) noexcept
+        {
+            std::swap(low_, other.low_);
+            other_.swap(other.other_);
+            std::swap(size_, other.size_);
+            std::swap(all_, other.all_);
+        }
+    };
+
+    // aggregates the notifications of the attached objects: the properties
+    // changed since the last flush are delivered in one callback per object.
+    // Flushes run once per interval on the batcher's thread, or on Flush.
+    // Objects must not be detached by the callback
+    class property_batcher
+    {
+    public:
+
+        // an object reporting its changes, see Attach
+        class watched_object
+        {
+            friend class property_batcher;
+
+            void *context_;
+            std::mutex mutex_;
+            dirty_properties dirty_;
+            // in pending_
+            bool queued_ = false;
+            bool detached_ = false;
+
+        public:
+
+            explicit watched_object(void *context)
+                : context_(context)
+            {
+            }
+
+            void* Context() const
+            {
+                return context_;
+            }
+        };
+
+    private:
+
+        std::function<void(void *context, const dirty_properties& changed)> onFlush_;
+        std::chrono::nanoseconds interval_;
+
+        // objects with changes, each once
+        std::vector<std::shared_ptr<watched_object>> pending_;
+        std::mutex mutexPending_;
+
+        // one flush at a time, keeps the deliveries of an object in order
+        std::mutex mutexFlush_;
+        std::vector<std::shared_ptr<watched_object>> flushing_;
+        dirty_properties delivered_;
+
+        std::atomic<uint64_t> numChanges_ = 0;
+        std::atomic<uint64_t> numDeliveries_ = 0;
+
+        std::mutex mutexStop_;
+        std::condition_variable stopping_;
+        bool stop_ = false;
+        std::thread flusher_;
+
+    public:
+
+        // onFlush is called with the context of the object and its changed properties
+        explicit property_batcher(std::function<void(void *context, const dirty_properties& changed)> onFlush,
+            std::chrono::nanoseconds interval = std::chrono::milliseconds(100))
+            : onFlush_(std::move(onFlush)),
+            interval_(interval)
+        {
+            assert(onFlush_ && "Invalid flush callback!");
+
+            flusher_ = std::thread(&property_batcher::run_flusher, this);
+        }
+
+        property_batcher(const property_batcher&) = delete;
+        property_batcher& operator=(const property_batcher&) = delete;
+
+        // the object is delivered with its context until Detach
+        std::shared_ptr<watched_object> Attach(void *context)
+        {
+            return std::make_shared<watched_object>(context);
+        }
+
+        // records the change for the next flush
+        void Changed(const std::shared_ptr<watched_object>& object, int32_t dispId)
+        {
+            numChanges_.fetch_add(1, std::memory_order_relaxed);
+
+            {
+                std::lock_guard<std::mutex> lock(object->mutex_);
+                object->dirty_.Add(dispId);
+                if (object->queued_ || object->detached_)
+                    return;
+                object->queued_ = true;
+            }
+
+            std::lock_guard<std::mutex> lock(mutexPending_);
+            pending_.push_back(object);
+        }
+
+        // no callback is running nor will be called for the object on return
+        void Detach(watched_object& object)
+        {
+            {
+                std::lock_guard<std::mutex> lock(object.mutex_);
+                object.detached_ = true;
+            }
+
+            // waits for a delivery in progress
+            std::lock_guard<std::mutex> flushLock(mutexFlush_);
+        }
+
+        // delivers the pending changes on the calling thread
+        void Flush()
+        {
+            std::lock_guard<std::mutex> flushLock(mutexFlush_);
+
+            {
+                std::lock_guard<std::mutex> lock(mutexPending_);
+                flushing_.swap(pending_);
+            }
+
+            for (const std::shared_ptr<watched_object>& object : flushing_)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(object->mutex_);
+                    object->queued_ = false;
+                    if (object->detached_)
+                        continue;
+                    // the object keeps the capacity of the previous delivery
+                    delivered_.Swap(object->dirty_);
+                }
+
+                if (delivered_.Empty())
+                    continue;
+
+                numDeliveries_.fetch_add(1, std::memory_order_relaxed);
+                try
+                {
+                    onFlush_(object->context_, delivered_);
+                }
+                catch (...)
+                {
+                    // the other objects are still delivered
+                }
+
+                delivered_.Clear();
+            }
+
+            flushing_.clear();
+        }
+
+        // changes recorded
+        uint64_t NumChanges() const
+        {
+            return numChanges_.load(std::memory_order_relaxed);
+        }
+
+        // callbacks called
+        uint64_t NumDeliveries() const
+        {
+            return numDeliveries_.load(std::memory_order_relaxed);
+        }
+
+        ~property_batcher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutexStop_);
+                stop_ = true;
+            }
+            stopping_.notify_one();
+
+            flusher_.join();
+        }
+
+    private:
+
+        void run_flusher()
+        {
+            std::unique_lock<std::mutex> lock(mutexStop_);
+            while (!stopping_.wait_for(lock, interval_, [this]() { return stop_; }))
+            {
+                lock.unlock();
+                Flush();
+                lock.lock();
+            }
+        }
+    };
+}
@@ -0,0 +1,250 @@
+﻿#pragma once
+
+// releases handed over to a background thread, for threads which must not wait
+// for them, e.g. final releases of out-of-process proxies, each a round trip
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace cmw
+{
+    // Push never blocks nor allocates: the releases are taken from a pool of nodes
+    // allocated with the queue, linked into a lock-free stack and taken by the worker
+    // in batches, in the order they were pushed. When the pool is exhausted
+    // the release is made in place
+    class release_queue
+    {
+        struct node
+        {
+            void *object = nullptr;
+            void (*release)(void*) = nullptr;
+            // set for the barriers of Flush, which have no object
+            bool *flushed = nullptr;
+            node *next = nullptr;
+            // 1-based index of the next free node, 0 ends the list
+            std::atomic<uint32_t> nextFree = 0;
+        };
+
+        std::unique_ptr<node[]> nodes_;
+        // 1-based index of the first free node in the low half, tag against ABA in the high one
+        std::atomic<uint64_t> free_ = 0;
+
+        std::atomic<node*> head_ = nullptr;
+
+        std::atomic<uint64_t> pushed_ = 0;
+        std::atomic<uint64_t> released_ = 0;
+        std::atomic<uint64_t> inPlace_ = 0;
+
+        // set by the worker before it waits, cleared by the push waking it
+        std::atomic<bool> sleeping_ = false;
+
+        std::mutex mutex_;
+        std::condition_variable hasWork_;
+        std::condition_variable flushed_;
+        bool stop_ = false;
+
+        std::function<void()> threadInit_;
+        std::thread worker_;
+
+    public:
+
+        constexpr static size_t default_capacity = 4096;
+
+        // a wakeup racing with the worker going to sleep is caught by its next check
+        constexpr static std::chrono::milliseconds idle_check{ 10 };
+
+        // threadInit runs first on the worker, e.g. to initialize COM.
+        // capacity is the number of releases which may be pending
+        explicit release_queue(std::function<void()> threadInit = nullptr,
+            size_t capacity = default_capacity)
+            : nodes_(new node[std::max<size_t>(capacity, 1)]),
+            threadInit_(std::move(threadInit))
+        {
+            capacity = std::max<size_t>(capacity, 1);
+            assert(capacity < UINT32_MAX && "Capacity too large!");
+
+            for (size_t i = 0; i + 1 < capacity; ++i)
+                nodes_[i].nextFree.store((uint32_t)i + 2, std::memory_order_relaxed);
+            free_.store(1, std::memory_order_relaxed);
+
+            worker_ = std::thread(&release_queue::run, this);
+        }
+
+        release_queue(const release_queue&) = delete;
+        release_queue& operator=(const release_queue&) = delete;
+
+        // releases everything pushed, then stops the worker
+        ~release_queue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            hasWork_.notify_one();
+
+            worker_.join();
+        }
+
+        // takes over the reference. Released right away if no node is free
+        template <class T>
+        void Push(T *owned) noexcept
+        {
+            if (!owned)
+                return;
+
+            node *n = take_node();
+            if (!n)
+            {
+                inPlace_.fetch_add(1, std::memory_order_relaxed);
+                owned->Release();
+                return;
+            }
+
+            n->object = owned;
+            n->release = [](void *object) { static_cast<T*>(object)->Release(); };
+
+            pushed_.fetch_add(1, std::memory_order_relaxed);
+            link(n);
+        }
+
+        // waits till everything pushed before the call is released.
+        // Must not be called by the releases themselves
+        void Flush()
+        {
+            assert(std::this_thread::get_id() != worker_.get_id() && "Flush from the release thread!");
+
+            bool flushed = false;
+            node barrier;
+            barrier.flushed = &flushed;
+            link(&barrier);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            flushed_.wait(lock, [&flushed]() { return flushed; });
+        }
+
+        uint64_t Pending() const
+        {
+            return pushed_.load(std::memory_order_relaxed) - released_.load(std::memory_order_relaxed);
+        }
+
+        uint64_t Released() const
+        {
+            return released_.load(std::memory_order_relaxed);
+        }
+
+        // pushes released by the caller because the pool was exhausted
+        uint64_t InPlace() const
+        {
+            return inPlace_.load(std::memory_order_relaxed);
+        }
+
+    private:
+
+        node* take_node() noexcept
+        {
+            uint64_t top = free_.load(std::memory_order_acquire);
+            while (uint32_t index = (uint32_t)top)
+            {
+                node *n = &nodes_[index - 1];
+                uint64_t next = ((top >> 32) + 1) << 32 | n->nextFree.load(std::memory_order_relaxed);
+                if (free_.compare_exchange_weak(top, next,
+                    std::memory_order_acquire, std::memory_order_acquire))
+                    return n;
+            }
+            return nullptr;
+        }
+
+        void return_node(node *n) noexcept
+        {
+            uint32_t index = (uint32_t)(n - nodes_.get()) + 1;
+            uint64_t top = free_.load(std::memory_order_relaxed);
+            uint64_t next;
+            do
+            {
+                n->nextFree.store((uint32_t)top, std::memory_order_relaxed);
+                next = ((top >> 32) + 1) << 32 | index;
+            } while (!free_.compare_exchange_weak(top, next,
+                std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        void link(node *n) noexcept
+        {
+            node *head = head_.load(std::memory_order_relaxed);
+            do
+            {
+                n->next = head;
+            } while (!head_.compare_exchange_weak(head, n,
+                std::memory_order_seq_cst, std::memory_order_relaxed));
+
+            // either the worker sees the push before it waits or the push sees it waiting
+            if (sleeping_.load(std::memory_order_seq_cst) && sleeping_.exchange(false))
+                hasWork_.notify_one();
+        }
+
+        void run()
+        {
+            if (threadInit_)
+                threadInit_();
+
+            while (true)
+            {
+                node *batch = head_.exchange(nullptr, std::memory_order_acquire);
+                if (!batch)
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    sleeping_.store(true, std::memory_order_seq_cst);
+                    hasWork_.wait_for(lock, idle_check, [this]()
+                    {
+                        return stop_ || head_.load(std::memory_order_seq_cst);
+                    });
+                    sleeping_.store(false, std::memory_order_relaxed);
+
+                    if (stop_ && !head_.load(std::memory_order_relaxed))
+                        return;
+
+                    continue;
+                }
+
+                // the stack holds the last push first
+                node *ordered = nullptr;
+                while (batch)
+                {
+                    node *next = batch->next;
+                    batch->next = ordered;
+                    ordered = batch;
+                    batch = next;
+                }
+
+                while (ordered)
+                {
+                    node *n = ordered;
+                    ordered = n->next;
+
+                    if (n->flushed)
+                    {
+                        // the barrier belongs to the flushing thread, which may return at once
+                        {
+                            std::lock_guard<std::mutex> lock(mutex_);
+                            *n->flushed = true;
+                        }
+                        flushed_.notify_all();
+                        continue;
+                    }
+
+                    n->release(n->object);
+                    return_node(n);
+
+                    released_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+    };
+}
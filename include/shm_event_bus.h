@@ -0,0 +1,871 @@
+﻿#pragma once
+
+// fan-out of sink events to the processes of one host through shared memory
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cmw
+{
+    // VARTYPE values of the arguments which can be flattened
+    enum class flat_vt : uint16_t
+    {
+        empty = 0,
+        i2 = 2,
+        i4 = 3,
+        r4 = 4,
+        r8 = 5,
+        date = 7,
+        bstr = 8,
+        error = 10,
+        boolean = 11,
+        i1 = 16,
+        ui1 = 17,
+        ui2 = 18,
+        ui4 = 19,
+        i8 = 20,
+        ui8 = 21,
+        integer = 22,
+        uinteger = 23
+    };
+
+    // pointer-free encoding of one Invoke call:
+    // flat_event_header, numArgs flat_arg records, then the string characters.
+    // Arguments keep the declaration order, unlike DISPPARAMS::rgvarg
+    struct flat_event_header
+    {
+        int32_t dispId;
+        uint16_t flags;
+        uint16_t numArgs;
+        uint32_t size;
+        uint32_t reserved;
+    };
+
+    struct flat_arg
+    {
+        flat_vt vt;
+        uint16_t reserved;
+        // characters of a string
+        uint32_t length;
+        union
+        {
+            int64_t i;
+            double r;
+            // of the string, from the beginning of the event
+            uint64_t offset;
+        };
+    };
+
+    static_assert(sizeof(flat_event_header) == 16 && sizeof(flat_arg) == 16,
+        "Flat encoding must not depend on the compiler!");
+
+    // read-only view of an encoded event. Valid during the callback only:
+    // the memory belongs to the bus. Arguments and strings are read within
+    // the bytes given, which the publisher may overwrite meanwhile
+    class flat_event
+    {
+        const uint8_t *data_;
+        size_t bound_;
+
+    public:
+
+        // trusts the size in the header, e.g. for events of flat_event_builder
+        explicit flat_event(const uint8_t *data)
+            : data_(data),
+            bound_(reinterpret_cast<const flat_event_header*>(data)->size)
+        {}
+
+        // bound: bytes readable from data, at least the header
+        flat_event(const uint8_t *data, size_t bound)
+            : data_(data),
+            bound_(bound)
+        {}
+
+        const flat_event_header& Header() const
+        {
+            return *reinterpret_cast<const flat_event_header*>(data_);
+        }
+
+        int32_t DispID() const
+        {
+            return Header().dispId;
+        }
+
+        uint16_t Flags() const
+        {
+            return Header().flags;
+        }
+
+        // the arguments within the bound
+        size_t NumArgs() const
+        {
+            return std::min<size_t>(Header().numArgs,
+                (bound_ - sizeof(flat_event_header)) / sizeof(flat_arg));
+        }
+
+        // in declaration order
+        const flat_arg& Arg(size_t i) const
+        {
+            return reinterpret_cast<const flat_arg*>(data_ + sizeof(flat_event_header))[i];
+        }
+
+        // empty if the characters are not within the bound
+        std::u16string_view String(size_t i) const
+        {
+            const flat_arg& arg = Arg(i);
+            if (arg.vt != flat_vt::bstr)
+                return std::u16string_view();
+
+            // read once: a torn record may change them between the check and the use
+            uint64_t offset = arg.offset;
+            uint64_t length = arg.length;
+            if (offset < sizeof(flat_event_header) || offset > bound_ || offset % sizeof(char16_t) ||
+                length > (bound_ - offset) / sizeof(char16_t))
+                return std::u16string_view();
+
+            return std::u16string_view(
+                reinterpret_cast<const char16_t*>(data_ + offset), (size_t)length);
+        }
+
+        size_t Size() const
+        {
+            return Header().size;
+        }
+    };
+
+    // encodes an event into a reusable buffer
+    class flat_event_builder
+    {
+        std::vector<flat_arg> args_;
+        std::u16string chars_;
+        flat_event_header header_{};
+        std::vector<uint8_t> buffer_;
+
+    public:
+
+        void Reset(int32_t dispId, uint16_t flags)
+        {
+            args_.clear();
+            chars_.clear();
+            header_ = flat_event_header{ dispId, flags, 0, 0, 0 };
+        }
+
+        void AddInt(flat_vt vt, int64_t value)
+        {
+            flat_arg arg{ vt, 0, 0, {} };
+            arg.i = value;
+            args_.push_back(arg);
+        }
+
+        void AddReal(flat_vt vt, double value)
+        {
+            flat_arg arg{ vt, 0, 0, {} };
+            arg.r = value;
+            args_.push_back(arg);
+        }
+
+        // the offset is fixed by Encode
+        void AddString(const char16_t *chars, size_t length)
+        {
+            flat_arg arg{ flat_vt::bstr, 0, (uint32_t)length, {} };
+            arg.offset = chars_.size();
+            args_.push_back(arg);
+            chars_.append(chars, length);
+        }
+
+        // arguments which can not leave the process, e.g. interfaces
+        void AddEmpty()
+        {
+            args_.push_back(flat_arg{ flat_vt::empty, 0, 0, {} });
+        }
+
+        // the buffer is reused by the next Encode
+        std::pair<const uint8_t*, size_t> Encode()
+        {
+            size_t stringsAt = sizeof(flat_event_header) + args_.size() * sizeof(flat_arg);
+            size_t size = stringsAt + chars_.size() * sizeof(char16_t);
+
+            header_.numArgs = (uint16_t)args_.size();
+            header_.size = (uint32_t)size;
+
+            buffer_.resize(size);
+            std::memcpy(buffer_.data(), &header_, sizeof(header_));
+
+            flat_arg *args = reinterpret_cast<flat_arg*>(buffer_.data() + sizeof(header_));
+            for (size_t i = 0; i < args_.size(); ++i)
+            {
+                args[i] = args_[i];
+                if (args[i].vt == flat_vt::bstr)
+                    args[i].offset = stringsAt + args_[i].offset * sizeof(char16_t);
+            }
+
+            if (!chars_.empty())
+                std::memcpy(buffer_.data() + stringsAt, chars_.data(),
+                    chars_.size() * sizeof(char16_t));
+
+            return { buffer_.data(), size };
+        }
+    };
+
+    // named shared memory mapping. The creator removes the name on destruction
+    class shm_segment
+    {
+        void *address_ = nullptr;
+        size_t size_ = 0;
+        std::string name_;
+        bool owner_ = false;
+#ifdef _WIN32
+        HANDLE mapping_ = nullptr;
+#endif
+
+    public:
+
+        shm_segment() = default;
+
+        shm_segment(const shm_segment&) = delete;
+        shm_segment& operator=(const shm_segment&) = delete;
+
+        // nullptr on failure. create: fails if the name already exists
+        static std::unique_ptr<shm_segment> Open(const std::string& name, size_t size, bool create)
+        {
+            std::unique_ptr<shm_segment> segment(new shm_segment());
+            segment->name_ = name;
+            segment->size_ = size;
+            segment->owner_ = create;
+
+#ifdef _WIN32
+            std::wstring wname(name.begin(), name.end());
+            segment->mapping_ = create ?
+                CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                    (DWORD)((uint64_t)size >> 32), (DWORD)size, wname.c_str()) :
+                OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, wname.c_str());
+            if (!segment->mapping_ || (create && GetLastError() == ERROR_ALREADY_EXISTS))
+                return nullptr;
+
+            segment->address_ = MapViewOfFile(segment->mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size);
+            if (!segment->address_)
+                return nullptr;
+#else
+            std::string path = name.empty() || name[0] != '/' ? "/" + name : name;
+            segment->name_ = path;
+            int fd = shm_open(path.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+            if (fd < 0)
+            {
+                segment->owner_ = false;
+                return nullptr;
+            }
+
+            if (create && ftruncate(fd, (off_t)size) != 0)
+            {
+                close(fd);
+                return nullptr;
+            }
+
+            void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (address == MAP_FAILED)
+                return nullptr;
+
+            segment->address_ = address;
+#endif
+
+            return segment;
+        }
+
+        void* Address() const
+        {
+            return address_;
+        }
+
+        size_t Size() const
+        {
+            return size_;
+        }
+
+        ~shm_segment()
+        {
+#ifdef _WIN32
+            if (address_)
+                UnmapViewOfFile(address_);
+            if (mapping_)
+                CloseHandle(mapping_);
+#else
+            if (address_)
+                munmap(address_, size_);
+            if (owner_)
+                shm_unlink(name_.c_str());
+#endif
+        }
+    };
+
+    enum class bus_overflow
+    {
+        // the publisher waits for the subscribers, up to the slow consumer timeout
+        block,
+        // the event is dropped. Subscribers keeping the ring full longer than the
+        // slow consumer timeout are evicted, as with block
+        drop
+    };
+
+    // shared layout. Positions are byte counters which never wrap
+    namespace shm_bus_layout
+    {
+        constexpr uint64_t magic = 0x31535542574d43ull; // "CMWBUS1"
+
+        enum slot_state : uint32_t
+        {
+            slot_free = 0,
+            slot_joining,
+            slot_active,
+            // too slow: the publisher stopped waiting for it
+            slot_evicted
+        };
+
+        struct alignas(64) subscriber_slot
+        {
+            std::atomic<uint32_t> state;
+            std::atomic<uint64_t> readPos;
+        };
+
+        struct alignas(64) header
+        {
+            uint64_t magic;
+            uint64_t capacity;
+            uint32_t maxSubscribers;
+            alignas(64) std::atomic<uint64_t> writePos;
+            std::atomic<uint64_t> published;
+            std::atomic<uint64_t> dropped;
+            std::atomic<uint64_t> evicted;
+        };
+
+        // every record starts with it. Size includes the prefix, 8-byte aligned
+        struct record_prefix
+        {
+            uint32_t size;
+            // filler up to the end of the ring
+            uint32_t padding;
+        };
+
+        static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+            std::atomic<uint32_t>::is_always_lock_free,
+            "Shared memory requires address-free atomics!");
+
+        inline size_t segment_size(size_t capacity, size_t maxSubscribers)
+        {
+            return sizeof(header) + maxSubscribers * sizeof(subscriber_slot) + capacity;
+        }
+
+        inline subscriber_slot* slots(void *base)
+        {
+            return reinterpret_cast<subscriber_slot*>(static_cast<uint8_t*>(base) + sizeof(header));
+        }
+
+        inline uint8_t* ring(void *base, size_t maxSubscribers)
+        {
+            return static_cast<uint8_t*>(base) + sizeof(header) +
+                maxSubscribers * sizeof(subscriber_slot);
+        }
+    }
+
+    // single publisher, many subscribers, every subscriber receives every event.
+    // A subscriber which keeps the ring full longer than the slow consumer timeout
+    // is evicted, so one stuck process can not stop the others
+    class shm_event_bus
+    {
+        std::unique_ptr<shm_segment> segment_;
+        shm_bus_layout::header *header_ = nullptr;
+        shm_bus_layout::subscriber_slot *slots_ = nullptr;
+        uint8_t *ring_ = nullptr;
+
+        bus_overflow overflow_;
+        std::chrono::milliseconds slowTimeout_;
+
+        // drop mode: since when the events are dropped for lack of space
+        std::chrono::steady_clock::time_point fullSince_;
+        bool full_ = false;
+
+    public:
+
+        // capacity in bytes, rounded up to a power of two. nullptr if the name is taken
+        static std::unique_ptr<shm_event_bus> Create(const std::string& name,
+            size_t capacity = 1 << 20, size_t maxSubscribers = 16,
+            bus_overflow overflow = bus_overflow::block,
+            std::chrono::milliseconds slowTimeout = std::chrono::milliseconds(100))
+        {
+            size_t pow2 = 64;
+            while (pow2 < capacity)
+                pow2 <<= 1;
+
+            std::unique_ptr<shm_segment> segment = shm_segment::Open(name,
+                shm_bus_layout::segment_size(pow2, maxSubscribers), true);
+            if (!segment)
+                return nullptr;
+
+            std::unique_ptr<shm_event_bus> bus(new shm_event_bus(std::move(segment),
+                overflow, slowTimeout));
+
+            void *base = bus->segment_->Address();
+            bus->header_ = new (base) shm_bus_layout::header();
+            bus->slots_ = shm_bus_layout::slots(base);
+            bus->ring_ = shm_bus_layout::ring(base, maxSubscribers);
+
+            for (size_t i = 0; i < maxSubscribers; ++i)
+                new (&bus->slots_[i]) shm_bus_layout::subscriber_slot{};
+
+            bus->header_->capacity = pow2;
+            bus->header_->maxSubscribers = (uint32_t)maxSubscribers;
+            // subscribers check it last
+            std::atomic_thread_fence(std::memory_order_release);
+            bus->header_->magic = shm_bus_layout::magic;
+
+            return bus;
+        }
+
+        shm_event_bus(const shm_event_bus&) = delete;
+        shm_event_bus& operator=(const shm_event_bus&) = delete;
+
+        // false if the event is dropped. Not thread safe: one publishing thread
+        bool Publish(const uint8_t *data, size_t size)
+        {
+            using namespace shm_bus_layout;
+
+            uint64_t capacity = header_->capacity;
+            uint64_t recordSize = (sizeof(record_prefix) + size + 7) & ~uint64_t(7);
+            if (recordSize > capacity / 2)
+            {
+                header_->dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            uint64_t writePos = header_->writePos.load(std::memory_order_relaxed);
+            uint64_t offset = writePos & (capacity - 1);
+            uint64_t filler = offset + recordSize > capacity ? capacity - offset : 0;
+            uint64_t needed = filler + recordSize;
+
+            if (!wait_for_space(writePos + needed))
+            {
+                header_->dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            if (filler)
+            {
+                record_prefix pad{ (uint32_t)filler, 1 };
+                std::memcpy(ring_ + offset, &pad, sizeof(pad));
+                writePos += filler;
+                offset = 0;
+            }
+
+            record_prefix prefix{ (uint32_t)recordSize, 0 };
+            std::memcpy(ring_ + offset, &prefix, sizeof(prefix));
+            std::memcpy(ring_ + offset + sizeof(prefix), data, size);
+
+            header_->writePos.store(writePos + recordSize, std::memory_order_release);
+            header_->published.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool Publish(flat_event_builder& event)
+        {
+            std::pair<const uint8_t*, size_t> encoded = event.Encode();
+            return Publish(encoded.first, encoded.second);
+        }
+
+        uint64_t Published() const
+        {
+            return header_->published.load(std::memory_order_relaxed);
+        }
+
+        uint64_t Dropped() const
+        {
+            return header_->dropped.load(std::memory_order_relaxed);
+        }
+
+        // subscribers evicted as slow consumers
+        uint64_t Evicted() const
+        {
+            return header_->evicted.load(std::memory_order_relaxed);
+        }
+
+        size_t NumSubscribers() const
+        {
+            size_t n = 0;
+            for (size_t i = 0; i < header_->maxSubscribers; ++i)
+                if (slots_[i].state.load(std::memory_order_acquire) == shm_bus_layout::slot_active)
+                    ++n;
+            return n;
+        }
+
+    private:
+
+        shm_event_bus(std::unique_ptr<shm_segment>&& segment, bus_overflow overflow,
+            std::chrono::milliseconds slowTimeout)
+            : segment_(std::move(segment)),
+            overflow_(overflow),
+            slowTimeout_(slowTimeout)
+        {}
+
+        // position of the slowest active subscriber
+        uint64_t min_read_pos(uint64_t writePos) const
+        {
+            uint64_t minPos = writePos;
+            for (size_t i = 0; i < header_->maxSubscribers; ++i)
+            {
+                if (slots_[i].state.load(std::memory_order_acquire) != shm_bus_layout::slot_active)
+                    continue;
+
+                uint64_t readPos = slots_[i].readPos.load(std::memory_order_acquire);
+                if (readPos < minPos)
+                    minPos = readPos;
+            }
+            return minPos;
+        }
+
+        // evicts the subscribers still holding the space when the wait is over
+        bool wait_for_space(uint64_t endPos)
+        {
+            uint64_t capacity = header_->capacity;
+            uint64_t writePos = header_->writePos.load(std::memory_order_relaxed);
+
+            if (endPos - min_read_pos(writePos) <= capacity)
+            {
+                full_ = false;
+                return true;
+            }
+
+            if (overflow_ == bus_overflow::drop)
+            {
+                // the events are dropped till the slow subscribers are evicted
+                auto now = std::chrono::steady_clock::now();
+                if (!full_)
+                {
+                    full_ = true;
+                    fullSince_ = now;
+                }
+
+                if (now - fullSince_ < slowTimeout_)
+                    return false;
+
+                full_ = false;
+                evict_blocking(endPos);
+                return true;
+            }
+
+            auto deadline = std::chrono::steady_clock::now() + slowTimeout_;
+            while (std::chrono::steady_clock::now() < deadline)
+            {
+                std::this_thread::yield();
+                if (endPos - min_read_pos(writePos) <= capacity)
+                    return true;
+            }
+
+            evict_blocking(endPos);
+            return true;
+        }
+
+        // subscribers whose unread events would be overwritten up to endPos
+        void evict_blocking(uint64_t endPos)
+        {
+            uint64_t capacity = header_->capacity;
+
+            for (size_t i = 0; i < header_->maxSubscribers; ++i)
+            {
+                shm_bus_layout::subscriber_slot& slot = slots_[i];
+                if (slot.state.load(std::memory_order_acquire) != shm_bus_layout::slot_active ||
+                    endPos - slot.readPos.load(std::memory_order_acquire) <= capacity)
+                    continue;
+
+                uint32_t active = shm_bus_layout::slot_active;
+                if (slot.state.compare_exchange_strong(active, shm_bus_layout::slot_evicted,
+                    std::memory_order_acq_rel))
+                    header_->evicted.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    struct bus_subscription
+    {
+        int32_t dispId;
+        size_t id;
+    };
+
+    // receiving side of shm_event_bus. Events are read in place: callbacks get
+    // a view into the ring, which is released when they return. Once evicted,
+    // the event being handled may be overwritten by the publisher.
+    // Registration and Poll must be called from the same thread
+    class shm_event_subscriber
+    {
+        using callback = std::function<void(const flat_event&)>;
+
+        std::unique_ptr<shm_segment> segment_;
+        shm_bus_layout::header *header_ = nullptr;
+        shm_bus_layout::subscriber_slot *slot_ = nullptr;
+        uint8_t *ring_ = nullptr;
+
+        // replaced on every change: a callback may register or remove
+        // callbacks while the ones of its event are being called
+        using subscribers = std::vector<std::pair<size_t, callback>>;
+        std::unordered_map<int32_t, std::shared_ptr<const subscribers>> callbacks_;
+        size_t nextId_ = 1;
+        // counts RemoveCallback
+        size_t removals_ = 0;
+
+    public:
+
+        // nullptr if the bus does not exist or has no free subscriber slot
+        static std::unique_ptr<shm_event_subscriber> Open(const std::string& name)
+        {
+            using namespace shm_bus_layout;
+
+            // the size is known only from the header
+            std::unique_ptr<shm_segment> probe = shm_segment::Open(name, sizeof(header), false);
+            if (!probe)
+                return nullptr;
+
+            const header *h = static_cast<const header*>(probe->Address());
+            if (h->magic != magic)
+                return nullptr;
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            size_t size = segment_size(h->capacity, h->maxSubscribers);
+            probe.reset();
+
+            std::unique_ptr<shm_segment> segment = shm_segment::Open(name, size, false);
+            if (!segment)
+                return nullptr;
+
+            std::unique_ptr<shm_event_subscriber> subscriber(new shm_event_subscriber());
+            subscriber->header_ = static_cast<header*>(segment->Address());
+            subscriber->ring_ = ring(segment->Address(), subscriber->header_->maxSubscribers);
+            subscriber->segment_ = std::move(segment);
+
+            subscriber_slot *s = slots(subscriber->segment_->Address());
+            for (size_t i = 0; i < subscriber->header_->maxSubscribers; ++i)
+            {
+                uint32_t free = slot_free;
+                if (s[i].state.compare_exchange_strong(free, slot_joining, std::memory_order_acq_rel))
+                {
+                    subscriber->slot_ = &s[i];
+                    subscriber->join();
+                    return subscriber;
+                }
+            }
+
+            return nullptr;
+        }
+
+        shm_event_subscriber(const shm_event_subscriber&) = delete;
+        shm_event_subscriber& operator=(const shm_event_subscriber&) = delete;
+
+        // may be called by a callback, the new one receives the next events
+        bus_subscription SetCallback(int32_t dispId, callback&& fn)
+        {
+            bus_subscription handle{ dispId, nextId_++ };
+
+            std::shared_ptr<const subscribers>& current = callbacks_[dispId];
+            auto changed = current ? std::make_shared<subscribers>(*current) : std::make_shared<subscribers>();
+            changed->emplace_back(handle.id, std::move(fn));
+            current = std::move(changed);
+
+            return handle;
+        }
+
+        // may be called by a callback, the removed one is not called afterwards
+        bool RemoveCallback(const bus_subscription& handle)
+        {
+            auto found = callbacks_.find(handle.dispId);
+            if (found == callbacks_.end())
+                return false;
+
+            const subscribers& current = *found->second;
+            auto it = std::find_if(current.cbegin(), current.cend(),
+                [&handle](const auto& s) { return s.first == handle.id; });
+            if (it == current.cend())
+                return false;
+
+            ++removals_;
+            if (current.size() == 1)
+            {
+                callbacks_.erase(found);
+                return true;
+            }
+
+            auto changed = std::make_shared<subscribers>();
+            changed->reserve(current.size() - 1);
+            for (const auto& s : current)
+                if (s.first != handle.id)
+                    changed->push_back(s);
+            found->second = std::move(changed);
+
+            return true;
+        }
+
+        // runs the callbacks of up to maxEvents pending events. Returns the number
+        // of events read, including those without callbacks.
+        // Records are validated before use: once evicted, the publisher may overwrite
+        // them at any time. An invalid record evicts the subscriber
+        size_t Poll(size_t maxEvents = (std::numeric_limits<size_t>::max)())
+        {
+            using namespace shm_bus_layout;
+
+            uint64_t capacity = header_->capacity;
+            uint64_t readPos = slot_->readPos.load(std::memory_order_relaxed);
+            uint64_t writePos = header_->writePos.load(std::memory_order_acquire);
+
+            size_t n = 0;
+            while (readPos != writePos && n < maxEvents)
+            {
+                if (IsEvicted())
+                    break;
+
+                if (writePos - readPos > capacity)
+                {
+                    evict();
+                    break;
+                }
+
+                uint64_t offset = readPos & (capacity - 1);
+                const uint8_t *record = ring_ + offset;
+
+                record_prefix prefix;
+                std::memcpy(&prefix, record, sizeof(prefix));
+
+                if (!valid_record(prefix, record, offset, writePos - readPos))
+                {
+                    evict();
+                    break;
+                }
+
+                if (!prefix.padding)
+                {
+                    flat_event event(record + sizeof(record_prefix), prefix.size - sizeof(record_prefix));
+                    dispatch(event);
+                    ++n;
+                }
+
+                readPos += prefix.size;
+                // the publisher may reuse the space from now on
+                slot_->readPos.store(readPos, std::memory_order_release);
+            }
+
+            return n;
+        }
+
+        // bytes published but not read yet
+        uint64_t Lag() const
+        {
+            return header_->writePos.load(std::memory_order_acquire) -
+                slot_->readPos.load(std::memory_order_relaxed);
+        }
+
+        // the publisher stopped waiting for this subscriber, events were lost
+        bool IsEvicted() const
+        {
+            return slot_->state.load(std::memory_order_acquire) == shm_bus_layout::slot_evicted;
+        }
+
+        // continues from the latest event after an eviction
+        void Rejoin()
+        {
+            uint32_t evicted = shm_bus_layout::slot_evicted;
+            if (slot_->state.compare_exchange_strong(evicted, shm_bus_layout::slot_joining,
+                std::memory_order_acq_rel))
+                join();
+        }
+
+        ~shm_event_subscriber()
+        {
+            if (slot_)
+                slot_->state.store(shm_bus_layout::slot_free, std::memory_order_release);
+        }
+
+    private:
+
+        shm_event_subscriber() = default;
+
+        // the record fits the ring and the unread bytes, the event fits the record
+        bool valid_record(const shm_bus_layout::record_prefix& prefix, const uint8_t *record,
+            uint64_t offset, uint64_t unread) const
+        {
+            using namespace shm_bus_layout;
+
+            uint64_t capacity = header_->capacity;
+            if (prefix.size < sizeof(record_prefix) || prefix.size % 8 ||
+                prefix.size > capacity - offset || prefix.size > unread)
+                return false;
+
+            if (prefix.padding)
+                return true;
+
+            uint64_t available = prefix.size - sizeof(record_prefix);
+            if (available < sizeof(flat_event_header))
+                return false;
+
+            flat_event_header event;
+            std::memcpy(&event, record + sizeof(record_prefix), sizeof(event));
+            return event.size <= available &&
+                sizeof(flat_event_header) + (uint64_t)event.numArgs * sizeof(flat_arg) <= event.size;
+        }
+
+        void evict()
+        {
+            uint32_t active = shm_bus_layout::slot_active;
+            slot_->state.compare_exchange_strong(active, shm_bus_layout::slot_evicted,
+                std::memory_order_acq_rel);
+        }
+
+        void join()
+        {
+            slot_->readPos.store(header_->writePos.load(std::memory_order_acquire),
+                std::memory_order_release);
+            slot_->state.store(shm_bus_layout::slot_active, std::memory_order_release);
+            // the publisher may have moved on before it saw the slot
+            slot_->readPos.store(header_->writePos.load(std::memory_order_acquire),
+                std::memory_order_release);
+        }
+
+        void dispatch(const flat_event& event)
+        {
+            auto found = callbacks_.find(event.DispID());
+            if (found == callbacks_.end())
+                return;
+
+            // the callbacks may replace the table
+            std::shared_ptr<const subscribers> current = found->second;
+            size_t removals = removals_;
+            for (const auto& subscriber : *current)
+                if (removals == removals_ || registered(event.DispID(), subscriber.first))
+                    subscriber.second(event);
+        }
+
+        // not removed by an earlier callback of the same event
+        bool registered(int32_t dispId, size_t id) const
+        {
+            auto found = callbacks_.find(dispId);
+            return found != callbacks_.end() && std::any_of(found->second->cbegin(), found->second->cend(),
+                [id](const auto& s) { return s.first == id; });
+        }
+    };
+}
@@ -0,0 +1,80 @@
+﻿#pragma once
+
+// per-thread slots of the lock-free readers, shared by hazard_pointers,
+// epoch_reclamation and callback_watchdog. A thread claims an index on first use
+// and releases it at thread exit; the tables indexed by it keep an entry per
+// cache line, so the threads writing their own entries do not share lines
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace cmw
+{
+    constexpr size_t cache_line_size = 64;
+
+    // entry of a per-thread table, alone on its cache line
+    template <class T>
+    struct alignas(cache_line_size) cache_padded
+    {
+        T value{};
+    };
+
+    class thread_slots
+    {
+    public:
+
+        constexpr static size_t max_threads = 256;
+
+        constexpr static size_t no_slot = SIZE_MAX;
+
+        // index of the calling thread, below max_threads.
+        // no_slot if every index is taken
+        static size_t Index() noexcept
+        {
+            thread_local owner own;
+            return own.index;
+        }
+
+        // one past the highest index ever claimed: the entries to scan.
+        // A thread using its entry after claiming the index is seen by later scans
+        static size_t InUse() noexcept
+        {
+            return inUse_.load(std::memory_order_seq_cst);
+        }
+
+    private:
+
+        struct owner
+        {
+            size_t index = no_slot;
+
+            owner() noexcept
+            {
+                for (size_t i = 0; i < max_threads; ++i)
+                {
+                    bool expected = false;
+                    if (claimed_[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+                    {
+                        index = i;
+
+                        size_t inUse = inUse_.load(std::memory_order_relaxed);
+                        while (inUse <= i && !inUse_.compare_exchange_weak(inUse, i + 1, std::memory_order_seq_cst))
+                            ;
+                        return;
+                    }
+                }
+            }
+
+            ~owner()
+            {
+                if (index != no_slot)
+                    claimed_[index].store(false, std::memory_order_release);
+            }
+        };
+
+        static inline std::array<std::atomic<bool>, max_threads> claimed_{};
+        static inline std::atomic<size_t> inUse_ = 0;
+    };
+}
@@ -0,0 +1,125 @@
+﻿#include "com_dispatch.h"
+
+#include <future>
+#include <utility>
+
+
+using namespace cmw;
+
+cmw::DispatchBatch::DispatchBatch(const ComPtr<IDispatch>& pDispatch,
+    std::shared_ptr<thread_pool> worker)
+    : pDispatch_(pDispatch),
+    worker_(std::move(worker))
+{
+    assert(pDispatch_.IsValid() && "Invalid dispatch interface!");
+}
+
+void cmw::DispatchBatch::put(disp_event && call)
+{
+    auto found = openPuts_.find(call.DispID());
+    if (found != openPuts_.end())
+    {
+        // keeps the position of the first put
+        calls_[found->second] = std::move(call);
+        ++coalesced_;
+        return;
+    }
+
+    openPuts_.emplace(call.DispID(), calls_.size());
+    calls_.push_back(std::move(call));
+}
+
+std::vector<batch_result> cmw::DispatchBatch::Flush()
+{
+    std::vector<disp_event> calls = std::move(calls_);
+    calls_.clear();
+    openPuts_.clear();
+
+    if (calls.empty())
+        return {};
+
+    if (!worker_)
+        return run(*pDispatch_, calls);
+
+    IStream *pStream = nullptr;
+    HRESULT hr = CoMarshalInterThreadInterfaceInStream(IID_IDispatch, pDispatch_.GetRaw(),
+        &pStream);
+    if (!SUCCEEDED(hr))
+    {
+        std::vector<batch_result> results;
+        for (disp_event& call : calls)
+            results.push_back({ call.DispID(), call.Flags(), hr });
+        return results;
+    }
+
+    std::promise<std::vector<batch_result>> done;
+    std::future<std::vector<batch_result>> results = done.get_future();
+
+    // the stream is released by the worker, or here if the task is never posted
+    auto release_stream = [](IStream *pStream)
+    {
+        CoReleaseMarshalData(pStream);
+        pStream->Release();
+    };
+
+    try
+    {
+        worker_->Post([pStream, &calls, &done, release_stream]() mutable
+        {
+            // the caller waits on the future: it must be satisfied whatever happens
+            try
+            {
+                IDispatch *pUnmarshaled = nullptr;
+                HRESULT hr = com_thread::Ensure();
+                if (SUCCEEDED(hr))
+                    hr = CoGetInterfaceAndReleaseStream(std::exchange(pStream, nullptr),
+                        IID_IDispatch, (void**)&pUnmarshaled);
+                else
+                    release_stream(std::exchange(pStream, nullptr));
+
+                if (!SUCCEEDED(hr))
+                {
+                    std::vector<batch_result> failed;
+                    for (disp_event& call : calls)
+                        failed.push_back({ call.DispID(), call.Flags(), hr });
+                    done.set_value(std::move(failed));
+                    return;
+                }
+
+                ComPtr<IDispatch> pTarget(pUnmarshaled);
+                done.set_value(run(*pTarget, calls));
+            }
+            catch (...)
+            {
+                if (pStream)
+                    release_stream(pStream);
+                done.set_exception(std::current_exception());
+            }
+        });
+    }
+    catch (...)
+    {
+        release_stream(pStream);
+        throw;
+    }
+
+    return results.get();
+}
+
+std::vector<batch_result> cmw::DispatchBatch::run(IDispatch & target, std::vector<disp_event>& calls)
+{
+    std::vector<batch_result> results;
+    results.reserve(calls.size());
+
+    for (disp_event& call : calls)
+    {
+        // interface arguments were marshaled when the call was recorded
+        HRESULT hr = call.Unmarshal();
+        if (SUCCEEDED(hr))
+            hr = target.Invoke(call.DispID(), IID_NULL, call.Locale(), call.Flags(),
+                call.Params(), nullptr, nullptr, nullptr);
+        results.push_back({ call.DispID(), call.Flags(), hr });
+    }
+
+    return results;
+}
@@ -1 +1,1311 @@
-﻿
+﻿#include "com_events.h"
+
+#include <algorithm>
+
+
+using namespace cmw;
+
+cmw::disp_event::disp_event(const allocator_type & alloc)
+    : args_(alloc),
+    namedArgs_(alloc),
+    marshaled_(alloc)
+{
+}
+
+cmw::disp_event::disp_event(DISPID dispIdMember, LCID lcid, WORD wFlags,
+    const DISPPARAMS * pDispParams, const allocator_type & alloc)
+    : dispIdMember_(dispIdMember),
+    lcid_(lcid),
+    wFlags_(wFlags),
+    args_(alloc),
+    namedArgs_(alloc),
+    marshaled_(alloc),
+    received_(std::chrono::steady_clock::now())
+{
+    if (!pDispParams)
+        return;
+
+    args_.resize(pDispParams->cArgs);
+    for (UINT i = 0; i < pDispParams->cArgs; ++i)
+    {
+        VariantInit(&args_[i]);
+        // the references point to the caller's stack
+        HRESULT hr = VariantCopyInd(&args_[i], &pDispParams->rgvarg[i]);
+        assert(SUCCEEDED(hr) && "Failed to copy event argument!");
+
+        VARTYPE vt = args_[i].vt;
+        if (vt == VT_DISPATCH || vt == VT_UNKNOWN)
+            marshal(i);
+        else if ((vt & VT_ARRAY) &&
+            ((vt & VT_TYPEMASK) == VT_DISPATCH || (vt & VT_TYPEMASK) == VT_UNKNOWN))
+            VariantClear(&args_[i]);
+    }
+
+    if (pDispParams->cNamedArgs)
+        namedArgs_.assign(pDispParams->rgdispidNamedArgs,
+            pDispParams->rgdispidNamedArgs + pDispParams->cNamedArgs);
+
+    bind();
+}
+
+cmw::disp_event::disp_event(disp_event && other) noexcept
+    : dispIdMember_(other.dispIdMember_),
+    lcid_(other.lcid_),
+    wFlags_(other.wFlags_),
+    args_(std::move(other.args_)),
+    namedArgs_(std::move(other.namedArgs_)),
+    marshaled_(std::move(other.marshaled_)),
+    received_(other.received_)
+{
+    bind();
+    other.release();
+}
+
+cmw::disp_event::disp_event(disp_event && other, const allocator_type & alloc)
+    : dispIdMember_(other.dispIdMember_),
+    lcid_(other.lcid_),
+    wFlags_(other.wFlags_),
+    args_(std::move(other.args_), alloc),
+    namedArgs_(std::move(other.namedArgs_), alloc),
+    marshaled_(std::move(other.marshaled_), alloc),
+    received_(other.received_)
+{
+    // VARIANTs are moved bitwise: the source must not clear them
+    bind();
+    other.release();
+}
+
+disp_event & cmw::disp_event::operator=(disp_event && other) noexcept
+{
+    if (this == &other)
+        return *this;
+
+    clear();
+
+    dispIdMember_ = other.dispIdMember_;
+    lcid_ = other.lcid_;
+    wFlags_ = other.wFlags_;
+    args_ = std::move(other.args_);
+    namedArgs_ = std::move(other.namedArgs_);
+    marshaled_ = std::move(other.marshaled_);
+    received_ = other.received_;
+
+    bind();
+    other.release();
+
+    return *this;
+}
+
+cmw::disp_event::~disp_event()
+{
+    clear();
+}
+
+HRESULT cmw::disp_event::Unmarshal() noexcept
+{
+    HRESULT res = S_OK;
+    for (const marshaled_arg& m : marshaled_)
+    {
+        // the stream is released in any case
+        void *pInterface = nullptr;
+        HRESULT hr = CoGetInterfaceAndReleaseStream(m.stream,
+            m.vt == VT_DISPATCH ? IID_IDispatch : IID_IUnknown, &pInterface);
+        if (!SUCCEEDED(hr))
+        {
+            if (SUCCEEDED(res))
+                res = hr;
+            continue;
+        }
+
+        VARIANTARG& arg = args_[m.index];
+        arg.vt = m.vt;
+        arg.punkVal = static_cast<IUnknown*>(pInterface);
+    }
+
+    marshaled_.clear();
+    return res;
+}
+
+void cmw::disp_event::clear()
+{
+    // never delivered
+    for (const marshaled_arg& m : marshaled_)
+    {
+        CoReleaseMarshalData(m.stream);
+        m.stream->Release();
+    }
+
+    for (VARIANTARG& arg : args_)
+        VariantClear(&arg);
+
+    release();
+}
+
+void cmw::disp_event::marshal(UINT index)
+{
+    VARIANTARG& arg = args_[index];
+
+    IStream *pStream = nullptr;
+    if (arg.punkVal)
+    {
+        HRESULT hr = CoMarshalInterThreadInterfaceInStream(
+            arg.vt == VT_DISPATCH ? IID_IDispatch : IID_IUnknown, arg.punkVal, &pStream);
+        if (!SUCCEEDED(hr))
+            pStream = nullptr;
+    }
+
+    VARTYPE vt = arg.vt;
+    bool isNull = !arg.punkVal;
+    VariantClear(&arg);
+
+    // null interfaces stay as they are
+    if (isNull)
+        arg.vt = vt;
+    else if (pStream)
+        marshaled_.push_back({ index, vt, pStream });
+}
+
+void cmw::disp_event::bind()
+{
+    params_.rgvarg = args_.empty() ? nullptr : args_.data();
+    params_.cArgs = (UINT)args_.size();
+    params_.rgdispidNamedArgs = namedArgs_.empty() ? nullptr : namedArgs_.data();
+    params_.cNamedArgs = (UINT)namedArgs_.size();
+}
+
+void cmw::disp_event::release()
+{
+    args_.clear();
+    namedArgs_.clear();
+    marshaled_.clear();
+    params_ = DISPPARAMS{};
+}
+
+
+void cmw::lane_stats::Record(std::chrono::nanoseconds latency)
+{
+    uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+    size_t bucket = 0;
+    while (bucket + 1 < num_buckets && (1ull << bucket) <= us)
+        ++bucket;
+
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    delivered_.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t prevMax = maxLatencyUs_.load(std::memory_order_relaxed);
+    while (prevMax < us &&
+        !maxLatencyUs_.compare_exchange_weak(prevMax, us, std::memory_order_relaxed))
+    {
+    }
+}
+
+void cmw::lane_stats::RecordDrop()
+{
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::chrono::microseconds cmw::lane_stats::Percentile(double p) const
+{
+    uint64_t total = delivered_.load(std::memory_order_relaxed);
+    if (!total)
+        return std::chrono::microseconds(0);
+
+    uint64_t rank = (uint64_t)(p * (double)total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < num_buckets; ++i)
+    {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen > rank)
+            return std::chrono::microseconds(1ull << i);
+    }
+
+    return MaxLatency();
+}
+
+void cmw::lane_stats::Reset()
+{
+    for (std::atomic<uint64_t>& bucket : buckets_)
+        bucket = 0;
+
+    delivered_ = 0;
+    dropped_ = 0;
+    maxLatencyUs_ = 0;
+}
+
+
+std::unique_ptr<PriorityListener> cmw::PriorityListener::Create(REFIID connectionIID,
+    lane_scheduler scheduler, std::pmr::memory_resource * resource)
+{
+    return std::unique_ptr<PriorityListener>(new PriorityListener(connectionIID, scheduler, resource));
+}
+
+cmw::PriorityListener::PriorityListener(REFIID connectionIID, lane_scheduler scheduler,
+    std::pmr::memory_resource * resource)
+    : Listener(connectionIID, resource),
+    scheduler_(scheduler),
+    lanes_{ { lane(resource), lane(resource), lane(resource), lane(resource) } }
+{
+    static_assert(num_event_priorities == 4, "Every lane must be initialized!");
+
+    // default weights: every class gets twice the share of the next one
+    size_t weight = 1ull << (num_event_priorities - 1);
+    for (lane& l : lanes_)
+    {
+        l.weight = weight;
+        weight = std::max<size_t>(weight / 2, 1);
+    }
+
+    worker_ = std::thread(&PriorityListener::run, this);
+}
+
+subscription cmw::PriorityListener::SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback,
+    event_priority priority)
+{
+    SetPriority(dispiid, priority);
+    return Listener::SetCallback(dispiid, std::move(callback));
+}
+
+void cmw::PriorityListener::SetPriority(DISPID dispiid, event_priority priority)
+{
+    std::unique_lock<std::shared_mutex> uLock(mutexPriorities_);
+    priorities_[dispiid] = priority;
+}
+
+event_priority cmw::PriorityListener::Priority(DISPID dispiid) const
+{
+    std::shared_lock<std::shared_mutex> sharedLock(mutexPriorities_);
+
+    auto found = priorities_.find(dispiid);
+    if (found == priorities_.cend())
+        return event_priority::normal;
+
+    return found->second;
+}
+
+void cmw::PriorityListener::SetLaneCapacity(event_priority priority, size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(mutexLanes_);
+    lanes_[(size_t)priority].capacity = capacity;
+}
+
+void cmw::PriorityListener::SetLaneWeight(event_priority priority, size_t weight)
+{
+    assert(weight && "Lane weight must be positive!");
+
+    std::lock_guard<std::mutex> lock(mutexLanes_);
+    lanes_[(size_t)priority].weight = std::max<size_t>(weight, 1);
+}
+
+size_t cmw::PriorityListener::Pending(event_priority priority) const
+{
+    std::lock_guard<std::mutex> lock(mutexLanes_);
+    return lanes_[(size_t)priority].events.size();
+}
+
+const lane_stats & cmw::PriorityListener::LaneStats(event_priority priority) const
+{
+    return lanes_[(size_t)priority].stats;
+}
+
+HRESULT __stdcall cmw::PriorityListener::Invoke(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
+{
+    lane& target = lanes_[(size_t)Priority(dispIdMember)];
+
+    // copy outside of the lock, the firing thread must not wait for the worker
+    disp_event event(dispIdMember, lcid, wFlags, pDispParams, target.events.get_allocator());
+
+    {
+        std::lock_guard<std::mutex> lock(mutexLanes_);
+        if (target.capacity && target.events.size() >= target.capacity)
+        {
+            target.stats.RecordDrop();
+            return S_OK;
+        }
+
+        target.events.push_back(std::move(event));
+    }
+
+    hasEvents_.notify_one();
+    return S_OK;
+}
+
+cmw::PriorityListener::~PriorityListener()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexLanes_);
+        stop_ = true;
+    }
+    hasEvents_.notify_one();
+
+    if (worker_.joinable())
+        worker_.join();
+}
+
+bool cmw::PriorityListener::has_events() const
+{
+    return std::any_of(lanes_.cbegin(), lanes_.cend(),
+        [](const lane& l) { return !l.events.empty(); });
+}
+
+size_t cmw::PriorityListener::next_lane()
+{
+    if (scheduler_ == lane_scheduler::strict_priority)
+    {
+        for (size_t i = 0; i < num_event_priorities; ++i)
+            if (!lanes_[i].events.empty())
+                return i;
+
+        assert(false && "No pending events!");
+        return 0;
+    }
+
+    // weighted fair: stay on the current lane until its weight is used up
+    if (!lanes_[currentLane_].events.empty() &&
+        servedInTurn_ < lanes_[currentLane_].weight)
+    {
+        ++servedInTurn_;
+        return currentLane_;
+    }
+
+    for (size_t step = 1; step <= num_event_priorities; ++step)
+    {
+        size_t i = (currentLane_ + step) % num_event_priorities;
+        if (!lanes_[i].events.empty())
+        {
+            currentLane_ = i;
+            servedInTurn_ = 1;
+            return i;
+        }
+    }
+
+    assert(false && "No pending events!");
+    return 0;
+}
+
+void cmw::PriorityListener::run()
+{
+    com_thread::SetApartment(com_apartment::multithreaded);
+
+    std::unique_lock<std::mutex> lock(mutexLanes_);
+    while (true)
+    {
+        hasEvents_.wait(lock, [this]() { return stop_ || has_events(); });
+
+        if (!has_events())
+            return;
+
+        lane& source = lanes_[next_lane()];
+        disp_event event = std::move(source.events.front());
+        source.events.pop_front();
+
+        lock.unlock();
+
+        // callbacks may use interface pointers received as arguments
+        if (SUCCEEDED(com_thread::Ensure()))
+        {
+            event.Unmarshal();
+            Listener::Invoke(event.DispID(), IID_NULL, event.Locale(), event.Flags(),
+                event.Params(), nullptr, nullptr, nullptr);
+
+            source.stats.Record(std::chrono::steady_clock::now() - event.Received());
+        }
+        else
+            source.stats.RecordDrop();
+
+        lock.lock();
+    }
+}
+
+
+std::unique_ptr<AffinityListener> cmw::AffinityListener::Create(REFIID connectionIID,
+    const std::vector<int>& cpus, size_t arenaSize)
+{
+    return std::unique_ptr<AffinityListener>(new AffinityListener(connectionIID, cpus, arenaSize));
+}
+
+cmw::AffinityListener::AffinityListener(REFIID connectionIID, const std::vector<int>& cpus,
+    size_t arenaSize)
+    : Listener(connectionIID),
+    arenaSize_(arenaSize)
+{
+    assert(!cpus.empty() && "At least one worker is required!");
+
+    std::vector<std::promise<void>> ready(cpus.size());
+
+    workers_.reserve(cpus.size());
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        std::unique_ptr<worker_thread> w = std::make_unique<worker_thread>();
+        w->cpu = cpus[i];
+        w->thread = std::thread(&AffinityListener::run, this, std::ref(*w), std::ref(ready[i]));
+        workers_.push_back(std::move(w));
+    }
+
+    // events may arrive right after Create, the memory of every worker must exist
+    for (std::promise<void>& r : ready)
+        r.get_future().wait();
+}
+
+subscription cmw::AffinityListener::SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback,
+    size_t worker)
+{
+    Route(dispiid, worker);
+    return Listener::SetCallback(dispiid, std::move(callback));
+}
+
+void cmw::AffinityListener::Route(DISPID dispiid, size_t worker)
+{
+    assert(worker < workers_.size() && "Invalid worker!");
+
+    std::unique_lock<std::shared_mutex> uLock(mutexRoutes_);
+    routes_[dispiid] = worker;
+}
+
+size_t cmw::AffinityListener::Worker(DISPID dispiid) const
+{
+    std::shared_lock<std::shared_mutex> sharedLock(mutexRoutes_);
+
+    auto found = routes_.find(dispiid);
+    if (found == routes_.cend())
+        return (size_t)(ULONG)dispiid % workers_.size();
+
+    return found->second;
+}
+
+size_t cmw::AffinityListener::NumWorkers() const
+{
+    return workers_.size();
+}
+
+int cmw::AffinityListener::WorkerCpu(size_t worker) const
+{
+    return workers_[worker]->cpu;
+}
+
+bool cmw::AffinityListener::IsPinned(size_t worker) const
+{
+    return workers_[worker]->pinned;
+}
+
+size_t cmw::AffinityListener::Pending(size_t worker) const
+{
+    worker_thread& w = *workers_[worker];
+
+    std::lock_guard<std::mutex> lock(w.mutexEvents);
+    return w.memory->events.size();
+}
+
+uint64_t cmw::AffinityListener::Dropped(size_t worker) const
+{
+    return workers_[worker]->dropped.load(std::memory_order_relaxed);
+}
+
+std::pmr::memory_resource * cmw::AffinityListener::WorkerResource(size_t worker) const
+{
+    return &workers_[worker]->memory->pool;
+}
+
+const first_touch_arena & cmw::AffinityListener::WorkerArena(size_t worker) const
+{
+    return workers_[worker]->memory->arena;
+}
+
+HRESULT __stdcall cmw::AffinityListener::Invoke(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
+{
+    worker_thread& target = *workers_[Worker(dispIdMember)];
+
+    try
+    {
+        // copy outside of the lock, into the memory of the worker's node
+        disp_event event(dispIdMember, lcid, wFlags, pDispParams, target.memory->events.get_allocator());
+
+        std::lock_guard<std::mutex> lock(target.mutexEvents);
+        target.memory->events.push_back(std::move(event));
+    }
+    catch (...)
+    {
+        // the server must not see our exceptions
+        target.dropped.fetch_add(1, std::memory_order_relaxed);
+        return E_OUTOFMEMORY;
+    }
+
+    target.hasEvents.notify_one();
+    return S_OK;
+}
+
+cmw::AffinityListener::~AffinityListener()
+{
+    for (std::unique_ptr<worker_thread>& w : workers_)
+    {
+        {
+            std::lock_guard<std::mutex> lock(w->mutexEvents);
+            w->stop = true;
+        }
+        w->hasEvents.notify_one();
+    }
+
+    for (std::unique_ptr<worker_thread>& w : workers_)
+        if (w->thread.joinable())
+            w->thread.join();
+}
+
+void cmw::AffinityListener::run(worker_thread & w, std::promise<void>& ready)
+{
+    w.pinned = pin_current_thread(w.cpu);
+    com_thread::SetApartment(com_apartment::multithreaded);
+
+    // the pages are placed by the first thread writing them: this one, on its CPU
+    w.memory = std::make_unique<worker_memory>(arenaSize_);
+    ready.set_value();
+
+    std::pmr::deque<disp_event>& events = w.memory->events;
+
+    std::unique_lock<std::mutex> lock(w.mutexEvents);
+    while (true)
+    {
+        w.hasEvents.wait(lock, [&]() { return w.stop || !events.empty(); });
+
+        if (events.empty())
+            return;
+
+        disp_event event = std::move(events.front());
+        events.pop_front();
+
+        lock.unlock();
+
+        // callbacks may use interface pointers received as arguments. Without COM
+        // the event is dropped, the next one tries to initialize it again
+        if (SUCCEEDED(com_thread::Ensure()))
+        {
+            event.Unmarshal();
+            Listener::Invoke(event.DispID(), IID_NULL, event.Locale(), event.Flags(),
+                event.Params(), nullptr, nullptr, nullptr);
+        }
+        else
+            w.dropped.fetch_add(1, std::memory_order_relaxed);
+
+        lock.lock();
+    }
+}
+
+
+cmw::callback_watchdog::callback_watchdog(std::function<void(const slow_callback&)> onSlow,
+    std::chrono::nanoseconds defaultBudget, std::chrono::nanoseconds period)
+    : onSlow_(std::move(onSlow)),
+    period_(std::chrono::duration_cast<clock::duration>(period)),
+    defaultBudget_(std::chrono::duration_cast<clock::duration>(defaultBudget))
+{
+    worker_ = std::thread(&callback_watchdog::run_worker, this);
+    monitor_ = std::thread(&callback_watchdog::run_monitor, this);
+}
+
+void cmw::callback_watchdog::SetBudget(DISPID dispId, std::chrono::nanoseconds budget)
+{
+    std::unique_lock<std::shared_mutex> uLock(mutexBudgets_);
+    budgets_[dispId] = std::chrono::duration_cast<clock::duration>(budget);
+}
+
+std::chrono::nanoseconds cmw::callback_watchdog::Budget(DISPID dispId) const
+{
+    std::shared_lock<std::shared_mutex> sharedLock(mutexBudgets_);
+
+    auto found = budgets_.find(dispId);
+    if (found == budgets_.cend())
+        return defaultBudget_;
+
+    return found->second;
+}
+
+void cmw::callback_watchdog::SetOffloadAfter(size_t offenses)
+{
+    offloadAfter_ = offenses;
+}
+
+size_t cmw::callback_watchdog::Offenses(const Listener & listener, size_t subscriber) const
+{
+    std::shared_lock<std::shared_mutex> sharedLock(mutexOffenders_);
+
+    auto found = offenses_.find({ listener.Id(), subscriber });
+    return found == offenses_.cend() ? 0 : found->second;
+}
+
+bool cmw::callback_watchdog::IsOffloaded(const Listener & listener, size_t subscriber) const
+{
+    std::shared_lock<std::shared_mutex> sharedLock(mutexOffenders_);
+    return offloaded_.count({ listener.Id(), subscriber }) > 0;
+}
+
+void cmw::callback_watchdog::Reset()
+{
+    std::unique_lock<std::shared_mutex> uLock(mutexOffenders_);
+    offenses_.clear();
+    offloaded_.clear();
+    numOffloaded_ = 0;
+}
+
+bool cmw::callback_watchdog::Begin(const Listener & listener, const callback_table::subscriber & subscriber, void * context, DISPID dispIdMember, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams) noexcept
+{
+    if (numOffloaded_.load(std::memory_order_relaxed) && IsOffloaded(listener, subscriber.id))
+    {
+        try
+        {
+            offload(listener, subscriber, context, dispIdMember, lcid, wFlags, pDispParams);
+            return false;
+        }
+        catch (...)
+        {
+            // called in place
+        }
+    }
+
+    // threads without an index are not watched
+    size_t index = thread_slots::Index();
+    if (index == thread_slots::no_slot)
+        return true;
+
+    call_slot& slot = slots_[index];
+    if (slot.depth++)
+        return true;
+
+    // the monitor must not see the new call's fields before the previous call's end
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.listener.store(&listener, std::memory_order_relaxed);
+    slot.listenerId.store(listener.Id(), std::memory_order_relaxed);
+    slot.dispId.store(dispIdMember, std::memory_order_relaxed);
+    slot.subscriber.store(subscriber.id, std::memory_order_relaxed);
+    slot.handler.store(subscriber.handler ? subscriber.handler : &subscriber.callback.target_type(),
+        std::memory_order_relaxed);
+    slot.call.store(slot.call.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    slot.began.store(clock::now().time_since_epoch().count(), std::memory_order_release);
+
+    return true;
+}
+
+void cmw::callback_watchdog::End(const Listener & listener, const callback_table::subscriber & subscriber) noexcept
+{
+    // threads without an index are not watched
+    size_t index = thread_slots::Index();
+    if (index == thread_slots::no_slot)
+        return;
+
+    call_slot& slot = slots_[index];
+    if (--slot.depth)
+        return;
+
+    slot.began.store(0, std::memory_order_release);
+}
+
+void cmw::callback_watchdog::Detach(const Listener & listener) noexcept
+{
+    uint64_t id = listener.Id();
+
+    // destroyed outside the lock: the events release their marshaled arguments
+    std::list<offloaded_call> cancelled;
+    {
+        std::unique_lock<std::mutex> lock(mutexLane_);
+
+        for (auto call = lane_.begin(); call != lane_.end();)
+        {
+            auto next = std::next(call);
+            if (call->listenerId == id)
+                cancelled.splice(cancelled.end(), lane_, call);
+            call = next;
+        }
+
+        // a handler destroying its own listener is the call in progress
+        if (std::this_thread::get_id() != worker_.get_id())
+            callDone_.wait(lock, [this, id]() { return running_ != id; });
+    }
+
+    std::unique_lock<std::shared_mutex> uLock(mutexOffenders_);
+
+    for (auto offense = offenses_.begin(); offense != offenses_.end();)
+        offense = offense->first.first == id ? offenses_.erase(offense) : std::next(offense);
+
+    for (auto offloaded = offloaded_.begin(); offloaded != offloaded_.end();)
+    {
+        if (offloaded->first != id)
+        {
+            ++offloaded;
+            continue;
+        }
+
+        offloaded = offloaded_.erase(offloaded);
+        --numOffloaded_;
+    }
+}
+
+cmw::callback_watchdog::~callback_watchdog()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexLane_);
+        stop_ = true;
+    }
+    hasCalls_.notify_one();
+    stopping_.notify_one();
+
+    monitor_.join();
+    worker_.join();
+}
+
+void cmw::callback_watchdog::offload(const Listener & listener, const callback_table::subscriber & subscriber, void * context, DISPID dispIdMember, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams)
+{
+    // moving a call allocates by design
+    allocation_guard::exempt exempt;
+
+    std::list<offloaded_call> call;
+    call.push_back({ listener.Id(), subscriber, context,
+        disp_event(dispIdMember, lcid, wFlags, pDispParams) });
+
+    {
+        std::lock_guard<std::mutex> lock(mutexLane_);
+        lane_.splice(lane_.end(), call);
+    }
+    hasCalls_.notify_one();
+
+    ++numOffloadedCalls_;
+}
+
+void cmw::callback_watchdog::report(const Listener * listener, uint64_t listenerId, DISPID dispId, size_t subscriber, const std::type_info * handler, clock::duration elapsed)
+{
+    slow_callback slow{ listener, listenerId, dispId, subscriber, handler,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed), 0, false };
+
+    {
+        std::unique_lock<std::shared_mutex> uLock(mutexOffenders_);
+
+        slow.offenses = ++offenses_[{ listenerId, subscriber }];
+
+        size_t offloadAfter = offloadAfter_;
+        if (offloadAfter && slow.offenses >= offloadAfter)
+        {
+            if (offloaded_.insert({ listenerId, subscriber }).second)
+                ++numOffloaded_;
+            slow.offloaded = true;
+        }
+    }
+
+    ++numReported_;
+
+    if (onSlow_)
+        onSlow_(slow);
+}
+
+void cmw::callback_watchdog::sample()
+{
+    clock::rep now = clock::now().time_since_epoch().count();
+
+    size_t inUse = thread_slots::InUse();
+    for (size_t i = 0; i < inUse; ++i)
+    {
+        call_slot& slot = slots_[i];
+
+        clock::rep began = slot.began.load(std::memory_order_acquire);
+        if (!began)
+            continue;
+
+        uint64_t call = slot.call.load(std::memory_order_relaxed);
+        const Listener *listener = slot.listener.load(std::memory_order_relaxed);
+        uint64_t listenerId = slot.listenerId.load(std::memory_order_relaxed);
+        DISPID dispId = slot.dispId.load(std::memory_order_relaxed);
+        size_t subscriber = slot.subscriber.load(std::memory_order_relaxed);
+        const std::type_info *handler = slot.handler.load(std::memory_order_relaxed);
+
+        // the fields are consistent only if the call is still the same
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.began.load(std::memory_order_relaxed) != began || call == slot.reported)
+            continue;
+
+        clock::duration elapsed(now - began);
+        if (elapsed <= Budget(dispId))
+            continue;
+
+        slot.reported = call;
+        report(listener, listenerId, dispId, subscriber, handler, elapsed);
+    }
+}
+
+void cmw::callback_watchdog::run_monitor()
+{
+    std::unique_lock<std::mutex> lock(mutexLane_);
+    while (!stopping_.wait_for(lock, period_, [this]() { return stop_; }))
+    {
+        lock.unlock();
+        sample();
+        lock.lock();
+    }
+}
+
+void cmw::callback_watchdog::run_worker()
+{
+    com_thread::SetApartment(com_apartment::multithreaded);
+
+    std::unique_lock<std::mutex> lock(mutexLane_);
+    while (true)
+    {
+        hasCalls_.wait(lock, [this]() { return stop_ || !lane_.empty(); });
+
+        if (lane_.empty())
+            return;
+
+        std::list<offloaded_call> taken;
+        taken.splice(taken.end(), lane_, lane_.begin());
+        offloaded_call& call = taken.front();
+        running_ = call.listenerId;
+
+        lock.unlock();
+
+        // callbacks may use interface pointers received as arguments
+        if (SUCCEEDED(com_thread::Ensure()))
+        {
+            call.event.Unmarshal();
+            Listener::InvokeSubscriber(call.subscriber, call.context, call.event.DispID(), IID_NULL,
+                call.event.Locale(), call.event.Flags(), call.event.Params(), nullptr, nullptr, nullptr);
+        }
+        taken.clear();
+
+        lock.lock();
+
+        running_ = 0;
+        callDone_.notify_all();
+    }
+}
+
+
+namespace
+{
+    // listeners calling handlers or updating their connection on this thread
+    class connection_frame
+    {
+        const AutoConnectListener *listener_;
+        const connection_frame *outer_;
+
+        static thread_local const connection_frame *innermost_;
+
+    public:
+
+        explicit connection_frame(const AutoConnectListener *listener) noexcept
+            : listener_(listener),
+            outer_(innermost_)
+        {
+            innermost_ = this;
+        }
+
+        ~connection_frame()
+        {
+            innermost_ = outer_;
+        }
+
+        connection_frame(const connection_frame&) = delete;
+        connection_frame& operator=(const connection_frame&) = delete;
+
+        static bool Active(const AutoConnectListener *listener) noexcept
+        {
+            for (const connection_frame *f = innermost_; f; f = f->outer_)
+                if (f->listener_ == listener)
+                    return true;
+
+            return false;
+        }
+    };
+
+    thread_local const connection_frame *connection_frame::innermost_ = nullptr;
+}
+
+std::unique_ptr<AutoConnectListener> cmw::AutoConnectListener::Create(REFIID connectionIID,
+    const ComPtr<IConnectionPointContainer>& provider,
+    std::shared_ptr<connection_point_cache> cache)
+{
+    return std::unique_ptr<AutoConnectListener>(
+        new AutoConnectListener(connectionIID, provider, std::move(cache)));
+}
+
+cmw::AutoConnectListener::AutoConnectListener(REFIID connectionIID,
+    const ComPtr<IConnectionPointContainer>& provider,
+    std::shared_ptr<connection_point_cache> cache)
+    : Listener(connectionIID),
+    provider_(provider),
+    cache_(cache ? std::move(cache) : std::make_shared<connection_point_cache>())
+{
+    assert(provider_.IsValid() && "Invalid connection point container!");
+}
+
+bool cmw::AutoConnectListener::IsConnected() const
+{
+    std::lock_guard<std::mutex> lock(mutexConnection_);
+    return connected_;
+}
+
+HRESULT cmw::AutoConnectListener::LastResult() const
+{
+    std::lock_guard<std::mutex> lock(mutexConnection_);
+    return hr_;
+}
+
+HRESULT __stdcall cmw::AutoConnectListener::Invoke(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
+{
+    HRESULT hr = S_OK;
+    {
+        connection_frame frame(this);
+        hr = Listener::Invoke(dispIdMember, riid, lcid, wFlags,
+            pDispParams, pVarResult, pExcepInfo, puArgErr);
+    }
+
+    // the changes of the handlers
+    if (!connection_frame::Active(this))
+        reconnect();
+
+    return hr;
+}
+
+void cmw::AutoConnectListener::OnCallbacksChanged()
+{
+    changed_.store(true);
+
+    // a handler or Advise of this thread is running: the outer frame reconnects
+    if (connection_frame::Active(this))
+        return;
+
+    reconnect();
+}
+
+void cmw::AutoConnectListener::reconnect()
+{
+    connection_frame frame(this);
+
+    // changes made while connecting are picked up by the next round
+    while (changed_.exchange(false))
+    {
+        std::lock_guard<std::mutex> lock(mutexConnection_);
+        update_connection();
+    }
+}
+
+void cmw::AutoConnectListener::update_connection()
+{
+    // notifications may arrive out of order: the current state decides
+    bool wanted = NumCallbacks() > 0;
+    if (wanted == connected_)
+        return;
+
+    if (!wanted)
+    {
+        hr_ = TryDisconnect(cookie_).HResult();
+        connected_ = false;
+        cookie_ = 0;
+        return;
+    }
+
+    Result<ComPtr<IConnectionPoint>> vCpoint = cache_->Find(*provider_, Interface());
+    if (!vCpoint)
+    {
+        hr_ = vCpoint.HResult();
+        return;
+    }
+
+    ComPtr<IConnectionPoint> cpoint = std::move(vCpoint).Value();
+
+    DWORD cookie = 0;
+    hr_ = cpoint->Advise(static_cast<IDispatch*>(this), &cookie);
+    if (!SUCCEEDED(hr_))
+        return;
+
+    RegConnection(cookie, cpoint);
+    cookie_ = cookie;
+    connected_ = true;
+}
+
+
+std::unique_ptr<PropertyNotifySink> cmw::PropertyNotifySink::Create(std::function<void(DISPID)>&& onChanged)
+{
+    return std::unique_ptr<PropertyNotifySink>(new PropertyNotifySink(std::move(onChanged)));
+}
+
+std::unique_ptr<PropertyNotifySink> cmw::PropertyNotifySink::Create(std::shared_ptr<property_cache> cache)
+{
+    assert(cache && "Invalid property cache!");
+
+    return Create([cache = std::move(cache)](DISPID dispID)
+    {
+        cache->Invalidate(dispID);
+    });
+}
+
+cmw::PropertyNotifySink::PropertyNotifySink(std::function<void(DISPID)>&& onChanged)
+    : onChanged_(std::move(onChanged))
+{
+}
+
+Result<DWORD> cmw::PropertyNotifySink::TryConnect(IConnectionPointContainer & container) noexcept
+{
+    Result<ComPtr<IConnectionPoint>> vCpoint =
+        FindConnectionPoint<>::TryFind(container, IID_IPropertyNotifySink);
+    if (!vCpoint)
+        return Result<DWORD>::Fail(vCpoint.HResult());
+
+    ComPtr<IConnectionPoint> cpoint = std::move(vCpoint).Value();
+
+    trace_span span("PropertyNotifySink::TryConnect", trace_category::connect);
+    DWORD cookie = 0;
+    HRESULT hr = cpoint->Advise(static_cast<IPropertyNotifySink*>(this), &cookie);
+    span.SetResult(hr);
+    if (!SUCCEEDED(hr))
+        return Result<DWORD>::Fail(hr);
+
+    try
+    {
+        RegConnection(cookie, cpoint);
+    }
+    catch (const std::bad_alloc&)
+    {
+        cpoint->Unadvise(cookie);
+        return Result<DWORD>::Fail(E_OUTOFMEMORY);
+    }
+
+    return cookie;
+}
+
+size_t cmw::PropertyNotifySink::NumConnections() const
+{
+    return connections_.NumConnections();
+}
+
+void cmw::PropertyNotifySink::RegConnection(DWORD cookie, ComPtr<IConnectionPoint>& cpoint)
+{
+    connections_.RegConnection(cookie, cpoint);
+}
+
+std::variant<HRESULT, bool> cmw::PropertyNotifySink::Disconnect(DWORD cookie)
+{
+    return connections_.Disconnect(cookie);
+}
+
+Result<void> cmw::PropertyNotifySink::TryDisconnect(DWORD cookie) noexcept
+{
+    return connections_.TryDisconnect(cookie);
+}
+
+HRESULT cmw::PropertyNotifySink::DisconnectAll()
+{
+    return connections_.DisconnectAll();
+}
+
+ULONG __stdcall cmw::PropertyNotifySink::AddRef(void)
+{
+    return refCounter_.AddRef();
+}
+
+ULONG __stdcall cmw::PropertyNotifySink::Release(void)
+{
+    return refCounter_.Release();
+}
+
+HRESULT __stdcall cmw::PropertyNotifySink::QueryInterface(REFIID riid, void ** ppvObject)
+{
+    if (!ppvObject)
+        return E_POINTER;
+
+    if (riid == IID_IUnknown || riid == IID_IPropertyNotifySink)
+    {
+        *ppvObject = static_cast<IPropertyNotifySink*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    *ppvObject = nullptr;
+    return E_NOINTERFACE;
+}
+
+HRESULT __stdcall cmw::PropertyNotifySink::OnChanged(DISPID dispID)
+{
+    flight_recorder::Record(flight_event::invoke, dispID, S_OK);
+
+    try
+    {
+        if (onChanged_)
+            onChanged_(dispID);
+    }
+    catch (...)
+    {
+        // the server must not see our failures
+    }
+
+    return S_OK;
+}
+
+HRESULT __stdcall cmw::PropertyNotifySink::OnRequestEdit(DISPID dispID)
+{
+    return S_OK;
+}
+
+
+static_assert(dirty_properties::dispid_unknown == DISPID_UNKNOWN, "DISPID_UNKNOWN mismatch!");
+
+
+std::unique_ptr<BatchedPropertySink> cmw::BatchedPropertySink::Create(
+    std::shared_ptr<property_batcher> batcher, void * context)
+{
+    return std::unique_ptr<BatchedPropertySink>(
+        new BatchedPropertySink(std::move(batcher), context));
+}
+
+cmw::BatchedPropertySink::BatchedPropertySink(std::shared_ptr<property_batcher> batcher,
+    void * context)
+    : PropertyNotifySink(nullptr),
+    batcher_(std::move(batcher))
+{
+    assert(batcher_ && "Invalid property batcher!");
+
+    object_ = batcher_->Attach(context);
+}
+
+void * cmw::BatchedPropertySink::Context() const
+{
+    return object_->Context();
+}
+
+HRESULT __stdcall cmw::BatchedPropertySink::OnChanged(DISPID dispID)
+{
+    flight_recorder::Record(flight_event::invoke, dispID, S_OK);
+
+    try
+    {
+        batcher_->Changed(object_, dispID);
+    }
+    catch (...)
+    {
+        // the server must not see our failures
+    }
+
+    return S_OK;
+}
+
+cmw::BatchedPropertySink::~BatchedPropertySink()
+{
+    // no OnChanged may arrive once the members are gone
+    DisconnectAll();
+    batcher_->Detach(*object_);
+}
+
+
+void cmw::flatten_disp_params(flat_event_builder & builder, DISPID dispIdMember, WORD wFlags,
+    const DISPPARAMS * pDispParams)
+{
+    builder.Reset(dispIdMember, wFlags);
+
+    UINT cArgs = pDispParams ? pDispParams->cArgs : 0;
+    for (UINT i = 0; i < cArgs; ++i)
+    {
+        // rgvarg is stored in reverse order
+        const VARIANT *pArg = &pDispParams->rgvarg[cArgs - 1 - i];
+        if (pArg->vt == (VT_BYREF | VT_VARIANT) && pArg->pvarVal)
+            pArg = pArg->pvarVal;
+
+        switch (pArg->vt)
+        {
+        case VT_I1: builder.AddInt(flat_vt::i1, pArg->cVal); break;
+        case VT_UI1: builder.AddInt(flat_vt::ui1, pArg->bVal); break;
+        case VT_I2: builder.AddInt(flat_vt::i2, pArg->iVal); break;
+        case VT_UI2: builder.AddInt(flat_vt::ui2, pArg->uiVal); break;
+        case VT_I4: builder.AddInt(flat_vt::i4, pArg->lVal); break;
+        case VT_UI4: builder.AddInt(flat_vt::ui4, pArg->ulVal); break;
+        case VT_I8: builder.AddInt(flat_vt::i8, pArg->llVal); break;
+        case VT_UI8: builder.AddInt(flat_vt::ui8, (int64_t)pArg->ullVal); break;
+        case VT_INT: builder.AddInt(flat_vt::integer, pArg->intVal); break;
+        case VT_UINT: builder.AddInt(flat_vt::uinteger, pArg->uintVal); break;
+        case VT_BOOL: builder.AddInt(flat_vt::boolean, pArg->boolVal); break;
+        case VT_ERROR: builder.AddInt(flat_vt::error, pArg->scode); break;
+        case VT_R4: builder.AddReal(flat_vt::r4, pArg->fltVal); break;
+        case VT_R8: builder.AddReal(flat_vt::r8, pArg->dblVal); break;
+        case VT_DATE: builder.AddReal(flat_vt::date, pArg->date); break;
+        case VT_BSTR:
+        {
+            UINT length = SysStringLen(pArg->bstrVal);
+            if constexpr (sizeof(OLECHAR) == sizeof(char16_t))
+                builder.AddString(reinterpret_cast<const char16_t*>(pArg->bstrVal), length);
+            else
+            {
+                std::u16string chars(pArg->bstrVal, pArg->bstrVal + length);
+                builder.AddString(chars.data(), chars.size());
+            }
+            break;
+        }
+        default: builder.AddEmpty(); break;
+        }
+    }
+}
+
+std::unique_ptr<PublishingListener> cmw::PublishingListener::Create(REFIID connectionIID,
+    std::shared_ptr<shm_event_bus> bus)
+{
+    return std::unique_ptr<PublishingListener>(new PublishingListener(connectionIID, std::move(bus)));
+}
+
+cmw::PublishingListener::PublishingListener(REFIID connectionIID, std::shared_ptr<shm_event_bus> bus)
+    : Listener(connectionIID),
+    bus_(std::move(bus))
+{
+    assert(bus_ && "Invalid event bus!");
+}
+
+HRESULT __stdcall cmw::PublishingListener::Invoke(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
+{
+    try
+    {
+        std::lock_guard<std::mutex> lock(mutexBus_);
+        flatten_disp_params(builder_, dispIdMember, wFlags, pDispParams);
+        // dropped events are counted by the bus
+        bus_->Publish(builder_);
+    }
+    catch (...)
+    {
+        // the server must not see our failures, the local callbacks are still called
+        numFailed_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    HRESULT hr = Listener::Invoke(dispIdMember, riid, lcid, wFlags,
+        pDispParams, pVarResult, pExcepInfo, puArgErr);
+
+    // the event is handled by the other processes
+    return hr == DISP_E_MEMBERNOTFOUND ? S_OK : hr;
+}
+
+
+std::unique_ptr<ExportingListener> cmw::ExportingListener::Create(REFIID connectionIID,
+    std::shared_ptr<columnar_exporter> exporter)
+{
+    return std::unique_ptr<ExportingListener>(new ExportingListener(connectionIID, std::move(exporter)));
+}
+
+cmw::ExportingListener::ExportingListener(REFIID connectionIID, std::shared_ptr<columnar_exporter> exporter)
+    : Listener(connectionIID),
+    exporter_(std::move(exporter))
+{
+    assert(exporter_ && "Invalid exporter!");
+}
+
+HRESULT __stdcall cmw::ExportingListener::Invoke(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
+{
+    int64_t timestamp = columnar_exporter::Now();
+
+    // the encoded event is copied by Append, before the handlers may fire others
+    try
+    {
+        thread_local flat_event_builder builder;
+        flatten_disp_params(builder, dispIdMember, wFlags, pDispParams);
+        exporter_->Append(flat_event(builder.Encode().first), timestamp);
+    }
+    catch (...)
+    {
+        // the server must not see our failures, the local callbacks are still called
+        numFailed_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    HRESULT hr = Listener::Invoke(dispIdMember, riid, lcid, wFlags,
+        pDispParams, pVarResult, pExcepInfo, puArgErr);
+
+    // exported events need no callback
+    return hr == DISP_E_MEMBERNOTFOUND ? S_OK : hr;
+}
@@ -0,0 +1,301 @@
+﻿#include "com_flight.h"
+#include "com_memory.h"
+
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <io.h>
+#include <intrin.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+
+using namespace cmw;
+
+namespace
+{
+    int64_t flight_clock() noexcept
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        return (int64_t)__rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+        return (int64_t)__builtin_ia32_rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    uint32_t os_thread_id() noexcept
+    {
+#ifdef _WIN32
+        return (uint32_t)GetCurrentThreadId();
+#else
+        return (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+    }
+
+    struct flight_ring
+    {
+        std::array<flight_record, flight_recorder::ring_capacity> records{};
+        // total number of records written, the slot is head % capacity
+        std::atomic<uint64_t> head = 0;
+        // rings of exited threads are taken over by new ones
+        std::atomic<bool> owned = false;
+        uint32_t threadId = 0;
+    };
+
+    // fixed table: the signal-safe dump can walk it without locks
+    std::array<std::atomic<flight_ring*>, flight_recorder::max_threads> rings{};
+
+    flight_ring* claim_ring() noexcept
+    {
+        // empty slots first: the history of exited threads is kept as long as possible
+        for (std::atomic<flight_ring*>& slot : rings)
+        {
+            if (slot.load(std::memory_order_acquire))
+                continue;
+
+            flight_ring *created = new (std::nothrow) flight_ring();
+            if (!created)
+                break;
+
+            created->owned = true;
+            flight_ring *expected = nullptr;
+            if (slot.compare_exchange_strong(expected, created, std::memory_order_acq_rel))
+                return created;
+
+            delete created;
+        }
+
+        for (std::atomic<flight_ring*>& slot : rings)
+        {
+            flight_ring *ring = slot.load(std::memory_order_acquire);
+            bool free = false;
+            if (ring && ring->owned.compare_exchange_strong(free, true, std::memory_order_acq_rel))
+                return ring;
+        }
+
+        // more threads than slots: their events are not recorded
+        return nullptr;
+    }
+
+    // owned by the thread till its exit. Rings are never deleted
+    struct ring_owner
+    {
+        flight_ring *ring = claim_ring();
+
+        ring_owner()
+        {
+            if (ring)
+                ring->threadId = os_thread_id();
+        }
+
+        ~ring_owner()
+        {
+            if (ring)
+                ring->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    struct ring_cursor
+    {
+        const flight_ring *ring;
+        uint64_t next;
+        uint64_t end;
+    };
+
+    // k-way merge by timestamp. Uses the stack only
+    template <class F>
+    void merge_rings(F&& emit)
+    {
+        std::array<ring_cursor, flight_recorder::max_threads> cursors;
+        size_t numCursors = 0;
+
+        for (const std::atomic<flight_ring*>& slot : rings)
+        {
+            const flight_ring *ring = slot.load(std::memory_order_acquire);
+            if (!ring)
+                continue;
+
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > flight_recorder::ring_capacity ?
+                head - flight_recorder::ring_capacity : 0;
+            if (first != head)
+                cursors[numCursors++] = { ring, first, head };
+        }
+
+        while (true)
+        {
+            ring_cursor *earliest = nullptr;
+            for (size_t i = 0; i < numCursors; ++i)
+            {
+                ring_cursor& c = cursors[i];
+                if (c.next == c.end)
+                    continue;
+
+                if (!earliest || c.ring->records[c.next % flight_recorder::ring_capacity].ticks <
+                    earliest->ring->records[earliest->next % flight_recorder::ring_capacity].ticks)
+                    earliest = &c;
+            }
+
+            if (!earliest)
+                return;
+
+            emit(*earliest->ring, earliest->next);
+            ++earliest->next;
+        }
+    }
+
+    const char* event_name(flight_event event)
+    {
+        switch (event)
+        {
+        case flight_event::invoke: return "invoke";
+        case flight_event::connect: return "connect";
+        case flight_event::disconnect: return "disconnect";
+        default: return "unknown";
+        }
+    }
+
+    bool write_all(int fd, const void *data, size_t size) noexcept
+    {
+        const char *p = static_cast<const char*>(data);
+        while (size)
+        {
+#ifdef _WIN32
+            int written = _write(fd, p, (unsigned int)size);
+#else
+            ssize_t written = write(fd, p, size);
+#endif
+            if (written <= 0)
+                return false;
+
+            p += written;
+            size -= (size_t)written;
+        }
+
+        return true;
+    }
+}
+
+void cmw::flight_recorder::Record(flight_event event, int32_t dispId, int32_t result,
+    uint32_t numArgs, uint32_t cookie) noexcept
+{
+    // the owner has a destructor: keep its guarded access off the fast path
+    thread_local flight_ring *ring = nullptr;
+    thread_local bool claimed = false;
+
+    if (!ring)
+    {
+        if (claimed)
+            return;
+
+        allocation_guard::exempt once;
+        thread_local ring_owner owner;
+        claimed = true;
+        ring = owner.ring;
+        if (!ring)
+            return;
+    }
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    flight_record& record = ring->records[head % ring_capacity];
+
+    // the slot holds record head - capacity until the stores below. Snapshot copies
+    // it, then reads head again and drops every record at or below head - capacity.
+    // The fence keeps the store of head by the previous Record ahead of the new
+    // fields: a reader copying any of them reads this head or a later one, and drops
+    // the copy. Compiles to nothing on x86
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record.ticks = flight_clock();
+    record.dispId = dispId;
+    record.result = result;
+    record.cookie = cookie;
+    record.threadId = ring->threadId;
+    record.numArgs = (uint16_t)std::min<uint32_t>(numArgs, UINT16_MAX);
+    record.event = event;
+    record.reserved = 0;
+
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<flight_record> cmw::flight_recorder::Snapshot()
+{
+    std::vector<flight_record> merged;
+    merged.reserve(ring_capacity);
+
+    // records are copied with their position, to find the ones overwritten meanwhile
+    std::vector<std::pair<const flight_ring*, uint64_t>> positions;
+    merge_rings([&](const flight_ring& ring, uint64_t index)
+    {
+        merged.push_back(ring.records[index % ring_capacity]);
+        positions.emplace_back(&ring, index);
+    });
+
+    // the copies above must complete before head is read again
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < merged.size(); ++i)
+    {
+        uint64_t head = positions[i].first->head.load(std::memory_order_acquire);
+        if (head - positions[i].second >= ring_capacity)
+            continue;
+
+        merged[kept++] = merged[i];
+    }
+
+    merged.resize(kept);
+    return merged;
+}
+
+void cmw::flight_recorder::Dump(std::ostream & out)
+{
+    for (const flight_record& record : Snapshot())
+    {
+        out << record.ticks << ' ' << event_name(record.event)
+            << " thread=" << record.threadId
+            << " dispid=" << record.dispId
+            << " args=" << record.numArgs
+            << " cookie=" << record.cookie
+            << " hr=0x" << std::hex << std::setw(8) << std::setfill('0')
+            << (uint32_t)record.result << std::dec << std::setfill(' ') << '\n';
+    }
+}
+
+void cmw::flight_recorder::DumpSignalSafe(int fd) noexcept
+{
+    struct header
+    {
+        char magic[8];
+        uint32_t recordSize;
+        uint32_t reserved;
+    };
+
+    header h{ { 'C', 'M', 'W', 'F', 'L', 'T', '1', '\0' }, (uint32_t)sizeof(flight_record), 0 };
+    if (!write_all(fd, &h, sizeof(h)))
+        return;
+
+    std::array<flight_record, 64> buffer;
+    size_t buffered = 0;
+
+    merge_rings([&](const flight_ring& ring, uint64_t index)
+    {
+        buffer[buffered++] = ring.records[index % ring_capacity];
+        if (buffered == buffer.size())
+        {
+            write_all(fd, buffer.data(), buffered * sizeof(flight_record));
+            buffered = 0;
+        }
+    });
+
+    write_all(fd, buffer.data(), buffered * sizeof(flight_record));
+}
@@ -0,0 +1,142 @@
+﻿#include "com_memory.h"
+
+#include <algorithm>
+
+
+using namespace cmw;
+
+std::atomic<allocation_check> cmw::allocation_guard::mode_ = allocation_check::off;
+std::atomic<allocation_guard::violation_handler> cmw::allocation_guard::handler_ = nullptr;
+
+namespace
+{
+    // guarded scopes entered by the thread
+    thread_local unsigned guardDepth = 0;
+    thread_local unsigned exemptDepth = 0;
+
+    std::atomic<uint64_t> violations = 0;
+    std::atomic<uint64_t> violationBytes = 0;
+}
+
+void cmw::allocation_guard::OnGlobalAllocation(size_t size) noexcept
+{
+    if (!guardDepth || exemptDepth)
+        return;
+
+    violations.fetch_add(1, std::memory_order_relaxed);
+    violationBytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (Mode() != allocation_check::assert_none)
+        return;
+
+    // global allocation during Invoke
+    if (violation_handler handler = handler_.load(std::memory_order_acquire))
+        handler(size);
+    else
+        std::abort();
+}
+
+uint64_t cmw::allocation_guard::Violations() noexcept
+{
+    return violations.load(std::memory_order_relaxed);
+}
+
+uint64_t cmw::allocation_guard::ViolationBytes() noexcept
+{
+    return violationBytes.load(std::memory_order_relaxed);
+}
+
+cmw::allocation_guard::scope::scope() noexcept
+    : active_(Mode() != allocation_check::off)
+{
+    if (active_)
+        ++guardDepth;
+}
+
+cmw::allocation_guard::scope::~scope()
+{
+    if (active_)
+        --guardDepth;
+}
+
+cmw::allocation_guard::exempt::exempt() noexcept
+    : active_(guardDepth != 0)
+{
+    if (active_)
+        ++exemptDepth;
+}
+
+cmw::allocation_guard::exempt::~exempt()
+{
+    if (active_)
+        --exemptDepth;
+}
+
+
+scratch_arena & cmw::scratch_arena::Current() noexcept
+{
+    thread_local scratch_arena arena;
+    return arena;
+}
+
+cmw::scratch_arena::~scratch_arena()
+{
+    while (first_)
+    {
+        chunk *next = first_->next;
+        ::operator delete(first_);
+        first_ = next;
+    }
+}
+
+void * cmw::scratch_arena::do_allocate(size_t bytes, size_t alignment)
+{
+    while (true)
+    {
+        if (current_)
+        {
+            // aligned in memory, the data of a chunk is aligned for max_align_t only
+            uintptr_t base = reinterpret_cast<uintptr_t>(data(current_));
+            size_t offset = ((base + used_ + alignment - 1) & ~uintptr_t(alignment - 1)) - base;
+            if (offset + bytes <= current_->size)
+            {
+                used_ = offset + bytes;
+                return data(current_) + offset;
+            }
+        }
+
+        // the chunks following the current one are free
+        chunk *next = current_ ? current_->next : first_;
+        if (!next || next->size < bytes + alignment)
+            next = add_chunk(bytes + alignment);
+
+        current_ = next;
+        used_ = 0;
+    }
+}
+
+cmw::scratch_arena::chunk * cmw::scratch_arena::add_chunk(size_t minSize)
+{
+    // the arena grows until it fits the largest callback, then stays
+    allocation_guard::exempt exempt;
+
+    size_t size = std::max(minSize, chunk_size);
+    chunk *c = static_cast<chunk*>(::operator new(sizeof(chunk) + size));
+    c->size = size;
+
+    if (current_)
+    {
+        c->next = current_->next;
+        current_->next = c;
+    }
+    else
+    {
+        c->next = first_;
+        first_ = c;
+    }
+
+    ++numChunks_;
+    capacity_ += size;
+
+    return c;
+}
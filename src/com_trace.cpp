@@ -0,0 +1,241 @@
+﻿#include "com_trace.h"
+#include "com_memory.h"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cinttypes>
+#include <cstdio>
+
+
+using namespace cmw;
+
+std::atomic<bool> cmw::tracer::enabled_ = false;
+
+const char * cmw::trace_category_name(trace_category category) noexcept
+{
+    switch (category)
+    {
+    case trace_category::create_instance: return "create_instance";
+    case trace_category::query_interface: return "query_interface";
+    case trace_category::find_connection_point: return "find_connection_point";
+    case trace_category::connect: return "connect";
+    case trace_category::disconnect: return "disconnect";
+    case trace_category::invoke: return "invoke";
+    default: return "unknown";
+    }
+}
+
+void cmw::trace_ring::Push(const trace_record & record) noexcept
+{
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= capacity)
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    records_[head % capacity] = record;
+    head_.store(head + 1, std::memory_order_release);
+}
+
+size_t cmw::trace_ring::Drain(std::vector<trace_record>& out)
+{
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+
+    for (size_t i = tail; i != head; ++i)
+        out.push_back(records_[i % capacity]);
+
+    tail_.store(head, std::memory_order_release);
+    return head - tail;
+}
+
+namespace
+{
+    struct trace_session
+    {
+        std::mutex mutexRings;
+        std::vector<std::shared_ptr<trace_ring>> rings;
+        uint32_t nextThreadId = 1;
+
+        // serializes Start and Stop
+        std::mutex mutexControl;
+        std::mutex mutexFlusher;
+        std::condition_variable wake;
+        bool stop = false;
+        std::thread flusher;
+
+        std::ofstream out;
+        bool first = true;
+        int64_t originNs = 0;
+        uint64_t dropped = 0;
+
+        std::shared_ptr<trace_ring> NewRing()
+        {
+            std::lock_guard<std::mutex> lock(mutexRings);
+            rings.push_back(std::make_shared<trace_ring>(nextThreadId++));
+            return rings.back();
+        }
+
+        // called by the flusher thread, or by Stop after it is joined
+        void Flush(std::vector<trace_record>& buffer)
+        {
+            std::vector<std::shared_ptr<trace_ring>> snapshot;
+            {
+                std::lock_guard<std::mutex> lock(mutexRings);
+                snapshot = rings;
+            }
+
+            for (const std::shared_ptr<trace_ring>& ring : snapshot)
+            {
+                buffer.clear();
+                ring->Drain(buffer);
+
+                for (const trace_record& record : buffer)
+                    write(record, ring->ThreadId());
+            }
+
+            out.flush();
+        }
+
+        void write(const trace_record& record, uint32_t threadId)
+        {
+            char line[320];
+            std::snprintf(line, sizeof(line),
+                "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu32
+                ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%" PRId64 ",\"hr\":\"0x%08" PRIX32 "\"}}",
+                first ? "" : ",\n",
+                record.name, trace_category_name(record.category), threadId,
+                (double)(record.beginNs - originNs) / 1000.0,
+                (double)(record.endNs - record.beginNs) / 1000.0,
+                record.arg, (uint32_t)record.result);
+
+            out << line;
+            first = false;
+        }
+    };
+
+    trace_session& session()
+    {
+        static trace_session s;
+        return s;
+    }
+}
+
+bool cmw::tracer::Start(const std::string & path, std::chrono::milliseconds flushInterval)
+{
+    trace_session& s = session();
+    std::lock_guard<std::mutex> control(s.mutexControl);
+
+    if (s.flusher.joinable())
+        return false;
+
+    s.out.open(path, std::ios::out | std::ios::trunc);
+    if (!s.out)
+        return false;
+
+    // leftovers of the previous session
+    {
+        std::vector<trace_record> discarded;
+        std::lock_guard<std::mutex> lock(s.mutexRings);
+        for (const std::shared_ptr<trace_ring>& ring : s.rings)
+        {
+            ring->Drain(discarded);
+            ring->TakeDropped();
+        }
+    }
+
+    s.out << "{\"traceEvents\":[\n";
+    s.first = true;
+    s.originNs = Now();
+    s.dropped = 0;
+    s.stop = false;
+
+    s.flusher = std::thread([&s, flushInterval]()
+    {
+        std::vector<trace_record> buffer;
+
+        std::unique_lock<std::mutex> lock(s.mutexFlusher);
+        while (!s.stop)
+        {
+            s.wake.wait_for(lock, flushInterval, [&s]() { return s.stop; });
+
+            lock.unlock();
+            s.Flush(buffer);
+            lock.lock();
+        }
+    });
+
+    enabled_.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void cmw::tracer::Stop()
+{
+    trace_session& s = session();
+    std::lock_guard<std::mutex> control(s.mutexControl);
+
+    if (!s.flusher.joinable())
+        return;
+
+    enabled_.store(false, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(s.mutexFlusher);
+        s.stop = true;
+    }
+    s.wake.notify_one();
+    s.flusher.join();
+
+    // spans completed while the flusher was stopping
+    std::vector<trace_record> buffer;
+    s.Flush(buffer);
+
+    s.out << "\n]}\n";
+    s.out.close();
+
+    std::lock_guard<std::mutex> lock(s.mutexRings);
+    for (const std::shared_ptr<trace_ring>& ring : s.rings)
+        s.dropped += ring->TakeDropped();
+
+    // rings of the exited threads
+    s.rings.erase(std::remove_if(s.rings.begin(), s.rings.end(),
+        [](const std::shared_ptr<trace_ring>& ring) { return ring.use_count() == 1; }),
+        s.rings.end());
+}
+
+uint64_t cmw::tracer::Dropped()
+{
+    trace_session& s = session();
+
+    std::lock_guard<std::mutex> lock(s.mutexRings);
+    uint64_t dropped = s.dropped;
+    if (Enabled())
+        for (const std::shared_ptr<trace_ring>& ring : s.rings)
+            dropped += ring->Dropped();
+
+    return dropped;
+}
+
+void cmw::tracer::Record(const trace_record & record) noexcept
+{
+    thread_local std::shared_ptr<trace_ring> ring;
+
+    if (!ring)
+    {
+        try
+        {
+            allocation_guard::exempt once;
+            ring = session().NewRing();
+        }
+        catch (...)
+        {
+            return;
+        }
+    }
+
+    ring->Push(record);
+}
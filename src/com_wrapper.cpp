@@ -1,6 +1,8 @@
 ﻿#include "com_wrapper.h"
 
 #include <exception>
+#include <algorithm>
+#include <iterator>
 
 
 using namespace cmw;
@@ -12,54 +14,1138 @@ COMContext::COMContext(bool multithreaded)
         COINIT_APARTMENTTHREADED;
 
     HRESULT res = CoInitializeEx(0, threads);
+    if (res == RPC_E_CHANGED_MODE)
+        return;
 
     assert(SUCCEEDED(res) && "Failed to initialize COM");
 
     if (!SUCCEEDED(res))
         throw std::exception("Failed to initialize COM");
+
+    initialized_ = true;
+}
+
+COMContext::~COMContext()
+{
+    if (initialized_)
+        CoUninitialize();
+}
+
+
+thread_local bool cmw::com_thread::initialized_ = false;
+
+namespace
+{
+    std::atomic<com_apartment> defaultApartment = com_apartment::multithreaded;
+
+    // apartment chosen by the thread, if any
+    thread_local bool hasApartment = false;
+    thread_local com_apartment threadApartment = com_apartment::multithreaded;
+
+    // balances a successful CoInitializeEx at thread exit
+    struct com_uninitializer
+    {
+        ~com_uninitializer()
+        {
+            CoUninitialize();
+        }
+    };
+}
+
+void cmw::com_thread::SetDefaultApartment(com_apartment apartment) noexcept
+{
+    defaultApartment = apartment;
+}
+
+void cmw::com_thread::SetApartment(com_apartment apartment) noexcept
+{
+    hasApartment = true;
+    threadApartment = apartment;
+}
+
+HRESULT cmw::com_thread::initialize() noexcept
+{
+    com_apartment apartment = hasApartment ? threadApartment : defaultApartment.load();
+
+    HRESULT hr = CoInitializeEx(0, apartment == com_apartment::multithreaded ?
+        COINIT_MULTITHREADED :
+        COINIT_APARTMENTTHREADED);
+
+    // initialized by someone else, the owner uninitializes
+    if (hr == RPC_E_CHANGED_MODE)
+    {
+        initialized_ = true;
+        return S_OK;
+    }
+
+    if (!SUCCEEDED(hr))
+        return hr;
+
+    thread_local com_uninitializer uninitializer;
+    initialized_ = true;
+
+    return S_OK;
+}
+
+
+thread_local size_t cmw::deferred_release::depth_ = 0;
+
+release_queue & cmw::com_release_queue()
+{
+    // the nodes and the thread are created once, maybe by a release inside Invoke
+    allocation_guard::exempt exempt;
+    static release_queue queue([]()
+    {
+        com_thread::SetApartment(com_apartment::multithreaded);
+        com_thread::Ensure();
+    });
+    return queue;
+}
+
+
+cmw::thread_pool::thread_pool(size_t numThreads)
+{
+    numThreads = std::max<size_t>(numThreads, 1);
+
+    workers_.reserve(numThreads);
+    for (size_t i = 0; i < numThreads; ++i)
+        workers_.emplace_back(&thread_pool::run, this);
+}
+
+void cmw::thread_pool::Post(std::function<void()>&& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexTasks_);
+        assert(!stop_ && "Posting to a stopped pool!");
+        tasks_.push_back(std::move(task));
+    }
+    hasTasks_.notify_one();
+}
+
+cmw::thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexTasks_);
+        stop_ = true;
+    }
+    hasTasks_.notify_all();
+
+    for (std::thread& worker : workers_)
+        worker.join();
+}
+
+void cmw::thread_pool::run()
+{
+    // the tasks share the workers: the default apartment of the process may be single-threaded
+    com_thread::SetApartment(com_apartment::multithreaded);
+
+    std::unique_lock<std::mutex> lock(mutexTasks_);
+    while (true)
+    {
+        hasTasks_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+
+        if (tasks_.empty())
+            return;
+
+        std::function<void()> task = std::move(tasks_.front());
+        tasks_.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+
+std::variant<ComPtr<IConnectionPoint>, HRESULT> FindConnectionPoint<void>::Find(IConnectionPointContainer & cpContainer, REFIID riid)
+{
+    trace_span span("FindConnectionPoint::Find", trace_category::find_connection_point);
+    IConnectionPoint *pCp = nullptr;
+    HRESULT hr = cpContainer.FindConnectionPoint(riid, &pCp);
+    span.SetResult(hr);
+    if (!SUCCEEDED(hr))
+        return hr;
+
+    return ComPtr<IConnectionPoint>(pCp);
+}
+
+
+
+Result<ComPtr<IConnectionPoint>> cmw::connection_point_cache::Find(IConnectionPointContainer & cpContainer, REFIID riid) noexcept
+{
+    Result<ComPtr<IUnknown>> identity = ComPtr<IUnknown>::TryQuery(&cpContainer);
+    if (!identity)
+        return Result<ComPtr<IConnectionPoint>>::Fail(identity.HResult());
+
+    key k{ identity.Raw(), riid };
+
+    {
+        std::lock_guard<std::mutex> lock(mutexEntries_);
+        auto found = entries_.find(k);
+        if (found != entries_.cend())
+        {
+            ++hits_;
+            return found->second.cpoint;
+        }
+    }
+
+    ++misses_;
+
+    // the lookup may be a round trip: do not hold the lock
+    Result<ComPtr<IConnectionPoint>> cpoint = FindConnectionPoint<>::TryFind(cpContainer, riid);
+    if (!cpoint)
+        return cpoint;
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(mutexEntries_);
+        entries_.emplace(k, entry{ std::move(identity).Value(), cpoint.Value() });
+    }
+    catch (const std::bad_alloc&)
+    {
+        // not cached, the connection point is still valid
+    }
+
+    return cpoint;
+}
+
+void cmw::connection_point_cache::Evict(IUnknown & container)
+{
+    Result<ComPtr<IUnknown>> identity = ComPtr<IUnknown>::TryQuery(&container);
+    if (!identity)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutexEntries_);
+
+    auto it = entries_.begin();
+    while (it != entries_.end())
+    {
+        if (it->first.identity == identity.Raw())
+            it = entries_.erase(it);
+        else
+            ++it;
+    }
+}
+
+void cmw::connection_point_cache::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutexEntries_);
+    entries_.clear();
+}
+
+size_t cmw::connection_point_cache::Size() const
+{
+    std::lock_guard<std::mutex> lock(mutexEntries_);
+    return entries_.size();
+}
+
+
+cmw::interface_cache::interface_cache(const interface_cache & other)
+    : source_(other.source_),
+    entries_(other.entries_),
+    size_(other.size_),
+    next_(other.next_),
+    hits_(other.hits_),
+    misses_(other.misses_)
+{
+    for (size_t i = 0; i < size_; ++i)
+        if (entries_[i].ptr)
+            static_cast<IUnknown*>(entries_[i].ptr)->AddRef();
+}
+
+cmw::interface_cache::interface_cache(interface_cache && other) noexcept
+    : source_(std::move(other.source_)),
+    entries_(other.entries_),
+    size_(other.size_),
+    next_(other.next_),
+    hits_(other.hits_),
+    misses_(other.misses_)
+{
+    other.size_ = 0;
+    other.next_ = 0;
+}
+
+interface_cache & cmw::interface_cache::operator=(const interface_cache & other)
+{
+    if (this != &other)
+        *this = interface_cache(other);
+
+    return *this;
+}
+
+interface_cache & cmw::interface_cache::operator=(interface_cache && other) noexcept
+{
+    if (this == &other)
+        return *this;
+
+    Clear();
+
+    source_ = std::move(other.source_);
+    entries_ = other.entries_;
+    size_ = other.size_;
+    next_ = other.next_;
+    hits_ = other.hits_;
+    misses_ = other.misses_;
+
+    other.size_ = 0;
+    other.next_ = 0;
+
+    return *this;
+}
+
+void cmw::interface_cache::Clear() noexcept
+{
+    for (size_t i = 0; i < size_; ++i)
+        if (entries_[i].ptr)
+            static_cast<IUnknown*>(entries_[i].ptr)->Release();
+
+    size_ = 0;
+    next_ = 0;
+    source_ = ComPtr<IUnknown>();
+}
+
+cmw::interface_cache::~interface_cache()
+{
+    Clear();
+}
+
+HRESULT cmw::interface_cache::query(IUnknown * object, REFIID riid, void ** ppv) noexcept
+{
+    *ppv = nullptr;
+    if (!object)
+        return E_POINTER;
+
+    if (source_.GetRaw() != object)
+    {
+        Clear();
+
+        // held so that the address can not be reused by another object while cached
+        object->AddRef();
+        source_ = ComPtr<IUnknown>(object);
+    }
+
+    for (size_t i = 0; i < size_; ++i)
+    {
+        entry& e = entries_[i];
+        if (std::memcmp(&e.iid, &riid, sizeof(IID)) != 0)
+            continue;
+
+        ++hits_;
+        if (e.ptr)
+        {
+            static_cast<IUnknown*>(e.ptr)->AddRef();
+            *ppv = e.ptr;
+        }
+        return e.hr;
+    }
+
+    ++misses_;
+
+    trace_span span("interface_cache::Query", trace_category::query_interface);
+    HRESULT hr = object->QueryInterface(riid, ppv);
+    span.SetResult(hr);
+
+    // QueryInterface is stable for the object's lifetime, other failures may be transient
+    if (!SUCCEEDED(hr) && hr != E_NOINTERFACE)
+        return hr;
+
+    entry *e = nullptr;
+    if (size_ < capacity)
+        e = &entries_[size_++];
+    else
+    {
+        e = &entries_[next_];
+        next_ = (next_ + 1) % capacity;
+
+        if (e->ptr)
+            static_cast<IUnknown*>(e->ptr)->Release();
+    }
+
+    e->iid = riid;
+    e->hr = hr;
+    e->ptr = SUCCEEDED(hr) ? *ppv : nullptr;
+    if (e->ptr)
+        static_cast<IUnknown*>(e->ptr)->AddRef();
+
+    return hr;
+}
+
+
+namespace
+{
+    // listeners are created by thousands and their callbacks rarely change:
+    // writers share a small pool of mutexes instead of owning one each
+    std::mutex& table_mutex(const Listener *listener)
+    {
+        static std::array<std::mutex, 32> mutexes;
+        return mutexes[(reinterpret_cast<uintptr_t>(listener) >> 4) % mutexes.size()];
+    }
+
+    const std::shared_ptr<const callback_table>& empty_table()
+    {
+        static const std::shared_ptr<const callback_table> table =
+            std::make_shared<callback_table>();
+        return table;
+    }
+
+    // the copy is made in the resource of the source
+    template<class T, class ... A>
+    std::shared_ptr<T> make_in(const callback_table::allocator_type& alloc, A&& ... args)
+    {
+        return std::allocate_shared<T>(alloc, std::forward<A>(args)...);
+    }
+
+    thread_local void *invokeContext = nullptr;
+
+    // restores the outer context: handlers may fire events of other listeners
+    class invoke_context_scope
+    {
+        void *prev_;
+
+    public:
+
+        explicit invoke_context_scope(void *context) noexcept
+            : prev_(invokeContext)
+        {
+            invokeContext = context;
+        }
+
+        ~invoke_context_scope()
+        {
+            invokeContext = prev_;
+        }
+    };
+}
+
+cmw::Listener::Listener(REFIID connectionIID)
+    : connectionIID_(connectionIID),
+    callbacks_(empty_table()),
+    table_(callbacks_.get())
+{
+}
+
+cmw::Listener::Listener(REFIID connectionIID, std::shared_ptr<const callback_table> callbacks,
+    void * context)
+    : connectionIID_(connectionIID),
+    callbacks_(callbacks ? std::move(callbacks) : empty_table()),
+    table_(callbacks_.get()),
+    context_(context)
+{
+}
+
+cmw::Listener::Listener(REFIID connectionIID, std::pmr::memory_resource * resource)
+    : connectionIID_(connectionIID),
+    callbacks_(make_in<callback_table>(callback_table::allocator_type(resource))),
+    table_(callbacks_.get()),
+    connections_(resource)
+{
+}
+
+cmw::Listener::~Listener()
+{
+    if (const std::shared_ptr<invoke_monitor>& monitor = callbacks_->monitor)
+        monitor->Detach(*this);
+
+    // the replaced tables are allocated from resource, which may go with the listener
+    epoch_reclamation::Synchronize(this);
+}
+
+uint64_t cmw::Listener::next_id() noexcept
+{
+    static std::atomic<uint64_t> lastId = 0;
+    return ++lastId;
+}
+
+std::unique_ptr<Listener> cmw::Listener::Create(REFIID connectionIID)
+{
+    return std::unique_ptr<Listener>(new Listener(connectionIID));
+}
+
+std::unique_ptr<Listener> cmw::Listener::Create(REFIID connectionIID,
+    std::shared_ptr<const callback_table> callbacks, void * context)
+{
+    return std::unique_ptr<Listener>(new Listener(connectionIID, std::move(callbacks), context));
+}
+
+std::unique_ptr<Listener> cmw::Listener::Create(REFIID connectionIID,
+    std::pmr::memory_resource * resource)
+{
+    return std::unique_ptr<Listener>(new Listener(connectionIID, resource));
+}
+
+std::shared_ptr<const callback_table> cmw::Listener::Callbacks() const
+{
+    return std::atomic_load(&callbacks_);
+}
+
+void cmw::Listener::SetContext(void * context)
+{
+    context_ = context;
+}
+
+void * cmw::Listener::Context() const
+{
+    return context_;
+}
+
+void * cmw::Listener::InvokeContext() noexcept
+{
+    return invokeContext;
+}
+
+REFIID cmw::Listener::Interface(size_t n) const
+{
+    assert(!n && "Only one interface connectible!");
+    if (n)
+        throw std::out_of_range("Inerface index is out of bounds!");
+
+    return connectionIID_;
+}
+
+size_t cmw::Listener::NumInterfaces() const
+{
+    return 1;
+}
+
+namespace
+{
+    // argument at its declaration position: rgvarg is stored in reverse order.
+    // References are read into a shallow copy, which does not own the value
+    bool disp_arg(const DISPPARAMS *pDispParams, UINT arg, VARIANT& value)
+    {
+        if (!pDispParams || arg >= pDispParams->cArgs)
+            return false;
+
+        const VARIANT *pArg = &pDispParams->rgvarg[pDispParams->cArgs - 1 - arg];
+        if (pArg->vt == (VT_BYREF | VT_VARIANT))
+        {
+            if (!pArg->pvarVal)
+                return false;
+            pArg = pArg->pvarVal;
+        }
+
+        if (!(pArg->vt & VT_BYREF))
+        {
+            value = *pArg;
+            return true;
+        }
+
+        if (!pArg->byref)
+            return false;
+
+        VariantInit(&value);
+        value.vt = pArg->vt & ~VT_BYREF;
+        switch (value.vt)
+        {
+        case VT_I1: value.cVal = *pArg->pcVal; break;
+        case VT_UI1: value.bVal = *pArg->pbVal; break;
+        case VT_I2: value.iVal = *pArg->piVal; break;
+        case VT_UI2: value.uiVal = *pArg->puiVal; break;
+        case VT_I4: value.lVal = *pArg->plVal; break;
+        case VT_UI4: value.ulVal = *pArg->pulVal; break;
+        case VT_I8: value.llVal = *pArg->pllVal; break;
+        case VT_UI8: value.ullVal = *pArg->pullVal; break;
+        case VT_INT: value.intVal = *pArg->pintVal; break;
+        case VT_UINT: value.uintVal = *pArg->puintVal; break;
+        case VT_BOOL: value.boolVal = *pArg->pboolVal; break;
+        case VT_R4: value.fltVal = *pArg->pfltVal; break;
+        case VT_R8: value.dblVal = *pArg->pdblVal; break;
+        case VT_DATE: value.date = *pArg->pdate; break;
+        case VT_BSTR: value.bstrVal = *pArg->pbstrVal; break;
+        default: return false;
+        }
+
+        return true;
+    }
+
+    bool arg_int(const VARIANT& arg, LONGLONG& value)
+    {
+        switch (arg.vt)
+        {
+        case VT_I1: value = arg.cVal; return true;
+        case VT_UI1: value = arg.bVal; return true;
+        case VT_I2: value = arg.iVal; return true;
+        case VT_UI2: value = arg.uiVal; return true;
+        case VT_I4: value = arg.lVal; return true;
+        case VT_UI4: value = arg.ulVal; return true;
+        case VT_I8: value = arg.llVal; return true;
+        case VT_UI8: value = (LONGLONG)arg.ullVal; return true;
+        case VT_INT: value = arg.intVal; return true;
+        case VT_UINT: value = arg.uintVal; return true;
+        case VT_BOOL: value = arg.boolVal; return true;
+        default: return false;
+        }
+    }
+
+    bool arg_double(const VARIANT& arg, double& value)
+    {
+        switch (arg.vt)
+        {
+        case VT_R4: value = arg.fltVal; return true;
+        case VT_R8: value = arg.dblVal; return true;
+        case VT_DATE: value = arg.date; return true;
+        default:
+            break;
+        }
+
+        LONGLONG i = 0;
+        if (!arg_int(arg, i))
+            return false;
+
+        value = (double)i;
+        return true;
+    }
+
+    bool arg_str(const VARIANT& arg, std::wstring_view& value)
+    {
+        if (arg.vt != VT_BSTR)
+            return false;
+
+        value = arg.bstrVal ?
+            std::wstring_view(arg.bstrVal, SysStringLen(arg.bstrVal)) :
+            std::wstring_view();
+        return true;
+    }
+
+    size_t hash_int(LONGLONG value)
+    {
+        return std::hash<LONGLONG>()(value);
+    }
+
+    size_t hash_str(std::wstring_view value)
+    {
+        return std::hash<std::wstring_view>()(value);
+    }
+
+    // true if an argument holds an interface or a reference, which may be used
+    // by the firing thread only
+    bool bound_to_caller(const DISPPARAMS *pDispParams)
+    {
+        if (!pDispParams)
+            return false;
+
+        for (UINT i = 0; i < pDispParams->cArgs; ++i)
+        {
+            VARTYPE vt = pDispParams->rgvarg[i].vt;
+            if (vt & VT_BYREF)
+                return true;
+
+            vt &= VT_TYPEMASK;
+            if (vt == VT_DISPATCH || vt == VT_UNKNOWN || vt == VT_VARIANT)
+                return true;
+        }
+
+        return false;
+    }
+
+    // calls fn for every subscriber accepting the event.
+    // Returns false if nobody is subscribed to the DISPID
+    template <class F>
+    bool for_each_accepting(const callback_table& table, DISPID dispIdMember,
+        const DISPPARAMS *pDispParams, F&& fn)
+    {
+        bool known = false;
+
+        auto found = table.callbacks.find(dispIdMember);
+        if (found != table.callbacks.cend())
+        {
+            known = true;
+            const callback_table::dispatch_entry& entry = *found->second;
+
+            for (const callback_table::subscriber& subscriber : entry.plain)
+                if (subscriber.Accepts(pDispParams))
+                    fn(subscriber);
+
+            for (const auto& slot : entry.indexed)
+            {
+                size_t hash = 0;
+                if (!event_filter::ArgHash(pDispParams, slot.first, hash))
+                    continue;
+
+                auto bucket = slot.second.find(hash);
+                if (bucket == slot.second.cend())
+                    continue;
+
+                // equal hashes may still hold different values, the filter decides
+                for (const callback_table::subscriber& subscriber : *bucket->second)
+                    if (subscriber.Accepts(pDispParams))
+                        fn(subscriber);
+            }
+        }
+
+        if (table.ranges)
+            for (const callback_table::range_subscriber& range : *table.ranges)
+            {
+                if (dispIdMember < range.first || dispIdMember > range.last)
+                    continue;
+
+                known = true;
+                if (range.target.Accepts(pDispParams))
+                    fn(range.target);
+            }
+
+        return known;
+    }
+
+    bool remove_from_entry(callback_table& table, const subscription& handle)
+    {
+        auto found = table.callbacks.find(handle.dispID);
+        if (found == table.callbacks.end())
+            return false;
+
+        auto has_id = [&handle](const callback_table::subscriber& s) { return s.id == handle.id; };
+
+        auto entry = make_in<callback_table::dispatch_entry>(table.get_allocator(), *found->second);
+
+        auto plain = std::find_if(entry->plain.begin(), entry->plain.end(), has_id);
+        if (plain != entry->plain.end())
+            entry->plain.erase(plain);
+        else
+        {
+            bool removed = false;
+            for (auto slot = entry->indexed.begin(); slot != entry->indexed.end(); ++slot)
+            {
+                auto bucket = std::find_if(slot->second.begin(), slot->second.end(),
+                    [&has_id](const auto& b) { return std::any_of(b.second->cbegin(), b.second->cend(), has_id); });
+                if (bucket == slot->second.end())
+                    continue;
+
+                auto subscribers = make_in<callback_table::subscribers>(table.get_allocator());
+                std::copy_if(bucket->second->cbegin(), bucket->second->cend(), std::back_inserter(*subscribers),
+                    [&has_id](const callback_table::subscriber& s) { return !has_id(s); });
+
+                if (subscribers->empty())
+                    slot->second.erase(bucket);
+                else
+                    bucket->second = std::move(subscribers);
+
+                if (slot->second.empty())
+                    entry->indexed.erase(slot);
+
+                // the erase invalidates slot
+                removed = true;
+                break;
+            }
+
+            if (!removed)
+                return false;
+        }
+
+        if (entry->Empty())
+            table.callbacks.erase(found);
+        else
+            found->second = std::move(entry);
+
+        return true;
+    }
+
+    bool remove_from_ranges(callback_table& table, const subscription& handle)
+    {
+        if (!table.ranges)
+            return false;
+
+        const callback_table::range_subscribers& current = *table.ranges;
+        auto found = std::find_if(current.cbegin(), current.cend(),
+            [&handle](const callback_table::range_subscriber& r) { return r.target.id == handle.id; });
+        if (found == current.cend())
+            return false;
+
+        auto ranges = make_in<callback_table::range_subscribers>(table.get_allocator(), current);
+        ranges->erase(ranges->begin() + (found - current.cbegin()));
+        table.ranges = std::move(ranges);
+
+        return true;
+    }
+}
+
+
+event_filter & cmw::event_filter::ArgEquals(UINT arg, LONGLONG value)
+{
+    predicate p{ op::equals_int, arg };
+    p.value = value;
+    return add(std::move(p));
+}
+
+event_filter & cmw::event_filter::ArgEquals(UINT arg, const std::wstring & value)
+{
+    predicate p{ op::equals_str, arg };
+    p.str = value;
+    return add(std::move(p));
+}
+
+event_filter & cmw::event_filter::ArgInRange(UINT arg, double lo, double hi)
+{
+    assert(lo <= hi && "Invalid range!");
+
+    predicate p{ op::in_range, arg };
+    p.lo = lo;
+    p.hi = hi;
+    return add(std::move(p));
+}
+
+event_filter & cmw::event_filter::ArgStartsWith(UINT arg, const std::wstring & prefix)
+{
+    predicate p{ op::starts_with, arg };
+    p.str = prefix;
+    return add(std::move(p));
 }
 
-COMContext::~COMContext()
+size_t cmw::event_filter::KeyHash() const
 {
-    CoUninitialize();
+    assert(HasKey() && "Filter has no equality predicate!");
+
+    const predicate& key = predicates_[key_];
+    if (key.kind == op::equals_int)
+        return hash_int(key.value);
+
+    return hash_str(key.str);
 }
 
+bool cmw::event_filter::Matches(const DISPPARAMS * pDispParams) const
+{
+    for (const predicate& p : predicates_)
+    {
+        VARIANT arg;
+        if (!disp_arg(pDispParams, p.arg, arg))
+            return false;
 
-std::variant<ComPtr<IConnectionPoint>, HRESULT> FindConnectionPoint<void>::Find(IConnectionPointContainer & cpContainer, REFIID riid)
+        switch (p.kind)
+        {
+        case op::equals_int:
+        {
+            LONGLONG value = 0;
+            if (!arg_int(arg, value) || value != p.value)
+                return false;
+            break;
+        }
+        case op::in_range:
+        {
+            double value = 0.;
+            if (!arg_double(arg, value) || value < p.lo || value > p.hi)
+                return false;
+            break;
+        }
+        case op::equals_str:
+        {
+            std::wstring_view value;
+            if (!arg_str(arg, value) || value != p.str)
+                return false;
+            break;
+        }
+        case op::starts_with:
+        {
+            std::wstring_view value;
+            if (!arg_str(arg, value) || value.substr(0, p.str.size()) != p.str)
+                return false;
+            break;
+        }
+        }
+    }
+
+    return true;
+}
+
+bool cmw::event_filter::ArgHash(const DISPPARAMS * pDispParams, UINT arg, size_t & hash)
 {
-    IConnectionPoint *pCp = nullptr;
-    HRESULT hr = cpContainer.FindConnectionPoint(riid, &pCp);
-    if (!SUCCEEDED(hr))
-        return hr;
+    VARIANT argValue;
+    if (!disp_arg(pDispParams, arg, argValue))
+        return false;
 
-    return ComPtr<IConnectionPoint>(pCp);
+    std::wstring_view str;
+    if (arg_str(argValue, str))
+    {
+        hash = hash_str(str);
+        return true;
+    }
+
+    LONGLONG value = 0;
+    if (arg_int(argValue, value))
+    {
+        hash = hash_int(value);
+        return true;
+    }
+
+    return false;
 }
 
+event_filter & cmw::event_filter::add(predicate && p)
+{
+    // cheap integer checks are evaluated before the string ones
+    auto pos = std::upper_bound(predicates_.begin(), predicates_.end(), p.kind,
+        [](op kind, const predicate& other) { return kind < other.kind; });
+    predicates_.insert(pos, std::move(p));
+
+    auto key = std::find_if(predicates_.cbegin(), predicates_.cend(),
+        [](const predicate& other)
+    {
+        return other.kind == op::equals_int || other.kind == op::equals_str;
+    });
+    key_ = key == predicates_.cend() ? no_key : (size_t)(key - predicates_.cbegin());
+
+    return *this;
+}
 
 
-std::unique_ptr<Listener> cmw::Listener::Create(REFIID connectionIID)
+size_t cmw::callback_table::dispatch_entry::Size() const
 {
-    return std::unique_ptr<Listener>(new Listener(connectionIID));
+    size_t size = plain.size();
+    for (const auto& slot : indexed)
+        for (const auto& bucket : slot.second)
+            size += bucket.second->size();
+
+    return size;
 }
 
-REFIID cmw::Listener::Interface(size_t n) const
+
+// ids are unique among all Listeners
+static std::atomic<size_t> nextSubscriberId = 1;
+
+// typed callbacks are registered without their adapter, see typed_callback
+static callback_table::subscriber make_subscriber(std::function<disp_inv_t>&& callback,
+    std::shared_ptr<const event_filter> filter)
 {
-    assert(!n && "Only one interface connectible!");
-    if (n)
-        throw std::out_of_range("Inerface index is out of bounds!");
+    const std::type_info *handler = &callback.target_type();
+    if (typed_callback *typed = callback.target<typed_callback>())
+    {
+        handler = typed->handler;
+        callback = std::move(typed->adapter);
+    }
 
-    return connectionIID_;
+    return { nextSubscriberId++, std::move(callback), std::move(filter), handler };
 }
 
-size_t cmw::Listener::NumInterfaces() const
+subscription cmw::Listener::SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback, REFIID)
 {
-    return 1;
+    return add_subscriber(dispiid, make_subscriber(std::move(callback), nullptr));
+}
+
+subscription cmw::Listener::SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback, const event_filter & filter)
+{
+    std::shared_ptr<const event_filter> compiled;
+    if (!filter.Empty())
+        compiled = std::make_shared<const event_filter>(filter);
+
+    return add_subscriber(dispiid, make_subscriber(std::move(callback), std::move(compiled)));
+}
+
+subscription cmw::Listener::SetCallbackOnce(DISPID dispiid, std::function<disp_inv_t>&& callback, const event_filter & filter)
+{
+    struct once_state
+    {
+        std::atomic<bool> fired = false;
+        // handle is set before registered
+        std::atomic<bool> registered = false;
+        subscription handle;
+    };
+
+    auto state = std::make_shared<once_state>();
+
+    // the wrapper keeps reporting the caller's handler
+    callback_table::subscriber target = make_subscriber(std::move(callback), nullptr);
+
+    subscription handle = SetCallback(dispiid, typed_callback{
+        [this, state, callback = std::move(target.callback)](DISPID dispIdMember, REFIID riid,
+            LCID lcid, WORD wFlags, DISPPARAMS *pDispParams, VARIANT *pVarResult,
+            EXCEPINFO *pExcepInfo, UINT *puArgErr)
+    {
+        if (state->fired.exchange(true, std::memory_order_acq_rel))
+            return S_OK;
+
+        // removed before the call: the callback may register itself again
+        if (state->registered.load(std::memory_order_acquire))
+            RemoveCallback(state->handle);
+
+        return callback(dispIdMember, riid, lcid, wFlags,
+            pDispParams, pVarResult, pExcepInfo, puArgErr);
+    }, target.handler }, filter);
+
+    state->handle = handle;
+    state->registered.store(true, std::memory_order_release);
+
+    // fired while being registered
+    if (state->fired.load(std::memory_order_acquire))
+        RemoveCallback(handle);
+
+    return handle;
+}
+
+subscription cmw::Listener::SetCallback(DISPID first, DISPID last, std::function<disp_inv_t>&& callback, const event_filter & filter)
+{
+    assert(first <= last && "Invalid DISPID range!");
+
+    callback_table::range_subscriber range{ first, last,
+        make_subscriber(std::move(callback), nullptr) };
+    if (!filter.Empty())
+        range.target.filter = std::make_shared<const event_filter>(filter);
+
+    subscription handle{ first, range.target.id };
+
+    std::shared_ptr<const callback_table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(table_mutex(this));
+
+        auto table = make_in<callback_table>(callbacks_->get_allocator(), *callbacks_);
+        auto ranges = table->ranges ?
+            make_in<callback_table::range_subscribers>(table->get_allocator(), *table->ranges) :
+            make_in<callback_table::range_subscribers>(table->get_allocator());
+        ranges->push_back(std::move(range));
+        table->ranges = std::move(ranges);
+        ++table->numSubscribers;
+
+        replaced = publish(std::move(table));
+    }
+
+    retire(std::move(replaced));
+    OnCallbacksChanged();
+
+    return handle;
+}
+
+subscription cmw::Listener::add_subscriber(DISPID dispiid, callback_table::subscriber && subscriber)
+{
+    subscription handle{ dispiid, subscriber.id };
+
+    std::shared_ptr<const callback_table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(table_mutex(this));
+
+        auto table = make_in<callback_table>(callbacks_->get_allocator(), *callbacks_);
+
+        auto entry = make_in<callback_table::dispatch_entry>(table->get_allocator());
+        auto found = table->callbacks.find(dispiid);
+        if (found != table->callbacks.end())
+            *entry = *found->second;
+
+        if (subscriber.filter && subscriber.filter->HasKey())
+        {
+            std::shared_ptr<const callback_table::subscribers>& bucket =
+                entry->indexed[subscriber.filter->KeyArg()][subscriber.filter->KeyHash()];
+
+            auto subscribers = bucket ?
+                make_in<callback_table::subscribers>(table->get_allocator(), *bucket) :
+                make_in<callback_table::subscribers>(table->get_allocator());
+            subscribers->push_back(std::move(subscriber));
+            bucket = std::move(subscribers);
+        }
+        else
+            entry->plain.push_back(std::move(subscriber));
+
+        table->callbacks[dispiid] = std::move(entry);
+        ++table->numSubscribers;
+
+        replaced = publish(std::move(table));
+    }
+
+    retire(std::move(replaced));
+    OnCallbacksChanged();
+
+    return handle;
+}
+
+bool cmw::Listener::RemoveCallback(const subscription& handle)
+{
+    std::shared_ptr<const callback_table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(table_mutex(this));
+
+        auto table = make_in<callback_table>(callbacks_->get_allocator(), *callbacks_);
+        if (!remove_from_entry(*table, handle) &&
+            !remove_from_ranges(*table, handle))
+            return false;
+
+        --table->numSubscribers;
+
+        replaced = publish(std::move(table));
+    }
+
+    retire(std::move(replaced));
+    OnCallbacksChanged();
+
+    return true;
+}
+
+std::shared_ptr<const callback_table> cmw::Listener::publish(std::shared_ptr<const callback_table>&& table)
+{
+    table_.store(table.get(), std::memory_order_seq_cst);
+    return std::atomic_exchange(&callbacks_, std::move(table));
+}
+
+void cmw::Listener::retire(std::shared_ptr<const callback_table>&& table)
+{
+    if (!table)
+        return;
+
+    epoch_reclamation::Retire([table = std::move(table)]() mutable
+    {
+        table.reset();
+    }, this);
+}
+
+size_t cmw::Listener::NumCallbacks(DISPID dispiid) const
+{
+    epoch_reclamation::reader reader;
+    const callback_table *table = table_.load(std::memory_order_seq_cst);
+
+    size_t num = 0;
+
+    auto found = table->callbacks.find(dispiid);
+    if (found != table->callbacks.cend())
+        num += found->second->Size();
+
+    if (table->ranges)
+        num += std::count_if(table->ranges->cbegin(), table->ranges->cend(),
+            [dispiid](const callback_table::range_subscriber& r)
+        {
+            return r.first <= dispiid && dispiid <= r.last;
+        });
+
+    return num;
+}
+
+size_t cmw::Listener::NumCallbacks() const
+{
+    epoch_reclamation::reader reader;
+    return table_.load(std::memory_order_seq_cst)->numSubscribers;
 }
 
-void cmw::Listener::SetCallback(DISPID dispiid, std::function<disp_inv_t>&& callback, REFIID)
+void cmw::Listener::SetFanout(fanout_policy policy, std::shared_ptr<thread_pool> pool)
 {
-    std::unique_lock<std::shared_mutex> uLock;
-    callbackMap_.emplace(dispiid, std::move(callback));
+    assert((policy == fanout_policy::sequential || pool) &&
+        "Parallel fan-out requires a thread pool!");
+
+    std::shared_ptr<const callback_table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(table_mutex(this));
+
+        auto table = make_in<callback_table>(callbacks_->get_allocator(), *callbacks_);
+        table->fanout = policy;
+        table->pool = std::move(pool);
+
+        replaced = publish(std::move(table));
+    }
+
+    retire(std::move(replaced));
+}
+
+void cmw::Listener::SetMonitor(std::shared_ptr<invoke_monitor> monitor)
+{
+    std::shared_ptr<invoke_monitor> previous;
+    std::shared_ptr<const callback_table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(table_mutex(this));
+
+        previous = callbacks_->monitor;
+
+        auto table = make_in<callback_table>(callbacks_->get_allocator(), *callbacks_);
+        table->monitor = std::move(monitor);
+
+        replaced = publish(std::move(table));
+    }
+
+    retire(std::move(replaced));
+
+    if (previous && previous != callbacks_->monitor)
+        previous->Detach(*this);
 }
 
 size_t cmw::Listener::NumConnections() const
@@ -77,6 +1163,11 @@ std::variant<HRESULT, bool> cmw::Listener::Disconnect(DWORD cookie)
     return connections_.Disconnect(cookie);
 }
 
+Result<void> cmw::Listener::TryDisconnect(DWORD cookie) noexcept
+{
+    return connections_.TryDisconnect(cookie);
+}
+
 HRESULT cmw::Listener::DisconnectAll()
 {
     return connections_.DisconnectAll();
@@ -120,22 +1211,175 @@ HRESULT __stdcall cmw::Listener::QueryInterface(REFIID riid, void ** ppvObject)
 
 HRESULT __stdcall cmw::Listener::Invoke(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
 {
-    std::shared_lock<std::shared_mutex> sharedLock;
+    allocation_guard::scope guard;
+    trace_span span("Listener::Invoke", trace_category::invoke, dispIdMember);
+
+    HRESULT hr = dispatch(dispIdMember, riid, lcid, wFlags,
+        pDispParams, pVarResult, pExcepInfo, puArgErr);
+
+    span.SetResult(hr);
+    flight_recorder::Record(flight_event::invoke, dispIdMember, hr,
+        pDispParams ? pDispParams->cArgs : 0);
+
+    return hr;
+}
+
+HRESULT cmw::Listener::dispatch(DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
+{
+    // keeps the subscribers alive even if they are removed during the call,
+    // also by the handlers
+    epoch_reclamation::reader reader;
+    const callback_table *table = table_.load(std::memory_order_seq_cst);
+    invoke_site site{ this, context_, table->monitor.get() };
+
+    // interfaces and references of the arguments are bound to the firing thread
+    if (table->fanout == fanout_policy::parallel && table->pool &&
+        !bound_to_caller(pDispParams))
+    {
+        // the accepted subscribers of a typical event fit the stack buffer
+        std::array<std::byte, 16 * sizeof(void*)> buffer;
+        std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size(),
+            table->get_allocator().resource());
+        std::pmr::vector<const callback_table::subscriber*> accepted(&arena);
+        if (!for_each_accepting(*table, dispIdMember, pDispParams,
+            [&accepted](const callback_table::subscriber& s) { accepted.push_back(&s); }))
+            return DISP_E_MEMBERNOTFOUND;
+
+        if (accepted.empty())
+            return S_OK;
+
+        if (accepted.size() > 1)
+            return invoke_parallel(accepted, *table->pool, site,
+                dispIdMember, riid, lcid, wFlags,
+                pDispParams, pVarResult, pExcepInfo, puArgErr);
+
+        return invoke_isolated(*accepted.front(), site, dispIdMember, riid,
+            lcid, wFlags,
+            pDispParams,
+            pVarResult, pExcepInfo, puArgErr);
+    }
+
+    // the first result set is returned, the results of the later
+    // subscribers are released
+    VARIANT discarded;
+    VariantInit(&discarded);
+    VARIANT *result = pVarResult;
 
-    decltype(callbackMap_)::iterator found = callbackMap_.find(dispIdMember);
+    HRESULT res = S_OK;
+    bool known = for_each_accepting(*table, dispIdMember, pDispParams,
+        [&](const callback_table::subscriber& subscriber)
+    {
+        HRESULT hr = invoke_isolated(subscriber, site, dispIdMember, riid,
+            lcid, wFlags,
+            pDispParams,
+            result, pExcepInfo, puArgErr);
+        if (!SUCCEEDED(hr) && SUCCEEDED(res))
+            res = hr;
+
+        if (result == &discarded)
+            VariantClear(&discarded);
+        else if (result && result->vt != VT_EMPTY)
+            result = &discarded;
+    });
 
-    if (found == callbackMap_.cend())
+    if (!known)
         return DISP_E_MEMBERNOTFOUND;
-    /*
-    return found->second->Invoke(dispIdMember, riid,
-        lcid, wFlags,
-        pDispParams,
-        pVarResult, pExcepInfo, puArgErr);*/
 
-    return found->second(dispIdMember, riid,
+    return res;
+}
+
+HRESULT cmw::Listener::invoke_isolated(const callback_table::subscriber& subscriber, const invoke_site& site, DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr) noexcept
+{
+    if (!site.monitor)
+        return InvokeSubscriber(subscriber, site.context, dispIdMember, riid,
+            lcid, wFlags, pDispParams, pVarResult, pExcepInfo, puArgErr);
+
+    if (!site.monitor->Begin(*site.listener, subscriber, site.context,
+        dispIdMember, lcid, wFlags, pDispParams))
+        return S_OK;
+
+    HRESULT hr = InvokeSubscriber(subscriber, site.context, dispIdMember, riid,
+        lcid, wFlags, pDispParams, pVarResult, pExcepInfo, puArgErr);
+
+    site.monitor->End(*site.listener, subscriber);
+    return hr;
+}
+
+HRESULT cmw::Listener::InvokeSubscriber(const callback_table::subscriber& subscriber, void * context, DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr) noexcept
+{
+    invoke_context_scope scope(context);
+    // the scratch memory of the callback is reused by the next one on the thread
+    scratch_arena::scope scratch;
+
+    try
+    {
+        return subscriber.callback(dispIdMember, riid,
+            lcid, wFlags,
+            pDispParams,
+            pVarResult, pExcepInfo, puArgErr);
+    }
+    catch (const _com_error& error)
+    {
+        return error.Error();
+    }
+    catch (...)
+    {
+        return DISP_E_EXCEPTION;
+    }
+}
+
+HRESULT cmw::Listener::invoke_parallel(const std::pmr::vector<const callback_table::subscriber*>& subscribers, thread_pool& pool, const invoke_site& site, DISPID dispIdMember, REFIID riid, LCID lcid, WORD wFlags, DISPPARAMS * pDispParams, VARIANT * pVarResult, EXCEPINFO * pExcepInfo, UINT * puArgErr)
+{
+    struct fanout_state
+    {
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t pending;
+        HRESULT res = S_OK;
+
+        void Complete(HRESULT hr)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!SUCCEEDED(hr) && SUCCEEDED(res))
+                res = hr;
+            if (!--pending)
+                done.notify_one();
+        }
+    };
+
+    fanout_state state;
+    state.pending = subscribers.size();
+
+    // out-parameters can not be shared between threads: only the first subscriber gets them.
+    // Posting allocates the tasks from the global heap
+    for (size_t i = 1; i < subscribers.size(); ++i)
+    {
+        const callback_table::subscriber *subscriber = subscribers[i];
+        pool.Post([&state, subscriber, site, dispIdMember, &riid, lcid, wFlags, pDispParams]()
+        {
+            // handlers may call COM objects
+            HRESULT init = com_thread::Ensure();
+            if (!SUCCEEDED(init))
+            {
+                state.Complete(init);
+                return;
+            }
+
+            state.Complete(invoke_isolated(*subscriber, site, dispIdMember, riid,
+                lcid, wFlags, pDispParams, nullptr, nullptr, nullptr));
+        });
+    }
+
+    state.Complete(invoke_isolated(*subscribers.front(), site, dispIdMember, riid,
         lcid, wFlags,
         pDispParams,
-        pVarResult, pExcepInfo, puArgErr);
+        pVarResult, pExcepInfo, puArgErr));
+
+    // arguments belong to the caller: wait for every subscriber to return
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.done.wait(lock, [&state]() { return !state.pending; });
+
+    return state.res;
 }
 
 HRESULT __stdcall cmw::Listener::GetTypeInfoCount(UINT * pctinfo)
@@ -155,3 +1399,200 @@ HRESULT __stdcall cmw::Listener::GetTypeInfo(UINT iTInfo, LCID lcid, ITypeInfo *
 {
     return E_NOTIMPL;
 }
+
+
+cmw::property_cache::property_cache(duration defaultTtl)
+{
+    auto t = std::make_shared<table>();
+    t->defaultTtl = defaultTtl;
+    table_.store(t.get(), std::memory_order_seq_cst);
+    owner_ = std::move(t);
+}
+
+cmw::property_cache::~property_cache()
+{
+    epoch_reclamation::Synchronize(this);
+}
+
+void cmw::property_cache::SetTtl(DISPID dispId, duration ttl)
+{
+    std::shared_ptr<const table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(mutexTable_);
+
+        std::shared_ptr<table> t = copy();
+        t->ttls[dispId] = ttl;
+        replaced = publish(std::move(t));
+    }
+
+    retire(std::move(replaced));
+}
+
+HRESULT cmw::property_cache::Read(IDispatch & target, DISPID dispId, VARIANT & value)
+{
+    uint64_t generation = 0;
+    {
+        epoch_reclamation::reader reader;
+        const table *t = table_.load(std::memory_order_seq_cst);
+
+        auto found = t->entries.find(dispId);
+        if (found != t->entries.cend())
+        {
+            const entry& e = *found->second;
+
+            if (!t->Expired(dispId, e, std::chrono::steady_clock::now()))
+            {
+                HRESULT hr = VariantCopy(&value, &e.value);
+                if (SUCCEEDED(hr))
+                {
+                    ++hits_;
+                    if (e.invalidated.load(std::memory_order_acquire))
+                        ++staleReads_;
+                    return hr;
+                }
+            }
+            else
+                ++expirations_;
+        }
+
+        generation = t->Generation(dispId);
+    }
+
+    ++misses_;
+
+    DISPPARAMS noArgs{};
+    HRESULT hr = target.Invoke(dispId, IID_NULL, LOCALE_USER_DEFAULT, DISPATCH_PROPERTYGET,
+        &noArgs, &value, nullptr, nullptr);
+    if (!SUCCEEDED(hr))
+        return hr;
+
+    store(dispId, value, generation);
+    return hr;
+}
+
+void cmw::property_cache::store(DISPID dispId, const VARIANT & value, uint64_t generation)
+{
+    auto e = std::make_shared<entry>();
+    if (!SUCCEEDED(VariantCopy(&e->value, &value)))
+        return;
+    e->fetched = std::chrono::steady_clock::now();
+
+    std::shared_ptr<const table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(mutexTable_);
+
+        // the property was invalidated while it was being fetched: the value may be
+        // outdated already. Invalidations of other properties do not matter
+        if (generation != owner_->Generation(dispId))
+            return;
+
+        std::shared_ptr<table> t = copy();
+        t->entries[dispId] = std::move(e);
+        replaced = publish(std::move(t));
+    }
+
+    retire(std::move(replaced));
+}
+
+void cmw::property_cache::Invalidate(DISPID dispId)
+{
+    if (dispId == DISPID_UNKNOWN)
+    {
+        InvalidateAll();
+        return;
+    }
+
+    std::shared_ptr<const table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(mutexTable_);
+
+        ++invalidations_;
+
+        auto found = owner_->entries.find(dispId);
+        if (found != owner_->entries.cend())
+            found->second->invalidated.store(true, std::memory_order_release);
+
+        std::shared_ptr<table> t = copy();
+        t->entries.erase(dispId);
+        ++t->invalidated[dispId];
+        replaced = publish(std::move(t));
+    }
+
+    retire(std::move(replaced));
+}
+
+void cmw::property_cache::InvalidateAll()
+{
+    std::shared_ptr<const table> replaced;
+    {
+        std::lock_guard<std::mutex> lock(mutexTable_);
+
+        ++invalidations_;
+
+        for (const auto& e : owner_->entries)
+            e.second->invalidated.store(true, std::memory_order_release);
+
+        auto t = std::make_shared<table>();
+        t->ttls = owner_->ttls;
+        t->defaultTtl = owner_->defaultTtl;
+        t->invalidated = owner_->invalidated;
+        t->invalidatedAll = owner_->invalidatedAll + 1;
+        replaced = publish(std::move(t));
+    }
+
+    retire(std::move(replaced));
+}
+
+std::shared_ptr<property_cache::table> cmw::property_cache::copy() const
+{
+    auto t = std::make_shared<table>();
+    t->ttls = owner_->ttls;
+    t->defaultTtl = owner_->defaultTtl;
+    t->invalidated = owner_->invalidated;
+    t->invalidatedAll = owner_->invalidatedAll;
+
+    // expired values would only be replaced by a later read of the same property
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& e : owner_->entries)
+        if (!owner_->Expired(e.first, *e.second, now))
+            t->entries.insert(e);
+
+    return t;
+}
+
+std::shared_ptr<const property_cache::table> cmw::property_cache::publish(std::shared_ptr<const table>&& t)
+{
+    table_.store(t.get(), std::memory_order_seq_cst);
+    std::swap(owner_, t);
+    return std::move(t);
+}
+
+void cmw::property_cache::retire(std::shared_ptr<const table>&& t)
+{
+    if (!t)
+        return;
+
+    epoch_reclamation::Retire([t = std::move(t)]() mutable
+    {
+        t.reset();
+    }, this);
+}
+
+subscription cmw::property_cache::InvalidateOn(Listener & listener, DISPID eventId,
+    std::vector<DISPID> properties)
+{
+    return listener.SetCallback(eventId,
+        [this, properties = std::move(properties)](DISPID, REFIID, LCID, WORD,
+            DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+    {
+        for (DISPID dispId : properties)
+            Invalidate(dispId);
+        return S_OK;
+    });
+}
+
+size_t cmw::property_cache::Size() const
+{
+    epoch_reclamation::reader reader;
+    return table_.load(std::memory_order_seq_cst)->entries.size();
+}
@@ -0,0 +1,118 @@
+﻿
+#include "com_wrapper.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iostream>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+CMW_DEFINE_GUARDED_OPERATOR_NEW
+
+constexpr DISPID num_handlers = 16;
+constexpr size_t num_events = 100000;
+
+HRESULT on_event(DISPID, REFIID, LCID, WORD, DISPPARAMS *pDispParams, VARIANT*, EXCEPINFO*, UINT*)
+{
+    return pDispParams && pDispParams->cArgs ? S_OK : E_INVALIDARG;
+}
+
+std::atomic<size_t> reported = 0;
+
+void on_violation(size_t size) noexcept
+{
+    reported += size;
+}
+
+HRESULT on_event_allocating(DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*)
+{
+    std::wstring copy(64, L'x');
+    return copy.empty() ? E_FAIL : S_OK;
+}
+
+// converted arguments and temporaries live in the scratch memory of the call
+HRESULT on_event_scratch(std::pmr::wstring text, cmw::scratch_arena& scratch)
+{
+    std::pmr::vector<std::pmr::wstring> words(&scratch);
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        size_t end = std::min(text.find(L' ', begin), text.size());
+        words.emplace_back(text.data() + begin, end - begin);
+        begin = end + 1;
+    }
+    return words.size() == 12 ? S_OK : E_FAIL;
+}
+
+int main(int argc, const char **argv)
+{
+    cmw::allocation_guard::SetMode(cmw::allocation_check::count);
+
+    // the tables of callbacks live in a pre-reserved buffer
+    std::array<std::byte, 64 * 1024> buffer;
+    std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size(),
+        std::pmr::null_memory_resource());
+    std::pmr::synchronized_pool_resource pool(&arena);
+
+    std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch, &pool);
+    for (DISPID id = 1; id <= num_handlers; ++id)
+        listener->SetCallback(id, on_event);
+
+    VARIANT arg;
+    VariantInit(&arg);
+    arg.vt = VT_I4;
+    arg.lVal = 42;
+    DISPPARAMS params{ &arg, nullptr, 1, 0 };
+
+    for (size_t i = 0; i < num_events; ++i)
+        listener->Invoke((DISPID)(i % num_handlers) + 1, IID_NULL, 0, DISPATCH_METHOD,
+            &params, nullptr, nullptr, nullptr);
+
+    uint64_t clean = cmw::allocation_guard::Violations();
+
+    listener->SetCallback(num_handlers + 1, on_event_allocating);
+    listener->Invoke(num_handlers + 1, IID_NULL, 0, DISPATCH_METHOD,
+        &params, nullptr, nullptr, nullptr);
+
+    uint64_t dirty = cmw::allocation_guard::Violations() - clean;
+    uint64_t dirtyBytes = cmw::allocation_guard::ViolationBytes();
+
+    // assert_none reports to the handler instead of aborting
+    cmw::allocation_guard::SetViolationHandler(on_violation);
+    cmw::allocation_guard::SetMode(cmw::allocation_check::assert_none);
+    listener->Invoke(num_handlers + 1, IID_NULL, 0, DISPATCH_METHOD,
+        &params, nullptr, nullptr, nullptr);
+    cmw::allocation_guard::SetMode(cmw::allocation_check::count);
+    cmw::allocation_guard::SetViolationHandler(nullptr);
+
+    listener->SetCallback(num_handlers + 2,
+        cmw::decode_disp_args(std::function<HRESULT(std::pmr::wstring, cmw::scratch_arena&)>(
+            on_event_scratch)));
+
+    VARIANT text;
+    VariantInit(&text);
+    text.vt = VT_BSTR;
+    text.bstrVal = SysAllocString(L"the arguments of this event are split into words by its handler");
+    DISPPARAMS textParams{ &text, nullptr, 1, 0 };
+
+    uint64_t before = cmw::allocation_guard::Violations();
+    size_t failed = 0;
+    for (size_t i = 0; i < num_events; ++i)
+        failed += listener->Invoke(num_handlers + 2, IID_NULL, 0, DISPATCH_METHOD,
+            &textParams, nullptr, nullptr, nullptr) != S_OK;
+
+    // the first call adds the chunk of the thread, reused by the following ones
+    uint64_t scratch = cmw::allocation_guard::Violations() - before;
+    VariantClear(&text);
+
+    std::cout << num_events << " events, global allocations: " << clean << std::endl;
+    std::cout << "allocating handler, global allocations: " << dirty << ", bytes: " << dirtyBytes
+        << ", reported: " << reported << std::endl;
+    std::cout << num_events << " scratch handler events, global allocations: " << scratch
+        << ", scratch chunks: " << cmw::scratch_arena::Current().NumChunks() << std::endl;
+
+    return clean == 0 && dirty != 0 && dirtyBytes >= 64 * sizeof(wchar_t) &&
+        reported == dirtyBytes && scratch == 0 && failed == 0 ? 0 : -1;
+}
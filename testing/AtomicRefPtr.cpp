@@ -0,0 +1,141 @@
+﻿
+// stress test of atomic_ref_ptr with reference counted fakes of IUnknown.
+// Built with ThreadSanitizer where available
+
+#include "atomic_ref_ptr.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+constexpr size_t num_readers = 8;
+constexpr size_t num_writers = 4;
+constexpr size_t num_iterations = 100000;
+
+constexpr uint32_t alive_tag = 0xC0FFEE;
+
+static std::atomic<int64_t> numAlive = 0;
+
+// AddRef and Release of COM objects, nothing else
+class fake_unknown
+{
+    std::atomic<uint32_t> refs_ = 1;
+    uint32_t tag_ = alive_tag;
+    size_t value_;
+
+public:
+
+    explicit fake_unknown(size_t value)
+        : value_(value)
+    {
+        ++numAlive;
+    }
+
+    uint32_t AddRef()
+    {
+        return refs_.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    uint32_t Release()
+    {
+        uint32_t refs = refs_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        if (!refs)
+            delete this;
+        return refs;
+    }
+
+    bool IsAlive() const
+    {
+        return tag_ == alive_tag;
+    }
+
+    size_t Value() const
+    {
+        return value_;
+    }
+
+    ~fake_unknown()
+    {
+        tag_ = 0;
+        --numAlive;
+    }
+};
+
+int main(int argc, const char **argv)
+{
+    cmw::atomic_ref_ptr<fake_unknown> shared(new fake_unknown(0));
+
+    std::atomic<bool> failed = false;
+    std::atomic<size_t> reads = 0;
+    std::atomic<size_t> swaps = 0;
+
+    std::vector<std::thread> threads;
+
+    for (size_t r = 0; r < num_readers; ++r)
+        threads.emplace_back([&]()
+        {
+            for (size_t i = 0; i < num_iterations; ++i)
+            {
+                fake_unknown *p = shared.Load();
+                if (p)
+                {
+                    if (!p->IsAlive())
+                        failed = true;
+                    p->Release();
+                }
+                ++reads;
+            }
+        });
+
+    for (size_t w = 0; w < num_writers; ++w)
+        threads.emplace_back([&, w]()
+        {
+            for (size_t i = 0; i < num_iterations / 10; ++i)
+            {
+                size_t value = w * num_iterations + i;
+                switch (i % 4)
+                {
+                case 0:
+                    shared.Store(new fake_unknown(value));
+                    break;
+                case 1:
+                    if (fake_unknown *prev = shared.Exchange(new fake_unknown(value)))
+                        prev->Release();
+                    break;
+                case 2:
+                {
+                    fake_unknown *held = shared.Load();
+                    fake_unknown *expected = held;
+                    fake_unknown *desired = new fake_unknown(value);
+                    while (!shared.CompareExchange(expected, desired))
+                    {
+                        if (held)
+                            held->Release();
+                        held = expected;
+                    }
+                    if (held)
+                        held->Release();
+                    desired->Release();
+                    break;
+                }
+                default:
+                    shared.Store(nullptr);
+                    break;
+                }
+                ++swaps;
+            }
+        });
+
+    for (std::thread& t : threads)
+        t.join();
+
+    int64_t alive = numAlive;
+    shared.Store(nullptr);
+
+    std::cout << reads << " reads, " << swaps << " swaps" << std::endl;
+    std::cout << "objects alive: " << alive << " before reset, " << numAlive << " after" << std::endl;
+
+    return !failed && alive <= 1 && numAlive == 0 ? 0 : -1;
+}
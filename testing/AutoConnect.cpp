@@ -0,0 +1,209 @@
+﻿
+// AutoConnectListener: Advise and Unadvise follow the callbacks, also when the
+// handlers change them while the provider fires or connects
+
+#include "com_events.h"
+
+#include <iostream>
+
+constexpr DISPID id_event = 1;
+
+// connection point of fake_provider, accepting a single sink
+class fake_point : public IConnectionPoint
+{
+    ULONG refs_ = 1;
+    IDispatch *pSink_ = nullptr;
+
+public:
+
+    size_t numAdvised = 0;
+    size_t numUnadvised = 0;
+
+    // fires an event from within Advise, as some providers do
+    bool fireOnAdvise = false;
+    // set by the test while a handler changes the callbacks
+    bool inHandler = false;
+    bool unadvisedInHandler = false;
+
+    HRESULT Fire()
+    {
+        if (!pSink_)
+            return S_FALSE;
+        return pSink_->Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+    }
+
+    bool Connected() const
+    {
+        return pSink_ != nullptr;
+    }
+
+    ULONG __stdcall AddRef() override { return ++refs_; }
+    ULONG __stdcall Release() override { return --refs_; }
+
+    HRESULT __stdcall QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if (riid != IID_IUnknown)
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        *ppvObject = static_cast<IUnknown*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    HRESULT __stdcall GetConnectionInterface(IID*) override { return E_NOTIMPL; }
+    HRESULT __stdcall GetConnectionPointContainer(IConnectionPointContainer**) override { return E_NOTIMPL; }
+    HRESULT __stdcall EnumConnections(IEnumConnections**) override { return E_NOTIMPL; }
+
+    HRESULT __stdcall Advise(IUnknown *pUnkSink, DWORD *pdwCookie) override
+    {
+        if (pSink_)
+            return CONNECT_E_ADVISELIMIT;
+
+        HRESULT hr = pUnkSink->QueryInterface(IID_IDispatch, (void**)&pSink_);
+        if (!SUCCEEDED(hr))
+            return hr;
+
+        ++numAdvised;
+        *pdwCookie = 1;
+
+        if (fireOnAdvise)
+            Fire();
+
+        return S_OK;
+    }
+
+    HRESULT __stdcall Unadvise(DWORD dwCookie) override
+    {
+        if (dwCookie != 1 || !pSink_)
+            return CONNECT_E_NOCONNECTION;
+
+        unadvisedInHandler = unadvisedInHandler || inHandler;
+        ++numUnadvised;
+        pSink_->Release();
+        pSink_ = nullptr;
+        return S_OK;
+    }
+};
+
+class fake_provider : public IConnectionPointContainer
+{
+    ULONG refs_ = 1;
+
+public:
+
+    fake_point point;
+
+    ULONG __stdcall AddRef() override { return ++refs_; }
+    ULONG __stdcall Release() override { return --refs_; }
+
+    HRESULT __stdcall QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if (riid != IID_IUnknown && riid != IID_IConnectionPointContainer)
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        *ppvObject = static_cast<IConnectionPointContainer*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    HRESULT __stdcall EnumConnectionPoints(IEnumConnectionPoints**) override { return E_NOTIMPL; }
+
+    HRESULT __stdcall FindConnectionPoint(REFIID riid, IConnectionPoint **ppCP) override
+    {
+        if (riid != IID_IDispatch)
+        {
+            *ppCP = nullptr;
+            return CONNECT_E_NOCONNECTION;
+        }
+
+        *ppCP = &point;
+        point.AddRef();
+        return S_OK;
+    }
+};
+
+HRESULT nothing(DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*)
+{
+    return S_OK;
+}
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    // connected while callbacks are registered
+    {
+        fake_provider provider;
+        cmw::ComPtr<IConnectionPointContainer> pProvider(static_cast<IConnectionPointContainer*>(&provider));
+        std::unique_ptr<cmw::AutoConnectListener> listener =
+            cmw::AutoConnectListener::Create(IID_IDispatch, pProvider);
+        check(!listener->IsConnected() && !provider.point.Connected(), "not connected without callbacks");
+
+        cmw::subscription first = listener->SetCallback(id_event, nothing);
+        cmw::subscription second = listener->SetCallback(id_event, nothing);
+        check(listener->IsConnected() && provider.point.numAdvised == 1, "advised once");
+
+        listener->RemoveCallback(first);
+        check(listener->IsConnected(), "connected while a callback is left");
+        listener->RemoveCallback(second);
+        check(!listener->IsConnected() && provider.point.numUnadvised == 1,
+            "unadvised with the last callback");
+    }
+
+    // a handler removes the last callback: Unadvise waits until it has returned
+    {
+        fake_provider provider;
+        cmw::ComPtr<IConnectionPointContainer> pProvider(static_cast<IConnectionPointContainer*>(&provider));
+        std::unique_ptr<cmw::AutoConnectListener> listener =
+            cmw::AutoConnectListener::Create(IID_IDispatch, pProvider);
+
+        cmw::subscription self;
+        self = listener->SetCallback(id_event, [&](DISPID, REFIID, LCID, WORD,
+            DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+        {
+            provider.point.inHandler = true;
+            listener->RemoveCallback(self);
+            provider.point.inHandler = false;
+            return S_OK;
+        });
+
+        provider.point.Fire();
+        check(!listener->IsConnected() && provider.point.numUnadvised == 1,
+            "unadvised after the handler");
+        check(!provider.point.unadvisedInHandler, "not unadvised inside the handler");
+    }
+
+    // the provider fires from Advise, the handler removes the only callback
+    {
+        fake_provider provider;
+        provider.point.fireOnAdvise = true;
+        cmw::ComPtr<IConnectionPointContainer> pProvider(static_cast<IConnectionPointContainer*>(&provider));
+        std::unique_ptr<cmw::AutoConnectListener> listener =
+            cmw::AutoConnectListener::Create(IID_IDispatch, pProvider);
+
+        size_t calls = 0;
+        listener->SetCallbackOnce(id_event, [&](DISPID, REFIID, LCID, WORD,
+            DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+        {
+            ++calls;
+            return S_OK;
+        });
+
+        check(calls == 1 && !listener->IsConnected() &&
+            provider.point.numAdvised == 1 && provider.point.numUnadvised == 1,
+            "callbacks changed during Advise");
+    }
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,133 @@
+﻿
+// callback_watchdog: reports of a sleeping handler while it runs, offload of the
+// repeat offender to the watchdog's worker, cancellation when the listener is destroyed
+
+#include "com_events.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+constexpr DISPID id_slow = 1;
+constexpr DISPID id_typed = 2;
+constexpr auto budget = milliseconds(20);
+constexpr auto handler_time = milliseconds(60);
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    std::mutex mutex;
+    std::vector<cmw::slow_callback> reports;
+
+    auto watchdog = std::make_shared<cmw::callback_watchdog>([&](const cmw::slow_callback& slow)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reports.push_back(slow);
+    }, budget, milliseconds(5));
+    watchdog->SetOffloadAfter(2);
+
+    std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+    listener->SetMonitor(watchdog);
+
+    std::atomic<size_t> calls = 0;
+    std::atomic<bool> onWorker = false;
+    std::thread::id firing = std::this_thread::get_id();
+
+    cmw::subscription slow = listener->SetCallback(id_slow, [&](DISPID, REFIID, LCID, WORD,
+        DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+    {
+        std::this_thread::sleep_for(handler_time);
+        onWorker = std::this_thread::get_id() != firing;
+        ++calls;
+        return S_OK;
+    });
+
+    auto invoke = [&listener]()
+    {
+        return listener->Invoke(id_slow, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+    };
+
+    // reported once per call, while it runs
+    invoke();
+    invoke();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        check(reports.size() == 2, "every slow call reported once");
+        check(reports.size() == 2 && reports[0].listener == listener.get() &&
+            reports[0].listenerId == listener->Id() && reports[0].dispId == id_slow &&
+            reports[0].subscriber == slow.id && reports[0].elapsed >= budget &&
+            reports[0].offenses == 1 && !reports[0].offloaded, "report of the first call");
+        check(reports.size() == 2 && reports[1].offenses == 2 && reports[1].offloaded,
+            "second offense moves the subscriber");
+    }
+    check(watchdog->IsOffloaded(*listener, slow.id), "subscriber offloaded");
+
+    // the next call is queued: Invoke returns without waiting for the handler
+    auto start = steady_clock::now();
+    invoke();
+    auto queued = steady_clock::now() - start;
+
+    while (calls < 3)
+        std::this_thread::sleep_for(milliseconds(1));
+    check(queued < handler_time && onWorker && watchdog->NumOffloadedCalls() == 1,
+        "offloaded call delivered by the worker");
+
+    // destroying the listener cancels its queued calls and waits for the running one
+    for (int i = 0; i < 3; ++i)
+        invoke();
+    std::this_thread::sleep_for(milliseconds(10));
+
+    const cmw::Listener *address = listener.get();
+    listener.reset();
+    size_t delivered = calls;
+
+    std::this_thread::sleep_for(handler_time * 3);
+    check(delivered == 4 && calls == delivered, "calls of a destroyed listener cancelled");
+
+    // a new listener is not taken for the old one, even at the same address
+    std::unique_ptr<cmw::Listener> next = cmw::Listener::Create(IID_IDispatch);
+    next->SetMonitor(watchdog);
+    cmw::subscription fresh = next->SetCallback(id_slow, [](DISPID, REFIID, LCID, WORD,
+        DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+    {
+        return S_OK;
+    });
+
+    std::cout << "new listener at the " << (next.get() == address ? "same" : "other") << " address" << std::endl;
+    check(!watchdog->IsOffloaded(*next, fresh.id) && !watchdog->Offenses(*next, fresh.id),
+        "offenses not inherited");
+
+    // typed callbacks are reported by the function they were registered with
+    auto sleeper = []()
+    {
+        std::this_thread::sleep_for(handler_time);
+    };
+    cmw::RegisterCallback typed(*next, id_typed, std::function<void()>(sleeper));
+    next->SetCallbackOnce(id_typed + 1,
+        cmw::reduce_disp_inv_args(std::function<void()>(sleeper)));
+
+    for (DISPID dispId : { id_typed, id_typed + 1 })
+        next->Invoke(dispId, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        check(reports.size() >= 2 && reports[reports.size() - 2].dispId == id_typed &&
+            *reports[reports.size() - 2].handler == typeid(sleeper), "typed callback's handler");
+        check(reports.back().dispId == id_typed + 1 && *reports.back().handler == typeid(sleeper),
+            "handler of a single-shot typed callback");
+    }
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,137 @@
+﻿
+// columnar export of encoded events to a file, read back through column_batch_view
+
+#include "columnar_export.h"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+constexpr size_t batch_rows = 64;
+constexpr size_t num_events = 1000;
+
+constexpr int32_t quote_id = 1;
+constexpr int32_t news_id = 2;
+constexpr int32_t trade_id = 3;
+
+constexpr size_t num_threads = 4;
+constexpr size_t num_trades = 500;
+
+int main(int argc, const char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "events.cmwcol";
+
+    cmw::flat_event_builder builder;
+    std::u16string headline = u"Zurich \u00fcber \U0001F4C8";
+
+    {
+        std::ofstream file(path, std::ios::binary);
+        cmw::columnar_exporter exporter(file, batch_rows);
+
+        for (size_t i = 0; i < num_events; ++i)
+        {
+            if (i % 4 == 3)
+            {
+                builder.Reset(news_id, 1);
+                builder.AddString(headline.data(), headline.size());
+            }
+            else
+            {
+                builder.Reset(quote_id, 1);
+                builder.AddInt(cmw::flat_vt::i4, (int64_t)i);
+                // every tenth quote has no price: a null
+                if (i % 10)
+                    builder.AddReal(cmw::flat_vt::r8, i * 0.5);
+                else
+                    builder.AddEmpty();
+            }
+
+            exporter.Append(cmw::flat_event(builder.Encode().first), (int64_t)i);
+        }
+
+        // trades from several threads, the later ones with more arguments
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; ++t)
+            threads.emplace_back([&exporter]()
+            {
+                cmw::flat_event_builder trade;
+                for (size_t i = 0; i < num_trades; ++i)
+                {
+                    trade.Reset(trade_id, 1);
+                    trade.AddInt(cmw::flat_vt::i4, (int64_t)i);
+                    if (i % 2)
+                        trade.AddReal(cmw::flat_vt::r8, i * 0.25);
+                    exporter.Append(cmw::flat_event(trade.Encode().first), (int64_t)i);
+                }
+            });
+        for (std::thread& t : threads)
+            t.join();
+
+        exporter.Flush();
+        std::cout << exporter.BatchesWritten() << " batches, " << exporter.RowsWritten() << " rows written" << std::endl;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    bool failed = data.size() < sizeof(cmw::columnar_file_magic) ||
+        std::memcmp(data.data(), cmw::columnar_file_magic, sizeof(cmw::columnar_file_magic)) != 0;
+
+    size_t quotes = 0;
+    size_t news = 0;
+    size_t nullPrices = 0;
+    size_t trades = 0;
+    size_t tradePrices = 0;
+
+    const uint8_t *at = data.data() + sizeof(cmw::columnar_file_magic);
+    while (!failed && at < data.data() + data.size())
+    {
+        cmw::column_batch_view batch(at);
+        if (!batch.IsValid() || batch.Header().size % 8)
+        {
+            failed = true;
+            break;
+        }
+
+        for (size_t row = 0; row < batch.NumRows(); ++row)
+        {
+            int64_t i = batch.Timestamp(row);
+            if (batch.DispID() == quote_id)
+            {
+                ++quotes;
+                failed |= batch.Value<int32_t>(1, row) != i;
+                if (batch.IsNull(2, row))
+                    ++nullPrices;
+                else
+                    failed |= batch.Value<double>(2, row) != i * 0.5;
+            }
+            else if (batch.DispID() == trade_id)
+            {
+                ++trades;
+                failed |= batch.NumColumns() != 3 || batch.Value<int32_t>(1, row) != i;
+                if (i % 2)
+                {
+                    failed |= batch.IsNull(2, row) || batch.Value<double>(2, row) != i * 0.25;
+                    ++tradePrices;
+                }
+                else
+                    failed |= !batch.IsNull(2, row);
+            }
+            else
+            {
+                ++news;
+                failed |= batch.String(1, row) != "Zurich \u00fcber \U0001F4C8";
+            }
+        }
+
+        at = batch.Next();
+    }
+
+    std::cout << quotes << " quotes, " << nullPrices << " without price, " << news << " news" << std::endl;
+    std::cout << trades << " trades, " << tradePrices << " with price" << std::endl;
+
+    return !failed && quotes + news == num_events && news == num_events / 4 &&
+        trades == num_threads * num_trades && tradePrices == trades / 2 ? 0 : -1;
+}
@@ -0,0 +1,118 @@
+﻿
+// lazy COM initialization: threads of the program follow the default apartment,
+// the workers of the library join the multithreaded one
+
+#include "com_events.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+constexpr DISPID id_event = 1;
+
+// apartment of the calling thread, COM initialized by the caller
+bool is_mta()
+{
+    APTTYPE type;
+    APTTYPEQUALIFIER qualifier;
+    return SUCCEEDED(CoGetApartmentType(&type, &qualifier)) && type == APTTYPE_MTA;
+}
+
+bool is_sta()
+{
+    APTTYPE type;
+    APTTYPEQUALIFIER qualifier;
+    return SUCCEEDED(CoGetApartmentType(&type, &qualifier)) &&
+        (type == APTTYPE_STA || type == APTTYPE_MAINSTA);
+}
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    cmw::com_thread::SetDefaultApartment(cmw::com_apartment::single_threaded);
+
+    // threads of the program get the default
+    {
+        bool sta = false;
+        std::thread t([&sta]()
+        {
+            sta = SUCCEEDED(cmw::com_thread::Ensure()) && is_sta();
+        });
+        t.join();
+        check(sta, "program thread in the default apartment");
+    }
+
+    // pool tasks run in the multithreaded apartment
+    {
+        cmw::thread_pool pool(2);
+        std::promise<bool> mta;
+        pool.Post([&mta]()
+        {
+            mta.set_value(SUCCEEDED(cmw::com_thread::Ensure()) && is_mta());
+        });
+        check(mta.get_future().get(), "pool worker in the multithreaded apartment");
+    }
+
+    // parallel fan-out: the subscribers moved to the pool
+    {
+        auto pool = std::make_shared<cmw::thread_pool>(4);
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        listener->SetFanout(cmw::fanout_policy::parallel, pool);
+
+        std::thread::id caller = std::this_thread::get_id();
+        std::atomic<size_t> pooled = 0;
+        std::atomic<size_t> pooledMta = 0;
+
+        for (int i = 0; i < 4; ++i)
+            listener->SetCallback(id_event, [&](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+                VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                if (std::this_thread::get_id() != caller)
+                {
+                    ++pooled;
+                    pooledMta += is_mta();
+                }
+                return S_OK;
+            });
+
+        VARIANT arg;
+        VariantInit(&arg);
+        arg.vt = VT_I4;
+        arg.lVal = 5;
+        DISPPARAMS params{ &arg, nullptr, 1, 0 };
+        HRESULT hr = listener->Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD,
+            &params, nullptr, nullptr, nullptr);
+
+        check(SUCCEEDED(hr) && pooled > 0 && pooledMta == pooled,
+            "fan-out subscribers in the multithreaded apartment");
+    }
+
+    // asynchronous listeners deliver in the multithreaded apartment
+    {
+        std::promise<bool> mta;
+        std::unique_ptr<cmw::PriorityListener> listener =
+            cmw::PriorityListener::Create(IID_IDispatch);
+        listener->SetCallback(id_event, [&mta](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+            VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+        {
+            mta.set_value(is_mta());
+            return S_OK;
+        }, cmw::event_priority::normal);
+
+        listener->Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+        check(mta.get_future().get(), "priority lane worker in the multithreaded apartment");
+    }
+
+    return passed ? 0 : -1;
+}
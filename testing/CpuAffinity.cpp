@@ -0,0 +1,75 @@
+﻿
+// pinning of threads and first touch placement of memory on the thread's NUMA node
+
+#include "cpu_affinity.h"
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+constexpr size_t arena_size = 1 << 20;
+
+int main(int argc, const char **argv)
+{
+    unsigned numCpus = std::max(std::thread::hardware_concurrency(), 1u);
+
+    bool failed = false;
+    size_t numPinned = 0;
+
+    for (int cpu = 0; cpu < (int)numCpus; ++cpu)
+    {
+        std::thread([&, cpu]()
+        {
+            // CPUs outside of the process' affinity mask can not be used
+            if (!cmw::pin_current_thread(cpu))
+                return;
+            ++numPinned;
+
+            int running = cmw::current_cpu();
+            if (running != cpu)
+            {
+                std::cout << "cpu " << cpu << ": running on " << running << std::endl;
+                failed = true;
+            }
+
+            cmw::first_touch_arena arena(arena_size);
+            if (!arena.Data())
+            {
+                std::cout << "cpu " << cpu << ": no arena" << std::endl;
+                failed = true;
+                return;
+            }
+
+            int cpuNode = cmw::numa_node_of_cpu(cpu);
+            int memoryNode = cmw::numa_node_of_address(arena.Data());
+            if (cpuNode >= 0 && memoryNode >= 0 && cpuNode != memoryNode)
+            {
+                std::cout << "cpu " << cpu << " on node " << cpuNode
+                    << ": memory on node " << memoryNode << std::endl;
+                failed = true;
+            }
+
+            std::pmr::vector<int> values(&arena);
+            values.resize(arena_size / sizeof(int) / 4);
+
+            // does not fit the rest of the block
+            void *large = arena.allocate(arena_size);
+            arena.deallocate(large, arena_size);
+
+            if (arena.Used() < values.size() * sizeof(int) || arena.Overflows() != 1)
+            {
+                std::cout << "cpu " << cpu << ": used " << arena.Used()
+                    << ", overflows " << arena.Overflows() << std::endl;
+                failed = true;
+            }
+
+            if (cpu == 0)
+                std::cout << "cpu 0: node " << cpuNode << ", memory on node " << memoryNode << std::endl;
+        }).join();
+    }
+
+    std::cout << numPinned << " of " << numCpus << " CPUs pinned" << std::endl;
+
+    return !failed && numPinned ? 0 : -1;
+}
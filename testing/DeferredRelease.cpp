@@ -0,0 +1,141 @@
+﻿
+// stall of a hot thread releasing objects whose final Release is slow, as proxies'
+// round trips, in place and through release_queue
+
+#include "release_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+constexpr size_t num_objects = 200;
+constexpr auto release_time = microseconds(500);
+
+static std::atomic<size_t> numAlive = 0;
+
+// final Release waits as long as a round trip
+class slow_release
+{
+    std::atomic<uint32_t> refs_ = 1;
+
+public:
+
+    slow_release()
+    {
+        ++numAlive;
+    }
+
+    uint32_t Release()
+    {
+        uint32_t refs = refs_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        if (!refs)
+        {
+            std::this_thread::sleep_for(release_time);
+            delete this;
+        }
+        return refs;
+    }
+
+    ~slow_release()
+    {
+        --numAlive;
+    }
+};
+
+class fast_release
+{
+public:
+
+    fast_release()
+    {
+        ++numAlive;
+    }
+
+    uint32_t Release()
+    {
+        delete this;
+        return 0;
+    }
+
+    ~fast_release()
+    {
+        --numAlive;
+    }
+};
+
+static std::vector<slow_release*> make_objects(size_t count = num_objects)
+{
+    std::vector<slow_release*> objects;
+    for (size_t i = 0; i < count; ++i)
+        objects.push_back(new slow_release);
+    return objects;
+}
+
+int main(int argc, const char **argv)
+{
+    std::vector<slow_release*> objects = make_objects();
+
+    auto start = steady_clock::now();
+    for (slow_release *object : objects)
+        object->Release();
+    auto inPlace = duration_cast<microseconds>(steady_clock::now() - start);
+
+    cmw::release_queue queue;
+
+    objects = make_objects();
+
+    start = steady_clock::now();
+    for (slow_release *object : objects)
+        queue.Push(object);
+    auto deferred = duration_cast<microseconds>(steady_clock::now() - start);
+
+    queue.Flush();
+    auto flushed = duration_cast<microseconds>(steady_clock::now() - start);
+
+    std::cout << num_objects << " releases, hot thread stalled " << inPlace.count()
+        << " us in place, " << deferred.count() << " us deferred" << std::endl;
+    std::cout << "flushed after " << flushed.count() << " us, " << queue.Released()
+        << " released, " << queue.Pending() << " pending, " << numAlive << " alive" << std::endl;
+
+    bool passed = numAlive == 0 && queue.Pending() == 0 && deferred < inPlace;
+
+    // more releases pending than nodes: the extra ones are made by the caller
+    {
+        cmw::release_queue small(nullptr, 4);
+        objects = make_objects(16);
+        for (slow_release *object : objects)
+            small.Push(object);
+        small.Flush();
+
+        std::cout << "pool of 4: " << small.Released() << " released by the queue, "
+            << small.InPlace() << " in place" << std::endl;
+        passed = passed && small.InPlace() > 0 && small.Released() + small.InPlace() == 16 &&
+            numAlive == 0;
+    }
+
+    // nodes are reused by concurrent producers
+    {
+        constexpr size_t num_threads = 4;
+        cmw::release_queue shared(nullptr, 64);
+
+        std::vector<std::thread> producers;
+        for (size_t t = 0; t < num_threads; ++t)
+            producers.emplace_back([&shared]()
+            {
+                for (size_t i = 0; i < 1000; ++i)
+                    shared.Push(new fast_release);
+            });
+        for (std::thread& t : producers)
+            t.join();
+        shared.Flush();
+
+        passed = passed && shared.Released() + shared.InPlace() == num_threads * 1000 &&
+            numAlive == 0;
+    }
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,137 @@
+﻿
+// DispatchBatch: coalesced puts, order of the calls on the calling thread and on a
+// worker, and failures of the calls, including thrown exceptions
+
+#include "com_dispatch.h"
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+constexpr DISPID id_failing = 99;
+constexpr DISPID id_throwing = 100;
+
+// IDispatch logging the calls. id_failing returns E_FAIL, id_throwing throws
+class logged_dispatch : public IDispatch
+{
+    std::atomic<ULONG> refs_ = 1;
+
+public:
+
+    std::vector<std::pair<DISPID, WORD>> calls;
+    std::vector<LONG> values;
+
+    ULONG Refs() const
+    {
+        return refs_;
+    }
+
+    ULONG __stdcall AddRef() override
+    {
+        return ++refs_;
+    }
+
+    ULONG __stdcall Release() override
+    {
+        return --refs_;
+    }
+
+    HRESULT __stdcall QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if (riid != IID_IUnknown && riid != IID_IDispatch)
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        *ppvObject = static_cast<IDispatch*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    HRESULT __stdcall GetTypeInfoCount(UINT*) override { return E_NOTIMPL; }
+    HRESULT __stdcall GetTypeInfo(UINT, LCID, ITypeInfo**) override { return E_NOTIMPL; }
+    HRESULT __stdcall GetIDsOfNames(REFIID, LPOLESTR*, UINT, LCID, DISPID*) override { return E_NOTIMPL; }
+
+    HRESULT __stdcall Invoke(DISPID dispIdMember, REFIID, LCID, WORD wFlags,
+        DISPPARAMS *pDispParams, VARIANT*, EXCEPINFO*, UINT*) override
+    {
+        calls.emplace_back(dispIdMember, wFlags);
+
+        if (wFlags == DISPATCH_PROPERTYPUT && (pDispParams->cNamedArgs != 1 ||
+            pDispParams->rgdispidNamedArgs[0] != DISPID_PROPERTYPUT))
+            return DISP_E_PARAMNOTOPTIONAL;
+
+        if (pDispParams->cArgs)
+            values.push_back(pDispParams->rgvarg[0].vt == VT_I4 ? pDispParams->rgvarg[0].lVal : -1);
+
+        if (dispIdMember == id_throwing)
+            throw std::runtime_error("Invoke failed!");
+
+        return dispIdMember == id_failing ? E_FAIL : S_OK;
+    }
+};
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const std::string& what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    logged_dispatch object;
+    auto worker = std::make_shared<cmw::thread_pool>(1);
+
+    {
+        object.AddRef();
+        cmw::ComPtr<IDispatch> pObject(static_cast<IDispatch*>(&object));
+
+        for (bool onWorker : { false, true })
+        {
+            std::string where = onWorker ? " on the worker" : " on the calling thread";
+            object.calls.clear();
+            object.values.clear();
+
+            // puts of the same DISPID are coalesced until a method call
+            cmw::DispatchBatch batch(pObject, onWorker ? worker : nullptr);
+            batch.Put(1, 10L);
+            batch.Put(2, 20L);
+            batch.Put(1, 11L);
+            batch.Put(1, std::wstring(L"text"));
+            batch.Call(5, 3L);
+            batch.Put(1, 12L);
+            batch.Call(id_failing);
+            check(batch.Size() == 5 && batch.Coalesced() == 2, "puts coalesced" + where);
+
+            std::vector<cmw::batch_result> results = batch.Flush();
+            check(batch.Size() == 0 && results.size() == 5 &&
+                results[0].dispId == 1 && results[0].flags == DISPATCH_PROPERTYPUT &&
+                results[0].hr == S_OK && results[4].hr == E_FAIL, "results" + where);
+            check(object.values == std::vector<LONG>{ -1, 20, 3, 12 }, "calls in order" + where);
+
+            // a thrown exception reaches the caller instead of leaving it waiting
+            batch.Put(3, 30L);
+            batch.Call(id_throwing);
+            bool thrown = false;
+            try
+            {
+                (void)batch.Flush();
+            }
+            catch (const std::runtime_error&)
+            {
+                thrown = true;
+            }
+            check(thrown && batch.Size() == 0, "exception rethrown" + where);
+        }
+    }
+
+    worker.reset();
+    check(object.Refs() == 1, "references released");
+
+    return passed ? 0 : -1;
+}
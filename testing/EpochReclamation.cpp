@@ -0,0 +1,153 @@
+﻿
+// epoch_reclamation: objects retired inside a reader, Synchronize waiting for the
+// readers of other threads, and the per-thread indices of thread_slots
+
+#include "epoch_reclamation.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+
+// a reader on another thread, held until Leave
+class held_reader
+{
+    std::promise<void> entered_;
+    std::promise<void> leave_;
+    std::thread thread_;
+
+public:
+
+    held_reader()
+    {
+        std::future<void> left = leave_.get_future();
+        thread_ = std::thread([this, left = std::move(left)]() mutable
+        {
+            cmw::epoch_reclamation::reader reader;
+            entered_.set_value();
+            left.wait();
+        });
+        entered_.get_future().wait();
+    }
+
+    void Leave()
+    {
+        leave_.set_value();
+        thread_.join();
+    }
+};
+
+int main(int argc, const char **argv)
+{
+    using cmw::epoch_reclamation;
+
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    int owner = 0;
+    int other = 0;
+
+    // kept by the retiring reader, reclaimed as it leaves
+    {
+        std::atomic<int> reclaimed = 0;
+        {
+            epoch_reclamation::reader reader;
+            {
+                epoch_reclamation::reader nested;
+                epoch_reclamation::Retire([&reclaimed]() { ++reclaimed; });
+            }
+            check(reclaimed == 0 && epoch_reclamation::NumRetired() == 1, "kept inside the reader");
+        }
+        check(reclaimed == 1 && epoch_reclamation::NumRetired() == 0, "reclaimed as the reader leaves");
+    }
+
+    // Synchronize waits for the readers started before
+    {
+        std::atomic<int> reclaimed = 0;
+        held_reader held;
+        epoch_reclamation::Retire([&reclaimed]() { ++reclaimed; }, &owner);
+        check(reclaimed == 0, "kept while another thread reads");
+
+        std::atomic<bool> synchronized = false;
+        std::thread synchronizing([&]()
+        {
+            epoch_reclamation::Synchronize(&owner);
+            synchronized = true;
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        check(!synchronized, "synchronize waits for the reader");
+
+        held.Leave();
+        synchronizing.join();
+        check(reclaimed == 1 && epoch_reclamation::NumRetired() == 0, "reclaimed by synchronize");
+    }
+
+    // readers started after are not waited for, nor an owner without retired objects
+    {
+        std::atomic<int> reclaimed = 0;
+        epoch_reclamation::Retire([&reclaimed]() { ++reclaimed; }, &owner);
+
+        held_reader held;
+        epoch_reclamation::Synchronize(&other);
+        epoch_reclamation::Synchronize(&owner);
+        check(reclaimed == 1, "later readers not waited for");
+        held.Leave();
+    }
+
+    // inside a reader, the owner's objects are reclaimed and the others kept
+    {
+        std::atomic<int> ownerReclaimed = 0;
+        std::atomic<int> otherReclaimed = 0;
+        {
+            epoch_reclamation::reader reader;
+            epoch_reclamation::Retire([&otherReclaimed]() { ++otherReclaimed; }, &other);
+            epoch_reclamation::Retire([&ownerReclaimed]() { ++ownerReclaimed; }, &owner);
+
+            epoch_reclamation::Synchronize(&owner);
+            check(ownerReclaimed == 1 && otherReclaimed == 0, "owner reclaimed inside a reader");
+        }
+        check(otherReclaimed == 1 && epoch_reclamation::NumRetired() == 0, "others reclaimed after");
+    }
+
+    // one index per running thread, released at thread exit
+    {
+        constexpr size_t num_threads = 8;
+
+        std::vector<size_t> indices(num_threads);
+        std::promise<void> release;
+        std::shared_future<void> released = release.get_future().share();
+        std::vector<std::thread> threads;
+        std::atomic<size_t> claimed = 0;
+        for (size_t i = 0; i < num_threads; ++i)
+            threads.emplace_back([&, i]()
+            {
+                indices[i] = cmw::thread_slots::Index();
+                ++claimed;
+                released.wait();
+            });
+
+        while (claimed < num_threads)
+            std::this_thread::yield();
+        release.set_value();
+        for (std::thread& t : threads)
+            t.join();
+
+        std::set<size_t> distinct(indices.cbegin(), indices.cend());
+        check(distinct.size() == num_threads && !distinct.count(cmw::thread_slots::no_slot) &&
+            *distinct.rbegin() < cmw::thread_slots::InUse(), "distinct indices in use");
+
+        size_t reused = cmw::thread_slots::no_slot;
+        std::thread([&reused]() { reused = cmw::thread_slots::Index(); }).join();
+        check(distinct.count(reused) == 1, "indices of exited threads reused");
+    }
+
+    return passed ? 0 : -1;
+}
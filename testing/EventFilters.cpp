@@ -0,0 +1,190 @@
+﻿
+// event_filter: equality predicates looked up by hash, ranges, prefixes,
+// reference arguments, removal of indexed subscribers, and the order of the
+// filtered subscribers
+
+#include "com_wrapper.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+constexpr DISPID id_event = 1;
+
+// one argument per value, declared in the order given
+class args
+{
+    std::vector<VARIANT> values_;
+
+public:
+
+    args& Add(VARIANT value)
+    {
+        // rgvarg is stored in reverse order
+        values_.insert(values_.begin(), value);
+        return *this;
+    }
+
+    DISPPARAMS Params()
+    {
+        return DISPPARAMS{ values_.data(), nullptr, (UINT)values_.size(), 0 };
+    }
+};
+
+VARIANT int_arg(LONG value)
+{
+    VARIANT v;
+    VariantInit(&v);
+    v.vt = VT_I4;
+    v.lVal = value;
+    return v;
+}
+
+VARIANT double_arg(double value)
+{
+    VARIANT v;
+    VariantInit(&v);
+    v.vt = VT_R8;
+    v.dblVal = value;
+    return v;
+}
+
+VARIANT str_arg(BSTR value)
+{
+    VARIANT v;
+    VariantInit(&v);
+    v.vt = VT_BSTR;
+    v.bstrVal = value;
+    return v;
+}
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    std::vector<std::wstring> called;
+    auto record = [&called](const std::wstring& name)
+    {
+        return [&called, name](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+            VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+        {
+            called.push_back(name);
+            return S_OK;
+        };
+    };
+
+    auto fire = [&called](cmw::Listener& listener, DISPPARAMS params)
+    {
+        called.clear();
+        listener.Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD, &params, nullptr, nullptr, nullptr);
+        return called;
+    };
+
+    BSTR symbol = SysAllocString(L"MSFT");
+    BSTR other = SysAllocString(L"AAPL");
+
+    // thousands of equality filters, one of them accepts the event
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        for (LONG i = 0; i < 2000; ++i)
+            listener->SetCallback(id_event, record(std::to_wstring(i)),
+                cmw::event_filter().ArgEquals(0, i));
+
+        check(fire(*listener, args().Add(int_arg(1234)).Params()) ==
+            std::vector<std::wstring>{ L"1234" }, "indexed equality filter");
+        check(fire(*listener, args().Add(int_arg(5000)).Params()).empty(),
+            "no equality filter matches");
+        check(fire(*listener, args().Params()).empty(), "missing argument is not matched");
+    }
+
+    // combined predicates
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        listener->SetCallback(id_event, record(L"price"),
+            cmw::event_filter().ArgEquals(0, L"MSFT").ArgInRange(1, 10., 20.));
+        listener->SetCallback(id_event, record(L"prefix"),
+            cmw::event_filter().ArgStartsWith(0, L"MS"));
+
+        check(fire(*listener, args().Add(str_arg(symbol)).Add(double_arg(15.)).Params()) ==
+            std::vector<std::wstring>{ L"prefix", L"price" }, "string and range predicates");
+        check(fire(*listener, args().Add(str_arg(symbol)).Add(double_arg(25.)).Params()) ==
+            std::vector<std::wstring>{ L"prefix" }, "value out of range");
+        check(fire(*listener, args().Add(str_arg(other)).Add(double_arg(15.)).Params()).empty(),
+            "different string");
+    }
+
+    // references are read through
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        listener->SetCallback(id_event, record(L"int"),
+            cmw::event_filter().ArgEquals(0, 7));
+        listener->SetCallback(id_event, record(L"str"),
+            cmw::event_filter().ArgEquals(1, L"MSFT"));
+
+        LONG value = 7;
+        BSTR text = symbol;
+        VARIANT intRef;
+        VariantInit(&intRef);
+        intRef.vt = VT_BYREF | VT_I4;
+        intRef.plVal = &value;
+        VARIANT strRef;
+        VariantInit(&strRef);
+        strRef.vt = VT_BYREF | VT_BSTR;
+        strRef.pbstrVal = &text;
+
+        std::vector<std::wstring> matched = fire(*listener, args().Add(intRef).Add(strRef).Params());
+        check(matched.size() == 2, "reference arguments matched");
+
+        value = 8;
+        check(fire(*listener, args().Add(intRef).Add(strRef).Params()) ==
+            std::vector<std::wstring>{ L"str" }, "referenced value changed");
+    }
+
+    // removal of indexed subscribers, down to the last one of a value and of an argument
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        cmw::subscription first = listener->SetCallback(id_event, record(L"first"),
+            cmw::event_filter().ArgEquals(0, 1));
+        cmw::subscription second = listener->SetCallback(id_event, record(L"second"),
+            cmw::event_filter().ArgEquals(0, 1));
+        cmw::subscription two = listener->SetCallback(id_event, record(L"two"),
+            cmw::event_filter().ArgEquals(0, 2));
+        cmw::subscription symbolFilter = listener->SetCallback(id_event, record(L"symbol"),
+            cmw::event_filter().ArgEquals(1, L"MSFT"));
+
+        check(listener->RemoveCallback(first) && fire(*listener, args().Add(int_arg(1)).Params()) ==
+            std::vector<std::wstring>{ L"second" }, "indexed subscriber removed");
+        check(listener->RemoveCallback(second) && fire(*listener, args().Add(int_arg(1)).Params()).empty() &&
+            fire(*listener, args().Add(int_arg(2)).Params()) == std::vector<std::wstring>{ L"two" },
+            "last subscriber of a value removed");
+        check(listener->RemoveCallback(two) && fire(*listener, args().Add(int_arg(2)).Params()).empty() &&
+            fire(*listener, args().Add(int_arg(2)).Add(str_arg(symbol)).Params()) ==
+            std::vector<std::wstring>{ L"symbol" }, "last subscriber of an argument removed");
+        check(!listener->RemoveCallback(two), "removed subscriber not found");
+        check(listener->RemoveCallback(symbolFilter) && listener->NumCallbacks(id_event) == 0,
+            "every indexed subscriber removed");
+    }
+
+    // unfiltered subscribers first, then the indexed ones, then DISPID ranges
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        listener->SetCallback(0, 10, record(L"range"));
+        listener->SetCallback(id_event, record(L"indexed"), cmw::event_filter().ArgEquals(0, 1));
+        listener->SetCallback(id_event, record(L"plain"));
+        listener->SetCallback(id_event, record(L"in range"), cmw::event_filter().ArgInRange(0, 0., 2.));
+
+        check(fire(*listener, args().Add(int_arg(1)).Params()) ==
+            std::vector<std::wstring>{ L"plain", L"in range", L"indexed", L"range" },
+            "order of the filtered subscribers");
+    }
+
+    SysFreeString(symbol);
+    SysFreeString(other);
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,118 @@
+﻿
+// cost of flight_recorder::Record against its budget, and snapshots taken
+// while other threads keep recording
+
+#include "com_flight.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+constexpr size_t iterations = 10000000;
+constexpr size_t num_writers = 3;
+constexpr size_t num_snapshots = 200;
+
+// Listener::Invoke records every event: the record must stay well below a call.
+// Measured on top of the timestamp, which depends on the machine's clock
+constexpr double budget_ns = 20.;
+
+// keeps the measured reads
+volatile int64_t clock_sink = 0;
+
+int64_t read_clock()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return (int64_t)__rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return (int64_t)__builtin_ia32_rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+int main(int argc, const char **argv)
+{
+    // the first call claims the ring of this thread
+    cmw::flight_recorder::Record(cmw::flight_event::invoke, 0, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        cmw::flight_recorder::Record(cmw::flight_event::invoke, (int32_t)i, 0, 2);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    double perRecord = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+        (double)iterations;
+    // the timestamp alone, read as the recorder does
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        clock_sink = read_clock();
+    elapsed = std::chrono::steady_clock::now() - start;
+
+    double perClock = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+        (double)iterations;
+
+    double overhead = perRecord - perClock;
+    std::cout << "Record: " << perRecord << " ns/call, of which the clock: " << perClock
+        << " ns, the rest " << overhead << " ns (budget " << budget_ns << " ns)" << std::endl;
+
+#ifdef NDEBUG
+    bool withinBudget = overhead <= budget_ns;
+#else
+    // unoptimized builds only report the cost
+    bool withinBudget = true;
+#endif
+    if (!withinBudget)
+        std::cout << "over budget" << std::endl;
+
+    // the benchmark's records are the only ones so far
+    std::vector<cmw::flight_record> own = cmw::flight_recorder::Snapshot();
+    uint32_t mainThread = own.empty() ? 0 : own.back().threadId;
+
+    // writers fill every field with the same counter: a torn record has different values
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < num_writers; ++t)
+        writers.emplace_back([&stop]()
+        {
+            for (uint32_t i = 0; !stop.load(std::memory_order_relaxed); ++i)
+                cmw::flight_recorder::Record(cmw::flight_event::invoke,
+                    (int32_t)i, (int32_t)i, i & 0xFFFF, i);
+        });
+
+    size_t torn = 0;
+    size_t unordered = 0;
+    size_t records = 0;
+    for (size_t s = 0; s < num_snapshots; ++s)
+    {
+        std::map<uint32_t, int64_t> lastTicks;
+        for (const cmw::flight_record& r : cmw::flight_recorder::Snapshot())
+        {
+            ++records;
+            if (r.threadId != mainThread && (r.dispId != r.result ||
+                (uint32_t)r.dispId != r.cookie || r.numArgs != (r.cookie & 0xFFFF)))
+                ++torn;
+
+            int64_t& last = lastTicks[r.threadId];
+            if (r.ticks < last)
+                ++unordered;
+            last = r.ticks;
+        }
+    }
+
+    stop = true;
+    for (std::thread& t : writers)
+        t.join();
+
+    std::cout << records << " records in " << num_snapshots << " snapshots, "
+        << torn << " torn, " << unordered << " out of order" << std::endl;
+
+    bool passed = withinBudget && !own.empty() && torn == 0 && unordered == 0 && records > 0;
+    return passed ? 0 : -1;
+}
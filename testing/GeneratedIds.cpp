@@ -0,0 +1,29 @@
+﻿
+// DISPID tables generated by cmwidlgen
+
+#include "market_events_ids.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+namespace ids = market::_IMarketEvents_dispid;
+
+static_assert(ids::LastPrice == 1, "Invalid DISPID!");
+static_assert(ids::OnTick == 2, "Invalid DISPID!");
+static_assert(ids::Subscriptions == 4, "Invalid DISPID!");
+// ids above 0x7FFFFFFF wrap to negative DISPIDs
+static_assert(ids::OnReset == (int32_t)0x80010000, "Invalid DISPID!");
+static_assert(ids::num_members == 7, "Invalid number of members!");
+static_assert(ids::members[1].numArgs == 3, "Invalid number of arguments!");
+
+int main(int argc, const char **argv)
+{
+    for (const ids::member_info& m : ids::members)
+        std::cout << m.name << ": " << m.dispid << " (" << m.numArgs << " args)" << std::endl;
+
+    if (std::strcmp(ids::members[4].name, "Subscriptions") != 0)
+        return -1;
+
+    return 0;
+}
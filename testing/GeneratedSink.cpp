@@ -0,0 +1,74 @@
+﻿
+#include "market_events.h"
+
+#include <iostream>
+
+int main(int argc, const char **argv)
+{
+    std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(market::IID__IMarketEvents);
+    market::_IMarketEventsSink sink(*listener);
+
+    double lastPrice = 0.;
+    sink.OnTick([&lastPrice](BSTR symbol, double price, LONG volume)
+    {
+        std::wcout << symbol << L": " << price << L" x " << volume << std::endl;
+        lastPrice = price;
+        return S_OK;
+    });
+
+    VARIANT args[3];
+    for (VARIANT& arg : args)
+        VariantInit(&arg);
+
+    // reverse order
+    args[2].vt = VT_BSTR;
+    args[2].bstrVal = SysAllocString(L"MSFT");
+    args[1].vt = VT_R8;
+    args[1].dblVal = 421.5;
+    args[0].vt = VT_I4;
+    args[0].lVal = 100;
+
+    DISPPARAMS params{ args, nullptr, 3, 0 };
+    HRESULT hr = listener->Invoke(market::_IMarketEvents_dispid::OnTick, IID_NULL,
+        LOCALE_USER_DEFAULT, DISPATCH_METHOD, &params, nullptr, nullptr, nullptr);
+    if (!SUCCEEDED(hr) || lastPrice != 421.5)
+        return -1;
+
+    // the price passed as a string must be rejected before the callback is called
+    VariantClear(&args[1]);
+    args[1].vt = VT_BSTR;
+    args[1].bstrVal = SysAllocString(L"421.5");
+
+    UINT argErr = 0;
+    hr = listener->Invoke(market::_IMarketEvents_dispid::OnTick, IID_NULL,
+        LOCALE_USER_DEFAULT, DISPATCH_METHOD, &params, nullptr, nullptr, &argErr);
+    if (hr != DISP_E_TYPEMISMATCH || argErr != 1)
+        return -1;
+
+    for (VARIANT& arg : args)
+        VariantClear(&arg);
+
+    // [out, retval] result returned by the handler is written to pVarResult
+    sink.Quote([](BSTR symbol)
+    {
+        return std::make_pair(symbol && *symbol ? S_OK : E_INVALIDARG, 421.5);
+    });
+
+    VARIANT symbol;
+    VariantInit(&symbol);
+    symbol.vt = VT_BSTR;
+    symbol.bstrVal = SysAllocString(L"MSFT");
+
+    VARIANT price;
+    VariantInit(&price);
+
+    DISPPARAMS quoteParams{ &symbol, nullptr, 1, 0 };
+    hr = listener->Invoke(market::_IMarketEvents_dispid::Quote, IID_NULL,
+        LOCALE_USER_DEFAULT, DISPATCH_METHOD, &quoteParams, &price, nullptr, nullptr);
+    if (!SUCCEEDED(hr) || price.vt != VT_R8 || price.dblVal != 421.5)
+        return -1;
+
+    VariantClear(&symbol);
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+﻿
+// interface_cache: hits, negative caching of E_NOINTERFACE, transient failures,
+// eviction of the oldest entry and the references it holds
+
+#include "com_wrapper.h"
+
+#include <atomic>
+#include <iostream>
+
+// interfaces without methods, only their IIDs matter
+#define TEST_INTERFACE(name, id) struct __declspec(uuid(id)) name : public IUnknown {};
+
+TEST_INTERFACE(ISupported, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0001")
+TEST_INTERFACE(IBusy, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0002")
+TEST_INTERFACE(IMissing0, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0010")
+TEST_INTERFACE(IMissing1, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0011")
+TEST_INTERFACE(IMissing2, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0012")
+TEST_INTERFACE(IMissing3, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0013")
+TEST_INTERFACE(IMissing4, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0014")
+TEST_INTERFACE(IMissing5, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0015")
+TEST_INTERFACE(IMissing6, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0016")
+TEST_INTERFACE(IMissing7, "8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0017")
+
+// implements ISupported, fails IBusy with a transient error and counts the queries
+class counted_object : public ISupported
+{
+    std::atomic<ULONG> refs_ = 1;
+    size_t queries_ = 0;
+
+public:
+
+    ULONG Refs() const
+    {
+        return refs_;
+    }
+
+    size_t Queries() const
+    {
+        return queries_;
+    }
+
+    ULONG __stdcall AddRef() override
+    {
+        return ++refs_;
+    }
+
+    ULONG __stdcall Release() override
+    {
+        return --refs_;
+    }
+
+    HRESULT __stdcall QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        ++queries_;
+        *ppvObject = nullptr;
+
+        if (riid == __uuidof(IBusy))
+            return E_OUTOFMEMORY;
+
+        if (riid != IID_IUnknown && riid != __uuidof(ISupported))
+            return E_NOINTERFACE;
+
+        *ppvObject = static_cast<ISupported*>(this);
+        AddRef();
+        return S_OK;
+    }
+};
+
+// coclass of the compile-only instantiation below
+class __declspec(uuid("8d6c1a10-5b1e-4a7e-9a51-0c1f8e2a0020")) SupportedClass;
+
+// never called: instantiates the constructor creating the object
+void create_in_process()
+{
+    cmw::ComObj<ISupported, SupportedClass, IDispatch> created(CLSCTX_INPROC_SERVER);
+}
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    counted_object object;
+
+    {
+        cmw::interface_cache cache;
+
+        bool found = cache.Query<ISupported>(&object).Succeeded() && cache.Query<ISupported>(&object).Succeeded();
+        check(found && object.Queries() == 1 && cache.Hits() == 1, "supported interface queried once");
+
+        HRESULT first = cache.Query<IMissing0>(&object).HResult();
+        HRESULT second = cache.Query<IMissing0>(&object).HResult();
+        check(first == E_NOINTERFACE && second == E_NOINTERFACE && object.Queries() == 2,
+            "E_NOINTERFACE cached");
+
+        (void)cache.Query<IBusy>(&object);
+        HRESULT busy = cache.Query<IBusy>(&object).HResult();
+        check(busy == E_OUTOFMEMORY && object.Queries() == 4 && cache.Size() == 2,
+            "transient failure not cached");
+
+        // fills the cache: the oldest entry, ISupported, is replaced by the last one
+        (void)cache.Query<IMissing1>(&object);
+        (void)cache.Query<IMissing2>(&object);
+        (void)cache.Query<IMissing3>(&object);
+        (void)cache.Query<IMissing4>(&object);
+        (void)cache.Query<IMissing5>(&object);
+        (void)cache.Query<IMissing6>(&object);
+        check(cache.Size() == cmw::interface_cache::capacity, "cache full");
+
+        ULONG full = object.Refs();
+        (void)cache.Query<IMissing7>(&object);
+        check(object.Refs() == full - 1, "evicted interface released");
+
+        size_t before = object.Queries();
+        found = cache.Query<ISupported>(&object).Succeeded();
+        check(found && object.Queries() == before + 1, "evicted interface queried again");
+
+        cache.Clear();
+        check(cache.Size() == 0 && object.Refs() == 1, "Clear releases the object and the interfaces");
+
+        // the cache is bound to the first object queried
+        counted_object other;
+        (void)cache.Query<ISupported>(&object);
+        (void)cache.Query<ISupported>(&other);
+        check(cache.Size() == 1 && object.Refs() == 1 && other.Refs() == 3,
+            "another object clears the cache");
+    }
+
+    check(object.Refs() == 1, "destructor releases the references");
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,122 @@
+﻿
+// Listener with several subscribers of a DISPID: order of the calls, isolation of
+// failures, ownership of the result, and parallel fan-out over a thread pool
+
+#include "com_wrapper.h"
+#include "counted_dispatch.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+constexpr DISPID id_event = 1;
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    // every subscriber is called, a failing one does not stop the others
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        std::vector<int> called;
+
+        for (int i = 0; i < 3; ++i)
+            listener->SetCallback(id_event, [&called, i](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+                VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+            {
+                called.push_back(i);
+                return i == 1 ? E_FAIL : S_OK;
+            });
+
+        HRESULT hr = listener->Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD,
+            nullptr, nullptr, nullptr, nullptr);
+        check(called == std::vector<int>{ 0, 1, 2 }, "subscribers called in order");
+        check(hr == E_FAIL, "first failure returned");
+    }
+
+    // the first result is kept, the later ones are released
+    {
+        counted_dispatch first;
+        counted_dispatch second;
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+
+        for (counted_dispatch *object : { &first, &second, &second })
+            listener->SetCallback(id_event, [object](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+                VARIANT *pVarResult, EXCEPINFO*, UINT*) -> HRESULT
+            {
+                if (pVarResult)
+                {
+                    object->AddRef();
+                    pVarResult->vt = VT_DISPATCH;
+                    pVarResult->pdispVal = object;
+                }
+                return S_OK;
+            });
+
+        VARIANT result;
+        VariantInit(&result);
+        listener->Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD, nullptr, &result, nullptr, nullptr);
+
+        check(result.vt == VT_DISPATCH && result.pdispVal == &first, "first result returned");
+        VariantClear(&result);
+        check(first.Refs() == 1 && second.Refs() == 1, "later results released");
+    }
+
+    // parallel fan-out: the subscribers run on the pool, Invoke waits for all of them
+    {
+        auto pool = std::make_shared<cmw::thread_pool>(4);
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        listener->SetFanout(cmw::fanout_policy::parallel, pool);
+
+        std::mutex mutex;
+        std::set<std::thread::id> threads;
+        std::atomic<size_t> calls = 0;
+
+        for (int i = 0; i < 4; ++i)
+            listener->SetCallback(id_event, [&](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+                VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    threads.insert(std::this_thread::get_id());
+                }
+                ++calls;
+                return S_OK;
+            });
+
+        VARIANT arg;
+        VariantInit(&arg);
+        arg.vt = VT_I4;
+        arg.lVal = 5;
+        DISPPARAMS params{ &arg, nullptr, 1, 0 };
+        listener->Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD, &params, nullptr, nullptr, nullptr);
+
+        check(calls == 4, "parallel subscribers returned before Invoke");
+        check(threads.size() > 1 && threads.count(std::this_thread::get_id()),
+            "parallel subscribers ran on the pool");
+
+        // interfaces can not leave the firing thread
+        counted_dispatch object;
+        arg.vt = VT_DISPATCH;
+        arg.pdispVal = &object;
+        threads.clear();
+        calls = 0;
+        listener->Invoke(id_event, IID_NULL, 0, DISPATCH_METHOD, &params, nullptr, nullptr, nullptr);
+
+        check(calls == 4 && threads.size() == 1 && threads.count(std::this_thread::get_id()),
+            "interface arguments delivered on the firing thread");
+        check(object.Refs() == 1, "interface argument not retained");
+    }
+
+    return passed ? 0 : -1;
+}
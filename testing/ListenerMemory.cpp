@@ -0,0 +1,132 @@
+﻿
+#include "com_wrapper.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+// heap bytes currently allocated through operator new
+static std::atomic<size_t> allocated = 0;
+
+void* operator new(size_t size)
+{
+    void *p = std::malloc(size + sizeof(max_align_t));
+    if (!p)
+        throw std::bad_alloc();
+
+    *static_cast<size_t*>(p) = size;
+    allocated += size;
+    return static_cast<char*>(p) + sizeof(max_align_t);
+}
+
+void operator delete(void *p) noexcept
+{
+    if (!p)
+        return;
+
+    void *block = static_cast<char*>(p) - sizeof(max_align_t);
+    allocated -= *static_cast<size_t*>(block);
+    std::free(block);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+// std::pmr::new_delete_resource may allocate through the aligned forms
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    assert((size_t)alignment <= alignof(max_align_t) && "Over-aligned allocation!");
+    return operator new(size);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    operator delete(p);
+}
+
+struct document
+{
+    size_t events = 0;
+};
+
+constexpr size_t num_listeners = 10000;
+constexpr DISPID num_handlers = 16;
+
+HRESULT on_event(DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*)
+{
+    if (document *doc = static_cast<document*>(cmw::Listener::InvokeContext()))
+        ++doc->events;
+    return S_OK;
+}
+
+template <class F>
+double bytes_per_listener(std::vector<std::unique_ptr<cmw::Listener>>& listeners, F&& create)
+{
+    size_t before = allocated;
+    for (size_t i = 0; i < num_listeners; ++i)
+        listeners.push_back(create(i));
+
+    return (double)(allocated - before) / (double)num_listeners;
+}
+
+int main(int argc, const char **argv)
+{
+    std::vector<document> documents(num_listeners);
+
+    std::vector<std::unique_ptr<cmw::Listener>> listeners;
+    listeners.reserve(num_listeners);
+
+    // every listener owns a copy of the same handlers
+    double own = bytes_per_listener(listeners, [&](size_t i)
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+        for (DISPID id = 1; id <= num_handlers; ++id)
+            listener->SetCallback(id, on_event);
+        listener->SetContext(&documents[i]);
+        return listener;
+    });
+
+    listeners.clear();
+
+    std::unique_ptr<cmw::Listener> prototype = cmw::Listener::Create(IID_IDispatch);
+    for (DISPID id = 1; id <= num_handlers; ++id)
+        prototype->SetCallback(id, on_event);
+
+    double shared = bytes_per_listener(listeners, [&](size_t i)
+    {
+        return cmw::Listener::Create(IID_IDispatch, prototype->Callbacks(), &documents[i]);
+    });
+
+    // copy on write: the others still share the prototype's table
+    listeners[0]->SetCallback(num_handlers + 1, on_event);
+    if (listeners[1]->Callbacks() != prototype->Callbacks() ||
+        listeners[0]->NumCallbacks() != num_handlers + 1)
+        return -1;
+
+    for (DISPID id = 1; id <= num_handlers; ++id)
+        listeners[42]->Invoke(id, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+    if (documents[42].events != num_handlers || documents[41].events)
+        return -1;
+
+    // the figures depend on the standard library and the platform, only their
+    // ratio is checked: a listener sharing the table costs a fraction of a copy
+    if (shared * 4 > own)
+        return -1;
+
+    std::cout << num_listeners << " listeners, " << num_handlers << " handlers each" << std::endl;
+    std::cout << "sizeof(Listener):     " << sizeof(cmw::Listener) << " bytes" << std::endl;
+    std::cout << "own callback tables:  " << own << " bytes/listener" << std::endl;
+    std::cout << "shared callback table: " << shared << " bytes/listener" << std::endl;
+
+    return 0;
+}
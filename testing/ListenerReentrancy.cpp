@@ -0,0 +1,174 @@
+﻿
+// stress test of Listener: handlers add and remove callbacks, also one-shot ones,
+// while other threads fire events and change the callbacks. Replaced tables are
+// released by the destructor
+
+#include "com_wrapper.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory_resource>
+#include <thread>
+#include <vector>
+
+constexpr size_t num_firing = 4;
+constexpr size_t num_writers = 2;
+constexpr size_t num_iterations = 5000;
+
+constexpr DISPID id_nested = 1;
+constexpr DISPID id_once = 2;
+constexpr DISPID id_churn = 3;
+
+// upstream resource counting the bytes not deallocated yet
+class counting_resource : public std::pmr::memory_resource
+{
+public:
+
+    std::atomic<size_t> outstanding = 0;
+
+private:
+
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        outstanding += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        outstanding -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// tables replaced while another thread reads are released by the destructor,
+// before their resource goes
+bool tables_released_by_destructor()
+{
+    counting_resource resource;
+
+    std::promise<void> entered;
+    std::promise<void> leave;
+    std::thread reading([&entered, left = leave.get_future()]()
+    {
+        cmw::epoch_reclamation::reader reader;
+        entered.set_value();
+        left.wait();
+    });
+    entered.get_future().wait();
+
+    {
+        std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch, &resource);
+        for (int i = 0; i < 3; ++i)
+            listener->SetCallback(id_churn, [](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+                VARIANT*, EXCEPINFO*, UINT*)
+            {
+                return S_OK;
+            });
+
+        std::thread leaving([&leave]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            leave.set_value();
+        });
+        listener.reset();
+        leaving.join();
+    }
+
+    reading.join();
+    return resource.outstanding == 0;
+}
+
+int main(int argc, const char **argv)
+{
+    std::unique_ptr<cmw::Listener> listener = cmw::Listener::Create(IID_IDispatch);
+
+    std::atomic<size_t> nestedCalls = 0;
+    std::atomic<size_t> onceCalls = 0;
+    std::atomic<size_t> onceRegistered = 0;
+
+    // registers a one-shot handler and a temporary one, removed by the same call
+    listener->SetCallback(id_nested, [&](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+        VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+    {
+        ++nestedCalls;
+
+        listener->SetCallbackOnce(id_once, [&](DISPID, REFIID, LCID, WORD, DISPPARAMS*,
+            VARIANT*, EXCEPINFO*, UINT*) -> HRESULT
+        {
+            ++onceCalls;
+            return S_OK;
+        });
+        ++onceRegistered;
+
+        cmw::scoped_subscription temporary(*listener, listener->SetCallback(id_churn,
+            [](DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*)
+        {
+            return S_OK;
+        }));
+
+        return S_OK;
+    });
+
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < num_firing; ++t)
+        threads.emplace_back([&]()
+        {
+            for (size_t i = 0; i < num_iterations; ++i)
+                for (DISPID id : { id_nested, id_once, id_churn })
+                    listener->Invoke(id, IID_NULL, 0, DISPATCH_METHOD,
+                        nullptr, nullptr, nullptr, nullptr);
+        });
+
+    for (size_t t = 0; t < num_writers; ++t)
+        threads.emplace_back([&]()
+        {
+            for (size_t i = 0; i < num_iterations; ++i)
+            {
+                cmw::subscription handle = listener->SetCallback(id_churn,
+                    [](DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*)
+                {
+                    return S_OK;
+                });
+                listener->RemoveCallback(handle);
+            }
+        });
+
+    for (std::thread& t : threads)
+        t.join();
+
+    // the one-shot handlers registered by the last events
+    for (size_t i = 0; i < num_firing; ++i)
+        listener->Invoke(id_once, IID_NULL, 0, DISPATCH_METHOD,
+            nullptr, nullptr, nullptr, nullptr);
+
+    cmw::epoch_reclamation::Reclaim();
+
+    size_t left = listener->NumCallbacks();
+    size_t retired = cmw::epoch_reclamation::NumRetired();
+
+    std::cout << "nested calls: " << nestedCalls << ", one-shot calls: " << onceCalls
+        << " of " << onceRegistered << std::endl;
+    std::cout << "callbacks left: " << left << ", tables not reclaimed: " << retired << std::endl;
+
+    // every one-shot handler runs once at most, fired events call the pending ones
+    bool passed = nestedCalls == num_firing * num_iterations &&
+        onceCalls <= onceRegistered && onceCalls > 0 &&
+        left == 1 + listener->NumCallbacks(id_once) &&
+        retired == 0;
+
+    bool released = tables_released_by_destructor();
+    std::cout << "tables released by the destructor: " << (released ? "yes" : "no") << std::endl;
+
+    passed = passed && released;
+
+    return passed ? 0 : -1;
+}
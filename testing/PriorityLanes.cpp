@@ -0,0 +1,212 @@
+﻿
+// PriorityListener: delivery order of the schedulers, lane capacity, and the copies
+// of reference and interface arguments delivered after Invoke has returned
+
+#include "com_events.h"
+#include "counted_dispatch.h"
+
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <vector>
+
+constexpr DISPID id_gate = 100;
+constexpr DISPID id_byref = 101;
+constexpr DISPID id_interface = 102;
+
+template <typename ... A>
+std::function<cmw::disp_inv_t> typed(std::function<HRESULT(A...)>&& callback)
+{
+    return cmw::reduce_disp_inv_args(std::move(callback));
+}
+
+// holds the worker in a callback until Open, so the following events queue up
+class gate
+{
+    std::promise<void> entered_;
+    std::promise<void> open_;
+    std::shared_future<void> opened_ = open_.get_future().share();
+
+public:
+
+    void Register(cmw::PriorityListener& listener)
+    {
+        listener.SetCallback(id_gate, typed(std::function<HRESULT()>([this]()
+        {
+            entered_.set_value();
+            opened_.wait();
+            return S_OK;
+        })), cmw::event_priority::critical);
+    }
+
+    void Close(cmw::PriorityListener& listener)
+    {
+        listener.Invoke(id_gate, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+        entered_.get_future().wait();
+    }
+
+    void Open()
+    {
+        open_.set_value();
+    }
+};
+
+// DISPIDs in the order of delivery
+std::vector<DISPID> deliver(cmw::lane_scheduler scheduler,
+    const std::vector<std::pair<DISPID, cmw::event_priority>>& fired,
+    const std::vector<std::pair<cmw::event_priority, size_t>>& weights = {})
+{
+    std::mutex mutex;
+    std::vector<DISPID> delivered;
+
+    {
+        std::unique_ptr<cmw::PriorityListener> listener =
+            cmw::PriorityListener::Create(IID_IDispatch, scheduler);
+        for (const auto& w : weights)
+            listener->SetLaneWeight(w.first, w.second);
+
+        gate g;
+        g.Register(*listener);
+
+        std::set<DISPID> registered;
+        for (const auto& f : fired)
+            if (registered.insert(f.first).second)
+                listener->SetCallback(f.first, typed(std::function<HRESULT(DISPID)>([&](DISPID dispId)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    delivered.push_back(dispId);
+                    return S_OK;
+                })), f.second);
+
+        g.Close(*listener);
+        for (const auto& f : fired)
+            listener->Invoke(f.first, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+        g.Open();
+
+        // the destructor delivers the queued events
+    }
+
+    return delivered;
+}
+
+int main(int argc, const char **argv)
+{
+    using cmw::event_priority;
+
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    // the higher lanes are drained first, whatever the arrival order
+    std::vector<DISPID> strict = deliver(cmw::lane_scheduler::strict_priority,
+        { { 1, event_priority::low }, { 2, event_priority::normal },
+        { 3, event_priority::high }, { 4, event_priority::critical } });
+    check(strict == std::vector<DISPID>{ 4, 3, 2, 1 }, "strict priority order");
+
+    // normal gets two events per turn, low one
+    std::vector<std::pair<DISPID, event_priority>> mixed;
+    for (int i = 0; i < 4; ++i)
+    {
+        mixed.push_back({ 1, event_priority::low });
+        mixed.push_back({ 2, event_priority::normal });
+    }
+    std::vector<DISPID> fair = deliver(cmw::lane_scheduler::weighted_fair, mixed,
+        { { event_priority::normal, 2 }, { event_priority::low, 1 } });
+    check(fair == std::vector<DISPID>{ 2, 2, 1, 2, 2, 1, 1, 1 }, "weighted fair turns");
+
+    // a full lane drops the arriving events
+    {
+        std::unique_ptr<cmw::PriorityListener> listener =
+            cmw::PriorityListener::Create(IID_IDispatch);
+        gate g;
+        g.Register(*listener);
+        listener->SetCallback(1, typed(std::function<HRESULT()>([]() { return S_OK; })),
+            event_priority::low);
+        listener->SetLaneCapacity(event_priority::low, 2);
+
+        g.Close(*listener);
+        for (int i = 0; i < 5; ++i)
+            listener->Invoke(1, IID_NULL, 0, DISPATCH_METHOD, nullptr, nullptr, nullptr, nullptr);
+        check(listener->Pending(event_priority::low) == 2 &&
+            listener->LaneStats(event_priority::low).Dropped() == 3, "lane capacity");
+        g.Open();
+    }
+
+    // references are copied by value: the caller's variable is gone after Invoke
+    {
+        LONG received = 0;
+        VARTYPE receivedVt = VT_EMPTY;
+
+        {
+            std::unique_ptr<cmw::PriorityListener> listener =
+                cmw::PriorityListener::Create(IID_IDispatch);
+            listener->SetCallback(id_byref, typed(std::function<HRESULT(DISPPARAMS*)>(
+                [&](DISPPARAMS *pDispParams)
+            {
+                receivedVt = pDispParams->rgvarg[0].vt;
+                received = pDispParams->rgvarg[0].lVal;
+                return S_OK;
+            })), event_priority::normal);
+
+            gate g;
+            g.Register(*listener);
+            g.Close(*listener);
+
+            LONG value = 7;
+            VARIANT arg;
+            VariantInit(&arg);
+            arg.vt = VT_BYREF | VT_I4;
+            arg.plVal = &value;
+            DISPPARAMS params{ &arg, nullptr, 1, 0 };
+            listener->Invoke(id_byref, IID_NULL, 0, DISPATCH_METHOD, &params, nullptr, nullptr, nullptr);
+            value = 8;
+
+            g.Open();
+        }
+
+        check(receivedVt == VT_I4 && received == 7, "reference argument copied by value");
+    }
+
+    // interfaces are marshaled to the worker, and released when dropped
+    {
+        counted_dispatch object;
+        bool receivedObject = false;
+
+        {
+            std::unique_ptr<cmw::PriorityListener> listener =
+                cmw::PriorityListener::Create(IID_IDispatch);
+            listener->SetCallback(id_interface, typed(std::function<HRESULT(DISPPARAMS*)>(
+                [&](DISPPARAMS *pDispParams)
+            {
+                const VARIANT& arg = pDispParams->rgvarg[0];
+                receivedObject = arg.vt == VT_DISPATCH && arg.pdispVal;
+                return S_OK;
+            })), event_priority::low);
+            listener->SetLaneCapacity(event_priority::low, 1);
+
+            gate g;
+            g.Register(*listener);
+            g.Close(*listener);
+
+            VARIANT arg;
+            VariantInit(&arg);
+            arg.vt = VT_DISPATCH;
+            arg.pdispVal = &object;
+            DISPPARAMS params{ &arg, nullptr, 1, 0 };
+            // the second one is dropped
+            listener->Invoke(id_interface, IID_NULL, 0, DISPATCH_METHOD, &params, nullptr, nullptr, nullptr);
+            listener->Invoke(id_interface, IID_NULL, 0, DISPATCH_METHOD, &params, nullptr, nullptr, nullptr);
+
+            g.Open();
+        }
+
+        check(receivedObject && object.Refs() == 1, "interface argument marshaled and released");
+    }
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,192 @@
+﻿
+// property_batcher: the bitset and vector parts of dirty_properties, DISPID_UNKNOWN,
+// changes coalesced within an interval, and Detach racing with a flush
+
+#include "property_batcher.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// long enough for the flusher thread to stay out of the way
+constexpr std::chrono::hours manual_interval{ 1 };
+
+std::vector<int32_t> listed(const cmw::dirty_properties& dirty)
+{
+    std::vector<int32_t> dispIds;
+    dirty.ForEach([&dispIds](int32_t dispId) { dispIds.push_back(dispId); });
+    return dispIds;
+}
+
+int main(int argc, const char **argv)
+{
+    using cmw::dirty_properties;
+    using cmw::property_batcher;
+
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    // DISPIDs on both sides of bitset_size, negative ones and duplicates
+    {
+        dirty_properties dirty;
+        for (int32_t dispId : { 1000, 3, dirty_properties::bitset_size, -5, 0,
+            dirty_properties::bitset_size - 1, 3, 1000, -5 })
+            dirty.Add(dispId);
+
+        check(dirty.Size() == 6 && !dirty.All() && !dirty.Empty(), "duplicates counted once");
+        check(listed(dirty) == std::vector<int32_t>{ -5, 0, 3, dirty_properties::bitset_size - 1,
+            dirty_properties::bitset_size, 1000 }, "ascending order across bitset and vector");
+        check(dirty.Contains(0) && dirty.Contains(dirty_properties::bitset_size) && dirty.Contains(-5) &&
+            !dirty.Contains(1) && !dirty.Contains(dirty_properties::bitset_size + 1) && !dirty.Contains(-6),
+            "membership across bitset and vector");
+
+        dirty_properties other;
+        other.Add(7);
+        dirty.Swap(other);
+        check(listed(dirty) == std::vector<int32_t>{ 7 } && other.Size() == 6, "swap");
+
+        other.Clear();
+        check(other.Empty() && !other.Contains(0) && listed(other).empty(), "clear");
+    }
+
+    // DISPID_UNKNOWN: every property changed, not listed
+    {
+        dirty_properties dirty;
+        dirty.Add(dirty_properties::dispid_unknown);
+        check(dirty.All() && !dirty.Empty() && dirty.Size() == 0 && listed(dirty).empty(),
+            "unknown marks all, not listed");
+        check(dirty.Contains(12345) && dirty.Contains(0), "unknown contains every DISPID");
+
+        dirty.Add(4);
+        check(dirty.Size() == 1 && listed(dirty) == std::vector<int32_t>{ 4 }, "known DISPIDs kept with unknown");
+
+        dirty.Clear();
+        check(!dirty.All() && dirty.Empty() && !dirty.Contains(4), "clear resets unknown");
+    }
+
+    // one delivery per object and interval, with the union of its changes
+    {
+        std::vector<std::pair<void*, std::vector<int32_t>>> delivered;
+        bool all = false;
+        property_batcher batcher([&](void *context, const dirty_properties& changed)
+        {
+            delivered.emplace_back(context, listed(changed));
+            all = all || changed.All();
+        }, manual_interval);
+
+        int first = 0;
+        int second = 0;
+        auto a = batcher.Attach(&first);
+        auto b = batcher.Attach(&second);
+
+        for (int i = 0; i < 3; ++i)
+        {
+            batcher.Changed(a, 5);
+            batcher.Changed(a, 300);
+        }
+        batcher.Changed(b, 2);
+        batcher.Flush();
+
+        check(batcher.NumChanges() == 7 && batcher.NumDeliveries() == 2, "changes coalesced");
+        check(delivered.size() == 2 &&
+            delivered[0] == std::make_pair((void*)&first, std::vector<int32_t>{ 5, 300 }) &&
+            delivered[1] == std::make_pair((void*)&second, std::vector<int32_t>{ 2 }),
+            "union of the changes delivered per object");
+
+        batcher.Flush();
+        check(delivered.size() == 2, "nothing delivered without changes");
+
+        batcher.Changed(a, dirty_properties::dispid_unknown);
+        batcher.Flush();
+        check(delivered.size() == 3 && all && delivered[2].second.empty(), "unknown delivered");
+
+        batcher.Detach(*a);
+        batcher.Detach(*b);
+    }
+
+    // the flusher thread delivers once per interval
+    {
+        std::atomic<size_t> deliveries = 0;
+        std::promise<std::vector<int32_t>> received;
+        property_batcher batcher([&](void*, const dirty_properties& changed)
+        {
+            if (!deliveries++)
+                received.set_value(listed(changed));
+        }, std::chrono::milliseconds(20));
+
+        auto a = batcher.Attach(nullptr);
+        for (int32_t dispId : { 9, 1, 9, 1 })
+            batcher.Changed(a, dispId);
+
+        std::future<std::vector<int32_t>> first = received.get_future();
+        check(first.wait_for(std::chrono::seconds(5)) == std::future_status::ready &&
+            first.get() == std::vector<int32_t>{ 1, 9 }, "flushed by the interval");
+
+        batcher.Detach(*a);
+    }
+
+    // Detach waits for the delivery in progress, later objects are skipped
+    {
+        std::promise<void> entered;
+        std::promise<void> open;
+        std::shared_future<void> opened = open.get_future().share();
+
+        int first = 0;
+        int second = 0;
+        std::mutex mutex;
+        std::vector<void*> delivered;
+        property_batcher batcher([&](void *context, const dirty_properties&)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                delivered.push_back(context);
+            }
+            if (context == &first)
+            {
+                entered.set_value();
+                opened.wait();
+            }
+        }, manual_interval);
+
+        auto a = batcher.Attach(&first);
+        auto b = batcher.Attach(&second);
+        batcher.Changed(a, 1);
+        batcher.Changed(b, 1);
+
+        std::thread flushing([&batcher]() { batcher.Flush(); });
+        entered.get_future().wait();
+
+        std::atomic<bool> detached = false;
+        std::thread detaching([&]()
+        {
+            batcher.Detach(*b);
+            detached = true;
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        check(!detached, "detach waits for the delivery in progress");
+
+        open.set_value();
+        detaching.join();
+        flushing.join();
+
+        check(delivered == std::vector<void*>{ &first }, "detached object not delivered");
+
+        batcher.Changed(b, 2);
+        batcher.Flush();
+        check(delivered.size() == 1, "changes after detach ignored");
+
+        batcher.Detach(*a);
+    }
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,195 @@
+﻿
+// property_cache: hits, TTL expiry and purging, and invalidations racing with the
+// refills of the same or of other properties
+
+#include "com_wrapper.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+constexpr DISPID id_price = 1;
+constexpr DISPID id_volume = 2;
+
+// IDispatch returning the number of fetches of each property
+class counting_dispatch : public IDispatch
+{
+    std::atomic<ULONG> refs_ = 1;
+    std::mutex mutex_;
+    std::map<DISPID, LONG> fetches_;
+
+public:
+
+    // called during the fetch, before the value is returned
+    std::function<void(DISPID)> onFetch;
+
+    LONG Fetches(DISPID dispId)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return fetches_[dispId];
+    }
+
+    ULONG __stdcall AddRef() override
+    {
+        return ++refs_;
+    }
+
+    ULONG __stdcall Release() override
+    {
+        return --refs_;
+    }
+
+    HRESULT __stdcall QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if (riid != IID_IUnknown && riid != IID_IDispatch)
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        *ppvObject = static_cast<IDispatch*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    HRESULT __stdcall GetTypeInfoCount(UINT*) override { return E_NOTIMPL; }
+    HRESULT __stdcall GetTypeInfo(UINT, LCID, ITypeInfo**) override { return E_NOTIMPL; }
+    HRESULT __stdcall GetIDsOfNames(REFIID, LPOLESTR*, UINT, LCID, DISPID*) override { return E_NOTIMPL; }
+
+    HRESULT __stdcall Invoke(DISPID dispIdMember, REFIID, LCID, WORD wFlags,
+        DISPPARAMS*, VARIANT *pVarResult, EXCEPINFO*, UINT*) override
+    {
+        if (wFlags != DISPATCH_PROPERTYGET || !pVarResult)
+            return DISP_E_MEMBERNOTFOUND;
+
+        LONG fetches = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fetches = ++fetches_[dispIdMember];
+        }
+
+        if (onFetch)
+            onFetch(dispIdMember);
+
+        pVarResult->vt = VT_I4;
+        pVarResult->lVal = fetches;
+        return S_OK;
+    }
+};
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    // the second read is a hit
+    {
+        counting_dispatch object;
+        cmw::property_cache cache;
+
+        cmw::Result<LONG> first = cache.Get<LONG>(object, id_price);
+        cmw::Result<LONG> second = cache.Get<LONG>(object, id_price);
+        check(first && second && second.Value() == 1 && object.Fetches(id_price) == 1 &&
+            cache.Hits() == 1 && cache.Misses() == 1, "cached value returned");
+
+        cache.Invalidate(id_price);
+        check(cache.Get<LONG>(object, id_price).Value() == 2 && cache.Size() == 1,
+            "refetched after Invalidate");
+
+        cache.Invalidate(DISPID_UNKNOWN);
+        check(cache.Size() == 0 && cache.Invalidations() == 2, "DISPID_UNKNOWN invalidates all");
+    }
+
+    // expired values are refetched, and purged when the table changes
+    {
+        counting_dispatch object;
+        cmw::property_cache cache;
+        cache.SetTtl(id_price, std::chrono::milliseconds(1));
+
+        (void)cache.Get<LONG>(object, id_price);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        check(cache.Get<LONG>(object, id_price).Value() == 2 && cache.Expirations() == 1,
+            "expired value refetched");
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        (void)cache.Get<LONG>(object, id_volume);
+        check(cache.Size() == 1, "expired value purged");
+    }
+
+    // an invalidation during the fetch of the same property: the value is not cached
+    {
+        counting_dispatch object;
+        cmw::property_cache cache;
+        object.onFetch = [&cache](DISPID dispId)
+        {
+            if (dispId == id_price)
+                cache.Invalidate(id_price);
+        };
+
+        (void)cache.Get<LONG>(object, id_price);
+        check(cache.Size() == 0, "refill invalidated meanwhile is dropped");
+    }
+
+    // an invalidation of another property does not discard the refill
+    {
+        counting_dispatch object;
+        cmw::property_cache cache;
+        object.onFetch = [&cache](DISPID dispId)
+        {
+            if (dispId == id_volume)
+                cache.Invalidate(id_price);
+        };
+
+        (void)cache.Get<LONG>(object, id_volume);
+        (void)cache.Get<LONG>(object, id_volume);
+        check(cache.Size() == 1 && object.Fetches(id_volume) == 1,
+            "refill kept across other invalidations");
+
+        object.onFetch = [&cache](DISPID)
+        {
+            cache.InvalidateAll();
+        };
+        (void)cache.Get<LONG>(object, id_price);
+        check(cache.Size() == 0, "refill dropped by InvalidateAll meanwhile");
+    }
+
+    // readers racing with invalidations
+    {
+        counting_dispatch object;
+        cmw::property_cache cache;
+        std::atomic<bool> stop = false;
+        std::atomic<size_t> failures = 0;
+
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; ++t)
+            readers.emplace_back([&, t]()
+            {
+                while (!stop)
+                    if (!cache.Get<LONG>(object, t % 2 ? id_price : id_volume))
+                        ++failures;
+            });
+
+        for (int i = 0; i < 2000; ++i)
+            cache.Invalidate(i % 3 ? id_price : DISPID_UNKNOWN);
+
+        stop = true;
+        for (std::thread& t : readers)
+            t.join();
+
+        check(failures == 0 && cache.Hits() + cache.Misses() > 0, "concurrent reads");
+    }
+
+    cmw::epoch_reclamation::Reclaim();
+    check(cmw::epoch_reclamation::NumRetired() == 0, "replaced tables reclaimed");
+
+    return passed ? 0 : -1;
+}
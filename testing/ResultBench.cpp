@@ -0,0 +1,185 @@
+﻿
+#include "com_wrapper.h"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+// object implementing IUnknown only: every other query fails with E_NOINTERFACE
+class Unknown : public IUnknown
+{
+    cmw::reference_counter refs_;
+
+public:
+
+    HRESULT __stdcall QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if (!ppvObject)
+            return E_POINTER;
+
+        if (riid == IID_IUnknown)
+        {
+            *ppvObject = static_cast<IUnknown*>(this);
+            AddRef();
+            return S_OK;
+        }
+
+        *ppvObject = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG __stdcall AddRef() override
+    {
+        return refs_.AddRef();
+    }
+
+    ULONG __stdcall Release() override
+    {
+        return refs_.Release();
+    }
+};
+
+template <class F>
+double measure_ns(size_t iterations, F&& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+        (double)iterations;
+}
+
+// continuations are noexcept as long as the callable is
+using dispatch_result = cmw::Result<cmw::ComPtr<IDispatch>>;
+using nothrow_next = dispatch_result(*)(cmw::ComPtr<IDispatch>&&) noexcept;
+using throwing_next = dispatch_result(*)(cmw::ComPtr<IDispatch>&&);
+
+static_assert(noexcept(std::declval<dispatch_result>().and_then(std::declval<nothrow_next>())),
+    "and_then of a noexcept callable must be noexcept!");
+static_assert(!noexcept(std::declval<dispatch_result>().and_then(std::declval<throwing_next>())),
+    "and_then of a throwing callable must not be noexcept!");
+
+// value whose copies throw on demand, counts the live instances
+struct fragile
+{
+    static inline int live = 0;
+    bool throws;
+
+    fragile(bool throws_)
+        : throws(throws_)
+    {
+        ++live;
+    }
+
+    fragile(const fragile& other)
+        : throws(other.throws)
+    {
+        if (other.throws)
+            throw std::runtime_error("copy failed");
+        ++live;
+    }
+
+    ~fragile()
+    {
+        --live;
+    }
+};
+
+// an assignment whose copy throws leaves a failed result, destroyed once
+static bool throwing_assignment()
+{
+    {
+        cmw::Result<fragile> target(fragile(false));
+        cmw::Result<fragile> source(fragile(false));
+        source.Value().throws = true;
+        try
+        {
+            target = source;
+            return false;
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+
+        if (target || target.HResult() != E_UNEXPECTED || fragile::live != 1)
+            return false;
+
+        target = cmw::Result<fragile>::Fail(E_FAIL);
+        if (target.HResult() != E_FAIL)
+            return false;
+    }
+
+    return fragile::live == 0;
+}
+
+int main(int argc, const char **argv)
+{
+    constexpr size_t iterations = 100000;
+
+    Unknown object;
+    object.AddRef();
+    cmw::ComPtr<IUnknown> pUnknown(static_cast<IUnknown*>(&object));
+
+    size_t failures = 0;
+    size_t expectedFailures = iterations;
+
+#ifdef NDEBUG
+    expectedFailures += iterations;
+
+    double throwing = measure_ns(iterations, [&]()
+    {
+        try
+        {
+            cmw::ComPtr<IDispatch> pDispatch = pUnknown;
+        }
+        catch (const _com_error&)
+        {
+            ++failures;
+        }
+    });
+#endif
+
+    double result = measure_ns(iterations, [&]()
+    {
+        cmw::Result<cmw::ComPtr<IDispatch>> pDispatch =
+            pUnknown.TryQueryInterface<IDispatch>();
+        if (!pDispatch)
+            ++failures;
+    });
+
+    cmw::Result<cmw::ComPtr<IDispatch>> failed = pUnknown.TryQueryInterface<IDispatch>();
+    if (failed || failed.HResult() != E_NOINTERFACE)
+        return -1;
+
+    cmw::Result<cmw::ComPtr<IUnknown>> succeeded = pUnknown.TryQueryInterface<IUnknown>();
+    if (!succeeded || succeeded.Raw() != &object)
+        return -1;
+
+    if (failures != expectedFailures)
+        return -1;
+
+    if (!throwing_assignment())
+        return -1;
+
+#ifdef NDEBUG
+    // a success code is not taken for a failure, debug builds assert
+    cmw::Result<int> misused = cmw::result_failure{ S_OK };
+    cmw::Result<cmw::ComPtr<IDispatch>> misusedPtr = cmw::result_failure{ S_FALSE };
+    if (misused || misused.HResult() != E_UNEXPECTED ||
+        misusedPtr || misusedPtr.HResult() != E_UNEXPECTED)
+        return -1;
+#endif
+
+#ifdef NDEBUG
+    std::cout << "E_NOINTERFACE via _com_error: " << throwing << " ns/call" << std::endl;
+#else
+    // the throwing conversions assert on failure
+    std::cout << "E_NOINTERFACE via _com_error: build in Release to measure" << std::endl;
+#endif
+    std::cout << "E_NOINTERFACE via Result:     " << result << " ns/call" << std::endl;
+
+    return 0;
+}
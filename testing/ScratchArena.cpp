@@ -0,0 +1,114 @@
+﻿
+// scratch_arena: alignment, rewinding by scopes, growth for large requests and
+// steady state without global allocations, checked by allocation_guard
+
+#include "com_memory.h"
+
+#include <cstdint>
+#include <iostream>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+CMW_DEFINE_GUARDED_OPERATOR_NEW
+
+constexpr size_t num_iterations = 10000;
+
+// temporaries of a callback: a vector of strings longer than the small buffer
+size_t split(cmw::scratch_arena& scratch, const std::string& text)
+{
+    cmw::scratch_arena::scope scope(scratch);
+
+    std::pmr::vector<std::pmr::string> words(&scratch);
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        size_t end = std::min(text.find(' ', begin), text.size());
+        words.emplace_back(text.data() + begin, end - begin);
+        begin = end + 1;
+    }
+    return words.size();
+}
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    cmw::scratch_arena arena;
+
+    {
+        cmw::scratch_arena::scope scope(arena);
+
+        bool aligned = true;
+        for (size_t alignment : { 1, 2, 8, 16, 64, 256 })
+        {
+            // misaligns the next one
+            (void)arena.allocate(1, 1);
+            void *p = arena.allocate(24, alignment);
+            aligned = aligned && reinterpret_cast<uintptr_t>(p) % alignment == 0;
+        }
+        check(aligned, "allocations aligned");
+    }
+
+    // a scope gives back what was allocated in it, nested ones as well
+    {
+        cmw::scratch_arena::scope outer(arena);
+        void *first = arena.allocate(100, 8);
+
+        void *inner = nullptr;
+        {
+            cmw::scratch_arena::scope scope(arena);
+            inner = arena.allocate(100, 8);
+        }
+        void *again = arena.allocate(100, 8);
+
+        check(first != inner && again == inner, "nested scope rewound");
+    }
+
+    // larger than a chunk: a chunk of its size is added, then reused
+    {
+        size_t before = arena.NumChunks();
+        {
+            cmw::scratch_arena::scope scope(arena);
+            (void)arena.allocate(cmw::scratch_arena::chunk_size * 3, 16);
+        }
+        {
+            cmw::scratch_arena::scope scope(arena);
+            (void)arena.allocate(cmw::scratch_arena::chunk_size * 3, 16);
+        }
+        check(arena.NumChunks() == before + 1 &&
+            arena.Capacity() >= cmw::scratch_arena::chunk_size * 3, "large request in its own chunk");
+    }
+
+    // steady state: the callbacks' temporaries never reach the heap
+    std::string text = "temporaries of the callbacks are built in the scratch memory of the thread";
+    cmw::allocation_guard::SetMode(cmw::allocation_check::count);
+
+    size_t words = 0;
+    size_t chunks = 0;
+    uint64_t violations = 0;
+    {
+        cmw::allocation_guard::scope guard;
+
+        words = split(cmw::scratch_arena::Current(), text);
+        chunks = cmw::scratch_arena::Current().NumChunks();
+
+        for (size_t i = 0; i < num_iterations; ++i)
+            words = split(cmw::scratch_arena::Current(), text);
+
+        violations = cmw::allocation_guard::Violations();
+    }
+
+    std::cout << num_iterations << " calls, scratch chunks: " << chunks
+        << ", global allocations: " << violations << std::endl;
+    check(words == 13 && chunks == 1 && cmw::scratch_arena::Current().NumChunks() == chunks,
+        "chunk of the thread reused");
+    check(violations == 0, "no global allocation in steady state");
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,235 @@
+﻿
+// shm_event_bus: subscribers in child processes, eviction of the slow and of the
+// ones reading overwritten records, callbacks changed while dispatching, and
+// strings of torn records
+
+#include "shm_event_bus.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+constexpr int32_t dispid_tick = 2;
+constexpr int num_events = 100000;
+
+// child process: checks every event in place
+int subscribe(const std::string& name, bool slow)
+{
+    std::unique_ptr<cmw::shm_event_subscriber> subscriber;
+    for (int attempt = 0; !subscriber && attempt < 1000; ++attempt)
+    {
+        subscriber = cmw::shm_event_subscriber::Open(name);
+        if (!subscriber)
+            usleep(1000);
+    }
+
+    if (!subscriber)
+        return 1;
+
+    int received = 0;
+    bool valid = true;
+    subscriber->SetCallback(dispid_tick, [&](const cmw::flat_event& event)
+    {
+        valid = valid && event.NumArgs() == 3 &&
+            event.Arg(0).vt == cmw::flat_vt::bstr && event.String(0) == u"MSFT" &&
+            event.Arg(1).vt == cmw::flat_vt::r8 && event.Arg(1).r == 1.5 * received &&
+            event.Arg(2).vt == cmw::flat_vt::i4 && event.Arg(2).i == received;
+        ++received;
+    });
+
+    // tells the parent it has joined
+    std::cout << (slow ? "slow" : "fast") << " subscriber joined" << std::endl;
+
+    if (slow)
+    {
+        // never reads: the publisher must evict it instead of stalling
+        while (!subscriber->IsEvicted())
+            usleep(1000);
+        return 0;
+    }
+
+    while (received < num_events && !subscriber->IsEvicted())
+        if (!subscriber->Poll())
+            std::this_thread::yield();
+
+    return valid && received == num_events ? 0 : 2;
+}
+
+void publish_tick(cmw::shm_event_bus& bus, cmw::flat_event_builder& event, int i, bool& published)
+{
+    event.Reset(dispid_tick, 1);
+    event.AddString(u"MSFT", 4);
+    event.AddReal(cmw::flat_vt::r8, 1.5 * i);
+    event.AddInt(cmw::flat_vt::i4, i);
+    published = bus.Publish(event);
+}
+
+// drop mode: a subscriber keeping the ring full is evicted after the timeout
+bool drop_evicts(const std::string& name)
+{
+    std::unique_ptr<cmw::shm_event_bus> bus = cmw::shm_event_bus::Create(name, 1 << 10, 2,
+        cmw::bus_overflow::drop, std::chrono::milliseconds(50));
+    std::unique_ptr<cmw::shm_event_subscriber> subscriber = cmw::shm_event_subscriber::Open(name);
+    if (!bus || !subscriber)
+        return false;
+
+    cmw::flat_event_builder event;
+    bool published = true;
+    int i = 0;
+    while (published)
+        publish_tick(*bus, event, i++, published);
+
+    bool dropped = bus->Dropped() > 0 && !subscriber->IsEvicted();
+
+    usleep(60000);
+    publish_tick(*bus, event, i, published);
+
+    return dropped && published && subscriber->IsEvicted() && bus->Evicted() == 1;
+}
+
+// a record overwritten under the subscriber evicts it instead of being read
+bool corrupt_evicts(const std::string& name)
+{
+    std::unique_ptr<cmw::shm_event_bus> bus = cmw::shm_event_bus::Create(name, 1 << 10, 2);
+    std::unique_ptr<cmw::shm_event_subscriber> subscriber = cmw::shm_event_subscriber::Open(name);
+    if (!bus || !subscriber)
+        return false;
+
+    int received = 0;
+    subscriber->SetCallback(dispid_tick, [&](const cmw::flat_event&) { ++received; });
+
+    cmw::flat_event_builder event;
+    bool published = false;
+    publish_tick(*bus, event, 0, published);
+
+    std::unique_ptr<cmw::shm_segment> segment = cmw::shm_segment::Open(name,
+        cmw::shm_bus_layout::segment_size(1 << 10, 2), false);
+    if (!published || !segment)
+        return false;
+
+    cmw::shm_bus_layout::record_prefix prefix{ 0, 0 };
+    std::memcpy(cmw::shm_bus_layout::ring(segment->Address(), 2), &prefix, sizeof(prefix));
+
+    return subscriber->Poll() == 0 && received == 0 && subscriber->IsEvicted();
+}
+
+// callbacks registering and removing callbacks of the event being dispatched
+bool reentrant_callbacks(const std::string& name)
+{
+    std::unique_ptr<cmw::shm_event_bus> bus = cmw::shm_event_bus::Create(name, 1 << 12, 2);
+    std::unique_ptr<cmw::shm_event_subscriber> subscriber = cmw::shm_event_subscriber::Open(name);
+    if (!bus || !subscriber)
+        return false;
+
+    int once = 0;
+    int added = 0;
+    int removed = 0;
+    cmw::bus_subscription self{};
+    cmw::bus_subscription later{};
+    self = subscriber->SetCallback(dispid_tick, [&](const cmw::flat_event&)
+    {
+        ++once;
+        subscriber->RemoveCallback(self);
+        subscriber->RemoveCallback(later);
+        for (int i = 0; i < 16; ++i)
+            subscriber->SetCallback(dispid_tick, [&](const cmw::flat_event&) { ++added; });
+    });
+    later = subscriber->SetCallback(dispid_tick, [&](const cmw::flat_event&) { ++removed; });
+
+    cmw::flat_event_builder event;
+    bool published = true;
+    for (int i = 0; i < 2 && published; ++i)
+        publish_tick(*bus, event, i, published);
+
+    return published && subscriber->Poll() == 2 && once == 1 && removed == 0 && added == 16;
+}
+
+// offsets and lengths of torn records are not trusted
+bool torn_strings()
+{
+    cmw::flat_event_builder builder;
+    builder.Reset(dispid_tick, 1);
+    builder.AddString(u"MSFT", 4);
+    std::pair<const uint8_t*, size_t> encoded = builder.Encode();
+    std::vector<uint8_t> record(encoded.first, encoded.first + encoded.second);
+
+    cmw::flat_arg *arg = reinterpret_cast<cmw::flat_arg*>(record.data() + sizeof(cmw::flat_event_header));
+    cmw::flat_event event(record.data(), record.size());
+    bool valid = event.String(0) == u"MSFT";
+
+    arg->length = 5;
+    bool pastEnd = event.String(0).empty();
+
+    arg->length = 4;
+    arg->offset = (uint64_t)1 << 40;
+    bool farOffset = event.String(0).empty();
+
+    // numArgs beyond the record
+    reinterpret_cast<cmw::flat_event_header*>(record.data())->numArgs = 1000;
+    bool argsBounded = event.NumArgs() == 1;
+
+    return valid && pastEnd && farOffset && argsBounded;
+}
+
+int main(int argc, const char **argv)
+{
+    std::string name = "/cmw_bus_test_" + std::to_string(getpid());
+
+    std::unique_ptr<cmw::shm_event_bus> bus = cmw::shm_event_bus::Create(name, 1 << 16, 4,
+        cmw::bus_overflow::block, std::chrono::milliseconds(200));
+    if (!bus)
+        return -1;
+
+    pid_t children[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        children[i] = fork();
+        if (!children[i])
+            _exit(subscribe(name, i == 1));
+    }
+
+    while (bus->NumSubscribers() < 2)
+        usleep(1000);
+
+    cmw::flat_event_builder event;
+    for (int i = 0; i < num_events; ++i)
+    {
+        event.Reset(dispid_tick, 1);
+        event.AddString(u"MSFT", 4);
+        event.AddReal(cmw::flat_vt::r8, 1.5 * i);
+        event.AddInt(cmw::flat_vt::i4, i);
+        if (!bus->Publish(event))
+            return -1;
+    }
+
+    int failures = 0;
+    for (pid_t child : children)
+    {
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            ++failures;
+    }
+
+    std::cout << "published " << bus->Published() << ", evicted " << bus->Evicted() << std::endl;
+    if (bus->Evicted() != 1)
+        ++failures;
+
+    bool dropEvicts = drop_evicts(name + "_drop");
+    std::cout << (dropEvicts ? "ok     " : "FAILED ") << "drop mode evicts the slow subscriber" << std::endl;
+
+    bool corruptEvicts = corrupt_evicts(name + "_corrupt");
+    std::cout << (corruptEvicts ? "ok     " : "FAILED ") << "invalid record evicts the subscriber" << std::endl;
+
+    bool reentrant = reentrant_callbacks(name + "_reentrant");
+    std::cout << (reentrant ? "ok     " : "FAILED ") << "callbacks changed while dispatching" << std::endl;
+
+    bool tornStrings = torn_strings();
+    std::cout << (tornStrings ? "ok     " : "FAILED ") << "strings read within the record" << std::endl;
+
+    return failures || !dropEvicts || !corruptEvicts || !reentrant || !tornStrings ? -1 : 0;
+}
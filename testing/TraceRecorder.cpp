@@ -0,0 +1,112 @@
+﻿
+// the trace ring, a tracer session and its Chrome trace JSON output
+
+#include "com_trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+constexpr size_t num_threads = 4;
+constexpr size_t spans_per_thread = 100;
+
+size_t count(const std::string& text, const std::string& what)
+{
+    size_t n = 0;
+    for (size_t pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1))
+        ++n;
+    return n;
+}
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream in(path);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    // records come out in order, a full ring drops the new ones
+    {
+        auto ring = std::make_unique<cmw::trace_ring>(7);
+        std::vector<cmw::trace_record> drained;
+
+        for (int64_t i = 0; i < 10; ++i)
+            ring->Push({ "push", cmw::trace_category::invoke, 0, i, i, i + 1 });
+        bool ordered = ring->Drain(drained) == 10;
+        for (int64_t i = 0; ordered && i < 10; ++i)
+            ordered = drained[i].arg == i;
+        check(ordered, "ring drains in order");
+
+        drained.clear();
+        for (int64_t i = 0; i < 5000; ++i)
+            ring->Push({ "push", cmw::trace_category::invoke, 0, i, i, i + 1 });
+        size_t kept = ring->Drain(drained);
+        check(kept == 4096 && drained.back().arg == 4095, "full ring keeps the oldest spans");
+        check(ring->TakeDropped() == 5000 - 4096 && ring->Dropped() == 0, "dropped spans counted");
+    }
+
+    std::string path = "TraceRecorder.json";
+
+    check(!cmw::tracer::Enabled(), "disabled before Start");
+    check(!cmw::tracer::Start("no/such/directory/trace.json"), "Start fails on a bad path");
+
+    // spans of a stopped tracer are not recorded
+    {
+        cmw::trace_span ignored("ignored", cmw::trace_category::invoke);
+    }
+
+    check(cmw::tracer::Start(path, std::chrono::milliseconds(5)), "Start");
+    check(cmw::tracer::Enabled(), "enabled while running");
+    check(!cmw::tracer::Start(path), "second Start fails");
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t)
+        threads.emplace_back([]()
+        {
+            for (size_t i = 0; i < spans_per_thread; ++i)
+            {
+                cmw::trace_span span("QueryInterface", cmw::trace_category::query_interface, (int64_t)i);
+                span.SetResult((int32_t)0x80004002);
+            }
+        });
+    for (std::thread& t : threads)
+        t.join();
+
+    {
+        cmw::trace_span span("Invoke", cmw::trace_category::invoke, 42);
+    }
+
+    cmw::tracer::Stop();
+    check(!cmw::tracer::Enabled(), "disabled after Stop");
+
+    std::string json = read_file(path);
+    check(json.rfind("{\"traceEvents\":[", 0) == 0 &&
+        json.size() > 4 && json.compare(json.size() - 4, 4, "\n]}\n") == 0,
+        "Chrome trace document");
+    check(count(json, "\"ph\":\"X\"") == num_threads * spans_per_thread + 1 &&
+        cmw::tracer::Dropped() == 0, "every span written");
+    check(count(json, "\"name\":\"QueryInterface\",\"cat\":\"query_interface\"") ==
+        num_threads * spans_per_thread, "span name and category");
+    check(count(json, "\"hr\":\"0x80004002\"") == num_threads * spans_per_thread,
+        "span result");
+    check(count(json, "\"name\":\"Invoke\",\"cat\":\"invoke\"") == 1 &&
+        count(json, "\"arg\":42,") == num_threads + 1, "span argument");
+    check(count(json, "ignored") == 0, "nothing recorded while stopped");
+
+    std::remove(path.c_str());
+
+    return passed ? 0 : -1;
+}
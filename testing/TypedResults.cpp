@@ -0,0 +1,150 @@
+﻿
+// typed callbacks: results written into pVarResult, [out] arguments through byref
+
+#include "com_wrapper.h"
+#include "counted_dispatch.h"
+
+#include <atomic>
+#include <iostream>
+#include <string>
+
+template <class R, typename ... A>
+std::function<cmw::disp_inv_t> typed(std::function<R(A...)>&& callback)
+{
+    return cmw::decode_disp_args(std::move(callback));
+}
+
+HRESULT call(const std::function<cmw::disp_inv_t>& callback, DISPPARAMS *params, VARIANT *result)
+{
+    return callback(1, IID_NULL, 0, DISPATCH_METHOD, params, result, nullptr, nullptr);
+}
+
+bool is_string(const VARIANT& v, const wchar_t *text)
+{
+    return v.vt == VT_BSTR && v.bstrVal && std::wstring(v.bstrVal) == text;
+}
+
+int main(int argc, const char **argv)
+{
+    bool passed = true;
+    auto check = [&passed](bool ok, const char *what)
+    {
+        std::cout << (ok ? "ok     " : "FAILED ") << what << std::endl;
+        passed = passed && ok;
+    };
+
+    VARIANT result;
+    VariantInit(&result);
+
+    // results
+    {
+        HRESULT hr = call(typed(std::function<std::wstring()>([]()
+        {
+            return std::wstring(L"wide");
+        })), nullptr, &result);
+        check(SUCCEEDED(hr) && is_string(result, L"wide"), "std::wstring result");
+        VariantClear(&result);
+
+        hr = call(typed(std::function<_bstr_t()>([]()
+        {
+            return _bstr_t(L"bstr");
+        })), nullptr, &result);
+        check(SUCCEEDED(hr) && is_string(result, L"bstr"), "_bstr_t result");
+        VariantClear(&result);
+
+        counted_dispatch object;
+        hr = call(typed(std::function<cmw::ComPtr<IDispatch>()>([&object]()
+        {
+            object.AddRef();
+            return cmw::ComPtr<IDispatch>(static_cast<IDispatch*>(&object));
+        })), nullptr, &result);
+        check(SUCCEEDED(hr) && result.vt == VT_DISPATCH && result.pdispVal == &object &&
+            object.Refs() == 2, "ComPtr result handed over");
+        VariantClear(&result);
+        check(object.Refs() == 1, "ComPtr result released with the VARIANT");
+
+        hr = call(typed(std::function<std::pair<HRESULT, std::wstring>()>([]()
+        {
+            return std::make_pair(E_FAIL, std::wstring(L"ignored"));
+        })), nullptr, &result);
+        check(hr == E_FAIL && result.vt == VT_EMPTY, "failed result not written");
+    }
+
+    // [in, out] LONG, by reference to the value and to a VARIANT
+    {
+        auto increment = typed(std::function<HRESULT(cmw::byref<LONG>)>([](cmw::byref<LONG> value)
+        {
+            value = value.Get() + 1;
+            return S_OK;
+        }));
+
+        LONG counter = 41;
+        VARIANT arg;
+        VariantInit(&arg);
+        arg.vt = VT_BYREF | VT_I4;
+        arg.plVal = &counter;
+        DISPPARAMS params{ &arg, nullptr, 1, 0 };
+        HRESULT hr = call(increment, &params, nullptr);
+        check(SUCCEEDED(hr) && counter == 42, "byref<LONG> through VT_BYREF | VT_I4");
+
+        VARIANT referenced;
+        VariantInit(&referenced);
+        referenced.vt = VT_I4;
+        referenced.lVal = 7;
+        arg.vt = VT_BYREF | VT_VARIANT;
+        arg.pvarVal = &referenced;
+        hr = call(increment, &params, nullptr);
+        check(SUCCEEDED(hr) && referenced.vt == VT_I4 && referenced.lVal == 8,
+            "byref<LONG> through VT_BYREF | VT_VARIANT");
+
+        double wrong = 0.;
+        arg.vt = VT_BYREF | VT_R8;
+        arg.pdblVal = &wrong;
+        hr = call(increment, &params, nullptr);
+        check(hr == DISP_E_TYPEMISMATCH, "byref<LONG> rejects a double");
+    }
+
+    // [in, out] strings: the previous one is released
+    {
+        auto append = typed(std::function<HRESULT(cmw::byref<_bstr_t>)>([](cmw::byref<_bstr_t> text)
+        {
+            // empty: no string
+            _bstr_t previous = text.Get();
+            std::wstring appended = previous.length() ? std::wstring(previous) : std::wstring();
+            text = _bstr_t((appended + L"!").c_str());
+            return S_OK;
+        }));
+
+        BSTR text = SysAllocString(L"hello");
+        VARIANT arg;
+        VariantInit(&arg);
+        arg.vt = VT_BYREF | VT_BSTR;
+        arg.pbstrVal = &text;
+        DISPPARAMS params{ &arg, nullptr, 1, 0 };
+        HRESULT hr = call(append, &params, nullptr);
+        check(SUCCEEDED(hr) && text && std::wstring(text) == L"hello!", "byref<_bstr_t> through VT_BYREF | VT_BSTR");
+        SysFreeString(text);
+
+        VARIANT referenced;
+        VariantInit(&referenced);
+        arg.vt = VT_BYREF | VT_VARIANT;
+        arg.pvarVal = &referenced;
+        hr = call(append, &params, nullptr);
+        check(SUCCEEDED(hr) && is_string(referenced, L"!"), "byref<_bstr_t> fills an empty VARIANT");
+        VariantClear(&referenced);
+
+        auto replace = typed(std::function<void(cmw::byref<std::wstring>)>([](cmw::byref<std::wstring> text)
+        {
+            text.Set(L"replaced");
+        }));
+
+        text = SysAllocString(L"old");
+        arg.vt = VT_BYREF | VT_BSTR;
+        arg.pbstrVal = &text;
+        hr = call(replace, &params, nullptr);
+        check(SUCCEEDED(hr) && text && std::wstring(text) == L"replaced", "byref<std::wstring> Set");
+        SysFreeString(text);
+    }
+
+    return passed ? 0 : -1;
+}
@@ -0,0 +1,48 @@
+﻿#pragma once
+
+// test fixture shared by the listener tests
+
+#include "com_wrapper.h"
+
+#include <atomic>
+
+// IDispatch doing nothing but counting its references
+class counted_dispatch : public IDispatch
+{
+    std::atomic<ULONG> refs_ = 1;
+
+public:
+
+    ULONG Refs() const
+    {
+        return refs_;
+    }
+
+    ULONG __stdcall AddRef() override
+    {
+        return ++refs_;
+    }
+
+    ULONG __stdcall Release() override
+    {
+        return --refs_;
+    }
+
+    HRESULT __stdcall QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if (riid != IID_IUnknown && riid != IID_IDispatch)
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        *ppvObject = static_cast<IDispatch*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    HRESULT __stdcall GetTypeInfoCount(UINT*) override { return E_NOTIMPL; }
+    HRESULT __stdcall GetTypeInfo(UINT, LCID, ITypeInfo**) override { return E_NOTIMPL; }
+    HRESULT __stdcall GetIDsOfNames(REFIID, LPOLESTR*, UINT, LCID, DISPID*) override { return E_NOTIMPL; }
+    HRESULT __stdcall Invoke(DISPID, REFIID, LCID, WORD, DISPPARAMS*, VARIANT*, EXCEPINFO*, UINT*) override { return E_NOTIMPL; }
+};
@@ -0,0 +1,672 @@
+﻿
+// cmwidlgen: generates DISPID tables, typed sinks and typed client stubs
+// from the dispinterfaces of an ODL file.
+//
+//   cmwidlgen <input.odl> <output dir> [namespace]
+//
+// Writes <name>_ids.h, which depends on the standard library only,
+// and <name>.h with the sinks and stubs built on com_wrapper.h.
+//
+// Supported subset:
+//   [uuid(...)] dispinterface Name {
+//   properties:
+//       [id(1)] double Price;
+//   methods:
+//       [id(2)] void OnTick(BSTR symbol, double price);
+//       [id(3), propget] long Count();
+//       [id(3), propput] void Count(long value);
+//       [id(4)] void Query(long n, [out, retval] VARIANT_BOOL *result);
+//   };
+// Everything outside of dispinterface blocks is skipped.
+
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct token
+    {
+        std::string text;
+        size_t line;
+    };
+
+    struct param
+    {
+        std::string type;
+        std::string name;
+        bool retval = false;
+    };
+
+    enum class member_kind
+    {
+        method,
+        propget,
+        propput,
+        property
+    };
+
+    struct member
+    {
+        member_kind kind = member_kind::method;
+        int32_t dispid = 0;
+        std::string name;
+        std::string returnType;
+        std::vector<param> params;
+    };
+
+    struct dispinterface
+    {
+        std::string name;
+        std::string uuid;
+        std::vector<member> members;
+    };
+
+    // ODL type -> C++ type used by the generated code
+    const std::map<std::string, std::string>& type_map()
+    {
+        static const std::map<std::string, std::string> types{
+            { "void", "void" },
+            { "VARIANT_BOOL", "bool" },
+            { "boolean", "bool" },
+            { "BYTE", "BYTE" },
+            { "unsigned char", "BYTE" },
+            { "short", "short" },
+            { "int", "int" },
+            { "long", "LONG" },
+            { "LONG", "LONG" },
+            { "unsigned long", "ULONG" },
+            { "ULONG", "ULONG" },
+            { "DWORD", "ULONG" },
+            { "hyper", "LONGLONG" },
+            { "LONGLONG", "LONGLONG" },
+            { "float", "float" },
+            { "double", "double" },
+            { "DATE", "double" },
+            { "BSTR", "BSTR" },
+            { "IDispatch*", "IDispatch*" },
+            { "IUnknown*", "IUnknown*" },
+            { "VARIANT", "const VARIANT*" }
+        };
+        return types;
+    }
+
+    [[noreturn]] void fail(size_t line, const std::string& message)
+    {
+        throw std::runtime_error("line " + std::to_string(line) + ": " + message);
+    }
+
+    std::vector<token> tokenize(const std::string& text)
+    {
+        std::vector<token> tokens;
+        size_t line = 1;
+
+        for (size_t i = 0; i < text.size();)
+        {
+            char c = text[i];
+
+            if (c == '\n')
+            {
+                ++line;
+                ++i;
+            }
+            else if (std::isspace((unsigned char)c))
+                ++i;
+            else if (text.compare(i, 2, "//") == 0)
+            {
+                while (i < text.size() && text[i] != '\n')
+                    ++i;
+            }
+            else if (text.compare(i, 2, "/*") == 0)
+            {
+                size_t end = text.find("*/", i + 2);
+                if (end == std::string::npos)
+                    fail(line, "unterminated comment");
+                for (; i < end + 2; ++i)
+                    if (text[i] == '\n')
+                        ++line;
+            }
+            else if (c == '"')
+            {
+                size_t end = text.find('"', i + 1);
+                if (end == std::string::npos)
+                    fail(line, "unterminated string");
+                tokens.push_back({ text.substr(i, end - i + 1), line });
+                i = end + 1;
+            }
+            else if (std::isalnum((unsigned char)c) || c == '_')
+            {
+                // uuids contain dashes
+                size_t start = i;
+                while (i < text.size() &&
+                    (std::isalnum((unsigned char)text[i]) || text[i] == '_' || text[i] == '-'))
+                    ++i;
+                tokens.push_back({ text.substr(start, i - start), line });
+            }
+            else
+            {
+                tokens.push_back({ std::string(1, c), line });
+                ++i;
+            }
+        }
+
+        return tokens;
+    }
+
+    class parser
+    {
+        const std::vector<token>& tokens_;
+        size_t pos_ = 0;
+
+    public:
+
+        explicit parser(const std::vector<token>& tokens)
+            : tokens_(tokens)
+        {}
+
+        std::vector<dispinterface> Parse()
+        {
+            std::vector<dispinterface> result;
+            std::vector<std::string> attributes;
+
+            while (!done())
+            {
+                if (peek() == "[")
+                    attributes = parse_attributes();
+                else if (peek() == "dispinterface")
+                {
+                    result.push_back(parse_dispinterface(attributes));
+                    attributes.clear();
+                }
+                else
+                {
+                    // attributes belong to the declaration that follows them
+                    attributes.clear();
+                    ++pos_;
+                }
+            }
+
+            return result;
+        }
+
+    private:
+
+        bool done() const
+        {
+            return pos_ >= tokens_.size();
+        }
+
+        const std::string& peek() const
+        {
+            static const std::string end;
+            return done() ? end : tokens_[pos_].text;
+        }
+
+        size_t line() const
+        {
+            return done() ? (tokens_.empty() ? 0 : tokens_.back().line) : tokens_[pos_].line;
+        }
+
+        std::string next()
+        {
+            if (done())
+                fail(line(), "unexpected end of file");
+            return tokens_[pos_++].text;
+        }
+
+        void expect(const std::string& text)
+        {
+            size_t at = line();
+            std::string got = next();
+            if (got != text)
+                fail(at, "expected '" + text + "', got '" + got + "'");
+        }
+
+        // [a, b(c), d] -> { "a", "b(c)", "d" }
+        std::vector<std::string> parse_attributes()
+        {
+            expect("[");
+
+            std::vector<std::string> attributes;
+            std::string current;
+            int depth = 0;
+
+            while (true)
+            {
+                std::string t = next();
+                if (depth == 0 && (t == "," || t == "]"))
+                {
+                    if (!current.empty())
+                        attributes.push_back(current);
+                    current.clear();
+                    if (t == "]")
+                        break;
+                    continue;
+                }
+
+                if (t == "(")
+                    ++depth;
+                else if (t == ")")
+                    --depth;
+                current += t;
+            }
+
+            return attributes;
+        }
+
+        static std::string attribute_value(const std::vector<std::string>& attributes,
+            const std::string& name)
+        {
+            for (const std::string& a : attributes)
+                if (a.compare(0, name.size() + 1, name + "(") == 0 && a.back() == ')')
+                    return a.substr(name.size() + 1, a.size() - name.size() - 2);
+            return std::string();
+        }
+
+        static bool has_attribute(const std::vector<std::string>& attributes,
+            const std::string& name)
+        {
+            for (const std::string& a : attributes)
+                if (a == name)
+                    return true;
+            return false;
+        }
+
+        // type tokens up to the declared name: "unsigned long", "IDispatch *"
+        std::string parse_type()
+        {
+            std::string type = next();
+            if (type == "const")
+                type = next();
+
+            if (type == "unsigned")
+                type += " " + next();
+
+            while (peek() == "*")
+                type += next();
+
+            return type;
+        }
+
+        dispinterface parse_dispinterface(const std::vector<std::string>& attributes)
+        {
+            expect("dispinterface");
+
+            dispinterface result;
+            result.name = next();
+            result.uuid = attribute_value(attributes, "uuid");
+
+            // forward declaration
+            if (peek() == ";")
+            {
+                ++pos_;
+                return result;
+            }
+
+            expect("{");
+            while (peek() != "}")
+            {
+                if (peek() == "properties" || peek() == "methods")
+                {
+                    ++pos_;
+                    expect(":");
+                    continue;
+                }
+
+                result.members.push_back(parse_member());
+            }
+            expect("}");
+
+            if (peek() == ";")
+                ++pos_;
+
+            return result;
+        }
+
+        member parse_member()
+        {
+            size_t at = line();
+
+            std::vector<std::string> attributes;
+            if (peek() == "[")
+                attributes = parse_attributes();
+
+            member result;
+            std::string id = attribute_value(attributes, "id");
+            if (id.empty())
+                fail(at, "member without id attribute");
+            // DISPIDs such as 0x80010000 overflow a 32-bit long, read them unsigned
+            result.dispid = (int32_t)std::stoul(id, nullptr, 0);
+
+            result.returnType = parse_type();
+            result.name = next();
+
+            if (peek() == ";")
+            {
+                ++pos_;
+                result.kind = member_kind::property;
+                return result;
+            }
+
+            if (has_attribute(attributes, "propget"))
+                result.kind = member_kind::propget;
+            else if (has_attribute(attributes, "propput") || has_attribute(attributes, "propputref"))
+                result.kind = member_kind::propput;
+
+            expect("(");
+            while (peek() != ")")
+            {
+                std::vector<std::string> paramAttributes;
+                if (peek() == "[")
+                    paramAttributes = parse_attributes();
+
+                param p;
+                p.type = parse_type();
+                if (p.type == "void" && peek() == ")")
+                    break;
+                p.name = next();
+                p.retval = has_attribute(paramAttributes, "retval");
+
+                if (p.retval)
+                {
+                    if (p.type.back() != '*')
+                        fail(at, "retval parameter must be a pointer");
+                    if (result.returnType != "void" && result.returnType != "HRESULT")
+                        fail(at, "method has both a return type and a retval parameter");
+                    result.returnType = p.type.substr(0, p.type.size() - 1);
+                }
+                else
+                    result.params.push_back(p);
+
+                if (peek() == ",")
+                    ++pos_;
+            }
+            expect(")");
+            expect(";");
+
+            if (result.returnType == "HRESULT")
+                result.returnType = "void";
+
+            return result;
+        }
+    };
+
+    std::string cpp_type(const std::string& odlType, const std::string& context)
+    {
+        auto found = type_map().find(odlType);
+        if (found == type_map().cend())
+            throw std::runtime_error(context + ": unsupported type '" + odlType + "'");
+        return found->second;
+    }
+
+    // "12345678-1234-1234-1234-123456789abc" -> IID initializer
+    std::string iid_initializer(const std::string& uuid)
+    {
+        std::string hex;
+        for (char c : uuid)
+            if (c != '-')
+                hex += c;
+
+        if (hex.size() != 32 || uuid.size() != 36)
+            throw std::runtime_error("invalid uuid '" + uuid + "'");
+
+        std::ostringstream out;
+        out << "{ 0x" << hex.substr(0, 8) << ", 0x" << hex.substr(8, 4) << ", 0x" << hex.substr(12, 4) << ", { ";
+        for (size_t i = 0; i < 8; ++i)
+            out << (i ? ", " : "") << "0x" << hex.substr(16 + 2 * i, 2);
+        out << " } }";
+
+        return out.str();
+    }
+
+    std::string params_list(const member& m, const std::string& context, bool withNames)
+    {
+        std::string list;
+        for (size_t i = 0; i < m.params.size(); ++i)
+        {
+            if (i)
+                list += ", ";
+            list += cpp_type(m.params[i].type, context);
+            if (withNames)
+                list += " " + m.params[i].name;
+        }
+        return list;
+    }
+
+    std::string call_args(const member& m)
+    {
+        std::string list;
+        for (const param& p : m.params)
+            list += ", " + p.name;
+        return list;
+    }
+
+    // stubs return std::wstring instead of BSTR and ComPtr instead of interface pointers
+    std::string result_type(const std::string& odlType, const std::string& context)
+    {
+        std::string type = cpp_type(odlType, context);
+        if (type == "BSTR")
+            return "std::wstring";
+        if (type == "IDispatch*" || type == "IUnknown*" || type == "const VARIANT*")
+            throw std::runtime_error(context + ": interface and VARIANT results are not supported");
+        return type;
+    }
+
+    void write_ids(std::ostream& out, const std::vector<dispinterface>& interfaces,
+        const std::string& ns, const std::string& source)
+    {
+        out << "#pragma once\n\n"
+            << "// generated by cmwidlgen from " << source << ". Do not edit\n\n"
+            << "#include <cstddef>\n\n"
+            << "namespace " << ns << "\n{\n";
+
+        for (const dispinterface& i : interfaces)
+        {
+            out << "    namespace " << i.name << "_dispid\n    {\n";
+
+            std::map<std::string, int32_t> ids;
+            for (const member& m : i.members)
+                ids.emplace(m.name, m.dispid);
+
+            for (const auto& id : ids)
+                out << "        constexpr long " << id.first << " = " << id.second << ";\n";
+
+            out << "\n        struct member_info\n        {\n"
+                << "            const char *name;\n"
+                << "            long dispid;\n"
+                << "            size_t numArgs;\n"
+                << "        };\n\n"
+                << "        constexpr member_info members[] = {\n";
+
+            for (const member& m : i.members)
+                out << "            { \"" << m.name << "\", " << m.dispid << ", "
+                    << (m.kind == member_kind::property ? 0 : m.params.size()) << " },\n";
+
+            out << "        };\n\n"
+                << "        constexpr size_t num_members = " << i.members.size() << ";\n"
+                << "    }\n\n";
+        }
+
+        out << "}\n";
+    }
+
+    void write_com(std::ostream& out, const std::vector<dispinterface>& interfaces,
+        const std::string& ns, const std::string& source, const std::string& idsHeader)
+    {
+        out << "#pragma once\n\n"
+            << "// generated by cmwidlgen from " << source << ". Do not edit\n\n"
+            << "#include \"com_wrapper.h\"\n"
+            << "#include \"" << idsHeader << "\"\n\n"
+            << "namespace " << ns << "\n{\n";
+
+        for (const dispinterface& i : interfaces)
+        {
+            if (!i.uuid.empty())
+                out << "    inline const IID IID_" << i.name << " = " << iid_initializer(i.uuid) << ";\n\n";
+
+            // sink: typed registration of event handlers
+            out << "    // registers typed handlers of " << i.name << " events\n"
+                << "    class " << i.name << "Sink\n    {\n"
+                << "        cmw::Listener& listener_;\n\n"
+                << "    public:\n\n"
+                << "        explicit " << i.name << "Sink(cmw::Listener& listener)\n"
+                << "            : listener_(listener)\n"
+                << "        {}\n";
+
+            for (const member& m : i.members)
+            {
+                if (m.kind != member_kind::method)
+                    continue;
+
+                std::string context = i.name + "::" + m.name;
+                std::string args = params_list(m, context, false);
+                if (m.returnType == "void")
+                {
+                    out << "\n        cmw::subscription " << m.name << "(std::function<HRESULT(" << args << ")>&& callback)\n"
+                        << "        {\n"
+                        << "            return listener_.SetCallback(" << i.name << "_dispid::" << m.name << ",\n"
+                        << "                cmw::decode_disp_args<" << args << ">(std::move(callback)));\n"
+                        << "        }\n";
+                    continue;
+                }
+
+                // the handler returns HRESULT, the result or std::pair<HRESULT, result>
+                std::string result = result_type(m.returnType, context);
+                out << "\n        // handler returns " << result << ", std::pair<HRESULT, " << result << "> or HRESULT\n"
+                    << "        template <class F>\n"
+                    << "        cmw::subscription " << m.name << "(F&& callback)\n"
+                    << "        {\n"
+                    << "            using R = std::invoke_result_t<F&" << (args.empty() ? "" : ", ") << args << ">;\n"
+                    << "            return listener_.SetCallback(" << i.name << "_dispid::" << m.name << ",\n"
+                    << "                cmw::decode_disp_args<" << args << ">(\n"
+                    << "                    std::function<R(" << args << ")>(std::forward<F>(callback))));\n"
+                    << "        }\n";
+            }
+
+            out << "    };\n\n";
+
+            // proxy: typed client calls
+            out << "    // typed calls of " << i.name << " members\n"
+                << "    class " << i.name << "Proxy\n    {\n"
+                << "        cmw::ComPtr<IDispatch> pDispatch_;\n\n"
+                << "    public:\n\n"
+                << "        explicit " << i.name << "Proxy(const cmw::ComPtr<IDispatch>& pDispatch)\n"
+                << "            : pDispatch_(pDispatch)\n"
+                << "        {}\n";
+
+            for (const member& m : i.members)
+            {
+                std::string context = i.name + "::" + m.name;
+                std::string id = i.name + "_dispid::" + m.name;
+
+                switch (m.kind)
+                {
+                case member_kind::method:
+                {
+                    std::string result = result_type(m.returnType, context);
+                    out << "\n        cmw::Result<" << result << "> " << m.name << "(" << params_list(m, context, true) << ")\n"
+                        << "        {\n"
+                        << "            return cmw::disp_call<" << result << ">(*pDispatch_, " << id
+                        << ", DISPATCH_METHOD" << call_args(m) << ");\n"
+                        << "        }\n";
+                    break;
+                }
+                case member_kind::propget:
+                {
+                    std::string result = result_type(m.returnType, context);
+                    out << "\n        cmw::Result<" << result << "> Get" << m.name << "(" << params_list(m, context, true) << ")\n"
+                        << "        {\n"
+                        << "            return cmw::disp_call<" << result << ">(*pDispatch_, " << id
+                        << ", DISPATCH_PROPERTYGET" << call_args(m) << ");\n"
+                        << "        }\n";
+                    break;
+                }
+                case member_kind::propput:
+                    out << "\n        cmw::Result<void> Put" << m.name << "(" << params_list(m, context, true) << ")\n"
+                        << "        {\n"
+                        << "            return cmw::disp_call<void>(*pDispatch_, " << id
+                        << ", DISPATCH_PROPERTYPUT" << call_args(m) << ");\n"
+                        << "        }\n";
+                    break;
+                case member_kind::property:
+                {
+                    std::string result = result_type(m.returnType, context);
+                    std::string value = cpp_type(m.returnType, context);
+                    out << "\n        cmw::Result<" << result << "> Get" << m.name << "()\n"
+                        << "        {\n"
+                        << "            return cmw::disp_call<" << result << ">(*pDispatch_, " << id
+                        << ", DISPATCH_PROPERTYGET);\n"
+                        << "        }\n"
+                        << "\n        cmw::Result<void> Put" << m.name << "(" << value << " value)\n"
+                        << "        {\n"
+                        << "            return cmw::disp_call<void>(*pDispatch_, " << id
+                        << ", DISPATCH_PROPERTYPUT, value);\n"
+                        << "        }\n";
+                    break;
+                }
+                }
+            }
+
+            out << "    };\n\n";
+        }
+
+        out << "}\n";
+    }
+
+    std::string file_stem(const std::string& path)
+    {
+        size_t slash = path.find_last_of("/\\");
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        return name.substr(0, name.find('.'));
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "usage: cmwidlgen <input.odl> <output dir> [namespace]" << std::endl;
+        return 2;
+    }
+
+    std::string input = argv[1];
+    std::string outputDir = argv[2];
+    std::string ns = argc > 3 ? argv[3] : "cmw_generated";
+
+    try
+    {
+        std::ifstream in(input);
+        if (!in)
+            throw std::runtime_error("can not open " + input);
+
+        std::stringstream text;
+        text << in.rdbuf();
+
+        std::vector<token> tokens = tokenize(text.str());
+        std::vector<dispinterface> interfaces = parser(tokens).Parse();
+
+        std::string stem = file_stem(input);
+        std::string idsHeader = stem + "_ids.h";
+
+        std::ofstream ids(outputDir + "/" + idsHeader);
+        std::ofstream com(outputDir + "/" + stem + ".h");
+        if (!ids || !com)
+            throw std::runtime_error("can not write to " + outputDir);
+
+        write_ids(ids, interfaces, ns, stem + ".odl");
+        write_com(com, interfaces, ns, stem + ".odl", idsHeader);
+    }
+    catch (const std::exception& error)
+    {
+        std::cerr << input << ": " << error.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}